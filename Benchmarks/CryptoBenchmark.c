@@ -0,0 +1,515 @@
+/**
+ * @file Benchmarks/CryptoBenchmark.c
+ * @brief Known-answer checks and timings for the Pandora crypto routines
+ *
+ * Builds without AppKit or Foundation, from blowfish.c and HexCodec.c only,
+ * so that it runs anywhere there's a C compiler (see the Makefile here).
+ * Encryption and decryption go through the same steps as
+ * PandoraEncryptBytesWithKey() and PandoraDecryptStringWithKey() in Crypt.m:
+ * a cached key schedule, the whole-buffer ECB routines and the hex codec, a
+ * chunk at a time. Blowfish itself is checked against Eric Young's test
+ * vectors through every kernel, then the whole path against known answers
+ * for every device key and against the byte-at-a-time ECB session, then timed at request body
+ * sizes from 100 B to 8 KB next to that reference path, and next to the
+ * same buffer routines with the key set up for every request, which shows
+ * what the key schedule cache saves each request. The hex codec is
+ * also checked and timed on its own, from 64 B to 64 KB, next to the table
+ * lookups Crypt.m used before it.
+ *
+ * BLOWFISH_KERNEL in the environment picks the kernel blowfish.c uses for
+ * eight blocks at a time, if this CPU has it. Exits with a non-zero status
+ * if any check fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blowfish/blowfish.h"
+#include "HexCodec.h"
+#include "CryptoVectors.h"
+
+/* Request body sizes to check and time, covering everything from a bare
+   userAuthToken/syncTime body to a large search */
+static const size_t body_sizes[] = {100, 333, 1024, 4096, 8192};
+
+/* Payload sizes for the hex codec on its own */
+static const size_t hex_sizes[] = {64, 256, 1024, 4096, 16384, 65536};
+
+/* Calls timed per body size and direction */
+#define TIMED_CALLS 2000
+
+/* Key setups timed */
+#define TIMED_KEYS 200
+
+/* As in Crypt.m */
+#define CRYPT_CHUNK 1024
+
+/* Blocks a test vector is repeated over, enough to go through the kernels
+   for eight, four and one block at once */
+#define VECTOR_BLOCKS 13
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+static uint32_t load_be32(const unsigned char *p) {
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+         (uint32_t) p[2] << 8 | p[3];
+}
+
+/* --- The path Crypt.m takes --- */
+
+static size_t encrypt_body(const struct blf_ctx *key, const unsigned char *in,
+                           size_t len, char *out) {
+  unsigned char chunk[CRYPT_CHUNK];
+  for (size_t i = 0; i < len; i += CRYPT_CHUNK) {
+    size_t n = len - i < CRYPT_CHUNK ? len - i : CRYPT_CHUNK;
+    Blowfish_ecb_encrypt(key, in + i, n, chunk);
+    HexCodecEncode(chunk, BLOWFISH_ECB_LENGTH(n), out + 2 * i);
+  }
+  return 2 * BLOWFISH_ECB_LENGTH(len);
+}
+
+/* Returns the number of bytes decrypted, or -1 if in isn't valid hex */
+static long decrypt_body(const struct blf_ctx *key, const char *in, size_t len,
+                         unsigned char *out) {
+  for (size_t i = 0; i < len; i += 2 * CRYPT_CHUNK) {
+    size_t n = len - i < 2 * CRYPT_CHUNK ? len - i : 2 * CRYPT_CHUNK;
+    if (HexCodecDecode(in + i, n, out + i / 2) != n) {
+      return -1;
+    }
+    Blowfish_ecb_decrypt(key, out + i / 2, n / 2, out + i / 2);
+  }
+  return (long) BLOWFISH_ECB_LENGTH(len / 2);
+}
+
+/* --- Reference implementation --- */
+
+typedef struct {
+  char *out;
+  size_t len;
+} HexSink;
+
+static void append_hex(unsigned char byte, void *user_data) {
+  static const char i2h[16] = "0123456789abcdef";
+  HexSink *sink = user_data;
+  sink->out[sink->len++] = i2h[byte / 16];
+  sink->out[sink->len++] = i2h[byte % 16];
+}
+
+/* Encryption as it was done before the key schedule cache and the buffer
+   routines: key setup, then a callback per byte */
+static size_t reference_encrypt(const char *key, const unsigned char *in,
+                                size_t len, char *out) {
+  struct blf_ecb_ctx ctx;
+  HexSink sink = {out, 0};
+  Blowfish_ecb_start(&ctx, 1, (const unsigned char *) key, strlen(key),
+                     append_hex, &sink);
+  for (size_t i = 0; i < len; i++) {
+    Blowfish_ecb_feed(&ctx, in[i]);
+  }
+  Blowfish_ecb_stop(&ctx);
+  return sink.len;
+}
+
+/* Hex coding as Crypt.m did it before HexCodec: a table lookup per nibble,
+   and no validation when decoding */
+static void reference_hex_encode(const unsigned char *in, size_t len,
+                                 char *out) {
+  static const char i2h[16] = "0123456789abcdef";
+  for (size_t i = 0; i < len; i++) {
+    out[2 * i] = i2h[in[i] >> 4];
+    out[2 * i + 1] = i2h[in[i] & 0xf];
+  }
+}
+
+static void reference_hex_decode(const char *in, size_t len,
+                                 unsigned char *out) {
+  static unsigned char h2i[256];
+  if (h2i['1'] == 0) {
+    for (int i = 0; i < 10; i++) h2i['0' + i] = (unsigned char) i;
+    for (int i = 0; i < 6; i++) h2i['a' + i] = (unsigned char) (10 + i);
+  }
+  for (size_t i = 0; i < len; i += 2) {
+    out[i / 2] = (unsigned char) (h2i[(unsigned char) in[i]] << 4 |
+                                  h2i[(unsigned char) in[i + 1]]);
+  }
+}
+
+static void schedule_key(struct blf_ctx *ctx, const char *key) {
+  Blowfish_initialize(ctx, (const unsigned char *) key, strlen(key));
+}
+
+static void random_bytes(unsigned char *buf, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    buf[i] = (unsigned char) (rand() >> 7);
+  }
+}
+
+/* --- Checks --- */
+
+static void decode_vector(const char *hex, unsigned char *out) {
+  HexCodecDecode(hex, strlen(hex), out);
+}
+
+/* Encipher every vector one block at a time and, repeated enough times to
+   go through every kernel, as a run of blocks; then decipher both back */
+static int check_blowfish_vectors(void) {
+  int passed = 1;
+
+  for (size_t i = 0; i < COUNT(blowfish_vectors); i++) {
+    unsigned char key[8], plain[8], cipher[8];
+    struct blf_ctx ctx;
+    decode_vector(blowfish_vectors[i].key, key);
+    decode_vector(blowfish_vectors[i].plaintext, plain);
+    decode_vector(blowfish_vectors[i].ciphertext, cipher);
+    Blowfish_initialize(&ctx, key, sizeof(key));
+
+    uint32_t pl = load_be32(plain), pr = load_be32(plain + 4);
+    uint32_t cl = load_be32(cipher), cr = load_be32(cipher + 4);
+    uint32_t xl = pl, xr = pr;
+    Blowfish_encipher(&ctx, &xl, &xr);
+    int ok = xl == cl && xr == cr;
+    Blowfish_decipher(&ctx, &xl, &xr);
+    ok = ok && xl == pl && xr == pr;
+
+    uint32_t x[2 * VECTOR_BLOCKS];
+    for (int b = 0; b < VECTOR_BLOCKS; b++) {
+      x[2 * b] = pl;  x[2 * b + 1] = pr;
+    }
+    Blowfish_encipher_blocks(&ctx, x, VECTOR_BLOCKS);
+    for (int b = 0; b < VECTOR_BLOCKS; b++) {
+      ok = ok && x[2 * b] == cl && x[2 * b + 1] == cr;
+    }
+    Blowfish_decipher_blocks(&ctx, x, VECTOR_BLOCKS);
+    for (int b = 0; b < VECTOR_BLOCKS; b++) {
+      ok = ok && x[2 * b] == pl && x[2 * b + 1] == pr;
+    }
+
+    if (!ok) {
+      printf("crypt: Blowfish vector %zu (key %s) failed\n", i,
+             blowfish_vectors[i].key);
+      passed = 0;
+    }
+  }
+  return passed;
+}
+
+static int check_known_answers(void) {
+  size_t len = strlen(known_plaintext);
+  char hex[2 * BLOWFISH_ECB_LENGTH(sizeof(known_plaintext))];
+  unsigned char plain[BLOWFISH_ECB_LENGTH(sizeof(known_plaintext))];
+  int passed = 1;
+
+  for (size_t i = 0; i < COUNT(device_vectors); i++) {
+    const char *expected = device_vectors[i].ciphertext;
+    struct blf_ctx key;
+    schedule_key(&key, device_vectors[i].key);
+
+    size_t n = encrypt_body(&key, (const unsigned char *) known_plaintext,
+                            len, hex);
+    if (n != strlen(expected) || memcmp(hex, expected, n) != 0) {
+      printf("crypt: encryption with key %s gave %.*s, expected %s\n",
+             device_vectors[i].key, (int) n, hex, expected);
+      passed = 0;
+    }
+
+    /* Decryption gives back the zero padding of the last block too */
+    long m = decrypt_body(&key, expected, strlen(expected), plain);
+    if (m != (long) BLOWFISH_ECB_LENGTH(len) ||
+        memcmp(plain, known_plaintext, len) != 0) {
+      printf("crypt: decryption with key %s did not give the plaintext\n",
+             device_vectors[i].key);
+      passed = 0;
+    }
+    for (long j = (long) len; j < m; j++) {
+      if (plain[j] != 0) {
+        printf("crypt: decryption with key %s left padding byte %ld set\n",
+               device_vectors[i].key, j);
+        passed = 0;
+        break;
+      }
+    }
+  }
+  return passed;
+}
+
+static int check_against_reference(void) {
+  const char *keystr = device_vectors[2].key;
+  struct blf_ctx key;
+  int passed = 1;
+  schedule_key(&key, keystr);
+
+  for (size_t i = 0; i < COUNT(body_sizes); i++) {
+    /* Also try one byte either side, to cover the padding of the last block */
+    for (size_t size = body_sizes[i] - 1; size <= body_sizes[i] + 1; size++) {
+      unsigned char *body = malloc(size);
+      char *expected = malloc(2 * BLOWFISH_ECB_LENGTH(size));
+      char *actual = malloc(2 * BLOWFISH_ECB_LENGTH(size));
+      unsigned char *decrypted = malloc(BLOWFISH_ECB_LENGTH(size));
+      random_bytes(body, size);
+
+      size_t n = reference_encrypt(keystr, body, size, expected);
+      if (encrypt_body(&key, body, size, actual) != n ||
+          memcmp(actual, expected, n) != 0) {
+        printf("crypt: encryption of %zu bytes differs from the reference\n",
+               size);
+        passed = 0;
+      } else if (decrypt_body(&key, actual, n, decrypted) < (long) size ||
+                 memcmp(decrypted, body, size) != 0) {
+        printf("crypt: decryption of %zu bytes did not round trip\n", size);
+        passed = 0;
+      }
+      free(body);
+      free(expected);
+      free(actual);
+      free(decrypted);
+    }
+  }
+  return passed;
+}
+
+/* Every size from 0 to a few vectors, so each kernel's tail is covered, then
+   the hex payload sizes which are timed */
+static int check_hex(void) {
+  int passed = 1;
+  size_t sizes[80 + COUNT(hex_sizes)];
+  size_t count = 0;
+  for (size_t size = 0; size < 80; size++) sizes[count++] = size;
+  for (size_t i = 0; i < COUNT(hex_sizes); i++) sizes[count++] = hex_sizes[i];
+
+  for (size_t i = 0; i < count; i++) {
+    size_t size = sizes[i];
+    unsigned char *bytes = malloc(size + 1);
+    unsigned char *decoded = malloc(size + 1);
+    char *expected = malloc(2 * size + 1);
+    char *actual = malloc(2 * size + 1);
+    random_bytes(bytes, size);
+
+    reference_hex_encode(bytes, size, expected);
+    HexCodecEncode(bytes, size, actual);
+    if (memcmp(actual, expected, 2 * size) != 0) {
+      printf("crypt: hex encoding of %zu bytes differs from the reference\n",
+             size);
+      passed = 0;
+    }
+    if (HexCodecDecode(actual, 2 * size, decoded) != 2 * size ||
+        memcmp(decoded, bytes, size) != 0) {
+      printf("crypt: hex decoding of %zu bytes did not round trip\n", size);
+      passed = 0;
+    }
+
+    /* Uppercase digits are accepted as well */
+    for (size_t j = 0; j < 2 * size; j++) {
+      if (actual[j] >= 'a') actual[j] = (char) (actual[j] - 'a' + 'A');
+    }
+    if (HexCodecDecode(actual, 2 * size, decoded) != 2 * size ||
+        memcmp(decoded, bytes, size) != 0) {
+      printf("crypt: uppercase hex of %zu bytes did not decode\n", size);
+      passed = 0;
+    }
+
+    /* A bad character anywhere is reported at its offset, including one
+       just past either end of a vector */
+    static const char bad[] = {'g', 'G', '/', ':', '@', '`', ' ', '\0',
+                               (char) 0x80, (char) 0xb0};
+    for (size_t at = 0; at < 2 * size; at += at < 70 ? 1 : 97) {
+      char saved = actual[at];
+      actual[at] = bad[at % sizeof(bad)];
+      size_t got = HexCodecDecode(actual, 2 * size, decoded);
+      if (got != at) {
+        printf("crypt: bad hex at %zu of %zu digits reported at %zu\n",
+               at, 2 * size, got);
+        passed = 0;
+      }
+      actual[at] = saved;
+    }
+
+    /* An odd number of digits leaves the last one unpaired */
+    if (size > 0 && HexCodecDecode(actual, 2 * size - 1, decoded) !=
+                    2 * size - 2) {
+      printf("crypt: unpaired hex digit after %zu digits not reported\n",
+             2 * size - 2);
+      passed = 0;
+    }
+    free(bytes);
+    free(decoded);
+    free(expected);
+    free(actual);
+  }
+  return passed;
+}
+
+/* --- Timing --- */
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_times(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+typedef void (*TimedCall)(void *ctx);
+
+/* Print throughput and latency percentiles for TIMED_CALLS calls, and
+   return the median latency in nanoseconds */
+static double time_calls(const char *label, size_t size, TimedCall call,
+                       void *ctx) {
+  double *ns = malloc(TIMED_CALLS * sizeof(double));
+  double total = 0;
+  call(ctx);
+  for (int i = 0; i < TIMED_CALLS; i++) {
+    double start = now();
+    call(ctx);
+    ns[i] = now() - start;
+    total += ns[i];
+  }
+  qsort(ns, TIMED_CALLS, sizeof(double), compare_times);
+
+  printf("crypt: %-17s %5zu B: %8.1f MB/s, p50 %8.2f us, p90 %8.2f us, "
+         "p99 %8.2f us\n", label, size,
+         (double) size * TIMED_CALLS / (total / 1e9) / 1e6,
+         ns[TIMED_CALLS / 2] / 1e3,
+         ns[TIMED_CALLS * 9 / 10] / 1e3,
+         ns[TIMED_CALLS * 99 / 100] / 1e3);
+  double median = ns[TIMED_CALLS / 2];
+  free(ns);
+  return median;
+}
+
+typedef struct {
+  const char *keystr;
+  struct blf_ctx key;
+  unsigned char *body;
+  size_t size;
+  char *hex;
+  size_t hexlen;
+  unsigned char *plain;
+} BodyCase;
+
+static void call_encrypt(void *ctx) {
+  BodyCase *c = ctx;
+  encrypt_body(&c->key, c->body, c->size, c->hex);
+}
+
+static void call_decrypt(void *ctx) {
+  BodyCase *c = ctx;
+  decrypt_body(&c->key, c->hex, c->hexlen, c->plain);
+}
+
+/* What a request cost before PandoraCipherKeyForString(): key setup, then
+   the same buffer routines */
+static void call_encrypt_uncached(void *ctx) {
+  BodyCase *c = ctx;
+  struct blf_ctx key;
+  schedule_key(&key, c->keystr);
+  encrypt_body(&key, c->body, c->size, c->hex);
+}
+
+static void call_reference(void *ctx) {
+  BodyCase *c = ctx;
+  reference_encrypt(c->keystr, c->body, c->size, c->hex);
+}
+
+static void time_key_setup(void) {
+  static struct blf_ctx key;
+  const char *keystr = device_vectors[2].key;
+  double start = now();
+  for (int i = 0; i < TIMED_KEYS; i++) {
+    schedule_key(&key, keystr);
+  }
+  printf("crypt: key setup %.2f us\n", (now() - start) / TIMED_KEYS / 1e3);
+}
+
+static void time_bodies(void) {
+  BodyCase c;
+  c.keystr = device_vectors[2].key;
+  schedule_key(&c.key, c.keystr);
+
+  for (size_t i = 0; i < COUNT(body_sizes); i++) {
+    c.size = body_sizes[i];
+    c.body = malloc(c.size);
+    c.hex = malloc(2 * BLOWFISH_ECB_LENGTH(c.size));
+    c.plain = malloc(BLOWFISH_ECB_LENGTH(c.size));
+    random_bytes(c.body, c.size);
+    c.hexlen = encrypt_body(&c.key, c.body, c.size, c.hex);
+
+    double cached = time_calls("encrypt", c.size, call_encrypt, &c);
+    time_calls("decrypt", c.size, call_decrypt, &c);
+    double uncached = time_calls("encrypt uncached", c.size,
+                                 call_encrypt_uncached, &c);
+    time_calls("encrypt reference", c.size, call_reference, &c);
+    printf("crypt: cached key saves %.2f us (%.0f%%) per %zu B request\n",
+           (uncached - cached) / 1e3, 100 * (uncached - cached) / uncached,
+           c.size);
+    free(c.body);
+    free(c.hex);
+    free(c.plain);
+  }
+}
+
+typedef struct {
+  unsigned char *bytes;
+  size_t size;
+  char *hex;
+} HexCase;
+
+static void call_hex_encode(void *ctx) {
+  HexCase *c = ctx;
+  HexCodecEncode(c->bytes, c->size, c->hex);
+}
+
+static void call_hex_decode(void *ctx) {
+  HexCase *c = ctx;
+  HexCodecDecode(c->hex, 2 * c->size, c->bytes);
+}
+
+static void call_reference_hex_encode(void *ctx) {
+  HexCase *c = ctx;
+  reference_hex_encode(c->bytes, c->size, c->hex);
+}
+
+static void call_reference_hex_decode(void *ctx) {
+  HexCase *c = ctx;
+  reference_hex_decode(c->hex, 2 * c->size, c->bytes);
+}
+
+static void time_hex(void) {
+  HexCase c;
+  for (size_t i = 0; i < COUNT(hex_sizes); i++) {
+    c.size = hex_sizes[i];
+    c.bytes = malloc(c.size);
+    c.hex = malloc(2 * c.size);
+    random_bytes(c.bytes, c.size);
+    HexCodecEncode(c.bytes, c.size, c.hex);
+
+    time_calls("hex encode", c.size, call_hex_encode, &c);
+    time_calls("hex decode", c.size, call_hex_decode, &c);
+    time_calls("hex encode ref", c.size, call_reference_hex_encode, &c);
+    time_calls("hex decode ref", c.size, call_reference_hex_decode, &c);
+    free(c.bytes);
+    free(c.hex);
+  }
+}
+
+int main(void) {
+  const char *kernel = getenv("BLOWFISH_KERNEL");
+  printf("crypt: Blowfish kernel for eight blocks %s\n",
+         kernel ? kernel : "picked for this CPU");
+  srand(1);
+  int passed = check_blowfish_vectors();
+  passed = check_known_answers() && passed;
+  passed = check_against_reference() && passed;
+  passed = check_hex() && passed;
+  printf("crypt: known-answer, reference and hex checks %s\n",
+         passed ? "passed" : "FAILED");
+
+  time_key_setup();
+  time_bodies();
+  time_hex();
+  return passed ? 0 : 1;
+}
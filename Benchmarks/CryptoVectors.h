@@ -0,0 +1,85 @@
+/**
+ * @file Benchmarks/CryptoVectors.h
+ * @brief Known answers for the Pandora crypto routines
+ */
+
+#ifndef CRYPTOVECTORS_H
+#define CRYPTOVECTORS_H
+
+/* Encrypted with every key below, as a userAuthToken/syncTime body */
+static const char known_plaintext[] =
+  "{\"syncTime\":1234567890,\"userAuthToken\":\"herm\"}";
+
+/* The encryption and decryption keys of every device in PandoraDevice.m,
+   with known_plaintext encrypted under each as computed by the original
+   byte-at-a-time implementation */
+static const struct {
+  const char *key;
+  const char *ciphertext;
+} device_vectors[] = {
+  /* iPhone */
+  {"721^26xE22776",
+   "8ed4232b70bd606d917edfcbce9526cfd7a649774c4932fff7de3d915ad74f19"
+   "6351ef373f01a93606d30846f0ca961f"},
+  {"20zE1E47BE57$51",
+   "6f3ec8d06bf2a06b5418f86cfb4e0275952102240003af48a0f9319efa306a6c"
+   "46ebde7493ced50df2bccc650998cd08"},
+  /* Android */
+  {"6#26FRL$ZWD",
+   "dc197ba6264f69574c76cf9e2cb7208029560ec66e96c4a89b28e42442e68407"
+   "4753fc2c329b055d96cc0b07495380e7"},
+  {"R=U!LH$O2B#",
+   "7faa96027743d72c4c17895fd6895e28aed6df36fa0ffbef078954e764f41f91"
+   "7d48e96aa9c2f374771b207a09932658"},
+  /* Desktop */
+  {"2%3WCL*JU$MP]4",
+   "d2ba357eb0653b72b22fe204a37ccc369549dbc8e03e2cf0ad0c3829fce38438"
+   "017328c4231b7847489294a2f08cd750"},
+  {"U#IO$RZPAB%VX2",
+   "1cdde49d3bc6e52b51a6f70ef5a167067daad6bc3d872acae758f6d8edb629b7"
+   "522119b15014959c5d9bb13e9e4406d8"},
+};
+
+/* Eric Young's test vectors for Blowfish itself: key, plaintext and
+   ciphertext of one block, as big-endian hex */
+static const struct {
+  const char *key;
+  const char *plaintext;
+  const char *ciphertext;
+} blowfish_vectors[] = {
+  {"0000000000000000", "0000000000000000", "4ef997456198dd78"},
+  {"ffffffffffffffff", "ffffffffffffffff", "51866fd5b85ecb8a"},
+  {"3000000000000000", "1000000000000001", "7d856f9a613063f2"},
+  {"1111111111111111", "1111111111111111", "2466dd878b963c9d"},
+  {"0123456789abcdef", "1111111111111111", "61f9c3802281b096"},
+  {"1111111111111111", "0123456789abcdef", "7d0cc630afda1ec7"},
+  {"fedcba9876543210", "0123456789abcdef", "0aceab0fc6a0a28d"},
+  {"7ca110454a1a6e57", "01a1d6d039776742", "59c68245eb05282b"},
+  {"0131d9619dc1376e", "5cd54ca83def57da", "b1b8cc0b250f09a0"},
+  {"07a1133e4a0b2686", "0248d43806f67172", "1730e5778bea1da4"},
+  {"3849674c2602319e", "51454b582ddf440a", "a25e7856cf2651eb"},
+  {"04b915ba43feb5b6", "42fd443059577fa2", "353882b109ce8f1a"},
+  {"0113b970fd34f2ce", "059b5e0851cf143a", "48f4d0884c379918"},
+  {"0170f175468fb5e6", "0756d8e0774761d2", "432193b78951fc98"},
+  {"43297fad38e373fe", "762514b829bf486a", "13f04154d69d1ae5"},
+  {"07a7137045da2a16", "3bdd119049372802", "2eedda93ffd39c79"},
+  {"04689104c2fd3b2f", "26955f6835af609a", "d887e0393c2da6e3"},
+  {"37d06bb516cb7546", "164d5e404f275232", "5f99d04f5b163969"},
+  {"1f08260d1ac2465e", "6b056e18759f5cca", "4a057a3b24d3977b"},
+  {"584023641aba6176", "004bd6ef09176062", "452031c1e4fada8e"},
+  {"025816164629b007", "480d39006ee762f2", "7555ae39f59b87bd"},
+  {"49793ebc79b3258f", "437540c8698f3cfa", "53c55f9cb49fc019"},
+  {"4fb05e1515ab73a7", "072d43a077075292", "7a8e7bfa937e89a3"},
+  {"49e95d6d4ca229bf", "02fe55778117f12a", "cf9c5d7a4986adb5"},
+  {"018310dc409b26d6", "1d9d5c5018f728c2", "d1abb290658bc778"},
+  {"1c587f1c13924fef", "305532286d6f295a", "55cb3774d13ef201"},
+  {"0101010101010101", "0123456789abcdef", "fa34ec4847b268b2"},
+  {"1f1f1f1f0e0e0e0e", "0123456789abcdef", "a790795108ea3cae"},
+  {"e0fee0fef1fef1fe", "0123456789abcdef", "c39e072d9fac631d"},
+  {"0000000000000000", "ffffffffffffffff", "014933e0cdaff6e4"},
+  {"ffffffffffffffff", "0000000000000000", "f21e9a77b71c49bc"},
+  {"0123456789abcdef", "0000000000000000", "245946885754369a"},
+  {"fedcba9876543210", "ffffffffffffffff", "6b5c5a9c5d9e0a5a"},
+};
+
+#endif /* CRYPTOVECTORS_H */
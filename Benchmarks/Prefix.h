@@ -0,0 +1,17 @@
+/**
+ * @file Benchmarks/Prefix.h
+ * @brief Stands in for Hermes_Prefix.pch when building the Pandora sources
+ *        into a benchmark, without the app around them
+ */
+
+#ifndef BENCHMARKS_PREFIX_H
+#define BENCHMARKS_PREFIX_H
+
+#ifdef __OBJC__
+#import <Foundation/Foundation.h>
+
+#define NSLogd(fmt, args...) NSLog(fmt, ##args)
+#define HMSLog NSLogd
+#endif
+
+#endif /* BENCHMARKS_PREFIX_H */
@@ -0,0 +1,446 @@
+/**
+ * @file Benchmarks/ProtocolBenchmark.m
+ * @brief Checks and timings for each stage of a request to Pandora and its
+ *        response
+ *
+ * Builds from the Pandora sources which only need Foundation (RequestBody.m,
+ * Crypt.m, ResponseParser.m and JSONStream.c, with blowfish.c and HexCodec.c
+ * under them), so it runs from the Makefile here rather than inside the app,
+ * and on macOS only.
+ *
+ * First checks that PandoraRequestBody() gives exactly what
+ * NSJSONSerialization and PandoraEncryptData() do, for bodies like those
+ * Pandora.m sends and for awkward ones: escapes, non-ASCII text, and a body
+ * too large for the writer's stack buffer.
+ *
+ * For a playlist, a long station list and a large search, then times building
+ * the request body, encrypting it, parsing the response, and building songs,
+ * stations or search results from it. The parsers and builders are set up as
+ * Pandora.m sets up its own, but build the plain objects below rather than
+ * Songs and Stations, which belong to the app. Each stage is printed with the
+ * nanoseconds it took per call, and with the heap blocks and bytes still
+ * allocated when a call returns, as malloc_zone_statistics() counts them.
+ * Those include what the call autoreleased, but not what it freed itself.
+ *
+ * Exits with a non-zero status if any check fails.
+ */
+
+#include <malloc/malloc.h>
+#include <mach/mach_time.h>
+#include <stdio.h>
+
+#import "Crypt.h"
+#import "PandoraDevice.h"
+#import "RequestBody.h"
+#import "ResponseParser.h"
+#import "SampleResponses.h"
+
+/* Stations in the station list, more than most accounts have */
+#define STATIONS 500
+
+/* Songs and artists each in the search response */
+#define SEARCH_RESULTS 100
+
+/* Calls timed per stage, for stages over small and large payloads */
+#define TIMED_CALLS 2000
+#define TIMED_LARGE_CALLS 100
+
+/* Calls whose allocations are counted per stage */
+#define COUNTED_CALLS 20
+
+#pragma mark - Model objects
+
+@interface BenchSong : NSObject
+@property (strong) NSString *artist, *title, *album, *art, *stationId, *token;
+@property (strong) NSNumber *nrating;
+@property (strong) NSString *albumUrl, *artistUrl, *titleUrl;
+@property (strong) NSString *highUrl, *medUrl, *lowUrl;
+@end
+
+@implementation BenchSong
+@end
+
+@interface BenchStation : NSObject
+@property (strong) NSString *name, *stationId, *token;
+@property BOOL shared, allowAddMusic, allowRename, isQuickMix;
+@property unsigned long long created;
+@end
+
+@implementation BenchStation
+@end
+
+@interface BenchSearchResult : NSObject
+@property (strong) NSString *name, *value;
+@end
+
+@implementation BenchSearchResult
+@end
+
+#pragma mark - Building
+
+/* As Pandora.m's parseSongFromDictionary:, without the logging */
+static BenchSong* songFromDictionary(NSDictionary *s) {
+  if (s[@"adToken"] != nil) return nil;
+
+  BenchSong *song = [[BenchSong alloc] init];
+  song.artist = s[@"artistName"];
+  song.title = s[@"songName"];
+  song.album = s[@"albumName"];
+  song.art = s[@"albumArtUrl"];
+  song.stationId = s[@"stationId"];
+  song.token = s[@"trackToken"];
+  song.nrating = s[@"songRating"];
+  song.albumUrl = s[@"albumDetailUrl"];
+  song.artistUrl = s[@"artistDetailUrl"];
+  song.titleUrl = s[@"songDetailUrl"];
+
+  id urls = s[@"additionalAudioUrl"];
+  if ([urls isKindOfClass:[NSArray class]]) {
+    NSArray *urlArray = urls;
+    switch (urlArray.count) {
+      case 3: song.highUrl = urlArray[2];
+      case 2: song.medUrl = urlArray[1];
+      case 1: song.lowUrl = urlArray[0];
+        break;
+      default:
+        break;
+    }
+  }
+
+  id audioUrlMap = s[@"audioUrlMap"];
+  if ([audioUrlMap isKindOfClass:[NSDictionary class]]) {
+    id qualityMap = audioUrlMap[@"highQuality"];
+    if ([qualityMap isKindOfClass:[NSDictionary class]]) {
+      if (!song.highUrl || [qualityMap[@"bitrate"] integerValue] > 128) {
+        song.highUrl = qualityMap[@"audioUrl"];
+      }
+    }
+    qualityMap = audioUrlMap[@"mediumQuality"];
+    if ([qualityMap isKindOfClass:[NSDictionary class]]) {
+      if (!song.medUrl || [qualityMap[@"bitrate"] integerValue] > 64) {
+        song.medUrl = qualityMap[@"audioUrl"];
+      }
+    }
+    qualityMap = audioUrlMap[@"lowQuality"];
+    if ([qualityMap isKindOfClass:[NSDictionary class]]) {
+      if (!song.lowUrl || [qualityMap[@"bitrate"] integerValue] > 32) {
+        song.lowUrl = qualityMap[@"audioUrl"];
+      }
+    }
+  }
+
+  if (!song.medUrl) song.medUrl = song.lowUrl;
+  if (!song.highUrl) song.highUrl = song.medUrl;
+  return song;
+}
+
+/* As Pandora.m's updateStation:fromDictionary: */
+static BenchStation* stationFromDictionary(NSDictionary *s) {
+  BenchStation *station = [[BenchStation alloc] init];
+  station.name = s[@"stationName"];
+  station.stationId = s[@"stationId"];
+  station.token = s[@"stationToken"];
+  station.shared = [s[@"isShared"] boolValue];
+  station.allowAddMusic = [s[@"allowAddMusic"] boolValue];
+  station.allowRename = [s[@"allowRename"] boolValue];
+  station.created = [s[@"dateCreated"][@"time"] unsignedLongLongValue];
+  station.isQuickMix = [s[@"isQuickMix"] boolValue];
+  return station;
+}
+
+/* As Pandora.m's parseSearchResults: */
+static NSDictionary* searchResults(NSDictionary *result) {
+  NSMutableArray *songs = [NSMutableArray array];
+  NSMutableArray *artists = [NSMutableArray array];
+  for (NSDictionary *s in result[@"songs"]) {
+    BenchSearchResult *r = [[BenchSearchResult alloc] init];
+    r.name = [NSString stringWithFormat:@"%@ - %@", s[@"songName"], s[@"artistName"]];
+    r.value = s[@"musicToken"];
+    [songs addObject:r];
+  }
+  for (NSDictionary *a in result[@"artists"]) {
+    BenchSearchResult *r = [[BenchSearchResult alloc] init];
+    r.value = a[@"musicToken"];
+    r.name = a[@"artistName"];
+    [artists addObject:r];
+  }
+  return @{@"Songs": songs, @"Artists": artists};
+}
+
+/* As Pandora.m's playlistParser */
+static PandoraResponseParser* playlistParser(void) {
+  NSSet *fields = [NSSet setWithObjects:@"artistName", @"songName",
+                   @"albumName", @"albumArtUrl", @"stationId", @"trackToken",
+                   @"songRating", @"albumDetailUrl", @"artistDetailUrl",
+                   @"songDetailUrl", @"additionalAudioUrl", @"audioUrlMap",
+                   @"adToken", nil];
+  return [[PandoraResponseParser alloc] initWithListKey:@"items"
+                                                 fields:fields
+                                                builder:^id(NSDictionary *s) {
+    return songFromDictionary(s);
+  }];
+}
+
+/* As Pandora.m's stationListParser, which leaves building the stations
+   until they're merged into those already known */
+static PandoraResponseParser* stationListParser(void) {
+  NSSet *fields = [NSSet setWithObjects:@"stationName", @"stationId",
+                   @"stationToken", @"isShared", @"allowAddMusic",
+                   @"allowRename", @"dateCreated", @"isQuickMix", nil];
+  PandoraResponseParser *parser =
+      [[PandoraResponseParser alloc] initWithListKey:@"stations"
+                                              fields:fields
+                                             builder:^id(NSDictionary *s) {
+    return s;
+  }];
+  parser.resultFields = [NSSet setWithObject:@"checksum"];
+  return parser;
+}
+
+#pragma mark - Counting allocations
+
+static malloc_statistics_t heapInUse(void) {
+  malloc_statistics_t stats;
+  malloc_zone_statistics(NULL, &stats);
+  return stats;
+}
+
+/* Blocks and bytes per call of a block still allocated when it returns,
+   before its autorelease pool is drained */
+static void allocationsPerCall(void(^call)(void), double *blocks,
+                               double *bytes) {
+  int64_t totalBlocks = 0, totalBytes = 0;
+  for (int i = 0; i < COUNTED_CALLS; i++) {
+    @autoreleasepool {
+      malloc_statistics_t before = heapInUse();
+      call();
+      malloc_statistics_t after = heapInUse();
+      totalBlocks += (int64_t) after.blocks_in_use - (int64_t) before.blocks_in_use;
+      totalBytes += (int64_t) after.size_in_use - (int64_t) before.size_in_use;
+    }
+  }
+  *blocks = (double) totalBlocks / COUNTED_CALLS;
+  *bytes = (double) totalBytes / COUNTED_CALLS;
+}
+
+#pragma mark - Timing
+
+static double nanoseconds(uint64_t ticks) {
+  static mach_timebase_info_data_t timebase;
+  if (timebase.denom == 0) {
+    mach_timebase_info(&timebase);
+  }
+  return (double)ticks * timebase.numer / timebase.denom;
+}
+
+static void timeStage(const char *payload, const char *stage, NSUInteger calls,
+                      void(^call)(void)) {
+  /* Warm up caches, such as the cipher key's */
+  @autoreleasepool {
+    call();
+  }
+
+  uint64_t start = mach_absolute_time();
+  for (NSUInteger i = 0; i < calls; i++) {
+    @autoreleasepool {
+      call();
+    }
+  }
+  double ns = nanoseconds(mach_absolute_time() - start) / calls;
+  double blocks, bytes;
+  allocationsPerCall(call, &blocks, &bytes);
+
+  printf("protocol: %-12s %-28s %10.0f ns/op %8.1f blocks/op %9.0f B/op\n",
+         payload, stage, ns, blocks, bytes);
+}
+
+#pragma mark - Payloads
+
+/* A response like music.search returns for a common word */
+static NSData* searchResponse(void) {
+  NSMutableArray *songs = [NSMutableArray array];
+  NSMutableArray *artists = [NSMutableArray array];
+  for (int i = 0; i < SEARCH_RESULTS; i++) {
+    [songs addObject:@{
+      @"songName": [NSString stringWithFormat:@"Love Song No. %d", i],
+      @"artistName": [NSString stringWithFormat:@"The L\u00f6vers %d", i],
+      @"musicToken": [NSString stringWithFormat:@"S%d", 300000 + i],
+      @"score": @(100 - i % 100),
+    }];
+    [artists addObject:@{
+      @"artistName": [NSString stringWithFormat:@"Love & %d", i],
+      @"musicToken": [NSString stringWithFormat:@"R%d", 400000 + i],
+      @"likelyMatch": @(i == 0),
+      @"score": @(100 - i % 100),
+    }];
+  }
+  NSDictionary *response = @{
+    @"stat": @"ok",
+    @"result": @{@"songs": songs, @"artists": artists,
+                 @"genreStations": @[@{@"stationName": @"Love Songs",
+                                       @"musicToken": @"G100", @"score": @80}],
+                 @"nearMatchesAvailable": @YES, @"explanation": @""}
+  };
+  return [NSJSONSerialization dataWithJSONObject:response options:0 error:nil];
+}
+
+static NSArray* parseStreaming(PandoraResponseParser *parser, NSData *data,
+                               NSString *listKey) {
+  [parser reset];
+  const char *bytes = [data bytes];
+  for (NSUInteger at = 0; at < [data length]; at += 1024) {
+    [parser feed:bytes + at length:MIN(1024, [data length] - at)];
+  }
+  return [parser finishWithError:nil][@"result"][listKey];
+}
+
+#pragma mark - Checks
+
+/* Request dictionaries like the ones Pandora.m builds, plus the awkward
+   cases: escapes, non-ASCII text, values NSJSONSerialization has to handle
+   itself, and a body too large for the writer's stack buffer */
+static NSArray* requestBodies(void) {
+  NSMutableString *large = [NSMutableString string];
+  while ([large length] < 6000) {
+    [large appendString:@"Sigur R\u00f3s / \"Hopp\u00edpolla\" "];
+  }
+  return @[
+    @{@"userAuthToken": @"XXXiJRnSIyrnNSAzG8bJn/7rIr+hkDmeQCd3JSs/Xb4dRbC9TkgjlZaA==",
+      @"syncTime": @(1234567890ULL)},
+    @{@"loginType": @"user", @"username": @"someone@example.com",
+      @"password": @"p\"a\\ss/word", @"partnerAuthToken": @"VA+Wr4vJ1EyP0=",
+      @"returnStationList": @YES, @"includeStationArtUrl": @NO,
+      @"syncTime": @(1400000000ULL)},
+    @{@"stationToken": @"1234567890", @"syncTime": @(1234567890ULL),
+      @"additionalAudioUrl": @"HTTP_32_AACPLUS_ADTS,HTTP_64_AACPLUS_ADTS",
+      @"stationCode": @(-42), @"seeds": @[@"R1234", @"S5678", [NSNull null], @[]],
+      @"nested": @{@"empty": @{}, @"unicode": @"\u65e5\u672c\u8a9e \U0001F3B5"}},
+    @{@"searchText": @"tab\there", @"syncTime": @(1234567890ULL)},
+    @{@"rating": @(0.5), @"syncTime": @(1234567890ULL)},
+    @{@"searchText": large, @"syncTime": @(1234567890ULL)},
+  ];
+}
+
+static BOOL checkRequestBodies(PandoraCipherKey *key) {
+  BOOL passed = YES;
+
+  NSArray *bodies = requestBodies();
+  for (NSUInteger i = 0; i < [bodies count]; i++) {
+    NSDictionary *body = bodies[i];
+    NSData *json = [NSJSONSerialization dataWithJSONObject:body options:0 error:nil];
+    if (![PandoraRequestBody(body, nil) isEqualToData:json]) {
+      printf("protocol: JSON of body %lu differs from NSJSONSerialization\n",
+             (unsigned long) i);
+      passed = NO;
+    }
+    if (![PandoraRequestBody(body, key) isEqualToData:PandoraEncryptDataWithKey(json, key)]) {
+      printf("protocol: encrypted body %lu differs from NSJSONSerialization\n",
+             (unsigned long) i);
+      passed = NO;
+    }
+  }
+  return passed;
+}
+
+#pragma mark - Stages
+
+/* The stages of sending a request, as sendRequest: goes through them, for
+   a logged in user */
+static void timeRequest(PandoraCipherKey *key, const char *payload,
+                        NSDictionary *fields) {
+  NSMutableDictionary *(^dictionary)(void) = ^{
+    NSMutableDictionary *d = [NSMutableDictionary dictionary];
+    d[@"userAuthToken"] = @"XXXiJRnSIyrnNSAzG8bJn/7rIr+hkDmeQCd3JSs/Xb4dRbC9TkgjlZaA==";
+    d[@"syncTime"] = @(1234567890ULL);
+    [d addEntriesFromDictionary:fields];
+    return d;
+  };
+  NSDictionary *body = dictionary();
+  NSData *json = PandoraRequestBody(body, nil);
+
+  timeStage(payload, "request dictionary + JSON", TIMED_CALLS, ^{
+    (void)PandoraRequestBody(dictionary(), nil);
+  });
+  timeStage(payload, "encrypt", TIMED_CALLS, ^{
+    (void)PandoraEncryptDataWithKey(json, key);
+  });
+  timeStage(payload, "JSON + encrypt as sent", TIMED_CALLS, ^{
+    (void)PandoraRequestBody(body, key);
+  });
+}
+
+static void timePlaylist(PandoraCipherKey *key) {
+  const char *payload = "playlist";
+  timeRequest(key, payload,
+              @{@"stationToken": @"1234567890",
+                @"additionalAudioUrl": @"HTTP_32_AACPLUS_ADTS,HTTP_64_AACPLUS_ADTS,HTTP_128_MP3"});
+
+  NSData *response = PandoraSamplePlaylistResponse();
+  NSArray *items = [NSJSONSerialization JSONObjectWithData:response options:0 error:nil][@"result"][@"items"];
+  PandoraResponseParser *parser = playlistParser();
+  printf("protocol: %s response is %lu B\n", payload, (unsigned long) [response length]);
+
+  timeStage(payload, "JSON parse", TIMED_CALLS, ^{
+    (void)[NSJSONSerialization JSONObjectWithData:response options:0 error:nil];
+  });
+  timeStage(payload, "streaming parse + songs", TIMED_CALLS, ^{
+    (void)parseStreaming(parser, response, @"items");
+  });
+  timeStage(payload, "songs", TIMED_CALLS, ^{
+    for (NSDictionary *s in items) {
+      (void)songFromDictionary(s);
+    }
+  });
+}
+
+static void timeStationList(PandoraCipherKey *key) {
+  const char *payload = "station list";
+  timeRequest(key, payload, @{});
+
+  NSData *response = PandoraSampleStationListResponse(STATIONS);
+  PandoraResponseParser *parser = stationListParser();
+  NSArray *stations = parseStreaming(parser, response, @"stations");
+  printf("protocol: %s response is %lu B\n", payload, (unsigned long) [response length]);
+
+  timeStage(payload, "JSON parse", TIMED_LARGE_CALLS, ^{
+    (void)[NSJSONSerialization JSONObjectWithData:response options:0 error:nil];
+  });
+  timeStage(payload, "streaming parse", TIMED_LARGE_CALLS, ^{
+    (void)parseStreaming(parser, response, @"stations");
+  });
+  timeStage(payload, "stations", TIMED_LARGE_CALLS, ^{
+    for (NSDictionary *s in stations) {
+      (void)stationFromDictionary(s);
+    }
+  });
+}
+
+static void timeSearch(PandoraCipherKey *key) {
+  const char *payload = "search";
+  timeRequest(key, payload, @{@"searchText": @"love"});
+
+  NSData *response = searchResponse();
+  NSDictionary *result = [NSJSONSerialization JSONObjectWithData:response options:0 error:nil][@"result"];
+  printf("protocol: %s response is %lu B\n", payload, (unsigned long) [response length]);
+
+  timeStage(payload, "JSON parse", TIMED_LARGE_CALLS, ^{
+    (void)[NSJSONSerialization JSONObjectWithData:response options:0 error:nil];
+  });
+  timeStage(payload, "search results", TIMED_LARGE_CALLS, ^{
+    (void)searchResults(result);
+  });
+}
+
+int main(void) {
+  @autoreleasepool {
+    PandoraCipherKey *key =
+        PandoraCipherKeyForString([PandoraDevice android][kPandoraDeviceEncrypt]);
+    BOOL passed = checkRequestBodies(key);
+    printf("protocol: request body checks %s\n", passed ? "passed" : "FAILED");
+
+    timePlaylist(key);
+    timeStationList(key);
+    timeSearch(key);
+    return passed ? 0 : 1;
+  }
+}
@@ -5,10 +5,21 @@
 
 /* Note: these routines do not depend on endianness. */
 
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "blowfish.h"
 
-static unsigned long
-F (const struct blf_ctx *bc, unsigned long x)
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define BLOWFISH_X86
+#define BLOWFISH_AVX2 __attribute__((target("avx2")))
+#endif
+
+static inline __attribute__((always_inline)) uint32_t
+F (const struct blf_ctx *bc, uint32_t x)
 {
   unsigned char a, b, c, d;
 
@@ -24,9 +35,9 @@ F (const struct blf_ctx *bc, unsigned long x)
 
 void
 Blowfish_encipher (const struct blf_ctx *c,
-                   unsigned long *xl, unsigned long *xr)
+                   uint32_t *xl, uint32_t *xr)
 {
-  unsigned long Xl, Xr, temp;
+  uint32_t Xl, Xr, temp;
   int i;
 
   Xl = *xl;  Xr = *xr;
@@ -44,9 +55,9 @@ Blowfish_encipher (const struct blf_ctx *c,
 
 void
 Blowfish_decipher (const struct blf_ctx *c,
-                   unsigned long *xl, unsigned long *xr)
+                   uint32_t *xl, uint32_t *xr)
 {
-  unsigned long Xl, Xr, temp;
+  uint32_t Xl, Xr, temp;
   int i;
 
   Xl = *xl;  Xr = *xr;
@@ -62,11 +73,195 @@ Blowfish_decipher (const struct blf_ctx *c,
   *xl = Xl;  *xr = Xr;
 }
 
+/* --- Interleaved encipherment of several blocks --- */
+
+/* Running several independent blocks through the rounds together lets
+ * their S-box lookups overlap instead of waiting on each other.  The
+ * lanes are spelled out with macros rather than loops, so that every
+ * half block stays in a register whether or not the compiler unrolls
+ * loops at the optimization level in use. */
+#define LANES1(op) op(0)
+#define LANES4(op) LANES1(op) op(1) op(2) op(3)
+#define LANES8(op) LANES4(op) op(4) op(5) op(6) op(7)
+
+#define LANE_LOAD(k)  uint32_t l##k = x[2*k], r##k = x[2*k+1];
+#define LANE_XOR_L(k) l##k ^= p;
+#define LANE_XOR_R(k) r##k ^= p;
+#define LANE_F_L(k)   r##k ^= F (c, l##k);
+#define LANE_F_R(k)   l##k ^= F (c, r##k);
+#define LANE_STORE(k) x[2*k] = r##k ^ pl;  x[2*k+1] = l##k ^ pr;
+
+/* Define a function running LANES blocks through the cipher.  `first'
+ * and `step' select the order in which the P array is used (forwards
+ * to encipher, backwards to decipher).  Two rounds are done per
+ * iteration, with the swaps folded into the naming of the halves. */
+#define DEFINE_CRYPT_LANES(name, LANES)                                  \
+static void                                                              \
+name (const struct blf_ctx *c, uint32_t *x, int first, int step)         \
+{                                                                        \
+  uint32_t p, pl, pr;                                                    \
+  int i, n;                                                              \
+  LANES (LANE_LOAD)                                                      \
+  for ( i=0, n=first ; i<NBROUNDS ; i+=2, n+=2*step )                    \
+  {                                                                      \
+    p = c->P[n];                                                         \
+    LANES (LANE_XOR_L)                                                   \
+    LANES (LANE_F_L)                                                     \
+    p = c->P[n+step];                                                    \
+    LANES (LANE_XOR_R)                                                   \
+    LANES (LANE_F_R)                                                     \
+  }                                                                      \
+  pl = c->P[n+step];  pr = c->P[n];                                      \
+  LANES (LANE_STORE)                                                     \
+}
+
+DEFINE_CRYPT_LANES (crypt_x1, LANES1)
+DEFINE_CRYPT_LANES (crypt_x4, LANES4)
+DEFINE_CRYPT_LANES (crypt_x8, LANES8)
+
+#ifdef BLOWFISH_X86
+
+/* With AVX2, the eight lanes are the elements of two vectors, and the
+ * S-box lookups of all eight are done by one gather per S-box. */
+static __m256i BLOWFISH_AVX2
+F_x8_avx2 (const struct blf_ctx *c, __m256i x)
+{
+  const __m256i mask = _mm256_set1_epi32 (0xff);
+  __m256i a, b, d, e;
+
+  a = _mm256_srli_epi32 (x, 24);
+  b = _mm256_and_si256 (_mm256_srli_epi32 (x, 16), mask);
+  d = _mm256_and_si256 (_mm256_srli_epi32 (x, 8), mask);
+  e = _mm256_and_si256 (x, mask);
+  a = _mm256_i32gather_epi32 ((const int *) c->S[0], a, 4);
+  b = _mm256_i32gather_epi32 ((const int *) c->S[1], b, 4);
+  d = _mm256_i32gather_epi32 ((const int *) c->S[2], d, 4);
+  e = _mm256_i32gather_epi32 ((const int *) c->S[3], e, 4);
+  return _mm256_add_epi32 (_mm256_xor_si256 (_mm256_add_epi32 (a, b), d), e);
+}
+
+static void BLOWFISH_AVX2
+crypt_x8_avx2 (const struct blf_ctx *c, uint32_t *x, int first, int step)
+{
+  uint32_t h[2][8];
+  __m256i l, r;
+  int i, n;
+
+  for ( i=0 ; i<8 ; i++ )
+  {
+    h[0][i] = x[2*i];  h[1][i] = x[2*i+1];
+  }
+  l = _mm256_loadu_si256 ((const __m256i *) h[0]);
+  r = _mm256_loadu_si256 ((const __m256i *) h[1]);
+  for ( i=0, n=first ; i<NBROUNDS ; i+=2, n+=2*step )
+  {
+    l = _mm256_xor_si256 (l, _mm256_set1_epi32 ((int) c->P[n]));
+    r = _mm256_xor_si256 (r, F_x8_avx2 (c, l));
+    r = _mm256_xor_si256 (r, _mm256_set1_epi32 ((int) c->P[n+step]));
+    l = _mm256_xor_si256 (l, F_x8_avx2 (c, r));
+  }
+  r = _mm256_xor_si256 (r, _mm256_set1_epi32 ((int) c->P[n+step]));
+  l = _mm256_xor_si256 (l, _mm256_set1_epi32 ((int) c->P[n]));
+  _mm256_storeu_si256 ((__m256i *) h[0], r);
+  _mm256_storeu_si256 ((__m256i *) h[1], l);
+  for ( i=0 ; i<8 ; i++ )
+  {
+    x[2*i] = h[0][i];  x[2*i+1] = h[1][i];
+  }
+}
+
+static int
+cpu_has_avx2 (void)
+{
+  unsigned int eax, ebx, ecx, edx, xcr0, xcr0_hi;
+
+  if ( !__get_cpuid (1, &eax, &ebx, &ecx, &edx) )
+    return 0;
+  if ( !(ecx & bit_AVX) || !(ecx & bit_OSXSAVE) )
+    return 0;
+  /* The OS must also preserve the YMM registers */
+  __asm__ ("xgetbv" : "=a" (xcr0), "=d" (xcr0_hi) : "c" (0));
+  if ( (xcr0 & 6) != 6 || __get_cpuid_max (0, 0) < 7 )
+    return 0;
+  __cpuid_count (7, 0, eax, ebx, ecx, edx);
+  return (ebx & bit_AVX2) != 0;
+}
+
+#endif /* BLOWFISH_X86 */
+
+/* Eight blocks as two runs of four, for cores where eight lanes don't
+ * fit in the registers. */
+static void
+crypt_x4x2 (const struct blf_ctx *c, uint32_t *x, int first, int step)
+{
+  crypt_x4 (c, x, first, step);
+  crypt_x4 (c, x+8, first, step);
+}
+
+typedef void (* crypt_kernel) (const struct blf_ctx *c, uint32_t *x,
+                               int first, int step);
+
+/* The kernel for eight blocks, picked for the CPU at first use: the
+ * AVX2 one where the CPU has AVX2, and otherwise eight scalar lanes.
+ * The BLOWFISH_KERNEL environment variable can name one instead ("x8",
+ * "x4", or "avx2" if the CPU has it), which is how Benchmarks/CryptoBenchmark.c checks and
+ * times each of them on a given machine. */
+static crypt_kernel crypt_wide;
+static pthread_once_t crypt_wide_once = PTHREAD_ONCE_INIT;
+
+static void
+select_crypt_wide (void)
+{
+  const char *forced = getenv ("BLOWFISH_KERNEL");
+
+  crypt_wide = crypt_x8;
+#ifdef BLOWFISH_X86
+  /* Only where the CPU can run it, even if asked for */
+  if ( cpu_has_avx2 () && (forced == NULL || strcmp (forced, "avx2") == 0) )
+    crypt_wide = crypt_x8_avx2;
+#endif
+  if ( forced != NULL && strcmp (forced, "x4") == 0 )
+    crypt_wide = crypt_x4x2;
+}
+
+/* Pick the widest kernel the remaining number of blocks allows. */
+static void
+crypt_blocks (const struct blf_ctx *c, uint32_t *x, unsigned long n,
+              int first, int step)
+{
+  if ( n>=8 )
+    pthread_once (&crypt_wide_once, select_crypt_wide);
+  for ( ; n>=8 ; n-=8, x+=16 )
+    crypt_wide (c, x, first, step);
+  for ( ; n>=4 ; n-=4, x+=8 )
+    crypt_x4 (c, x, first, step);
+  for ( ; n ; n--, x+=2 )
+    crypt_x1 (c, x, first, step);
+}
+
+void
+Blowfish_encipher_blocks (const struct blf_ctx *c,
+                          uint32_t *x, unsigned long n)
+{
+  crypt_blocks (c, x, n, 0, 1);
+}
+
+void
+Blowfish_decipher_blocks (const struct blf_ctx *c,
+                          uint32_t *x, unsigned long n)
+{
+  crypt_blocks (c, x, n, NBROUNDS+1, -1);
+}
+
+/* How many blocks the ECB buffer routines hand to the kernels at
+ * once. */
+#define BLF_BATCH 8
+
 /* The magical constants of the Blowfish cipher (used in initializing
  * the P array and the S-boxes): these are the hexadecimal digits of
  * pi = 3.243F6A8885A308D313198A2E03707344... */
 
-static const unsigned long init_P[NBROUNDS+2] = {
+static const uint32_t init_P[NBROUNDS+2] = {
   0x243f6a88UL, 0x85a308d3UL, 0x13198a2eUL, 0x03707344UL,
   0xa4093822UL, 0x299f31d0UL, 0x082efa98UL, 0xec4e6c89UL,
   0x452821e6UL, 0x38d01377UL, 0xbe5466cfUL, 0x34e90c6cUL,
@@ -74,7 +269,7 @@ static const unsigned long init_P[NBROUNDS+2] = {
   0x9216d5d9UL, 0x8979fb1bUL,
 };
 
-static const unsigned long init_S[4][256] = {
+static const uint32_t init_S[4][256] = {
   {
     0xd1310ba6UL, 0x98dfb5acUL, 0x2ffd72dbUL, 0xd01adfb7UL,
     0xb8e1afedUL, 0x6a267e96UL, 0xba7c9045UL, 0xf12c7f99UL,
@@ -345,7 +540,7 @@ Blowfish_initialize (struct blf_ctx *c,
                      const unsigned char key[], unsigned long key_bytes)
 {
   unsigned long i, j, k;
-  unsigned long data, datal, datar;
+  uint32_t data, datal, datar;
 
   for ( i=0 ; i<NBROUNDS+2 ; i++ )
     c->P[i] = init_P[i];
@@ -389,9 +584,20 @@ Blowfish_ecb_start (struct blf_ecb_ctx *c, char encrypt,
                     const unsigned char key[], unsigned long key_bytes,
                     void (* callback) (unsigned char byte, void *user_data),
                     void *user_data)
+{
+  Blowfish_initialize (&c->key, key, key_bytes);
+  Blowfish_ecb_start_schedule (c, encrypt, &c->key, callback, user_data);
+}
+
+void
+Blowfish_ecb_start_schedule (struct blf_ecb_ctx *c, char encrypt,
+                             const struct blf_ctx *subkeys,
+                             void (* callback) (unsigned char byte,
+                                                void *user_data),
+                             void *user_data)
 {
   c->encrypt = encrypt;
-  Blowfish_initialize (&c->c, key, key_bytes);
+  c->c = subkeys;
   c->b = 0;
   c->dl = 0;
   c->dr = 0;
@@ -409,10 +615,10 @@ Blowfish_ecb_feed (struct blf_ecb_ctx *c, unsigned char inb)
   if ( c->b >= 8 )
   /* We have one block of data */
   {
-    unsigned long xl, xr;
+    uint32_t xl, xr;
 
     xl = c->dl;  xr = c->dr;
-    (c->encrypt ? Blowfish_encipher : Blowfish_decipher) (&c->c, &xl, &xr);
+    (c->encrypt ? Blowfish_encipher : Blowfish_decipher) (c->c, &xl, &xr);
     c->callback ((xl>>24)&0xff, c->user_data);
     c->callback ((xl>>16)&0xff, c->user_data);
     c->callback ((xl>>8)&0xff, c->user_data);
@@ -433,3 +639,55 @@ Blowfish_ecb_stop (struct blf_ecb_ctx *c)
   for ( ; c->b ; ) /* ``Cryptic'', isn't it? */
     Blowfish_ecb_feed (c, 0);
 }
+
+static void
+ecb_crypt (const struct blf_ctx *c,
+           const unsigned char *in, unsigned long len, unsigned char *out,
+           void (* kernel) (const struct blf_ctx *c,
+                            uint32_t *x, unsigned long n))
+{
+  unsigned char last[8];
+  uint32_t x[2*BLF_BATCH];
+  unsigned long i, k, n;
+
+  for ( i=0 ; i<len ; )
+  {
+    /* Gather as many blocks as the kernels take at once */
+    for ( n=0 ; n<BLF_BATCH && i<len ; n++, i+=8, in+=8 )
+    {
+      if ( len-i < 8 )
+      /* Pad the last block with zeroes, like Blowfish_ecb_stop */
+      {
+        memset (last, 0, sizeof(last));
+        memcpy (last, in, len-i);
+        in = last;
+      }
+      x[2*n] = (uint32_t)in[0]<<24 | (uint32_t)in[1]<<16
+        | (uint32_t)in[2]<<8 | in[3];
+      x[2*n+1] = (uint32_t)in[4]<<24 | (uint32_t)in[5]<<16
+        | (uint32_t)in[6]<<8 | in[7];
+    }
+    kernel (c, x, n);
+    for ( k=0 ; k<2*n ; k++, out+=4 )
+    {
+      out[0] = (x[k]>>24)&0xff;  out[1] = (x[k]>>16)&0xff;
+      out[2] = (x[k]>>8)&0xff;   out[3] = x[k]&0xff;
+    }
+  }
+}
+
+void
+Blowfish_ecb_encrypt (const struct blf_ctx *c,
+                      const unsigned char *in, unsigned long len,
+                      unsigned char *out)
+{
+  ecb_crypt (c, in, len, out, Blowfish_encipher_blocks);
+}
+
+void
+Blowfish_ecb_decrypt (const struct blf_ctx *c,
+                      const unsigned char *in, unsigned long len,
+                      unsigned char *out)
+{
+  ecb_crypt (c, in, len, out, Blowfish_decipher_blocks);
+}
@@ -6,24 +6,41 @@
 #ifndef _DMADORE_BLOWFISH_H
 #define _DMADORE_BLOWFISH_H
 
+#include <stdint.h>
+
 /* --- Basic blowfish routines --- */
 
 #define NBROUNDS 16
 
 struct blf_ctx {
-  /* The subkeys used by the blowfish cipher */
-  unsigned long P[NBROUNDS+2], S[4][256];
+  /* The subkeys used by the blowfish cipher (32 bits each, so that the
+   * S-boxes take 4 KB regardless of the size of a long) */
+  uint32_t P[NBROUNDS+2], S[4][256];
 };
 
 /* Encipher one 64-bit quantity (divided in two 32-bit quantities)
  * using the precalculated subkeys). */
 void Blowfish_encipher (const struct blf_ctx *c,
-                        unsigned long *xl, unsigned long *xr);
+                        uint32_t *xl, uint32_t *xr);
 
 /* Decipher one 64-bit quantity (divided in two 32-bit quantities)
  * using the precalculated subkeys). */
 void Blowfish_decipher (const struct blf_ctx *c,
-                        unsigned long *xl, unsigned long *xr);
+                        uint32_t *xl, uint32_t *xr);
+
+/* Encipher n independent 64-bit quantities, stored as n pairs of
+ * 32-bit quantities (left half first) in x.  Several blocks are run
+ * through the rounds at once so that their S-box lookups overlap; the
+ * result is the same as calling Blowfish_encipher on every block.
+ * The kernel for eight blocks is picked from the CPU's features on
+ * the first call with eight or more blocks, unless the BLOWFISH_KERNEL
+ * environment variable names one. */
+void Blowfish_encipher_blocks (const struct blf_ctx *c,
+                               uint32_t *x, unsigned long n);
+
+/* Decipher n independent 64-bit quantities (see above). */
+void Blowfish_decipher_blocks (const struct blf_ctx *c,
+                               uint32_t *x, unsigned long n);
 
 /* Initialize the cipher by calculating the subkeys from the key. */
 void Blowfish_initialize (struct blf_ctx *c,
@@ -34,10 +51,12 @@ void Blowfish_initialize (struct blf_ctx *c,
 struct blf_ecb_ctx {
   /* Whether we are encrypting (rather than decrypting) */
   char encrypt;
-  /* The blowfish subkeys */
-  struct blf_ctx c;
+  /* The blowfish subkeys, when the session computed them itself */
+  struct blf_ctx key;
+  /* The subkeys in use: either &key or a schedule shared with others */
+  const struct blf_ctx *c;
   /* The 64-bits of data being written */
-  unsigned long dl, dr;
+  uint32_t dl, dr;
   /* Our position within the 64 bits (always between 0 and 7) */
   int b;
   /* The callback function to be called with every byte produced */
@@ -55,10 +74,39 @@ void Blowfish_ecb_start (struct blf_ecb_ctx *c, char encrypt,
                                             void *user_data),
                          void *user_data);
 
+/* Same as Blowfish_ecb_start, but use subkeys which were already
+ * calculated by Blowfish_initialize instead of a key.  The subkeys
+ * are only ever read, so one schedule may be shared by any number of
+ * sessions, but it must outlive all of them. */
+void Blowfish_ecb_start_schedule (struct blf_ecb_ctx *c, char encrypt,
+                                  const struct blf_ctx *subkeys,
+                                  void (* callback) (unsigned char byte,
+                                                     void *user_data),
+                                  void *user_data);
+
 /* Feed one byte to an ECB Blowfish cipher session. */
 void Blowfish_ecb_feed (struct blf_ecb_ctx *c, unsigned char inb);
 
 /* Stop an ECB Blowfish session (i.e. flush the remaining bytes). */
 void Blowfish_ecb_stop (struct blf_ecb_ctx *c);
 
+/* --- Blowfish ECB over whole buffers --- */
+
+/* Number of bytes produced by encrypting or decrypting len bytes (the
+ * input is padded with zeroes to a whole number of blocks). */
+#define BLOWFISH_ECB_LENGTH(len) ((((len) + 7) / 8) * 8)
+
+/* Encrypt len bytes from in, and write the result to out, which must
+ * have room for BLOWFISH_ECB_LENGTH(len) bytes.  out may be the same
+ * buffer as in.  This gives the same result as feeding every byte of
+ * in to an ECB session. */
+void Blowfish_ecb_encrypt (const struct blf_ctx *c,
+                           const unsigned char *in, unsigned long len,
+                           unsigned char *out);
+
+/* Decrypt len bytes from in (see above). */
+void Blowfish_ecb_decrypt (const struct blf_ctx *c,
+                           const unsigned char *in, unsigned long len,
+                           unsigned char *out);
+
 #endif /* not defined _DMADORE_BLOWFISH_H */
@@ -0,0 +1,259 @@
+/**
+ * @file AudioStreamer/ASPacketRing.c
+ * @brief Implementation of the ring of audio packets
+ *
+ * Within one ring, the bytes of the held packets lie either in one stretch
+ * from the oldest to the newest, or once a packet didn't fit before the end of
+ * the ring, in a stretch from the oldest to where the ring wrapped followed by
+ * a stretch from the start of the ring to the newest. The producer works out
+ * which from where the oldest packet starts, which it wrote itself, so the
+ * only things the two sides share are the counts of descriptions each has
+ * pushed and popped, and the link to the next ring.
+ *
+ * The producer publishes a packet by storing the count it has pushed with
+ * release ordering once the packet is written, and the consumer frees space
+ * by storing the count it has popped with release ordering once it is done
+ * reading. A full ring is left to the consumer, which frees it once it has
+ * read everything in it and found the next ring linked after it.
+ */
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ASPacketRing.h"
+
+/* Room for about 1.5 seconds of 320 kbps MP3 until told otherwise */
+#define DEFAULT_CAPACITY (64 * 1024)
+#define DEFAULT_DESC_CAPACITY 256
+
+/* Bytes of room per description made room for up front, about one frame of
+   80 kbps MP3 */
+#define BYTES_PER_DESC 256
+
+typedef struct segment {
+  char *data;
+  size_t capacity;
+  AudioStreamPacketDescription *descs;
+  size_t descCapacity;
+  size_t tail;                    /* where the newest packet ends */
+  _Atomic size_t pushed;          /* descriptions written by the producer */
+  _Atomic size_t popped;          /* descriptions read by the consumer */
+  struct segment *_Atomic next;   /* the ring the producer moved on to */
+} segment_t;
+
+struct ASPacketRing {
+  segment_t *producing;
+  segment_t *consuming;
+  _Atomic size_t count;
+  _Atomic size_t bytes;
+  ASPacketRingStats stats;        /* kept by the producer */
+};
+
+static void segmentFree(segment_t *seg) {
+  free(seg->data);
+  free(seg->descs);
+  free(seg);
+}
+
+static segment_t* segmentCreate(ASPacketRing *ring, size_t capacity,
+                                size_t descCapacity) {
+  segment_t *seg = calloc(1, sizeof(segment_t));
+  if (seg == NULL) return NULL;
+  seg->capacity = capacity;
+  seg->descCapacity = descCapacity;
+  seg->data = malloc(capacity);
+  seg->descs = malloc(descCapacity * sizeof(seg->descs[0]));
+  if (seg->data == NULL || seg->descs == NULL) {
+    segmentFree(seg);
+    return NULL;
+  }
+  ring->stats.allocations += 3;
+  return seg;
+}
+
+ASPacketRing* ASPacketRingCreate(size_t capacity) {
+  ASPacketRing *ring = calloc(1, sizeof(ASPacketRing));
+  if (ring == NULL) return NULL;
+  ring->stats.allocations = 1;
+  if (capacity == 0) capacity = DEFAULT_CAPACITY;
+  size_t descCapacity = capacity / BYTES_PER_DESC;
+  if (descCapacity < DEFAULT_DESC_CAPACITY) {
+    descCapacity = DEFAULT_DESC_CAPACITY;
+  }
+  ring->producing = ring->consuming =
+      segmentCreate(ring, capacity, descCapacity);
+  if (ring->producing == NULL) {
+    free(ring);
+    return NULL;
+  }
+  return ring;
+}
+
+void ASPacketRingFree(ASPacketRing *ring) {
+  if (ring == NULL) return;
+  segment_t *seg = ring->consuming;
+  while (seg != NULL) {
+    segment_t *next = atomic_load_explicit(&seg->next, memory_order_relaxed);
+    segmentFree(seg);
+    seg = next;
+  }
+  free(ring);
+}
+
+/* Where in a ring a packet fits, if it does */
+static int place(segment_t *seg, size_t size, size_t *offset) {
+  size_t pushed = atomic_load_explicit(&seg->pushed, memory_order_relaxed);
+  size_t popped = atomic_load_explicit(&seg->popped, memory_order_acquire);
+  if (pushed - popped == seg->descCapacity) return 0;
+
+  /* Everything has been read, so start over at the beginning */
+  if (pushed == popped) {
+    seg->tail = 0;
+    *offset = 0;
+    return size <= seg->capacity;
+  }
+
+  size_t head = (size_t) seg->descs[popped % seg->descCapacity].mStartOffset;
+  if (seg->tail > head) {
+    if (seg->capacity - seg->tail >= size) {
+      *offset = seg->tail;
+      return 1;
+    } else if (head >= size) {
+      *offset = 0;
+      return 1;
+    }
+    return 0;
+  }
+  /* Wrapped, so the space left is between the newest and the oldest */
+  if (head - seg->tail >= size) {
+    *offset = seg->tail;
+    return 1;
+  }
+  return 0;
+}
+
+int ASPacketRingPush(ASPacketRing *ring, const void *data,
+                     const AudioStreamPacketDescription *desc) {
+  segment_t *seg = ring->producing;
+  size_t size = desc->mDataByteSize;
+  size_t offset;
+
+  if (!place(seg, size, &offset)) {
+    size_t capacity = seg->capacity * 2;
+    while (capacity < size) capacity *= 2;
+    segment_t *next = segmentCreate(ring, capacity, seg->descCapacity * 2);
+    if (next == NULL) return -1;
+    /* Nothing more is pushed to the full ring once the consumer can see it
+       has a successor */
+    ring->producing = next;
+    atomic_store_explicit(&seg->next, next, memory_order_release);
+    seg = next;
+    offset = 0;
+  }
+
+  if (size > 0) {
+    memcpy(seg->data + offset, data, size);
+    ring->stats.copies++;
+    ring->stats.copiedBytes += size;
+  }
+  seg->tail = offset + size;
+
+  size_t pushed = atomic_load_explicit(&seg->pushed, memory_order_relaxed);
+  AudioStreamPacketDescription *slot = &seg->descs[pushed % seg->descCapacity];
+  *slot = *desc;
+  slot->mStartOffset = (SInt64) offset;
+
+  /* Counted before it's published, so the consumer never uncounts a packet
+     before it was counted */
+  atomic_fetch_add_explicit(&ring->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&ring->bytes, size, memory_order_relaxed);
+  atomic_store_explicit(&seg->pushed, pushed + 1, memory_order_release);
+  return 0;
+}
+
+size_t ASPacketRingCount(const ASPacketRing *ring) {
+  return atomic_load_explicit(&ring->count, memory_order_relaxed);
+}
+
+size_t ASPacketRingBytes(const ASPacketRing *ring) {
+  return atomic_load_explicit(&ring->bytes, memory_order_relaxed);
+}
+
+size_t ASPacketRingPeek(ASPacketRing *ring, size_t maxBytes,
+                        size_t maxPackets, const void **data,
+                        const AudioStreamPacketDescription **descs,
+                        size_t *bytes) {
+  *data = NULL;
+  *descs = NULL;
+  *bytes = 0;
+  segment_t *seg = ring->consuming;
+  size_t popped = atomic_load_explicit(&seg->popped, memory_order_relaxed);
+  size_t pushed = atomic_load_explicit(&seg->pushed, memory_order_acquire);
+
+  /* Move on from rings which have been read and which the producer has
+     moved on from */
+  while (pushed == popped) {
+    segment_t *next = atomic_load_explicit(&seg->next, memory_order_acquire);
+    if (next == NULL) return 0;
+    pushed = atomic_load_explicit(&seg->pushed, memory_order_acquire);
+    if (pushed != popped) break;
+    ring->consuming = next;
+    segmentFree(seg);
+    seg = next;
+    popped = atomic_load_explicit(&seg->popped, memory_order_relaxed);
+    pushed = atomic_load_explicit(&seg->pushed, memory_order_acquire);
+  }
+
+  size_t start = popped % seg->descCapacity;
+  const AudioStreamPacketDescription *first = &seg->descs[start];
+  size_t count = 0;
+  size_t span = 0;
+  while (popped + count < pushed && count < maxPackets) {
+    /* The descriptions handed back must lie one after another too */
+    if (start + count >= seg->descCapacity) break;
+    const AudioStreamPacketDescription *desc = &seg->descs[start + count];
+    if ((size_t) desc->mStartOffset != (size_t) first->mStartOffset + span) {
+      break;
+    }
+    if (span + desc->mDataByteSize > maxBytes) break;
+    span += desc->mDataByteSize;
+    count++;
+  }
+
+  *data = seg->data + first->mStartOffset;
+  *descs = first;
+  *bytes = span;
+  return count;
+}
+
+void ASPacketRingPop(ASPacketRing *ring, size_t packets) {
+  segment_t *seg = ring->consuming;
+  size_t popped = atomic_load_explicit(&seg->popped, memory_order_relaxed);
+  size_t size = 0;
+  for (size_t i = 0; i < packets; i++) {
+    size += seg->descs[(popped + i) % seg->descCapacity].mDataByteSize;
+  }
+  atomic_store_explicit(&seg->popped, popped + packets, memory_order_release);
+  atomic_fetch_sub_explicit(&ring->count, packets, memory_order_relaxed);
+  atomic_fetch_sub_explicit(&ring->bytes, size, memory_order_relaxed);
+}
+
+void ASPacketRingClear(ASPacketRing *ring) {
+  segment_t *seg = ring->consuming;
+  while (seg != ring->producing) {
+    segment_t *next = atomic_load_explicit(&seg->next, memory_order_relaxed);
+    segmentFree(seg);
+    seg = next;
+  }
+  ring->consuming = seg;
+  seg->tail = 0;
+  atomic_store_explicit(&seg->pushed, 0, memory_order_relaxed);
+  atomic_store_explicit(&seg->popped, 0, memory_order_relaxed);
+  atomic_store_explicit(&ring->count, 0, memory_order_relaxed);
+  atomic_store_explicit(&ring->bytes, 0, memory_order_relaxed);
+}
+
+ASPacketRingStats ASPacketRingGetStats(const ASPacketRing *ring) {
+  return ring->stats;
+}
@@ -0,0 +1,102 @@
+/**
+ * @file AudioStreamer/ASPacketRing.h
+ * @brief Audio packets handed from the thread parsing them to the thread
+ *        playing them
+ *
+ * Packets are copied once into a contiguous ring of bytes, with their
+ * descriptions kept in a ring of their own, so that handing a packet over
+ * costs a copy but no allocation. A packet is never split across the end of
+ * the ring, which means the oldest packets can be read back as runs which lie
+ * one after another, and each run copied out in one go. When the ring is
+ * full, another twice its size is chained after it, which is the only time
+ * it allocates; the full one is freed once it has been read.
+ *
+ * One thread may push while another peeks and pops, without locking. Those
+ * two are the producer and the consumer, and no more than one thread may be
+ * either at a time. ASPacketRingCount and ASPacketRingBytes may be called
+ * from anywhere. Everything else must only be called while neither side is
+ * running.
+ */
+
+#ifndef ASPACKETRING_H
+#define ASPACKETRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <CoreAudio/CoreAudioTypes.h>
+
+typedef struct ASPacketRing ASPacketRing;
+
+/**
+ * @brief What a ring has cost so far
+ */
+typedef struct {
+  uint64_t allocations; /* of either ring, growing included */
+  uint64_t copies;      /* calls to memcpy */
+  uint64_t copiedBytes;
+} ASPacketRingStats;
+
+/**
+ * @brief Create an empty ring
+ *
+ * @param capacity bytes of packets to make room for up front, such as the
+ *        length of the download, or 0 for a small default
+ * @return the ring, or NULL if out of memory
+ */
+ASPacketRing* ASPacketRingCreate(size_t capacity);
+
+void ASPacketRingFree(ASPacketRing *ring);
+
+/**
+ * @brief Copy a packet to the end of the ring (producer)
+ *
+ * @param data the packet's bytes, mDataByteSize of them
+ * @param desc the packet's description, whose mStartOffset is ignored
+ * @return 0 on success, or -1 if out of memory
+ */
+int ASPacketRingPush(ASPacketRing *ring, const void *data,
+                     const AudioStreamPacketDescription *desc);
+
+/**
+ * @brief How many packets are held
+ */
+size_t ASPacketRingCount(const ASPacketRing *ring);
+
+/**
+ * @brief How many bytes of packets are held
+ */
+size_t ASPacketRingBytes(const ASPacketRing *ring);
+
+/**
+ * @brief The oldest packets which lie one after another in the ring
+ *        (consumer)
+ *
+ * @param maxBytes the most bytes the run may span
+ * @param maxPackets the most packets the run may hold
+ * @param data set to the first packet's bytes, or NULL if none are held
+ * @param descs set to the packets' descriptions, or NULL if none are held,
+ *        whose mStartOffset is where each packet lies in the ring, so each
+ *        minus the first's is where it lies in the run
+ * @param bytes set to how many bytes the run spans
+ * @return how many packets are in the run, which is 0 if none are held or
+ *         the oldest is larger than maxBytes
+ */
+size_t ASPacketRingPeek(ASPacketRing *ring, size_t maxBytes,
+                        size_t maxPackets, const void **data,
+                        const AudioStreamPacketDescription **descs,
+                        size_t *bytes);
+
+/**
+ * @brief Drop the oldest packets, no more than the last peek returned, such
+ *        as once they were copied out (consumer)
+ */
+void ASPacketRingPop(ASPacketRing *ring, size_t packets);
+
+/**
+ * @brief Drop every packet, keeping the largest ring for reuse
+ */
+void ASPacketRingClear(ASPacketRing *ring);
+
+ASPacketRingStats ASPacketRingGetStats(const ASPacketRing *ring);
+
+#endif /* ASPACKETRING_H */
@@ -21,6 +21,19 @@ extern NSString * const ASBitrateReadyNotification;
  * class for a more robust interface if one is desired. It also manages a queue
  * of songs to play and automatically switches from one song to the next when
  * playback finishes.
+ *
+ * While a song plays its last few seconds, the next one on the list is opened
+ * and buffered ahead of time (see -[AudioStreamer preload]), so that once the
+ * song ends the next starts playing from what's buffered rather than waiting
+ * on the network. How long the silence between songs lasts is measured either
+ * way.
+ *
+ * Songs which can be played at several qualities (see -qualitiesForURL:) are
+ * played at the highest one the connection downloads comfortably faster than
+ * it plays, as measured while the songs before it downloaded. If a song still
+ * comes close to running out of audio, the lower quality is preloaded from a
+ * little way ahead of where it's playing, and takes over once it has some of
+ * that buffered.
  */
 @interface ASPlaylist : NSObject {
   BOOL retrying;              /* Are we retrying the current url? */
@@ -33,6 +46,18 @@ extern NSString * const ASBitrateReadyNotification;
   NSInteger tries;            /* # of retry attempts */
   NSMutableArray *urls;       /* list of URLs to play */
   AudioStreamer *stream;      /* stream that is playing */
+  AudioStreamer *preloaded;   /* the next song, buffered ahead of time */
+  NSURL *preloadedFor;        /* the entry on the list it was preloaded for */
+  dispatch_source_t playbackTimer; /* checks on the song playing every second */
+  CFAbsoluteTime endedAt;     /* when the last song finished playing */
+  BOOL playingPreloaded;      /* the stream playing was preloaded */
+
+  double throughput;          /* last download rate measured, bits/sec */
+  double bitrate;             /* of the quality last picked, bits/sec */
+  BOOL switchingQuality;      /* the song is restarting at a lower quality */
+  AudioStreamer *downshifted; /* the song at a lower quality, buffering */
+  double downshiftAt;         /* where in the song it was sent to, or 0 */
+  NSUInteger underrunsSeen;   /* of the stream playing, already counted */
 }
 
 /**
@@ -101,4 +126,36 @@ extern NSString * const ASBitrateReadyNotification;
  */
 - (void) addSong:(NSURL*)url play:(BOOL)play;
 
+/**
+ * The URLs the song added with a URL can be played from, at each quality
+ *
+ * This returns nil, playing every song from the URL it was added with, and
+ * is for subclasses to override.
+ *
+ * @param url the URL the song was added with, or the one it's playing from
+ * @return the song's URLs keyed by their bit rates in bits per second, or nil
+ *         if it can only be played from url
+ */
+- (NSDictionary*) qualitiesForURL:(NSURL*)url;
+
+/**
+ * Counters of how the switches from one song to the next have gone so far,
+ * across all playlists
+ *
+ * The keys are "preloaded" (songs which followed another from what they had
+ * buffered ahead of time), "cold" (songs which followed another without
+ * anything buffered), "averageGapMs" and "maxGapMs" (of the silence between
+ * the end of one song and the start of the next).
+ */
++ (NSDictionary*) transitionStatistics;
+
+/**
+ * Counters of the qualities picked so far, across all playlists
+ *
+ * The keys are "up" and "down" (songs picked at a higher or lower quality
+ * than the one before), "downshifts" (songs switched to a lower quality while
+ * playing) and "rebuffers" (times playback ran out of audio).
+ */
++ (NSDictionary*) qualityStatistics;
+
 @end
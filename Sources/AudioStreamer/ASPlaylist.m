@@ -15,6 +15,27 @@ NSString * const ASRunningOutOfSongs = @"ASRunningOutOfSongs";
 NSString * const ASStreamError       = @"ASStreamError";
 NSString * const ASAttemptingNewSong = @"ASAttemptingNewSong";
 
+/* Seconds before the end of a song to start buffering the next one, which
+   leaves plenty of time to connect over a slow link */
+#define kPreloadSeconds 15
+
+/* Songs are played at a quality the connection downloads at least this much
+   faster than it plays, so that a slower patch doesn't run playback dry */
+#define kQualityHeadroom 1.5
+
+/* Seconds of audio left ahead of playback, while it's downloading slower than
+   it plays, at which a song is switched to a lower quality */
+#define kStarvingSeconds 3
+
+/* Seconds ahead of where a song is playing that the lower quality is sent to
+   when switching down, and how much of it is buffered before it takes over */
+#define kDownshiftLeadSeconds 4
+#define kDownshiftBufferedSeconds 2
+
+static NSUInteger preloadedTransitions, coldTransitions;
+static double totalGap, maxGap;
+static NSUInteger qualitiesUp, qualitiesDown, downshifts, rebuffers;
+
 @implementation ASPlaylist
 
 - (id)init {
@@ -29,6 +50,7 @@ NSString * const ASAttemptingNewSong = @"ASAttemptingNewSong";
 
 - (void)clearSongList {
   [urls removeAllObjects];
+  [self discardPreloaded];
 }
 
 - (void)addSong:(NSURL *)url play:(BOOL)play {
@@ -39,6 +61,16 @@ NSString * const ASAttemptingNewSong = @"ASAttemptingNewSong";
   }
 }
 
+/* A new stream, which observers of ASCreatedNewStream configure */
+- (AudioStreamer*)streamForURL:(NSURL*)url {
+  AudioStreamer *created = [AudioStreamer streamWithURL:url];
+  [[NSNotificationCenter defaultCenter]
+        postNotificationName:ASCreatedNewStream
+                      object:self
+                    userInfo:@{@"stream": created}];
+  return created;
+}
+
 - (void)setAudioStream {
   if (stream != nil) {
     [[NSNotificationCenter defaultCenter]
@@ -47,12 +79,15 @@ NSString * const ASAttemptingNewSong = @"ASAttemptingNewSong";
                 object:stream];
     [stream stop];
   }
-  stream = [AudioStreamer streamWithURL: _playing];
-  [[NSNotificationCenter defaultCenter]
-        postNotificationName:ASCreatedNewStream
-                      object:self
-                    userInfo:@{@"stream": stream}];
+  [self discardDownshifted];
+  stream = [self streamForURL:_playing];
+  playingPreloaded = NO;
+  [self watchAudioStream];
+}
+
+- (void)watchAudioStream {
   volumeSet = [stream setVolume:volume];
+  underrunsSeen = 0;
 
   /* Watch for error notifications */
   [[NSNotificationCenter defaultCenter]
@@ -70,10 +105,14 @@ NSString * const ASAttemptingNewSong = @"ASAttemptingNewSong";
 - (void)bitrateReady: (NSNotification*)notification {
   NSAssert([notification object] == stream,
            @"Should only receive notifications for the current stream");
-  [[NSNotificationCenter defaultCenter]
-        postNotificationName:ASNewSongPlaying
-                      object:self
-                    userInfo:@{@"url": _playing}];
+  /* The same song carries on at a lower quality */
+  if (!switchingQuality) {
+    [[NSNotificationCenter defaultCenter]
+          postNotificationName:ASNewSongPlaying
+                        object:self
+                      userInfo:@{@"url": _playing}];
+  }
+  switchingQuality = NO;
   NSLogd(@"%@", stream);
   if (lastKnownSeekTime == 0)
     return;
@@ -89,6 +128,9 @@ NSString * const ASAttemptingNewSong = @"ASAttemptingNewSong";
   if (!volumeSet) {
     volumeSet = [stream setVolume:volume];
   }
+  if (endedAt != 0 && [stream isPlaying]) {
+    [self recordGap];
+  }
 
   int code = [stream errorCode];
   if (stopping) {
@@ -108,7 +150,8 @@ NSString * const ASAttemptingNewSong = @"ASAttemptingNewSong";
        retrying with a new auth token because it will never work for that
        reason. Most likely this is some network trouble and we should have the
        opportunity to hit a button to retry this specific connection so we can
-       at least hope to regain our current place in the song */
+       at least hope to regain our current place in the song. The stream has
+       already tried resuming the download from where it dropped by now */
     if (code == AS_NETWORK_CONNECTION_FAILED || code == AS_TIMED_OUT) {
       [[NSNotificationCenter defaultCenter]
             postNotificationName:ASStreamError
@@ -123,9 +166,12 @@ NSString * const ASAttemptingNewSong = @"ASAttemptingNewSong";
 
   /* When the stream has finished, move on to the next song */
   } else if ([stream isDone]) {
-    [self performSelectorOnMainThread:@selector(next)
-                           withObject:nil
-                        waitUntilDone:NO];
+    if ([stream doneReason] == AS_DONE_EOF) {
+      endedAt = CFAbsoluteTimeGetCurrent();
+    }
+    /* Straight away, so a preloaded song starts playing what it buffered as
+       soon as this one is heard to end */
+    [self next];
   }
 }
 
@@ -155,9 +201,19 @@ NSString * const ASAttemptingNewSong = @"ASAttemptingNewSong";
     return;
   }
 
-  _playing = urls[0];
+  NSURL *entry = urls[0];
   [urls removeObjectAtIndex:0];
-  [self setAudioStream];
+  AudioStreamer *next = [self takePreloadedFor:entry];
+  if (next != nil) {
+    _playing = [next url];
+    stream = next;
+    playingPreloaded = YES;
+    [self watchAudioStream];
+  } else {
+    _playing = [self URLToPlay:entry];
+    [self setAudioStream];
+  }
+  [self startPlaybackTimer];
   tries = 0;
   [[NSNotificationCenter defaultCenter]
         postNotificationName:ASAttemptingNewSong
@@ -204,14 +260,27 @@ NSString * const ASAttemptingNewSong = @"ASAttemptingNewSong";
   nexting = YES;
   lastKnownSeekTime = 0;
   retrying = FALSE;
-  [self stop];
+  [self stopPlaying];
   [self play];
   nexting = NO;
 }
 
 - (void)stop {
+  [self discardPreloaded];
+  [self stopPlaying];
+  endedAt = 0;
+}
+
+/* Stops the current song, keeping the next one if it's been preloaded */
+- (void)stopPlaying {
   assert(!stopping);
   stopping = YES;
+  if (playbackTimer != nil) {
+    dispatch_source_cancel(playbackTimer);
+    playbackTimer = nil;
+  }
+  switchingQuality = NO;
+  [self discardDownshifted];
   [stream stop];
   if (stream != nil) {
     [[NSNotificationCenter defaultCenter]
@@ -229,4 +298,257 @@ NSString * const ASAttemptingNewSong = @"ASAttemptingNewSong";
   self->volume = vol;
 }
 
+#pragma mark - Preloading the next song
+
+/**
+ * @brief Check every second while a song plays how fast it's downloading,
+ *        and whether it's time to buffer the next one
+ */
+- (void)startPlaybackTimer {
+  if (playbackTimer != nil) return;
+  playbackTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0,
+                                         dispatch_get_main_queue());
+  dispatch_source_set_timer(playbackTimer,
+                            dispatch_time(DISPATCH_TIME_NOW, NSEC_PER_SEC),
+                            NSEC_PER_SEC, NSEC_PER_SEC / 10);
+  __weak ASPlaylist *weakSelf = self;
+  dispatch_source_set_event_handler(playbackTimer, ^{
+    [weakSelf measureConnection];
+    [weakSelf downshiftIfStarving];
+    [weakSelf preloadIfEnding];
+  });
+  dispatch_resume(playbackTimer);
+}
+
+- (void)preloadIfEnding {
+  double progress, duration;
+  if (preloaded != nil || [urls count] == 0 || ![stream isPlaying]) return;
+  if (![stream progress:&progress] || ![stream duration:&duration]) return;
+  if (duration - progress > kPreloadSeconds) return;
+
+  NSLogd(@"Preloading the next song, %.1fs before the end", duration - progress);
+  preloadedFor = urls[0];
+  preloaded = [self streamForURL:[self URLToPlay:preloadedFor]];
+  [preloaded preload];
+}
+
+/**
+ * @brief The preloaded stream, if it's for the song about to play and it
+ *        hasn't failed along the way
+ */
+- (AudioStreamer*)takePreloadedFor:(NSURL*)entry {
+  AudioStreamer *next = preloaded;
+  NSURL *nextFor = preloadedFor;
+  preloaded = nil;
+  preloadedFor = nil;
+  if (next == nil) return nil;
+  if ([next isDone] || ![nextFor isEqual:entry]) {
+    [next stop];
+    return nil;
+  }
+  return next;
+}
+
+- (void)discardPreloaded {
+  [preloaded stop];
+  preloaded = nil;
+  preloadedFor = nil;
+}
+
+/* The silence between the end of the last song and this one playing */
+- (void)recordGap {
+  double gap = CFAbsoluteTimeGetCurrent() - endedAt;
+  endedAt = 0;
+  if (playingPreloaded) {
+    preloadedTransitions++;
+  } else {
+    coldTransitions++;
+  }
+  totalGap += gap;
+  maxGap = MAX(maxGap, gap);
+  NSLogd(@"%.0f ms between songs, %@", gap * 1000,
+         playingPreloaded ? @"preloaded" : @"not preloaded");
+}
+
+#pragma mark - Picking the quality
+
+- (NSDictionary*)qualitiesForURL:(NSURL*)url {
+  return nil;
+}
+
+/**
+ * @brief The URL to play the song added with a URL from, at the highest
+ *        quality the connection has kept well ahead of
+ */
+- (NSURL*)URLToPlay:(NSURL*)url {
+  NSDictionary *qualities = [self qualitiesForURL:url];
+  if ([qualities count] == 0) return url;
+  NSArray *rates =
+    [[qualities allKeys] sortedArrayUsingSelector:@selector(compare:)];
+
+  /* Until a download has been measured, somewhere in the middle */
+  NSNumber *pick = rates[[rates count] / 2];
+  if (throughput > 0) {
+    pick = rates[0];
+    for (NSNumber *rate in rates) {
+      if ([rate doubleValue] * kQualityHeadroom <= throughput) {
+        pick = rate;
+      }
+    }
+  }
+
+  double picked = [pick doubleValue];
+  if (bitrate > 0 && picked != bitrate) {
+    if (picked > bitrate) {
+      qualitiesUp++;
+    } else {
+      qualitiesDown++;
+    }
+    NSLogd(@"Switching from %.0f to %.0f kbps, downloading at %.0f kbps",
+           bitrate / 1000, picked / 1000, throughput / 1000);
+  }
+  bitrate = picked;
+  return qualities[pick];
+}
+
+/* How fast songs download, and whether the one playing has run dry */
+- (void)measureConnection {
+  double rate;
+  if ([stream throughput:&rate]) {
+    throughput = rate;
+  }
+  if ([preloaded throughput:&rate]) {
+    throughput = rate;
+  }
+  if ([downshifted throughput:&rate]) {
+    throughput = rate;
+  }
+
+  NSUInteger underruns = [stream underrunCount];
+  if (underruns > underrunsSeen) {
+    rebuffers += underruns - underrunsSeen;
+    underrunsSeen = underruns;
+    double playing = 0;
+    [stream calculatedBitRate:&playing];
+    NSLogd(@"Rebuffering at %.0f kbps, downloading at %.0f kbps",
+           playing / 1000, throughput / 1000);
+  }
+}
+
+/**
+ * @brief Switch the song playing to a lower quality, from about where it's
+ *        playing, if it's downloading too slowly to keep from running dry
+ *
+ * The audio queue only plays the format it was created for, so the lower
+ * quality is another stream, preloaded alongside the one playing so that
+ * what's buffered keeps playing meanwhile (see -handOverDownshifted).
+ */
+- (void)downshiftIfStarving {
+  if (downshifted != nil) {
+    [self handOverDownshifted];
+    return;
+  }
+  if (switchingQuality || ![stream isPlaying] || [stream isDownloaded]) return;
+  NSDictionary *qualities = [self qualitiesForURL:_playing];
+  NSNumber *current = [[qualities allKeysForObject:_playing] firstObject];
+  if (current == nil || throughput <= 0 ||
+      throughput >= [current doubleValue]) {
+    return;
+  }
+  double buffered, progress;
+  if (![stream bufferedTime:&buffered] || buffered > kStarvingSeconds ||
+      ![stream progress:&progress]) {
+    return;
+  }
+
+  NSNumber *lower = nil;
+  for (NSNumber *rate in qualities) {
+    if ([rate compare:current] == NSOrderedAscending &&
+        (lower == nil || [rate compare:lower] == NSOrderedDescending)) {
+      lower = rate;
+    }
+  }
+  if (lower == nil) return;
+
+  NSLogd(@"%.1fs buffered, switching down from %.0f to %.0f kbps at %.1fs",
+         buffered, [current doubleValue] / 1000, [lower doubleValue] / 1000,
+         progress);
+  downshifts++;
+  bitrate = [lower doubleValue];
+  downshifted = [self streamForURL:qualities[lower]];
+  downshiftAt = 0;
+  [downshifted preload];
+}
+
+/**
+ * @brief Move the song over to the lower quality preloading alongside it,
+ *        once that has buffered from where the song has got to
+ *
+ * Once the preloaded stream has worked out its bit rate it's sent a little
+ * ahead of where the song is playing, which goes by its seek index or a Range
+ * request as any seek does, and sent again if the song passes that point
+ * before enough of it arrived. It takes over as soon as the song reaches that
+ * point with a few seconds of it buffered, or straight away if the song is
+ * about to run dry.
+ */
+- (void)handOverDownshifted {
+  if ([downshifted isDone]) {
+    NSLogd(@"Lower quality failed, staying at %@", _playing);
+    [self discardDownshifted];
+    return;
+  }
+  double progress, left, buffered;
+  if (![stream progress:&progress] || ![stream bufferedTime:&left]) return;
+  BOOL starved = left < 1;
+
+  BOOL ready = downshiftAt > 0 &&
+               [downshifted bufferedTime:&buffered] &&
+               buffered >= kDownshiftBufferedSeconds;
+  if (!ready) {
+    if (downshiftAt <= progress) {
+      double at = progress + kDownshiftLeadSeconds, duration;
+      /* Too near the end to be worth it */
+      if ([stream duration:&duration] && at >= duration) {
+        [self discardDownshifted];
+      } else if ([downshifted seekToTime:at]) {
+        downshiftAt = at;
+      }
+    }
+    return;
+  }
+  if (!starved && progress < downshiftAt) return;
+
+  NSLogd(@"Handing over to the lower quality at %.1fs", downshiftAt);
+  [[NSNotificationCenter defaultCenter]
+      removeObserver:self
+                name:nil
+              object:stream];
+  [stream stop];
+  stream = downshifted;
+  downshifted = nil;
+  _playing = [stream url];
+  playingPreloaded = NO;
+  switchingQuality = YES;
+  [self watchAudioStream];
+  [stream start];
+}
+
+- (void)discardDownshifted {
+  [downshifted stop];
+  downshifted = nil;
+  downshiftAt = 0;
+}
+
++ (NSDictionary*)qualityStatistics {
+  return @{@"up": @(qualitiesUp), @"down": @(qualitiesDown),
+           @"downshifts": @(downshifts), @"rebuffers": @(rebuffers)};
+}
+
++ (NSDictionary*)transitionStatistics {
+  NSUInteger transitions = preloadedTransitions + coldTransitions;
+  return @{@"preloaded": @(preloadedTransitions), @"cold": @(coldTransitions),
+           @"averageGapMs": @(transitions ? totalGap * 1000 / transitions : 0),
+           @"maxGapMs": @(maxGap * 1000)};
+}
+
 @end
@@ -0,0 +1,289 @@
+/**
+ * @file AudioStreamer/ASStreamIndex.c
+ * @brief Implementation of reading MP3 headers and indexing packets
+ *
+ * The layouts of the headers follow what LAME and the Fraunhofer encoder
+ * write: a Xing header lies right after the first frame's side information,
+ * with the LAME extension right after it, and a VBRI header lies 32 bytes
+ * after the frame header whatever the channel mode.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ASStreamIndex.h"
+
+/* Packets made room for up front, about a minute and a half of MP3 */
+#define INITIAL_CAPACITY 4096
+
+static uint32_t be16(const uint8_t *p) {
+  return (uint32_t) p[0] << 8 | p[1];
+}
+
+static uint32_t be32(const uint8_t *p) {
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+         (uint32_t) p[2] << 8 | p[3];
+}
+
+uint64_t ASStreamTagLength(const uint8_t *bytes, size_t length) {
+  if (length < AS_STREAM_TAG_BYTES || memcmp(bytes, "ID3", 3) != 0 ||
+      bytes[3] == 0xff || bytes[4] == 0xff) {
+    return 0;
+  }
+  /* The size is "syncsafe", seven bits to a byte */
+  uint64_t size = 0;
+  for (int i = 6; i < 10; i++) {
+    if (bytes[i] & 0x80) return 0;
+    size = size << 7 | bytes[i];
+  }
+  /* With a footer as long as the header */
+  if (bytes[5] & 0x10) size += AS_STREAM_TAG_BYTES;
+  return AS_STREAM_TAG_BYTES + size;
+}
+
+/* Fills in the frame's sample rate and frames per packet, and returns how far
+   after the frame header its side information ends, or 0 if bytes isn't the
+   header of a Layer III frame */
+static size_t frameHeader(const uint8_t *bytes, ASStreamHeader *header) {
+  static const uint32_t rates[] = {44100, 48000, 32000};
+  uint32_t h = be32(bytes);
+  if ((h & 0xffe00000) != 0xffe00000) return 0;
+  uint32_t version = (h >> 19) & 3;  /* 0 is 2.5, 1 reserved, 2 is 2, 3 is 1 */
+  uint32_t layer = (h >> 17) & 3;    /* 1 is Layer III */
+  uint32_t bitrate = (h >> 12) & 15;
+  uint32_t rate = (h >> 10) & 3;
+  if (version == 1 || layer != 1 || bitrate == 0 || bitrate == 15 ||
+      rate == 3) {
+    return 0;
+  }
+  int mono = ((h >> 6) & 3) == 3;
+  header->sampleRate = rates[rate] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+  header->framesPerPacket = version == 3 ? 1152 : 576;
+  if (version == 3) {
+    return mono ? 17 : 32;
+  }
+  return mono ? 9 : 17;
+}
+
+static int xingHeader(const uint8_t *p, const uint8_t *end,
+                      ASStreamHeader *header) {
+  if (end - p < 8 ||
+      (memcmp(p, "Xing", 4) != 0 && memcmp(p, "Info", 4) != 0)) {
+    return 0;
+  }
+  uint32_t flags = be32(p + 4);
+  const uint8_t *q = p + 8;
+  size_t needed = (flags & 1 ? 4 : 0) + (flags & 2 ? 4 : 0) +
+                  (flags & 4 ? 100 : 0) + (flags & 8 ? 4 : 0);
+  if (!(flags & 1) || (size_t) (end - q) < needed) return 0;
+
+  header->packets = be32(q);
+  q += 4;
+  if (flags & 2) {
+    header->bytes = be32(q);
+    q += 4;
+  }
+  if (flags & 4) {
+    /* Each percent is given in 256ths of the stream's bytes */
+    header->hasToc = header->bytes > 0;
+    for (int i = 0; i < 100; i++) {
+      header->toc[i] = header->bytes * q[i] / 256;
+    }
+    header->toc[100] = header->bytes;
+    q += 100;
+  }
+  if (flags & 8) q += 4;
+
+  /* Twelve bits each of delay and padding, 21 bytes into LAME's extension,
+     which FFmpeg writes too */
+  if (end - q >= 24 && (memcmp(q, "LAME", 4) == 0 ||
+                        memcmp(q, "Lavc", 4) == 0 ||
+                        memcmp(q, "Lavf", 4) == 0)) {
+    const uint8_t *d = q + 21;
+    header->delay = (uint32_t) d[0] << 4 | d[1] >> 4;
+    header->padding = (uint32_t) (d[1] & 15) << 8 | d[2];
+  }
+  return 1;
+}
+
+static int vbriHeader(const uint8_t *p, const uint8_t *end,
+                      ASStreamHeader *header) {
+  if (end - p < 26 || memcmp(p, "VBRI", 4) != 0) return 0;
+  header->delay = be16(p + 6);
+  header->bytes = be32(p + 10);
+  header->packets = be32(p + 14);
+  uint32_t entries = be16(p + 18);
+  uint32_t scale = be16(p + 20);
+  uint32_t entrySize = be16(p + 22);
+  uint32_t framesPerEntry = be16(p + 24);
+  const uint8_t *table = p + 26;
+  if (entries == 0 || entrySize == 0 || entrySize > 4 ||
+      framesPerEntry == 0 || header->packets == 0 ||
+      (size_t) (end - table) < (size_t) entries * entrySize) {
+    return 1;
+  }
+
+  /* Each entry is how many bytes the next framesPerEntry packets take, which
+     is turned into where each percent lies, one entry at a time */
+  uint64_t start = 0;
+  uint32_t entry = 0;
+  for (int i = 0; i <= 100; i++) {
+    uint64_t packet = header->packets * (uint64_t) i / 100;
+    uint64_t size = 0;
+    while (entry < entries) {
+      size = 0;
+      for (uint32_t b = 0; b < entrySize; b++) {
+        size = size << 8 | table[entry * entrySize + b];
+      }
+      size *= scale;
+      if (packet < (uint64_t) (entry + 1) * framesPerEntry) break;
+      start += size;
+      entry++;
+    }
+    uint64_t within = entry < entries ?
+        size * (packet - (uint64_t) entry * framesPerEntry) / framesPerEntry :
+        0;
+    header->toc[i] = start + within;
+    if (header->bytes > 0 && header->toc[i] > header->bytes) {
+      header->toc[i] = header->bytes;
+    }
+  }
+  header->hasToc = 1;
+  return 1;
+}
+
+int ASStreamHeaderParse(const uint8_t *bytes, size_t length, uint64_t offset,
+                        ASStreamHeader *header) {
+  const uint8_t *end = bytes + length;
+  for (size_t i = 0; i + 4 <= length; i++) {
+    ASStreamHeader found;
+    memset(&found, 0, sizeof(found));
+    size_t sideInfo = frameHeader(bytes + i, &found);
+    if (sideInfo == 0) continue;
+
+    /* Only the first frame may hold a header */
+    found.offset = offset + i;
+    if (xingHeader(bytes + i + 4 + sideInfo, end, &found) ||
+        vbriHeader(bytes + i + 4 + 32, end, &found)) {
+      *header = found;
+      return 1;
+    }
+    return 0;
+  }
+  return 0;
+}
+
+double ASStreamHeaderDuration(const ASStreamHeader *header) {
+  if (header->sampleRate == 0) return 0;
+  uint64_t frames = header->packets * header->framesPerPacket;
+  uint64_t trimmed = (uint64_t) header->delay + header->padding;
+  if (frames > trimmed) frames -= trimmed;
+  return (double) frames / header->sampleRate;
+}
+
+uint64_t ASStreamHeaderOffset(const ASStreamHeader *header, double seconds) {
+  double duration = ASStreamHeaderDuration(header);
+  if (header->bytes == 0 || duration <= 0) return 0;
+  double percent = seconds / duration * 100;
+  if (percent < 0) percent = 0;
+  if (percent > 100) percent = 100;
+
+  double into;
+  if (header->hasToc) {
+    int i = (int) percent;
+    uint64_t a = header->toc[i];
+    uint64_t b = header->toc[i < 100 ? i + 1 : 100];
+    into = a + (b > a ? (double) (b - a) * (percent - i) : 0);
+  } else {
+    into = header->bytes * percent / 100;
+  }
+  return header->offset + (uint64_t) into;
+}
+
+struct ASSeekIndex {
+  uint64_t start;
+  uint64_t *ends;
+  uint64_t count;
+  uint64_t capacity;
+  uint64_t framing;   /* bytes from one packet's data ending to the next's */
+  int lastExact;      /* the last end recorded was where the data was */
+};
+
+ASSeekIndex* ASSeekIndexCreate(uint64_t start) {
+  ASSeekIndex *index = calloc(1, sizeof(ASSeekIndex));
+  if (index == NULL) return NULL;
+  index->start = start;
+  index->lastExact = 1;
+  index->capacity = INITIAL_CAPACITY;
+  index->ends = malloc(index->capacity * sizeof(index->ends[0]));
+  if (index->ends == NULL) {
+    free(index);
+    return NULL;
+  }
+  return index;
+}
+
+void ASSeekIndexFree(ASSeekIndex *index) {
+  if (index == NULL) return;
+  free(index->ends);
+  free(index);
+}
+
+int ASSeekIndexAppend(ASSeekIndex *index, uint64_t end) {
+  if (index->count == index->capacity) {
+    uint64_t *grown = realloc(index->ends,
+                              index->capacity * 2 * sizeof(index->ends[0]));
+    if (grown == NULL) return -1;
+    index->ends = grown;
+    index->capacity *= 2;
+  }
+  index->ends[index->count++] = end;
+  return 0;
+}
+
+int ASSeekIndexAppendPackets(ASSeekIndex *index, uint64_t first,
+                             const void *data,
+                             const AudioStreamPacketDescription *descs,
+                             size_t count, const void *chunk,
+                             size_t chunkLength, uint64_t chunkOffset) {
+  if (first > index->count) return 0;
+  uintptr_t chunkStart = (uintptr_t) chunk;
+  uint64_t end;
+  ASSeekIndexFind(index, first, &end);
+  int exact = first == 0 || (first == index->count && index->lastExact);
+  for (size_t i = 0; i < count; i++) {
+    uintptr_t at = (uintptr_t) data + (uintptr_t) descs[i].mStartOffset;
+    if (at >= chunkStart && at + descs[i].mDataByteSize <=
+                              chunkStart + chunkLength) {
+      /* Whatever lies between two packets whose data was found in place is
+         the framing (an ADTS header is 7 bytes, or 9 with a CRC) */
+      uint64_t start = chunkOffset + (at - chunkStart);
+      if (exact && start >= end) {
+        index->framing = start - end;
+      }
+      end = start;
+      exact = 1;
+    } else {
+      /* A copy, which is taken to follow on after the same framing */
+      end += index->framing;
+      exact = 0;
+    }
+    end += descs[i].mDataByteSize;
+    if (first + i == index->count) {
+      if (ASSeekIndexAppend(index, end) < 0) return -1;
+      index->lastExact = exact;
+    }
+  }
+  return 0;
+}
+
+uint64_t ASSeekIndexCount(const ASSeekIndex *index) {
+  return index->count;
+}
+
+int ASSeekIndexFind(const ASSeekIndex *index, uint64_t packet,
+                    uint64_t *offset) {
+  if (packet > index->count) return 0;
+  *offset = packet == 0 ? index->start : index->ends[packet - 1];
+  return 1;
+}
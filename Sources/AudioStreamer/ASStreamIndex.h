@@ -0,0 +1,145 @@
+/**
+ * @file AudioStreamer/ASStreamIndex.h
+ * @brief How long a stream lasts and where in it each moment lies
+ *
+ * Two sources are used. Encoders of VBR MP3s write a Xing (or Info), VBRI or
+ * LAME header into the stream's first frame, which gives the number of frames
+ * in the stream and a table of contents of where each percent of it lies.
+ * Those are read from the first few kilobytes, so the duration is known
+ * exactly from the start and seeks into parts not downloaded yet land about
+ * where they should. Streams without one, such as ADTS AAC, still have every
+ * packet's position recorded as it's parsed, in an ASSeekIndex, which makes
+ * seeks into what was downloaded exact, as is the duration once all of it was.
+ */
+
+#ifndef ASSTREAMINDEX_H
+#define ASSTREAMINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <CoreAudio/CoreAudioTypes.h>
+
+/* Bytes from where an MP3's frames start which are enough to hold its
+   header */
+#define AS_STREAM_HEADER_BYTES 4096
+
+/* Bytes from the start of a stream which are enough to find where its frames
+   start */
+#define AS_STREAM_TAG_BYTES 10
+
+/**
+ * @brief What an MP3's first frame says about the stream
+ */
+typedef struct ASStreamHeader {
+  uint64_t offset;          /* of the frame holding the header */
+  uint64_t packets;         /* of audio, not counting the header's own */
+  uint64_t bytes;           /* of frames from offset on, 0 if not known */
+  uint32_t framesPerPacket;
+  uint32_t sampleRate;
+  uint32_t delay;           /* frames of silence the encoder added first */
+  uint32_t padding;         /* and last */
+  int hasToc;
+  uint64_t toc[101];        /* bytes from offset to each percent of the time */
+} ASStreamHeader;
+
+/**
+ * @brief How many bytes an ID3v2 tag takes up at the start of a stream
+ *
+ * @param bytes the start of the stream, AS_STREAM_TAG_BYTES of it
+ * @return the length of the tag, or 0 if there isn't one
+ */
+uint64_t ASStreamTagLength(const uint8_t *bytes, size_t length);
+
+/**
+ * @brief Read a Xing, Info, VBRI or LAME header from an MP3's first frame
+ *
+ * @param bytes the stream from where its frames start, AS_STREAM_HEADER_BYTES
+ *        of it or all of it if shorter
+ * @param offset where bytes lies in the stream
+ * @param header filled in if a header is found
+ * @return 1 if there was a header, or 0 if not, as for streams of any other
+ *         kind
+ */
+int ASStreamHeaderParse(const uint8_t *bytes, size_t length, uint64_t offset,
+                        ASStreamHeader *header);
+
+/**
+ * @brief The length of the stream in seconds
+ */
+double ASStreamHeaderDuration(const ASStreamHeader *header);
+
+/**
+ * @brief Where in the stream a moment lies, according to the header's table
+ *        of contents, or linearly from its byte count without one
+ *
+ * @return the offset in the stream, or 0 if the header doesn't know the
+ *         stream's length
+ */
+uint64_t ASStreamHeaderOffset(const ASStreamHeader *header, double seconds);
+
+typedef struct ASSeekIndex ASSeekIndex;
+
+/**
+ * @brief Create an index of where each packet of a stream starts
+ *
+ * @param start where in the stream the first packet starts
+ * @return the index, or NULL if out of memory
+ */
+ASSeekIndex* ASSeekIndexCreate(uint64_t start);
+
+void ASSeekIndexFree(ASSeekIndex *index);
+
+/**
+ * @brief Record where the next packet of the stream ends
+ *
+ * This is where the packet after starts, framing included, which is what
+ * seeking to it needs, even if the parser handed packets over without their
+ * framing (such as ADTS headers).
+ *
+ * @return 0 on success, or -1 if out of memory
+ */
+int ASSeekIndexAppend(ASSeekIndex *index, uint64_t end);
+
+/**
+ * @brief Record where packets handed over by an AudioFileStream end
+ *
+ * The parser hands packets over from the bytes it was given where it can,
+ * which tells exactly where they lie in the stream. Packets are handed over
+ * without framing which isn't part of their data, such as ADTS headers, so
+ * how many bytes of it lie between packets is learned from the gap between
+ * two handed over in place. A packet which straddled two lots of bytes is
+ * handed over from a copy, and is taken to follow the packet before it after
+ * that much framing.
+ *
+ * @param first which packet of the stream the first handed over is. Those
+ *        recorded already are skipped, and nothing is recorded if this is
+ *        past the last recorded, since then where the packets fall is unknown
+ * @param data the packets' bytes, as handed over
+ * @param descs the packets' descriptions, as handed over
+ * @param chunk the bytes last given to the parser
+ * @param chunkOffset where in the stream chunk lies
+ * @return 0 on success, or -1 if out of memory
+ */
+int ASSeekIndexAppendPackets(ASSeekIndex *index, uint64_t first,
+                             const void *data,
+                             const AudioStreamPacketDescription *descs,
+                             size_t count, const void *chunk,
+                             size_t chunkLength, uint64_t chunkOffset);
+
+/**
+ * @brief How many packets have been recorded
+ */
+uint64_t ASSeekIndexCount(const ASSeekIndex *index);
+
+/**
+ * @brief Where a packet starts in the stream
+ *
+ * @param packet which packet, counting from 0
+ * @param offset set to where it starts
+ * @return 1 if it's known, which is for every packet recorded and the one
+ *         after, or 0 if not
+ */
+int ASSeekIndexFind(const ASSeekIndex *index, uint64_t packet,
+                    uint64_t *offset);
+
+#endif /* ASSTREAMINDEX_H */
@@ -26,6 +26,10 @@
 
 #import <AudioToolbox/AudioToolbox.h>
 #import <Foundation/Foundation.h>
+#import <os/lock.h>
+#import <stdatomic.h>
+
+@class TrafficExchange;
 
 /* Maximum number of packets which can be contained in one buffer */
 #define kAQMaxPacketDescs 512
@@ -80,7 +84,9 @@ typedef enum {
 
 extern NSString * const ASStatusChangedNotification;
 
-struct queued_packet;
+struct ASPacketRing;
+struct ASSeekIndex;
+struct ASStreamHeader;
 
 /**
  * This class is implemented on top of Apple's AudioQueue framework. This
@@ -100,8 +106,19 @@ struct queued_packet;
  * because it allows configuration of proxies and scheduling/rescheduling on the
  * event loop. All data read from the HTTP stream is piped into the
  * AudioFileStream which then parses all of the data. This stage of the pipeline
- * also flags that events are happening to prevent a timeout. All network
- * activity occurs on the thread which started the audio stream.
+ * also flags that events are happening to prevent a timeout.
+ *
+ * All network activity for every stream happens on one I/O thread of its own,
+ * which runs nothing else, so however busy the main thread gets it can't hold
+ * up the download. Reads start small so that the first packets reach the audio
+ * queue quickly, and grow while each read fills up, which means a fast
+ * connection is read in fewer, larger chunks.
+ *
+ * If the download drops or times out partway, it's reopened a few times with a
+ * Range request for the byte after the last one read. Parsing carries on from
+ * there as if nothing happened, into the same audio queue, which plays what it
+ * has buffered meanwhile. Only once that fails does the stream fail with
+ * AS_NETWORK_CONNECTION_FAILED or AS_TIMED_OUT.
  *
  * ### AudioFileStream
  *
@@ -115,30 +132,36 @@ struct queued_packet;
  * The second callback is invoked whenever complete "audio packets" are
  * available to send to the audio queue. This stage is invoked on the call stack
  * of the stream which received the data (synchronously with receiving the
- * data).
+ * data), so on the I/O thread.
  *
- * Packets received are buffered in a static set of buffers allocated by the
- * audio queue instance. When a buffer is full, it is committed to the audio
- * queue, and then the next buffer is moved on to. Multiple packets can possibly
- * fit in one buffer. When committing a buffer, if there are no more buffers
- * available, then the http read stream is unscheduled from the run loop and all
- * currently received data is stored aside for later processing.
+ * Every packet received is copied into a ring (see ASPacketRing.h), which is
+ * how packets are handed from the I/O thread to playback without either
+ * waiting on a lock. Unless buffering infinitely, the http read stream is
+ * unscheduled from the run loop once the ring holds as much as all of the
+ * buffers do, and rescheduled once playback has drained half of it.
  *
  * ### AudioQueue
  *
  * This final stage is also implemented by Apple, and receives all of the full
  * buffers of data from the AudioFileStream's parsed packets. The implementation
- * manages its own set of threads, but callbacks are invoked on the main thread.
- * The two callbacks that the audio stream is interested in are playback state
- * changing and audio buffers being freed.
- *
- * When a buffer is freed, then it is marked as so, and if the stream was
- * waiting for a buffer to be freed a message to empty the queue as much as
- * possible is sent to the main thread's run loop. Otherwise no extra action
- * need be performed.
+ * manages its own set of threads, and its callbacks are invoked on them rather
+ * than on any run loop. The two callbacks that the audio stream is interested
+ * in are playback state changing and audio buffers being freed.
+ *
+ * Packets are copied out of the ring into a static set of buffers allocated by
+ * the audio queue instance, a run of packets at a time. When a buffer is full,
+ * it is committed to the audio queue, and then the next buffer is moved on to.
+ * Multiple packets can possibly fit in one buffer. Buffers are filled by
+ * whichever thread has a reason to: the audio queue's own when a buffer frees
+ * up, or the I/O thread when packets arrive while a buffer is free, as when
+ * starting out. Only one fills at a time, which is decided by whichever takes
+ * the fill lock, and one which finds it taken leaves a request behind for the
+ * other to pick up once it's done.
  *
  * The main purpose of knowing when the playback state changes is to change the
- * state of the player accordingly.
+ * state of the player accordingly. Notifications are always posted on the main
+ * thread, whichever thread the change happened on, and the methods below are
+ * all meant to be called on the main thread as well.
  *
  * ## Errors
  *
@@ -165,6 +188,11 @@ struct queued_packet;
  * proper byte offset. This second stream is then used to put data through the
  * pipelines.
  *
+ * Where each packet parsed lies is recorded, so seeking back into what was
+ * downloaded lands on the exact packet. Further on, an MP3's Xing or VBRI
+ * table of contents is used if it had one, which places the seek far better
+ * than the average bit rate does for VBR streams.
+ *
  * ## Example usage
  *
  * An audio stream is a one-shot thing. Once initialized, the source cannot be
@@ -186,8 +214,12 @@ struct queued_packet;
   BOOL            bufferInfinite;
   int             timeoutInterval;
 
-  /* Creates as part of the [start] method */
+  /* Creates as part of the [start] method. Everything from here to the audio
+     queue belongs to the I/O thread */
   CFReadStreamRef stream;
+  TrafficExchange *traffic; /* the download being recorded, if recording */
+  UInt8 *readBuffer;        /* where reads from the stream land */
+  CFIndex readSize;         /* how much to read at a time */
 
   /* Timeout management */
   NSTimer *timeout; /* timer managing the timeout event */
@@ -195,55 +227,88 @@ struct queued_packet;
   BOOL rescheduled; /* flag if the http stream was rescheduled */
   int events;       /* events which have happened since the last tick */
 
+  /* Resuming a download which dropped */
+  int resumes;        /* times in a row it was reopened without reading */
+  bool resuming;      /* reopened, and the response is yet to be checked */
+  AudioStreamerErrorCode resumedFrom; /* to fail with if resuming does */
+
   /* Once the stream has bytes read from it, these are created */
   NSDictionary *httpHeaders;
   AudioFileStreamID audioFileStream;
 
   /* The audio file stream will fill in these parameters */
-  UInt64 fileLength;         /* length of file, set from http headers */
+  _Atomic UInt64 fileLength; /* length of file, set from http headers */
   UInt64 dataOffset;         /* offset into the file of the start of stream */
   UInt64 audioDataByteCount; /* number of bytes of audio data in file */
   AudioStreamBasicDescription asbd; /* description of audio */
 
+  /* Where each part of the stream lies, learned while reading and parsing it
+     on the I/O thread (see ASStreamIndex.h) */
+  UInt64 readOffset;         /* where in the file the last read started */
+  CFIndex readLength;        /* how long the last read was */
+  UInt8 *headerBytes;        /* the start of an MP3's frames, until read */
+  UInt64 headerStart;        /* where the frames start, past any ID3 tag */
+  size_t headerLength;
+  bool headerRead;           /* finished looking for a Xing or VBRI header */
+  struct ASStreamHeader *streamHeader; /* what it said, if there was one */
+  struct ASSeekIndex *seekIndex;
+  UInt64 nextPacket;         /* which packet of the stream is parsed next */
+  bool indexing;             /* nextPacket is known to be right */
+  _Atomic double knownDuration; /* exactly, once known, or else 0 */
+
   /* Once properties have been read, packets arrive, and the audio queue is
      created once the first packet arrives */
-  AudioQueueRef audioQueue;
-  UInt32 packetBufferSize;  /* guessed from audioFileStream */
+  _Atomic AudioQueueRef audioQueue;
+  _Atomic UInt32 packetBufferSize; /* guessed from audioFileStream */
+
+  /* Packets on their way from the I/O thread to the buffers below */
+  struct ASPacketRing *queued;
+  _Atomic bool producerDone;    /* every packet has been pushed */
+  _Atomic bool throttled;       /* the http stream waits for the ring to drain */
 
   /* When receiving audio data, raw data is placed into these buffers. The
    * buffers are essentially a "ring buffer of buffers" as each buffer is cycled
    * through and then freed when not in use. Each buffer can contain one or many
    * packets, so the packetDescs array is a list of packets which describes the
    * data in the next pending buffer (used to enqueue data into the AudioQueue
-   * structure */
+   * structure). Only the thread holding fillLock may touch these besides inuse
+   * and buffersUsed */
   AudioQueueBufferRef *buffers;
   AudioStreamPacketDescription packetDescs[kAQMaxPacketDescs];
   UInt32 packetsFilled;         /* number of valid entries in packetDescs */
   UInt32 bytesFilled;           /* bytes in use in the pending buffer */
   unsigned int fillBufferIndex; /* index of the pending buffer */
-  BOOL *inuse;                  /* which buffers have yet to be processed */
-  UInt32 buffersUsed;           /* Number of buffers in use */
-
-  /* cache state (see above description) */
-  bool waitingOnBuffer;
-  struct queued_packet *queued_head;
-  struct queued_packet *queued_tail;
+  _Atomic bool *inuse;          /* which buffers have yet to be processed */
+  _Atomic UInt32 buffersUsed;   /* Number of buffers in use */
+  os_unfair_lock fillLock;      /* held by the thread filling buffers */
+  _Atomic bool fillRequested;   /* buffers are to be filled again */
+  bool flushed;                 /* the last buffer has been enqueued */
+  _Atomic bool finishing;       /* the queue is stopping at the end */
+  _Atomic bool held;            /* preloading, so not to start playing yet */
 
   /* Internal metadata about errors and state */
-  AudioStreamerState state_;
-  AudioStreamerErrorCode errorCode;
+  _Atomic AudioStreamerState state_;
+  _Atomic AudioStreamerErrorCode errorCode;
   NSError *networkError;
-  OSStatus err;
 
   /* Miscellaneous metadata */
   bool discontinuous;        /* flag to indicate the middle of a stream */
   UInt64 seekByteOffset;     /* position with the file to seek */
   double seekTime;
-  bool seeking;              /* Are we currently in the process of seeking? */
-  double lastProgress;       /* last calculated progress point */
-  UInt64 processedPacketsCount;     /* bit rate calculation utility */
-  UInt64 processedPacketsSizeTotal; /* helps calculate the bit rate */
+  _Atomic bool seeking;      /* Are we currently in the process of seeking? */
+  _Atomic double lastProgress; /* last calculated progress point */
+  _Atomic UInt64 processedPacketsCount;     /* bit rate calculation utility */
+  _Atomic UInt64 processedPacketsSizeTotal; /* helps calculate the bit rate */
   bool   bitrateNotification;       /* notified that the bitrate is ready */
+
+  /* How fast the stream downloads and how far ahead of playback it is, for
+     choosing which quality to play at */
+  CFAbsoluteTime rateStart;  /* when the current measurement began */
+  CFAbsoluteTime rateLast;   /* when the last read of it came */
+  UInt64 rateBytes;          /* bytes read since it began */
+  _Atomic double throughput; /* bits per second, smoothed, or 0 if unknown */
+  _Atomic double parsedTime; /* how far into the stream packets were parsed */
+  _Atomic UInt32 underruns;  /* times playback ran out of buffers */
 }
 
 /** @name Creating an audio stream */
@@ -268,7 +333,7 @@ struct queued_packet;
  *
  * By default this is AS_NO_ERROR.
  */
-@property AudioStreamerErrorCode errorCode;
+@property (readonly) AudioStreamerErrorCode errorCode;
 
 /**
  * Converts an error code to a string
@@ -372,7 +437,9 @@ struct queued_packet;
  * When downloading audio data from a remote source, this is the interval in
  * which to consider it a timeout if no data is received. If the stream is
  * paused, then that time interval is not counted. This only counts if we are
- * waiting for data and an amount of time larger than this elapses.
+ * waiting for data and an amount of time larger than this elapses. A timeout
+ * partway through is first resumed from where it stopped, as a dropped
+ * connection is.
  *
  * The units of this variable is seconds.
  *
@@ -403,13 +470,28 @@ struct queued_packet;
  *
  * This method can only be invoked once, and other methods will not work before
  * this method has been invoked. All properties (like proxies) must be set
- * before this method is invoked.
+ * before this method is invoked. The exception is a stream which is preloading,
+ * which this starts playing.
  *
  * @return YES if the stream was started, or NO if the stream was previously
  *         started and this had no effect.
  */
 - (BOOL) start;
 
+/**
+ * Starts downloading and buffering this audio stream without playing it
+ *
+ * This is for opening the next song while the current one finishes, so that
+ * it can start playing as soon as the current one is done. The stream goes as
+ * far as filling the audio queue's buffers, but the queue isn't started and no
+ * notifications are posted about the stream until it is sent 'start', which
+ * then plays what was buffered straight away.
+ *
+ * @return YES if the stream started preloading, or NO if the stream was
+ *         previously started and this had no effect.
+ */
+- (BOOL) preload;
+
 /**
  * Stop all streams, cleaning up resources and preventing all further events
  * from occurring.
@@ -417,6 +499,10 @@ struct queued_packet;
  * This method may be invoked at any time from any point of the audio stream as
  * a signal of error happening. This method sets the state to AS_STOPPED if it
  * isn't already AS_STOPPED or AS_DONE.
+ *
+ * A stream which was started must be stopped before it's released, since
+ * the download holds on to it until then. The download is closed and the
+ * audio queue disposed of on the I/O thread soon after this returns.
  */
 - (void) stop;
 
@@ -491,11 +577,13 @@ struct queued_packet;
  * function can fail to actually seek.
  *
  * Additionally, seeking to a new time involves re-opening the audio stream with
- * the remote source, although this is done under the hood.
+ * the remote source, although this is done under the hood, on the I/O thread
+ * after this returns. Another seek can't start until that's done.
  *
  * @param newSeekTime the time in seconds to seek to
  * @return YES if the stream will be seeking, or NO if the stream did not have
- *         enough information available to it to seek to the specified time.
+ *         enough information available to it to seek to the specified time,
+ *         or was still seeking.
  */
 - (BOOL) seekToTime:(double)newSeekTime;
 
@@ -526,8 +614,9 @@ struct queued_packet;
 /**
  * Calculates the duration of the audio stream in seconds
  *
- * Uses information about the size of the file and the calculated bit rate to
- * determine the duration of the stream.
+ * This is known exactly from the start for MP3s with a Xing, VBRI or LAME
+ * header, and for any stream once all of it was downloaded. Until then it's
+ * worked out from the size of the file and the calculated bit rate.
  *
  * @param ret where to fill in with the duration of the stream on success.
  * @return YES if ret contains the duration of the stream, or NO if the duration
@@ -549,4 +638,41 @@ struct queued_packet;
  */
 - (BOOL) progress:(double*)ret;
 
+/** @name Measuring the connection */
+
+/**
+ * Calculates how fast the stream has been downloading
+ *
+ * This is measured about once a second while the stream is read and smoothed
+ * over the last few seconds, and once more for what was read since the last
+ * measurement when the download ends or is closed, so that a stream which
+ * downloads in under a second is measured too. Time spent waiting for
+ * playback to catch up with what was read isn't counted.
+ *
+ * @param ret filled in with the rate in bits per second on success
+ * @return YES if the rate has been measured, or NO if too little was read yet
+ */
+- (BOOL) throughput:(double*)ret;
+
+/**
+ * Calculates how many seconds of audio were downloaded ahead of what's
+ * playing, or for a stream which is preloading, ahead of where it will start
+ * playing from
+ *
+ * @param ret filled in with the time on success
+ * @return YES if it could be determined, or NO if the progress couldn't be
+ */
+- (BOOL) bufferedTime:(double*)ret;
+
+/**
+ * @return YES once all of the stream has been read
+ */
+- (BOOL) isDownloaded;
+
+/**
+ * @return how many times playback ran out of audio before all of the stream
+ *         was read, each of which is heard as a pause to rebuffer
+ */
+- (NSUInteger) underrunCount;
+
 @end
@@ -24,7 +24,12 @@
 /* This file has been heavily modified since its original distribution bytes
    Alex Crichton for the Hermes project */
 
+#include <pthread.h>
+
+#import "ASPacketRing.h"
+#import "ASStreamIndex.h"
 #import "AudioStreamer.h"
+#import "TrafficRecorder.h"
 
 #define BitRateEstimationMinPackets 50
 
@@ -36,6 +41,28 @@
 #define kDefaultNumAQBufs 16
 #define kDefaultAQDefaultBufSize 2048
 
+/* The most room made up front for packets held aside, which otherwise is as
+   long as the download when buffering infinitely */
+#define kMaxQueuedReserve (32ULL * 1024 * 1024)
+
+/* Reads start small so the first packets are handed over quickly, and double
+   for as long as each read fills up, halving again once reads come back well
+   short */
+#define kMinReadSize 4096
+#define kMaxReadSize (64 * 1024)
+
+/* The most reads made each time the stream has bytes, so that stopping or
+   seeking isn't kept waiting long on the I/O thread */
+#define kMaxReadsPerEvent 4
+
+/* Times in a row a dropped download is reopened before the stream fails */
+#define kMaxResumes 3
+
+/* The download rate is sampled once a second, and each sample moves the
+   smoothed rate a third of the way towards it */
+#define kThroughputInterval 1.0
+#define kThroughputWeight (1.0 / 3)
+
 #define CHECK_ERR(err, code) {                                                 \
     if (err) { [self failWithErrorCode:code]; return; }                        \
   }
@@ -46,11 +73,77 @@
 #define LOG(...)
 #endif
 
-typedef struct queued_packet {
-  AudioStreamPacketDescription desc;
-  struct queued_packet *next;
-  char data[];
-} queued_packet_t;
+static inline BOOL hasQueuedPackets(ASPacketRing *queued) {
+  return queued != NULL && ASPacketRingCount(queued) > 0;
+}
+
+#pragma mark - I/O thread
+
+static CFRunLoopRef ioRunLoop;
+
+/* Does nothing, but keeps the I/O thread's run loop from returning while no
+   stream is scheduled on it */
+static void keepAlive(void *info) {
+}
+
+static void* ioThreadMain(void *started) {
+  pthread_setname_np("AudioStreamer I/O");
+  CFRunLoopSourceContext context = {0};
+  context.perform = keepAlive;
+  CFRunLoopSourceRef source = CFRunLoopSourceCreate(NULL, 0, &context);
+  CFRunLoopAddSource(CFRunLoopGetCurrent(), source, kCFRunLoopDefaultMode);
+  CFRelease(source);
+  ioRunLoop = (CFRunLoopRef) CFRetain(CFRunLoopGetCurrent());
+  dispatch_semaphore_signal((__bridge dispatch_semaphore_t) started);
+  CFRunLoopRun();
+  return NULL;
+}
+
+/**
+ * @brief The run loop of the thread which every stream's network reads and
+ *        parsing happen on, started the first time it's needed
+ */
+static CFRunLoopRef ASIORunLoop(void) {
+  static dispatch_once_t once;
+  dispatch_once(&once, ^{
+    dispatch_semaphore_t started = dispatch_semaphore_create(0);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    /* Falling behind here is heard as a dropout */
+    pthread_attr_set_qos_class_np(&attr, QOS_CLASS_USER_INTERACTIVE, 0);
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, ioThreadMain,
+                       (__bridge void*) started) == 0) {
+      dispatch_semaphore_wait(started, DISPATCH_TIME_FOREVER);
+    } else {
+      ioRunLoop = CFRunLoopGetMain();
+    }
+    pthread_attr_destroy(&attr);
+  });
+  return ioRunLoop;
+}
+
+/**
+ * @brief Run a block on the I/O thread, right away if already on it
+ *
+ * Nothing waits for the block, so however long the I/O thread takes, it
+ * can't hold up the main thread or the audio queue's. Blocks run in the order
+ * they were sent, and hold on to whatever they use until then.
+ */
+static void performOnIOThread(dispatch_block_t block) {
+  CFRunLoopRef runLoop = ASIORunLoop();
+  if (CFRunLoopGetCurrent() == runLoop) {
+    block();
+    return;
+  }
+  CFRunLoopPerformBlock(runLoop, kCFRunLoopCommonModes, ^{
+    @autoreleasepool {
+      block();
+    }
+  });
+  CFRunLoopWakeUp(runLoop);
+}
 
 NSString * const ASBitrateReadyNotification = @"ASBitrateReadyNotification";
 NSString * const ASStatusChangedNotification = @"ASStatusChangedNotification";
@@ -73,12 +166,14 @@ NSString * const ASDidChangeStateDistributedNotification = @"hermes.state";
 - (void)handleReadFromStream:(CFReadStreamRef)aStream
                    eventType:(CFStreamEventType)eventType;
 
+@property (readwrite) NSDictionary *httpHeaders;
+@property (readwrite) NSError *networkError;
+
 @end
 
 /* Woohoo, actual implementation now! */
 @implementation AudioStreamer
 
-@synthesize errorCode;
 @synthesize networkError;
 @synthesize httpHeaders;
 @synthesize url;
@@ -114,23 +209,32 @@ static void MyPacketsProc(void *inClientData, UInt32 inNumberBytes, UInt32
  * own personal threads, not the main thread */
 static void MyAudioQueueOutputCallback(void *inClientData, AudioQueueRef inAQ,
                                 AudioQueueBufferRef inBuffer) {
-  AudioStreamer* streamer = (__bridge AudioStreamer*)inClientData;
-  [streamer handleBufferCompleteForQueue:inAQ buffer:inBuffer];
+  @autoreleasepool {
+    AudioStreamer* streamer = (__bridge AudioStreamer*)inClientData;
+    [streamer handleBufferCompleteForQueue:inAQ buffer:inBuffer];
+  }
 }
 
 /* AudioQueue callback that a property has changed, invoked on AudioQueue's own
  * personal threads like above */
 static void MyAudioQueueIsRunningCallback(void *inUserData, AudioQueueRef inAQ,
                                    AudioQueuePropertyID inID) {
-  AudioStreamer* streamer = (__bridge AudioStreamer *)inUserData;
-  [streamer handlePropertyChangeForQueue:inAQ propertyID:inID];
+  @autoreleasepool {
+    AudioStreamer* streamer = (__bridge AudioStreamer *)inUserData;
+    [streamer handlePropertyChangeForQueue:inAQ propertyID:inID];
+  }
 }
 
-/* CFReadStream callback when an event has occurred */
+/* CFReadStream callback when an event has occurred, invoked on the I/O
+ * thread. The stream retains the streamer while it's the stream's client, and
+ * the strong reference here keeps it for the rest of the event, even if
+ * handling it closes the stream. */
 static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType eventType,
                           void* inClientInfo) {
-  AudioStreamer* streamer = (__bridge AudioStreamer *)inClientInfo;
-  [streamer handleReadFromStream:aStream eventType:eventType];
+  @autoreleasepool {
+    AudioStreamer* streamer = (__bridge AudioStreamer *)inClientInfo;
+    [streamer handleReadFromStream:aStream eventType:eventType];
+  }
 }
 
 + (AudioStreamer*) streamWithURL:(NSURL*)url{
@@ -140,16 +244,38 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
   stream->bufferCnt  = kDefaultNumAQBufs;
   stream->bufferSize = kDefaultAQDefaultBufSize;
   stream->timeoutInterval = 10;
+  stream->indexing = true;
+  stream->fillLock = OS_UNFAIR_LOCK_INIT;
   return stream;
 }
 
 - (void)dealloc {
-  [self stop];
-  assert(queued_head == NULL);
-  assert(queued_tail == NULL);
-  assert(timeout == nil);
-  assert(buffers == NULL);
-  assert(inuse == NULL);
+  /* Normally stopped by now, which can't be done from here since stopping
+     finishes on the I/O thread. Whatever is left can't call back into this object: the
+     read stream retains it while it's the stream's client, and the timeout
+     timer retains it while scheduled, so neither is still set up. The rest is
+     torn down here synchronously. */
+  if (stream != NULL) {
+    CFReadStreamSetClient(stream, kCFStreamEventNone, NULL, NULL);
+    CFReadStreamClose(stream);
+    CFRelease(stream);
+    stream = NULL;
+  }
+  AudioQueueRef queue = atomic_exchange(&audioQueue, NULL);
+  if (queue) {
+    AudioQueueStop(queue, true);
+    AudioQueueDispose(queue, true);
+  }
+  if (audioFileStream) {
+    AudioFileStreamClose(audioFileStream);
+  }
+  free(buffers);
+  free(inuse);
+  ASPacketRingFree(queued);
+  free(readBuffer);
+  free(headerBytes);
+  free(streamHeader);
+  ASSeekIndexFree(seekIndex);
 }
 
 - (void) setHTTPProxy:(NSString*)host port:(int)port {
@@ -165,8 +291,10 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
 }
 
 - (BOOL)setVolume: (double) volume {
-  if (audioQueue != NULL) {
-    AudioQueueSetParameter(audioQueue, kAudioQueueParam_Volume, volume);
+  /* Once stopped, the queue is on its way to being disposed of */
+  AudioQueueRef queue = audioQueue;
+  if (queue != NULL && state_ != AS_STOPPED) {
+    AudioQueueSetParameter(queue, kAudioQueueParam_Volume, volume);
     return YES;
   }
   return NO;
@@ -260,22 +388,66 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
 }
 
 - (BOOL) start {
-  if (stream != NULL) return NO;
-  assert(audioQueue == NULL);
-  assert(state_ == AS_INITIALIZED);
-  [self openReadStream];
-  timeout = [NSTimer scheduledTimerWithTimeInterval:timeoutInterval
-                                             target:self
-                                           selector:@selector(checkTimeout)
-                                           userInfo:nil
-                                            repeats:YES];
+  if (atomic_exchange(&held, false)) {
+    [self releaseHold];
+    return YES;
+  }
+  if (state_ != AS_INITIALIZED) return NO;
+  [self open];
   return YES;
 }
 
+- (BOOL) preload {
+  if (state_ != AS_INITIALIZED) return NO;
+  held = true;
+  [self open];
+  return YES;
+}
+
+- (AudioStreamerErrorCode) errorCode {
+  return errorCode;
+}
+
+/**
+ * @brief Open the download on the I/O thread, and start watching it for a
+ *        timeout
+ */
+- (void) open {
+  assert(audioQueue == NULL);
+  performOnIOThread(^{
+    if ([self openReadStream]) {
+      [self scheduleTimeout];
+    }
+  });
+}
+
+/**
+ * @brief Let a preloaded stream play what it has buffered so far
+ *
+ * The queue is started right away if enough was buffered, and otherwise
+ * filling buffers starts it as it would have anyway. Observers hear of the
+ * stream for the first time now.
+ */
+- (void) releaseHold {
+  os_unfair_lock_lock(&fillLock);
+  AudioQueueRef queue = audioQueue;
+  if (queue != NULL && [self shouldStartQueue]) {
+    [self startQueue:queue];
+  }
+  [self notifyBitrateReady];
+  os_unfair_lock_unlock(&fillLock);
+
+  /* A stream too short to have started the queue was held back at its end */
+  [self fillBuffers];
+  dispatch_async(dispatch_get_main_queue(), ^{
+    [self postState:self->state_];
+  });
+}
+
 - (BOOL) pause {
   if (state_ != AS_PLAYING) return NO;
   assert(audioQueue != NULL);
-  err = AudioQueuePause(audioQueue);
+  OSStatus err = AudioQueuePause(audioQueue);
   if (err) {
     [self failWithErrorCode:AS_AUDIO_QUEUE_PAUSE_FAILED];
     return NO;
@@ -287,7 +459,7 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
 - (BOOL) play {
   if (state_ != AS_PAUSED) return NO;
   assert(audioQueue != NULL);
-  err = AudioQueueStart(audioQueue, NULL);
+  OSStatus err = AudioQueueStart(audioQueue, NULL);
   if (err) {
     [self failWithErrorCode:AS_AUDIO_QUEUE_START_FAILED];
     return NO;
@@ -301,22 +473,28 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
     [self setState:AS_STOPPED];
   }
 
-  [timeout invalidate];
-  timeout = nil;
+  /* Torn down on the I/O thread, after anything already on its way there, so
+     nothing here waits on it */
+  performOnIOThread(^{
+    [self stopReading];
+    [self disposePlayback];
+  });
+}
 
-  /* Clean up our streams */
-  [self closeReadStream];
-  if (audioFileStream) {
-    err = AudioFileStreamClose(audioFileStream);
-    assert(!err);
-    audioFileStream = nil;
-  }
-  if (audioQueue) {
-    AudioQueueStop(audioQueue, true);
-    err = AudioQueueDispose(audioQueue, true);
+/**
+ * @brief Dispose of the audio queue and everything handed to it, on the I/O
+ *        thread once nothing more is read or parsed
+ */
+- (void) disposePlayback {
+  /* Disposing of the queue waits for its callbacks to return, which leaves
+     only the fill lock to wait out */
+  AudioQueueRef queue = atomic_exchange(&audioQueue, NULL);
+  if (queue) {
+    AudioQueueStop(queue, true);
+    OSStatus err = AudioQueueDispose(queue, true);
     assert(!err);
-    audioQueue = nil;
   }
+  os_unfair_lock_lock(&fillLock);
   if (buffers != NULL) {
     free(buffers);
     buffers = NULL;
@@ -325,10 +503,13 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
     free(inuse);
     inuse = NULL;
   }
-
-  httpHeaders      = nil;
+  ASPacketRingFree(queued);
+  queued = NULL;
   bytesFilled      = 0;
   packetsFilled    = 0;
+  os_unfair_lock_unlock(&fillLock);
+
+  self.httpHeaders = nil;
   seekByteOffset   = 0;
   packetBufferSize = 0;
 }
@@ -336,64 +517,39 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
 - (BOOL)seekToTime:(double)newSeekTime {
   double bitrate;
   double duration;
+  if ([self isDone]) return NO;
   if (![self calculatedBitRate:&bitrate]) return NO;
   if (![self duration:&duration]) return NO;
   if (bitrate == 0.0 || fileLength <= 0) {
     return NO;
   }
-  assert(!seeking);
-  seeking = YES;
-
-  //
-  // Calculate the byte offset for seeking
-  //
-  seekByteOffset = dataOffset +
-    (newSeekTime / duration) * (fileLength - dataOffset);
-
-  //
-  // Attempt to leave 1 useful packet at the end of the file (although in
-  // reality, this may still seek too far if the file has a long trailer).
-  //
-  if (seekByteOffset > fileLength - 2 * packetBufferSize) {
-    seekByteOffset = fileLength - 2 * packetBufferSize;
-  }
-
-  //
-  // Store the old time from the audio queue and the time that we're seeking
-  // to so that we'll know the correct time progress after seeking.
-  //
-  seekTime = newSeekTime;
-
-  //
-  // Attempt to align the seek with a packet boundary
-  //
-  double packetDuration = asbd.mFramesPerPacket / asbd.mSampleRate;
-  if (packetDuration > 0 && bitrate > 0) {
-    UInt32 ioFlags = 0;
-    SInt64 packetAlignedByteOffset;
-    SInt64 seekPacket = floor(newSeekTime / packetDuration);
-    err = AudioFileStreamSeek(audioFileStream, seekPacket,
-                              &packetAlignedByteOffset, &ioFlags);
-    if (!err && !(ioFlags & kAudioFileStreamSeekFlag_OffsetIsEstimated)) {
-      seekTime -= ((seekByteOffset - dataOffset) - packetAlignedByteOffset) * 8.0 / bitrate;
-      seekByteOffset = packetAlignedByteOffset + dataOffset;
+  /* Only one seek at a time, which finishes on the I/O thread */
+  if (atomic_exchange(&seeking, true)) return NO;
+
+  performOnIOThread(^{
+    /* Stopped meanwhile, which tears everything down after this */
+    AudioQueueRef queue = self->audioQueue;
+    if ([self isDone] || queue == NULL) {
+      self->seeking = false;
+      return;
     }
-  }
-
-  [self closeReadStream];
+    [self seekReadStreamToTime:newSeekTime bitrate:bitrate duration:duration];
 
-  /* Stop audio for now */
-  err = AudioQueueStop(audioQueue, true);
-  if (err) {
-    seeking = NO;
-    [self failWithErrorCode:AS_AUDIO_QUEUE_STOP_FAILED];
-    return NO;
-  }
+    /* Stop audio for now */
+    OSStatus err = AudioQueueStop(queue, true);
+    if (err) {
+      self->seeking = false;
+      [self failWithErrorCode:AS_AUDIO_QUEUE_STOP_FAILED];
+      return;
+    }
+    [self resetPlayback];
 
-  /* Open a new stream with a new offset */
-  BOOL ret = [self openReadStream];
-  seeking = NO;
-  return ret;
+    /* Open a new stream with a new offset, letting buffers be filled again
+       before any of it arrives */
+    [self openReadStream];
+    self->seeking = false;
+  });
+  return YES;
 }
 
 - (BOOL) progress:(double*)ret {
@@ -407,7 +563,8 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
 
   AudioTimeStamp queueTime;
   Boolean discontinuity;
-  err = AudioQueueGetCurrentTime(audioQueue, NULL, &queueTime, &discontinuity);
+  OSStatus err = AudioQueueGetCurrentTime(audioQueue, NULL, &queueTime,
+                                          &discontinuity);
   if (err) {
     return NO;
   }
@@ -422,6 +579,28 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
   return YES;
 }
 
+- (BOOL) throughput:(double*)ret {
+  double rate = throughput;
+  if (rate <= 0) return NO;
+  *ret = rate;
+  return YES;
+}
+
+- (BOOL) bufferedTime:(double*)ret {
+  double progress = seekTime;
+  if (!held && ![self progress:&progress]) return NO;
+  *ret = MAX(parsedTime - progress, 0);
+  return YES;
+}
+
+- (BOOL) isDownloaded {
+  return producerDone;
+}
+
+- (NSUInteger) underrunCount {
+  return underruns;
+}
+
 - (BOOL) calculatedBitRate:(double*)rate {
   double sampleRate     = asbd.mSampleRate;
   double packetDuration = asbd.mFramesPerPacket / sampleRate;
@@ -438,6 +617,13 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
 }
 
 - (BOOL) duration:(double*)ret {
+  /* Read from the header, or counted once the whole stream was parsed */
+  double known = knownDuration;
+  if (known > 0) {
+    *ret = known;
+    return YES;
+  }
+
   double calculatedBitRate;
   if (![self calculatedBitRate:&calculatedBitRate]) return NO;
   if (calculatedBitRate == 0 || fileLength == 0) {
@@ -453,32 +639,49 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
 //
 // failWithErrorCode:
 //
-// Sets the playback state to failed and logs the error.
+// Sets the playback state to failed and logs the error. May be called on any
+// thread, and the stream is stopped on the main thread soon after.
 //
 // Parameters:
 //    anErrorCode - the error condition
 //
 - (void)failWithErrorCode:(AudioStreamerErrorCode)anErrorCode {
-  // Only set the error once.
-  if (errorCode != AS_NO_ERROR) {
-    assert(state_ == AS_STOPPED);
-    return;
+  @synchronized (self) {
+    // Only set the error once, and not once the stream was stopped
+    if (errorCode != AS_NO_ERROR || state_ == AS_STOPPED) {
+      return;
+    }
+    errorCode = anErrorCode;
   }
-  /* Attempt to save our last point of progress */
-  [self progress:&lastProgress];
 
   LOG(@"got an error: %@", [AudioStreamer stringForErrorCode:anErrorCode]);
-  errorCode = anErrorCode;
-
-  [self stop];
+  dispatch_async(dispatch_get_main_queue(), ^{
+    /* Attempt to save our last point of progress */
+    double progress;
+    [self progress:&progress];
+    [self stop];
+  });
 }
 
 - (void)setState:(AudioStreamerState)aStatus {
   LOG(@"transitioning to state:%d", aStatus);
 
-  if (state_ == aStatus) return;
-  state_ = aStatus;
+  /* Nothing moves the stream on once it's been stopped */
+  AudioStreamerState old = atomic_load(&state_);
+  do {
+    if (old == aStatus || old == AS_STOPPED) return;
+  } while (!atomic_compare_exchange_weak(&state_, &old, aStatus));
+
+  /* Posted later even on the main thread, so that an observer stopping the
+     stream can't do so while it's filling buffers there */
+  dispatch_async(dispatch_get_main_queue(), ^{
+    [self postState:aStatus];
+  });
+}
 
+- (void)postState:(AudioStreamerState)aStatus {
+  /* Nothing is heard of a preloaded stream until it's started */
+  if (held) return;
   [[NSNotificationCenter defaultCenter]
         postNotificationName:ASStatusChangedNotification
                       object:self];
@@ -505,6 +708,19 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
   }
 }
 
+/**
+ * @brief Start checking for a timeout, on the I/O thread along with the reads
+ *        it's watching for
+ */
+- (void) scheduleTimeout {
+  timeout = [NSTimer timerWithTimeInterval:timeoutInterval
+                                    target:self
+                                  selector:@selector(checkTimeout)
+                                  userInfo:nil
+                                   repeats:YES];
+  [[NSRunLoop currentRunLoop] addTimer:timeout forMode:NSRunLoopCommonModes];
+}
+
 /**
  * @brief Check the stream for a timeout, and trigger one if this is a timeout
  *        situation
@@ -530,7 +746,9 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
     return;
   }
 
-  networkError = [NSError errorWithDomain:@"Timed out" code:1 userInfo:nil];
+  if ([self resumeReadStream:AS_TIMED_OUT]) return;
+  self.networkError = [[NSError alloc] initWithDomain:@"Timed out" code:1
+                                             userInfo:nil];
   [self failWithErrorCode:AS_TIMED_OUT];
 }
 
@@ -592,7 +810,7 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
 }
 
 /**
- * @brief Creates a new stream for reading audio data
+ * @brief Creates a new stream for reading audio data, on the I/O thread
  *
  * The stream is currently only compatible with remote HTTP sources. The stream
  * opened could possibly be seeked into the middle of the file, or have other
@@ -603,23 +821,29 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
 - (BOOL)openReadStream {
   NSAssert(stream == NULL, @"Download stream already initialized");
 
-  /* Create our GET request */
+  /* Create our GET request, which goes to the replay server when replaying */
+  TrafficRecorder *recorder = [TrafficRecorder sharedRecorder];
   CFHTTPMessageRef message =
       CFHTTPMessageCreateRequest(NULL,
                                  CFSTR("GET"),
-                                 (__bridge CFURLRef) url,
+                                 (__bridge CFURLRef) [recorder URLForRequest:url],
                                  kCFHTTPVersion1_1);
 
   /* When seeking to a time within the stream, we both already know the file
      length and the seekByteOffset will be set to know what to send to the
      remote server */
+  readOffset = 0;
+  readLength = 0;
+  rateStart = 0;
   if (fileLength > 0 && seekByteOffset > 0) {
     NSString *str = [NSString stringWithFormat:@"bytes=%lld-%lld",
                                                seekByteOffset, fileLength - 1];
     CFHTTPMessageSetHeaderFieldValue(message,
                                      CFSTR("Range"),
                                      (__bridge CFStringRef) str);
-    discontinuous = YES;
+    /* A resumed download carries on parsing where the last one stopped */
+    discontinuous = !resuming;
+    readOffset = seekByteOffset;
     seekByteOffset = 0;
   }
 
@@ -677,16 +901,22 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
                             (__bridge CFDictionaryRef) sslSettings);
   }
 
-  [self setState:AS_WAITING_FOR_DATA];
+  if (!resuming) {
+    [self setState:AS_WAITING_FOR_DATA];
+  }
 
+  traffic = [recorder exchangeForURL:url method:@"GET" audio:YES];
+  [traffic opened];
   if (!CFReadStreamOpen(stream)) {
     [self failWithErrorCode:AS_FILE_STREAM_OPEN_FAILED];
     return NO;
   }
 
   /* Set the callback to receive a few events, and then we're ready to
-     schedule and go */
-  CFStreamClientContext context = {0, (__bridge void*) self, NULL, NULL, NULL};
+     schedule and go. The stream holds on to this object until the client is
+     cleared in closeReadStream, so no event can arrive after it's gone. */
+  CFStreamClientContext context = {0, (__bridge void*) self, CFRetain,
+                                   CFRelease, NULL};
   CFReadStreamSetClient(stream,
                         kCFStreamEventHasBytesAvailable |
                           kCFStreamEventErrorOccurred |
@@ -695,6 +925,8 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
                         &context);
   CFReadStreamScheduleWithRunLoop(stream, CFRunLoopGetCurrent(),
                                   kCFRunLoopCommonModes);
+  unscheduled = NO;
+  rescheduled = NO;
 
   return YES;
 }
@@ -702,7 +934,8 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
 //
 // handleReadFromStream:eventType:
 //
-// Reads data from the network file stream into the AudioFileStream
+// Reads data from the network file stream into the AudioFileStream, on the I/O
+// thread
 //
 // Parameters:
 //    aStream - the network file stream
@@ -711,13 +944,17 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
 - (void)handleReadFromStream:(CFReadStreamRef)aStream
                    eventType:(CFStreamEventType)eventType {
   assert(aStream == stream);
-  assert(!waitingOnBuffer || bufferInfinite);
   events++;
+  if ([self isDone]) return;
 
   switch (eventType) {
     case kCFStreamEventErrorOccurred:
       LOG(@"error");
-      networkError = (__bridge_transfer NSError*) CFReadStreamCopyError(aStream);
+      self.networkError =
+        (__bridge_transfer NSError*) CFReadStreamCopyError(aStream);
+      [traffic finishedWithError:self.networkError];
+      traffic = nil;
+      if ([self resumeReadStream:AS_NETWORK_CONNECTION_FAILED]) return;
       [self failWithErrorCode:AS_NETWORK_CONNECTION_FAILED];
       return;
 
@@ -725,18 +962,21 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
       LOG(@"end");
       [timeout invalidate];
       timeout = nil;
+      [traffic finishedWithError:nil];
+      traffic = nil;
+      [self finishThroughput];
 
-      /* Flush out extra data if necessary */
-      if (bytesFilled) {
-        /* Disregard return value because we're at the end of the stream anyway
-           so there's no bother in pausing it */
-        if ([self enqueueBuffer] < 0) return;
-      }
+      [self streamEnded];
 
       /* If we never received any packets, then we're done now */
-      if (state_ == AS_WAITING_FOR_DATA) {
+      if (audioQueue == NULL) {
         [self setState:AS_DONE];
+        return;
       }
+
+      /* Otherwise playback flushes out the rest once it has caught up */
+      producerDone = true;
+      [self fillBuffers];
       return;
 
     default:
@@ -751,7 +991,7 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
   if (!httpHeaders) {
     CFTypeRef message =
         CFReadStreamCopyProperty(stream, kCFStreamPropertyHTTPResponseHeader);
-    httpHeaders = (__bridge_transfer NSDictionary *)
+    self.httpHeaders = (__bridge_transfer NSDictionary *)
         CFHTTPMessageCopyAllHeaderFields((CFHTTPMessageRef) message);
     CFRelease(message);
 
@@ -762,6 +1002,25 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
     if (seekByteOffset == 0) {
       fileLength = [httpHeaders[@"Content-Length"] integerValue];
     }
+    traffic.expectedLength = (NSUInteger) MAX([httpHeaders[@"Content-Length"] integerValue], 0);
+  }
+
+  /* A resumed download only carries on if the server sent the rest of it,
+     rather than all of it again */
+  if (resuming) {
+    resuming = false;
+    CFHTTPMessageRef response = (CFHTTPMessageRef)
+        CFReadStreamCopyProperty(stream, kCFStreamPropertyHTTPResponseHeader);
+    CFIndex status = 0;
+    if (response != NULL) {
+      status = CFHTTPMessageGetResponseStatusCode(response);
+      CFRelease(response);
+    }
+    if (status != 206) {
+      LOG(@"resuming got status %ld", (long) status);
+      [self failWithErrorCode:resumedFrom];
+      return;
+    }
   }
 
   /* If we haven't yet opened up a file stream, then do so now */
@@ -779,18 +1038,24 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
     }
 
     // create an audio file stream parser
-    err = AudioFileStreamOpen((__bridge void*) self, MyPropertyListenerProc,
-                              MyPacketsProc, fileType, &audioFileStream);
-    CHECK_ERR(err, AS_FILE_STREAM_OPEN_FAILED);
+    OSStatus status = AudioFileStreamOpen((__bridge void*) self,
+                                          MyPropertyListenerProc,
+                                          MyPacketsProc, fileType,
+                                          &audioFileStream);
+    CHECK_ERR(status, AS_FILE_STREAM_OPEN_FAILED);
+  }
+
+  if (readBuffer == NULL) {
+    readBuffer = malloc(kMaxReadSize);
+    CHECK_ERR(readBuffer == NULL, AS_AUDIO_STREAMER_FAILED);
+    readSize = kMinReadSize;
   }
 
-  UInt8 bytes[2048];
-  CFIndex length;
-  int i;
-  for (i = 0;
-       i < 3 && ![self isDone] && CFReadStreamHasBytesAvailable(stream);
+  for (int i = 0;
+       i < kMaxReadsPerEvent && ![self isDone] &&
+         CFReadStreamHasBytesAvailable(stream);
        i++) {
-    length = CFReadStreamRead(stream, bytes, sizeof(bytes));
+    CFIndex length = CFReadStreamRead(stream, readBuffer, readSize);
 
     if (length < 0) {
       [self failWithErrorCode:AS_AUDIO_DATA_NOT_FOUND];
@@ -798,32 +1063,149 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
     } else if (length == 0) {
       return;
     }
+    [traffic receivedBytes:readBuffer length:(NSUInteger) length];
+    [self measureThroughput:length];
+    resumes = 0;
+    readOffset += readLength;
+    readLength = length;
+    if (!headerRead) {
+      [self findHeaderIn:readBuffer length:length];
+    }
 
+    OSStatus status;
     if (discontinuous) {
-      err = AudioFileStreamParseBytes(audioFileStream, (UInt32) length, bytes,
-                                      kAudioFileStreamParseFlag_Discontinuity);
+      status = AudioFileStreamParseBytes(audioFileStream, (UInt32) length,
+                                         readBuffer,
+                                         kAudioFileStreamParseFlag_Discontinuity);
     } else {
-      err = AudioFileStreamParseBytes(audioFileStream, (UInt32) length,
-                                      bytes, 0);
+      status = AudioFileStreamParseBytes(audioFileStream, (UInt32) length,
+                                         readBuffer, 0);
+    }
+    CHECK_ERR(status, AS_FILE_STREAM_PARSE_BYTES_FAILED);
+
+    if (length == readSize && readSize < kMaxReadSize) {
+      readSize *= 2;
+    } else if (length < readSize / 4 && readSize > kMinReadSize) {
+      readSize /= 2;
+    }
+
+    /* Leave the rest on the network until playback catches up, if enough is
+       held aside already */
+    if (!bufferInfinite && queued != NULL &&
+        ASPacketRingBytes(queued) > (size_t) bufferCnt * packetBufferSize) {
+      LOG(@"waiting for the held packets to drain");
+      CFReadStreamUnscheduleFromRunLoop(stream, CFRunLoopGetCurrent(),
+                                        kCFRunLoopCommonModes);
+      /* Make sure we don't have ourselves marked as rescheduled */
+      unscheduled = YES;
+      rescheduled = NO;
+      throttled = true;
+      [self finishThroughput];
+      /* In case playback drained it in the meantime */
+      [self fillBuffers];
+      return;
     }
-    CHECK_ERR(err, AS_FILE_STREAM_PARSE_BYTES_FAILED);
   }
 }
 
+/**
+ * @brief Measure how fast the stream downloads, on the I/O thread
+ *
+ * A measurement starts with the first read after connecting or after waiting
+ * on playback, so neither the time to connect nor the wait counts against it.
+ */
+- (void) measureThroughput:(CFIndex)length {
+  CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+  rateLast = now;
+  if (rateStart == 0) {
+    rateStart = now;
+    rateBytes = 0;
+    return;
+  }
+  rateBytes += (UInt64) length;
+  if (now - rateStart < kThroughputInterval) return;
+  [self sampleThroughput];
+  rateStart = now;
+}
+
+/**
+ * @brief Cut the measurement short as reading stops, at the end of the
+ *        download, on closing it or to wait on playback, on the I/O thread
+ *
+ * Whatever was read since the measurement began is a sample of its own, up
+ * to the last read, so long as anything was read after the first.
+ */
+- (void) finishThroughput {
+  if (rateStart != 0 && rateBytes > 0 && rateLast > rateStart) {
+    [self sampleThroughput];
+  }
+  rateStart = 0;
+}
+
+/* Moves the smoothed rate towards what was read from rateStart to rateLast */
+- (void) sampleThroughput {
+  double sample = rateBytes * 8 / (rateLast - rateStart);
+  double previous = throughput;
+  throughput = previous > 0 ?
+      previous + (sample - previous) * kThroughputWeight : sample;
+  rateBytes = 0;
+}
+
+/**
+ * @brief Reopen the download from the byte after the last one read, once it
+ *        dropped or timed out, on the I/O thread
+ *
+ * This only works once the length of the stream is known, which a Range
+ * request needs, and the parser has started on it, which is then left as it
+ * was, halfway through a packet or not.
+ *
+ * @param code what to fail with if the resumed download can't carry on
+ * @return YES if the download was reopened, or NO if the stream is to fail
+ */
+- (BOOL) resumeReadStream:(AudioStreamerErrorCode)code {
+  UInt64 resumeAt = readOffset + (UInt64) readLength;
+  if (resumes >= kMaxResumes || seeking || [self isDone] ||
+      audioFileStream == NULL || fileLength == 0 || resumeAt == 0 ||
+      resumeAt >= fileLength) {
+    return NO;
+  }
+  resumes++;
+  LOG(@"resuming at byte %llu of %llu", resumeAt, fileLength);
+
+  [self closeReadStream];
+  seekByteOffset = resumeAt;
+  resuming = true;
+  resumedFrom = code;
+  events = 0;
+  /* Failing to open fails the stream already */
+  [self openReadStream];
+  return YES;
+}
+
+/**
+ * @brief Reschedule the http stream once playback has drained the packets held
+ *        aside, on the I/O thread
+ */
+- (void) rescheduleReadStream {
+  if (stream == NULL || !unscheduled || rescheduled) return;
+  CFReadStreamScheduleWithRunLoop(stream, CFRunLoopGetCurrent(),
+                                  kCFRunLoopCommonModes);
+  rescheduled = YES;
+}
+
 //
-// enqueueBuffer
+// enqueueBuffer:
 //
-// Called from MyPacketsProc and connectionDidFinishLoading to pass filled audio
-// buffers (filled by MyPacketsProc) to the AudioQueue for playback. This
-// function does not return until a buffer is idle for further filling or
-// the AudioQueue is stopped.
+// Called while filling buffers to pass a filled audio buffer to the AudioQueue
+// for playback, starting the queue once a few are enqueued.
 //
 // This function is adapted from Apple's example in AudioFileStreamExample with
 // CBR functionality added.
 //
-- (int) enqueueBuffer {
-  assert(stream != NULL);
-
+// Returns -1 on failure, 0 if the next buffer is still in use, or 1 if it's
+// free to fill.
+//
+- (int) enqueueBuffer:(AudioQueueRef)queue {
   assert(!inuse[fillBufferIndex]);
   inuse[fillBufferIndex] = true;    // set in use flag
   buffersUsed++;
@@ -833,25 +1215,16 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
   fillBuf->mAudioDataByteSize = bytesFilled;
 
   assert(packetsFilled > 0);
-  err = AudioQueueEnqueueBuffer(audioQueue, fillBuf, packetsFilled,
-                                packetDescs);
-  if (err) {
+  OSStatus status = AudioQueueEnqueueBuffer(queue, fillBuf, packetsFilled,
+                                            packetDescs);
+  if (status) {
     [self failWithErrorCode:AS_AUDIO_QUEUE_ENQUEUE_FAILED];
     return -1;
   }
   LOG(@"committed buffer %d", fillBufferIndex);
 
-  if (state_ == AS_WAITING_FOR_DATA) {
-    /* Once we have a small amount of queued data, then we can go ahead and
-     * start the audio queue and the file stream should remain ahead of it */
-    if (bufferCnt < 3 || buffersUsed > 2) {
-      err = AudioQueueStart(audioQueue, NULL);
-      if (err) {
-        [self failWithErrorCode:AS_AUDIO_QUEUE_START_FAILED];
-        return -1;
-      }
-      [self setState:AS_WAITING_FOR_QUEUE_TO_START];
-    }
+  if ([self shouldStartQueue]) {
+    if ([self startQueue:queue] < 0) return -1;
   }
 
   /* move on to the next buffer and wait for it to be in use */
@@ -859,38 +1232,38 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
   bytesFilled   = 0;    // reset bytes filled
   packetsFilled = 0;    // reset packets filled
 
-  /* If we have no more queued data, and the stream has reached its end, then
-     we're not going to be enqueueing any more buffers to the audio stream. In
-     this case flush it out and asynchronously stop it */
-  if (queued_head == NULL &&
-      CFReadStreamGetStatus(stream) == kCFStreamStatusAtEnd) {
-    err = AudioQueueFlush(audioQueue);
-    if (err) {
-      [self failWithErrorCode:AS_AUDIO_QUEUE_FLUSH_FAILED];
-      return -1;
-    }
-  }
+  return inuse[fillBufferIndex] ? 0 : 1;
+}
 
-  if (inuse[fillBufferIndex]) {
-    LOG(@"waiting for buffer %d", fillBufferIndex);
-    if (!bufferInfinite) {
-      CFReadStreamUnscheduleFromRunLoop(stream, CFRunLoopGetCurrent(),
-                                        kCFRunLoopCommonModes);
-      /* Make sure we don't have ourselves marked as rescheduled */
-      unscheduled = YES;
-      rescheduled = NO;
-    }
-    waitingOnBuffer = true;
-    return 0;
+/**
+ * @brief Whether the queue is yet to be started and enough is buffered to
+ *        start it, unless the stream is preloading
+ *
+ * Once we have a small amount of queued data, then we can go ahead and start
+ * the audio queue and the file stream should remain ahead of it.
+ */
+- (BOOL) shouldStartQueue {
+  return state_ == AS_WAITING_FOR_DATA && !held &&
+         (bufferCnt < 3 || buffersUsed > 2);
+}
+
+- (int) startQueue:(AudioQueueRef)queue {
+  /* Waiting before starting, since the queue may tell us it's running before
+     AudioQueueStart returns */
+  [self setState:AS_WAITING_FOR_QUEUE_TO_START];
+  OSStatus status = AudioQueueStart(queue, NULL);
+  if (status) {
+    [self failWithErrorCode:AS_AUDIO_QUEUE_START_FAILED];
+    return -1;
   }
-  return 1;
+  return 0;
 }
 
 //
 // createQueue
 //
 // Method to create the AudioQueue from the parameters gathered by the
-// AudioFileStream.
+// AudioFileStream, along with the ring its packets are handed over in.
 //
 // Creation is deferred to the handling of the first audio packet (although
 // it could be handled any time after kAudioFileStreamProperty_ReadyToProducePackets
@@ -899,35 +1272,39 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
 - (void)createQueue {
   assert(audioQueue == NULL);
 
-  // create the audio queue
-  err = AudioQueueNewOutput(&asbd, MyAudioQueueOutputCallback,
-                            (__bridge void*) self, CFRunLoopGetCurrent(), NULL,
-                            0, &audioQueue);
-  CHECK_ERR(err, AS_AUDIO_QUEUE_CREATION_FAILED);
+  // create the audio queue, whose callbacks are invoked on its own threads
+  AudioQueueRef queue;
+  OSStatus status = AudioQueueNewOutput(&asbd, MyAudioQueueOutputCallback,
+                                        (__bridge void*) self, NULL, NULL, 0,
+                                        &queue);
+  CHECK_ERR(status, AS_AUDIO_QUEUE_CREATION_FAILED);
+  audioQueue = queue;
 
   // start the queue if it has not been started already
   // listen to the "isRunning" property
-  err = AudioQueueAddPropertyListener(audioQueue, kAudioQueueProperty_IsRunning,
-                                      MyAudioQueueIsRunningCallback,
-                                      (__bridge void*) self);
-  CHECK_ERR(err, AS_AUDIO_QUEUE_ADD_LISTENER_FAILED);
+  status = AudioQueueAddPropertyListener(queue, kAudioQueueProperty_IsRunning,
+                                         MyAudioQueueIsRunningCallback,
+                                         (__bridge void*) self);
+  CHECK_ERR(status, AS_AUDIO_QUEUE_ADD_LISTENER_FAILED);
 
   /* Try to determine the packet size, eventually falling back to some
      reasonable default of a size */
+  UInt32 packetSize = 0;
   UInt32 sizeOfUInt32 = sizeof(UInt32);
-  err = AudioFileStreamGetProperty(audioFileStream,
-          kAudioFileStreamProperty_PacketSizeUpperBound, &sizeOfUInt32,
-          &packetBufferSize);
-
-  if (err || packetBufferSize == 0) {
-    err = AudioFileStreamGetProperty(audioFileStream,
-            kAudioFileStreamProperty_MaximumPacketSize, &sizeOfUInt32,
-            &packetBufferSize);
-    if (err || packetBufferSize == 0) {
+  status = AudioFileStreamGetProperty(audioFileStream,
+             kAudioFileStreamProperty_PacketSizeUpperBound, &sizeOfUInt32,
+             &packetSize);
+
+  if (status || packetSize == 0) {
+    status = AudioFileStreamGetProperty(audioFileStream,
+               kAudioFileStreamProperty_MaximumPacketSize, &sizeOfUInt32,
+               &packetSize);
+    if (status || packetSize == 0) {
       // No packet size available, just use the default
-      packetBufferSize = bufferSize;
+      packetSize = bufferSize;
     }
   }
+  packetBufferSize = packetSize;
 
   // allocate audio queue buffers
   buffers = malloc(bufferCnt * sizeof(buffers[0]));
@@ -935,10 +1312,18 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
   inuse = calloc(bufferCnt, sizeof(inuse[0]));
   CHECK_ERR(inuse == NULL, AS_AUDIO_QUEUE_BUFFER_ALLOCATION_FAILED);
   for (unsigned int i = 0; i < bufferCnt; ++i) {
-    err = AudioQueueAllocateBuffer(audioQueue, packetBufferSize,
-                                   &buffers[i]);
-    CHECK_ERR(err, AS_AUDIO_QUEUE_BUFFER_ALLOCATION_FAILED);
+    status = AudioQueueAllocateBuffer(queue, packetBufferSize, &buffers[i]);
+    CHECK_ERR(status, AS_AUDIO_QUEUE_BUFFER_ALLOCATION_FAILED);
+  }
+
+  /* Making room up front for the whole download if it's all going to be
+     held */
+  size_t reserve = 0;
+  if (bufferInfinite && fileLength > 0) {
+    reserve = (size_t) MIN(fileLength, kMaxQueuedReserve);
   }
+  queued = ASPacketRingCreate(reserve);
+  CHECK_ERR(queued == NULL, AS_AUDIO_QUEUE_BUFFER_ALLOCATION_FAILED);
 
   /* Some audio formats have a "magic cookie" which needs to be transferred from
      the file stream to the audio queue. If any of this fails it's "OK" because
@@ -968,7 +1353,7 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
 
   // set the cookie on the queue. Don't worry if it fails, all we'd to is return
   // anyway
-  AudioQueueSetProperty(audioQueue, kAudioQueueProperty_MagicCookie, cookieData,
+  AudioQueueSetProperty(queue, kAudioQueueProperty_MagicCookie, cookieData,
                         cookieSize);
   free(cookieData);
 }
@@ -987,6 +1372,7 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
                      fileStreamPropertyID:(AudioFileStreamPropertyID)inPropertyID
                                   ioFlags:(UInt32 *)ioFlags {
   assert(inAudioFileStream == audioFileStream);
+  OSStatus status;
 
   switch (inPropertyID) {
     case kAudioFileStreamProperty_ReadyToProducePackets:
@@ -997,9 +1383,9 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
     case kAudioFileStreamProperty_DataOffset: {
       SInt64 offset;
       UInt32 offsetSize = sizeof(offset);
-      err = AudioFileStreamGetProperty(inAudioFileStream,
+      status = AudioFileStreamGetProperty(inAudioFileStream,
               kAudioFileStreamProperty_DataOffset, &offsetSize, &offset);
-      CHECK_ERR(err, AS_FILE_STREAM_GET_PROPERTY_FAILED);
+      CHECK_ERR(status, AS_FILE_STREAM_GET_PROPERTY_FAILED);
       dataOffset = offset;
 
       if (audioDataByteCount) {
@@ -1011,10 +1397,10 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
 
     case kAudioFileStreamProperty_AudioDataByteCount: {
       UInt32 byteCountSize = sizeof(UInt64);
-      err = AudioFileStreamGetProperty(inAudioFileStream,
+      status = AudioFileStreamGetProperty(inAudioFileStream,
               kAudioFileStreamProperty_AudioDataByteCount,
               &byteCountSize, &audioDataByteCount);
-      CHECK_ERR(err, AS_FILE_STREAM_GET_PROPERTY_FAILED);
+      CHECK_ERR(status, AS_FILE_STREAM_GET_PROPERTY_FAILED);
       fileLength = dataOffset + audioDataByteCount;
       LOG(@"have byte count: %llx", audioDataByteCount);
       break;
@@ -1025,9 +1411,9 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
       if (asbd.mSampleRate == 0) {
         UInt32 asbdSize = sizeof(asbd);
 
-        err = AudioFileStreamGetProperty(inAudioFileStream,
+        status = AudioFileStreamGetProperty(inAudioFileStream,
                 kAudioFileStreamProperty_DataFormat, &asbdSize, &asbd);
-        CHECK_ERR(err, AS_FILE_STREAM_GET_PROPERTY_FAILED);
+        CHECK_ERR(status, AS_FILE_STREAM_GET_PROPERTY_FAILED);
       }
       LOG(@"have data format");
       break;
@@ -1037,7 +1423,7 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
     /*case kAudioFileStreamProperty_FormatList: {
       Boolean outWriteable;
       UInt32 formatListSize;
-      err = AudioFileStreamGetPropertyInfo(inAudioFileStream,
+      OSStatus err = AudioFileStreamGetPropertyInfo(inAudioFileStream,
               kAudioFileStreamProperty_FormatList,
               &formatListSize, &outWriteable);
       CHECK_ERR(err, AS_FILE_STREAM_GET_PROPERTY_FAILED);
@@ -1078,7 +1464,7 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
                numberBytes:(UInt32)inNumberBytes
              numberPackets:(UInt32)inNumberPackets
         packetDescriptions:(AudioStreamPacketDescription*)inPacketDescriptions {
-  if ([self isDone]) return;
+  if ([self isDone] || errorCode != AS_NO_ERROR) return;
   // we have successfully read the first packets from the audio stream, so
   // clear the "discontinuous" flag
   if (discontinuous) {
@@ -1086,134 +1472,246 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
   }
 
   if (!audioQueue) {
-    assert(!waitingOnBuffer);
     [self createQueue];
+    if (errorCode != AS_NO_ERROR) return;
   }
   assert(inPacketDescriptions != NULL);
 
-  /* Place each packet into a buffer and then send each buffer into the audio
-     queue */
-  UInt32 i;
-  for (i = 0; i < inNumberPackets && !waitingOnBuffer && queued_head == NULL; i++) {
+  /* Hand each packet over to playback, which copies them into buffers */
+  for (UInt32 i = 0; i < inNumberPackets; i++) {
     AudioStreamPacketDescription *desc = &inPacketDescriptions[i];
-    int ret = [self handlePacket:(inInputData + desc->mStartOffset)
-                            desc:desc];
+    int ret = ASPacketRingPush(queued, inInputData + desc->mStartOffset, desc);
     CHECK_ERR(ret < 0, AS_AUDIO_QUEUE_ENQUEUE_FAILED);
-    if (!ret) break;
   }
-  if (i == inNumberPackets) return;
+  [self indexPackets:inInputData
+         numberPackets:inNumberPackets
+    packetDescriptions:inPacketDescriptions];
+  if (asbd.mSampleRate > 0) {
+    parsedTime += inNumberPackets * asbd.mFramesPerPacket / asbd.mSampleRate;
+  }
+  [self fillBuffers];
+}
 
-  for (; i < inNumberPackets; i++) {
-    /* Allocate the packet */
-    UInt32 size = inPacketDescriptions[i].mDataByteSize;
-    queued_packet_t *packet = malloc(sizeof(queued_packet_t) + size);
-    CHECK_ERR(packet == NULL, AS_AUDIO_QUEUE_ENQUEUE_FAILED);
+/**
+ * @brief Record where the packets just handed over lie, so seeks back to
+ *        them are exact, on the I/O thread
+ */
+- (void) indexPackets:(const void*)inInputData
+        numberPackets:(UInt32)inNumberPackets
+   packetDescriptions:(AudioStreamPacketDescription*)inPacketDescriptions {
+  if (indexing && seekIndex == NULL) {
+    seekIndex = ASSeekIndexCreate(dataOffset);
+  }
+  if (indexing && (seekIndex == NULL ||
+                   ASSeekIndexAppendPackets(seekIndex, nextPacket, inInputData,
+                                            inPacketDescriptions,
+                                            inNumberPackets, readBuffer,
+                                            (size_t) readLength,
+                                            readOffset) < 0)) {
+    LOG(@"giving up on indexing packets");
+    indexing = false;
+  }
+  nextPacket += inNumberPackets;
+}
 
-    /* Prepare the packet */
-    packet->next = NULL;
-    packet->desc = inPacketDescriptions[i];
-    packet->desc.mStartOffset = 0;
-    memcpy(packet->data, inInputData + inPacketDescriptions[i].mStartOffset,
-           size);
+/**
+ * @brief Gather the start of an MP3's frames until there's enough to read
+ *        its header from, on the I/O thread
+ */
+- (void) findHeaderIn:(const UInt8*)bytes length:(CFIndex)length {
+  /* Only MP3s have them */
+  if (fileType != kAudioFileMP3Type) {
+    headerRead = true;
+    return;
+  }
+  if (readOffset == 0) {
+    headerStart = ASStreamTagLength(bytes, (size_t) length);
+    headerLength = 0;
+  }
 
-    if (queued_head == NULL) {
-      queued_head = queued_tail = packet;
-    } else {
-      queued_tail->next = packet;
-      queued_tail = packet;
+  /* Bytes are gathered from where the frames start, in order, which a seek
+     past them breaks off */
+  UInt64 wanted = headerStart + headerLength;
+  if (readOffset > wanted) {
+    [self parseHeader];
+    return;
+  }
+  if (readOffset + (UInt64) length <= wanted) return;
+  if (headerBytes == NULL) {
+    headerBytes = malloc(AS_STREAM_HEADER_BYTES);
+    if (headerBytes == NULL) {
+      headerRead = true;
+      return;
     }
   }
+
+  size_t from = (size_t) (wanted - readOffset);
+  size_t n = MIN((size_t) length - from,
+                 AS_STREAM_HEADER_BYTES - headerLength);
+  memcpy(headerBytes + headerLength, bytes + from, n);
+  headerLength += n;
+  if (headerLength == AS_STREAM_HEADER_BYTES) {
+    [self parseHeader];
+  }
 }
 
-- (int) handlePacket:(const void*)data
-                desc:(AudioStreamPacketDescription*)desc{
-  assert(audioQueue != NULL);
-  UInt64 packetSize = desc->mDataByteSize;
-
-  /* This shouldn't happen because most of the time we read the packet buffer
-     size from the file stream, but if we restored to guessing it we could
-     come up too small here */
-  if (packetSize > packetBufferSize) return -1;
-
-  // if the space remaining in the buffer is not enough for this packet, then
-  // enqueue the buffer and wait for another to become available.
-  if (packetBufferSize - bytesFilled < packetSize) {
-    int hasFreeBuffer = [self enqueueBuffer];
-    if (hasFreeBuffer <= 0) {
-      return hasFreeBuffer;
+/**
+ * @brief Read a Xing or VBRI header from the bytes gathered, which gives the
+ *        exact duration and a table of contents for seeking
+ */
+- (void) parseHeader {
+  ASStreamHeader header;
+  if (headerBytes != NULL &&
+      ASStreamHeaderParse(headerBytes, headerLength, headerStart, &header)) {
+    streamHeader = malloc(sizeof(ASStreamHeader));
+    if (streamHeader != NULL) {
+      *streamHeader = header;
+      knownDuration = ASStreamHeaderDuration(&header);
+      LOG(@"header gives %llu packets, %f seconds", header.packets,
+          (double) knownDuration);
     }
-    assert(bytesFilled == 0);
-    assert(packetBufferSize >= packetSize);
   }
+  free(headerBytes);
+  headerBytes = NULL;
+  headerRead = true;
+}
 
-  /* global statistics */
-  processedPacketsSizeTotal += packetSize;
-  processedPacketsCount++;
-  if (processedPacketsCount > BitRateEstimationMinPackets &&
-      !bitrateNotification) {
-    bitrateNotification = true;
-    [[NSNotificationCenter defaultCenter]
-          postNotificationName:ASBitrateReadyNotification
-                        object:self];
+/**
+ * @brief Once the whole stream was read, anything it didn't say in a header
+ *        is known from every packet having been counted
+ */
+- (void) streamEnded {
+  if (!headerRead) {
+    [self parseHeader];
   }
+  double packetDuration = asbd.mFramesPerPacket / asbd.mSampleRate;
+  if (knownDuration <= 0 && indexing && seekIndex != NULL &&
+      packetDuration > 0) {
+    knownDuration = ASSeekIndexCount(seekIndex) * packetDuration;
+  }
+}
 
-  // copy data to the audio queue buffer
-  AudioQueueBufferRef buf = buffers[fillBufferIndex];
-  memcpy(buf->mAudioData + bytesFilled, data, packetSize);
-
-  // fill out packet description to pass to enqueue() later on
-  packetDescs[packetsFilled] = *desc;
-  // Make sure the offset is relative to the start of the audio buffer
-  packetDescs[packetsFilled].mStartOffset = bytesFilled;
-  // keep track of bytes filled and packets filled
-  bytesFilled += packetSize;
-  packetsFilled++;
+/* Global statistics for the bit rate, of packets sent to the buffers */
+- (void) countPackets:(UInt64)count bytes:(UInt64)bytes {
+  processedPacketsSizeTotal += bytes;
+  processedPacketsCount += count;
+  [self notifyBitrateReady];
+}
 
-  /* If filled our buffer with packets, then commit it to the system */
-  if (packetsFilled >= kAQMaxPacketDescs) return [self enqueueBuffer];
-  return 1;
+/* Tells observers the bit rate is known once enough packets were counted,
+   though not while preloading, by whichever thread holds the fill lock */
+- (void) notifyBitrateReady {
+  if (bitrateNotification || held ||
+      processedPacketsCount <= BitRateEstimationMinPackets) {
+    return;
+  }
+  bitrateNotification = true;
+  dispatch_async(dispatch_get_main_queue(), ^{
+    [[NSNotificationCenter defaultCenter]
+          postNotificationName:ASBitrateReadyNotification
+                        object:self];
+  });
 }
 
 /**
- * @brief Internal helper for sending cached packets to the audio queue
+ * @brief Fill buffers with the packets handed over, on whichever thread has
+ *        a reason to
  *
- * This method is enqueued for delivery when an audio buffer is freed
+ * Called when packets arrive and when a buffer frees up. If another thread is
+ * filling buffers already, it's left a request to go around again once it's
+ * done, so that nothing it might have missed is left waiting.
  */
-- (void) enqueueCachedData {
-  if ([self isDone]) return;
-  assert(!waitingOnBuffer);
-  assert(!inuse[fillBufferIndex]);
-  assert(stream != NULL);
-  LOG(@"processing some cached data");
+- (void) fillBuffers {
+  fillRequested = true;
+  while (fillRequested && os_unfair_lock_trylock(&fillLock)) {
+    fillRequested = false;
+    [self fillBuffersWhileClaimed];
+    os_unfair_lock_unlock(&fillLock);
+  }
+}
 
-  /* Queue up as many packets as possible into the buffers */
-  queued_packet_t *cur = queued_head;
-  while (cur != NULL) {
-    int ret = [self handlePacket:cur->data desc:&cur->desc];
-    CHECK_ERR(ret < 0, AS_AUDIO_QUEUE_ENQUEUE_FAILED);
-    if (ret == 0) break;
-    queued_packet_t *next = cur->next;
-    free(cur);
-    cur = next;
-  }
-  queued_head = cur;
-
-  /* If we finished queueing all our saved packets, we can re-schedule the
-   * stream to run */
-  if (cur == NULL) {
-    queued_tail = NULL;
-    rescheduled = YES;
-    if (!bufferInfinite) {
-      CFReadStreamScheduleWithRunLoop(stream, CFRunLoopGetCurrent(),
-                                      kCFRunLoopCommonModes);
+- (void) fillBuffersWhileClaimed {
+  /* While seeking, the buffers are left to be freed by stopping the queue */
+  AudioQueueRef queue = audioQueue;
+  if (queue == NULL || seeking || [self isDone] || errorCode != AS_NO_ERROR) {
+    return;
+  }
+
+  /* Queue up as many packets as possible into the buffers, copying each run
+     of packets which lie together in the ring with one memcpy */
+  while (!inuse[fillBufferIndex]) {
+    const void *data;
+    const AudioStreamPacketDescription *descs;
+    size_t bytes;
+    size_t count = ASPacketRingPeek(queued, packetBufferSize - bytesFilled,
+                                    kAQMaxPacketDescs - packetsFilled,
+                                    &data, &descs, &bytes);
+    if (count == 0) {
+      if (descs == NULL) break;
+      /* The next packet doesn't fit in what's left of this buffer. This
+         shouldn't happen on an empty buffer because most of the time we read
+         the packet buffer size from the file stream, but if we restored to
+         guessing it we could come up too small here */
+      CHECK_ERR(bytesFilled == 0, AS_AUDIO_QUEUE_ENQUEUE_FAILED);
+      int ret = [self enqueueBuffer:queue];
+      if (ret < 0) return;
+      continue;
     }
+
+    [self countPackets:count bytes:bytes];
+    AudioQueueBufferRef buf = buffers[fillBufferIndex];
+    memcpy(buf->mAudioData + bytesFilled, data, bytes);
+    for (size_t i = 0; i < count; i++) {
+      packetDescs[packetsFilled] = descs[i];
+      packetDescs[packetsFilled].mStartOffset =
+        descs[i].mStartOffset - descs[0].mStartOffset + bytesFilled;
+      packetsFilled++;
+    }
+    bytesFilled += bytes;
+    ASPacketRingPop(queued, count);
+
+    /* If filled our buffer with packets, then commit it to the system */
+    if (packetsFilled >= kAQMaxPacketDescs) {
+      int ret = [self enqueueBuffer:queue];
+      if (ret < 0) return;
+    }
+  }
+
+  /* Start reading again once half of what was held aside has drained */
+  if (throttled &&
+      ASPacketRingBytes(queued) <= (size_t) bufferCnt * packetBufferSize / 2 &&
+      atomic_exchange(&throttled, false)) {
+    performOnIOThread(^{
+      [self rescheduleReadStream];
+    });
+  }
+
+  /* If there is absolutely no more data which will ever come into the stream,
+     then flush out what's left, and once it has all played we're done */
+  if (!producerDone || hasQueuedPackets(queued)) return;
+  if (bytesFilled > 0) {
+    if ([self enqueueBuffer:queue] < 0) return;
+  }
+  if (!flushed) {
+    flushed = true;
+    OSStatus status = AudioQueueFlush(queue);
+    CHECK_ERR(status, AS_AUDIO_QUEUE_FLUSH_FAILED);
+  }
+  /* Too short a stream to have started the queue yet, which waits here while
+     preloading for the hold to be released */
+  if (state_ == AS_WAITING_FOR_DATA) {
+    if (held || [self startQueue:queue] < 0) return;
+  }
+  if (buffersUsed == 0 && !atomic_exchange(&finishing, true)) {
+    AudioQueueStop(queue, false);
   }
 }
 
 //
 // handleBufferCompleteForQueue:buffer:
 //
-// Handles the buffer completion notification from the audio queue
+// Handles the buffer completion notification from the audio queue, on one of
+// the audio queue's threads
 //
 // Parameters:
 //    inAQ - the queue
@@ -1221,51 +1719,39 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
 //
 - (void)handleBufferCompleteForQueue:(AudioQueueRef)inAQ
                               buffer:(AudioQueueBufferRef)inBuffer {
-  /* we're only registered for one audio queue... */
-  assert(inAQ == audioQueue);
-  /* Sanity check to make sure we're on the right thread */
-  assert([NSThread currentThread] == [NSThread mainThread]);
-
   /* Figure out which buffer just became free, and it had better damn well be
      one of our own buffers */
   UInt32 idx;
   for (idx = 0; idx < bufferCnt; idx++) {
     if (buffers[idx] == inBuffer) break;
   }
-  assert(idx >= 0 && idx < bufferCnt);
-  assert(inuse[idx]);
+  assert(idx < bufferCnt);
 
   LOG(@"buffer %d finished", idx);
 
-  /* Signal the buffer is no longer in use */
-  inuse[idx] = false;
-  buffersUsed--;
-
-  /* If we're done with buffers because the stream dying, then there's no need
-   * to call more methods on it. */
-  if (state_ == AS_STOPPED) {
-    return;
+  /* Signal the buffer is no longer in use, unless seeking already freed it */
+  if (atomic_exchange(&inuse[idx], false)) {
+    buffersUsed--;
   }
 
-  /* If there is absolutely no more data which will ever come into the stream,
-   * then we're done with the audio */
-  else if (buffersUsed == 0 && queued_head == NULL && stream != nil &&
-      CFReadStreamGetStatus(stream) == kCFStreamStatusAtEnd) {
-    assert(!waitingOnBuffer);
-    AudioQueueStop(audioQueue, false);
+  /* Fill it with some of the packets handed over if there are any, or stop
+     the queue if they've all been played */
+  [self fillBuffers];
 
-  /* Otherwise we just opened up a buffer so try to fill it with some cached
-   * data if there is any available */
-  } else if (waitingOnBuffer) {
-    waitingOnBuffer = false;
-    [self enqueueCachedData];
+  /* Nothing is left to play though more is on its way, which is heard as a
+     pause until it arrives */
+  if (buffersUsed == 0 && !producerDone && !seeking &&
+      state_ == AS_PLAYING) {
+    underruns++;
+    LOG(@"ran out of buffers");
   }
 }
 
 //
 // handlePropertyChangeForQueue:propertyID:
 //
-// Implementation for MyAudioQueueIsRunningCallback
+// Implementation for MyAudioQueueIsRunningCallback, on one of the audio
+// queue's threads
 //
 // Parameters:
 //    inAQ - the audio queue
@@ -1273,45 +1759,175 @@ static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType even
 //
 - (void)handlePropertyChangeForQueue:(AudioQueueRef)inAQ
                           propertyID:(AudioQueuePropertyID)inID {
-  /* Sanity check to make sure we're on the expected thread */
-  assert([NSThread currentThread] == [NSThread mainThread]);
   /* We only asked for one property, so the audio queue had better damn well
      only tell us about this property */
   assert(inID == kAudioQueueProperty_IsRunning);
 
-  if (state_ == AS_WAITING_FOR_QUEUE_TO_START) {
-    [self setState:AS_PLAYING];
-  } else {
-    UInt32 running;
-    UInt32 output = sizeof(running);
-    err = AudioQueueGetProperty(audioQueue, kAudioQueueProperty_IsRunning,
-                                &running, &output);
-    if (!err && !running && !seeking) {
-      [self setState:AS_DONE];
+  UInt32 running;
+  UInt32 output = sizeof(running);
+  OSStatus status = AudioQueueGetProperty(inAQ, kAudioQueueProperty_IsRunning,
+                                          &running, &output);
+  if (status) return;
+
+  if (running) {
+    if (state_ == AS_WAITING_FOR_QUEUE_TO_START) {
+      [self setState:AS_PLAYING];
     }
+  /* Stopped at the end, or otherwise stopped by something other than seeking,
+     which tells us when it's done */
+  } else if (finishing || (!seeking && state_ == AS_PLAYING)) {
+    [self setState:AS_DONE];
   }
 }
 
 /**
- * @brief Closes the read stream and frees all queued data
+ * @brief Closes the read stream, on the I/O thread
  */
 - (void) closeReadStream {
-  if (waitingOnBuffer) waitingOnBuffer = FALSE;
-  queued_packet_t *cur = queued_head;
-  while (cur != NULL) {
-    queued_packet_t *tmp = cur->next;
-    free(cur);
-    cur = tmp;
-  }
-  queued_head = queued_tail = NULL;
+  /* Stopped before the end, as when skipping a song */
+  [traffic finishedWithError:nil];
+  traffic = nil;
 
   if (stream) {
+    [self finishThroughput];
+    /* Which may release this object, but whatever is closing the stream holds
+       on to it: the read stream callback or a block on the I/O thread */
+    CFReadStreamSetClient(stream, kCFStreamEventNone, NULL, NULL);
+    CFReadStreamUnscheduleFromRunLoop(stream, CFRunLoopGetCurrent(),
+                                      kCFRunLoopCommonModes);
     CFReadStreamClose(stream);
     CFRelease(stream);
     stream = nil;
   }
 }
 
+/**
+ * @brief Closes the read and file streams, on the I/O thread, after which
+ *        nothing more is read or handed over
+ */
+- (void) stopReading {
+  [timeout invalidate];
+  timeout = nil;
+
+  [self closeReadStream];
+  if (audioFileStream) {
+    AudioFileStreamClose(audioFileStream);
+    audioFileStream = nil;
+  }
+  free(readBuffer);
+  readBuffer = NULL;
+  free(headerBytes);
+  headerBytes = NULL;
+  free(streamHeader);
+  streamHeader = NULL;
+  ASSeekIndexFree(seekIndex);
+  seekIndex = NULL;
+}
+
+/**
+ * @brief Works out where to seek to and closes the read stream, on the I/O
+ *        thread, so a new one can be opened from there
+ */
+- (void) seekReadStreamToTime:(double)newSeekTime
+                      bitrate:(double)bitrate
+                     duration:(double)duration {
+  resuming = false;
+
+  /* Exactly where the packet starts if it was parsed already */
+  double packetDuration = asbd.mFramesPerPacket / asbd.mSampleRate;
+  UInt64 packet = packetDuration > 0 ? (UInt64) (newSeekTime / packetDuration)
+                                     : 0;
+  UInt64 offset;
+  if (packetDuration > 0 && seekIndex != NULL &&
+      ASSeekIndexFind(seekIndex, packet, &offset) && offset < fileLength) {
+    seekByteOffset = offset;
+    seekTime = packet * packetDuration;
+    nextPacket = packet;
+    indexing = true;
+  } else {
+    [self estimateSeekToTime:newSeekTime bitrate:bitrate duration:duration];
+    indexing = false;
+  }
+  parsedTime = seekTime;
+  [self closeReadStream];
+}
+
+/**
+ * @brief Works out where in the stream a time not parsed yet lies, from the
+ *        header's table of contents if there was one, or else the bit rate
+ */
+- (void) estimateSeekToTime:(double)newSeekTime
+                    bitrate:(double)bitrate
+                   duration:(double)duration {
+  if (streamHeader != NULL) {
+    UInt64 offset = ASStreamHeaderOffset(streamHeader, newSeekTime);
+    if (offset > 0) {
+      seekByteOffset = MIN(offset, fileLength - 2 * packetBufferSize);
+      seekTime = newSeekTime;
+      return;
+    }
+  }
+
+  //
+  // Calculate the byte offset for seeking
+  //
+  seekByteOffset = dataOffset +
+    (newSeekTime / duration) * (fileLength - dataOffset);
+
+  //
+  // Attempt to leave 1 useful packet at the end of the file (although in
+  // reality, this may still seek too far if the file has a long trailer).
+  //
+  if (seekByteOffset > fileLength - 2 * packetBufferSize) {
+    seekByteOffset = fileLength - 2 * packetBufferSize;
+  }
+
+  //
+  // Store the old time from the audio queue and the time that we're seeking
+  // to so that we'll know the correct time progress after seeking.
+  //
+  seekTime = newSeekTime;
+
+  //
+  // Attempt to align the seek with a packet boundary
+  //
+  double packetDuration = asbd.mFramesPerPacket / asbd.mSampleRate;
+  if (packetDuration > 0 && bitrate > 0) {
+    UInt32 ioFlags = 0;
+    SInt64 packetAlignedByteOffset;
+    SInt64 seekPacket = floor(newSeekTime / packetDuration);
+    OSStatus status = AudioFileStreamSeek(audioFileStream, seekPacket,
+                                          &packetAlignedByteOffset, &ioFlags);
+    if (!status && !(ioFlags & kAudioFileStreamSeekFlag_OffsetIsEstimated)) {
+      seekTime -= ((seekByteOffset - dataOffset) - packetAlignedByteOffset) * 8.0 / bitrate;
+      seekByteOffset = packetAlignedByteOffset + dataOffset;
+    }
+  }
+}
+
+/**
+ * @brief Drop every packet handed over and free every buffer, once the read
+ *        stream is closed and the audio queue stopped
+ */
+- (void) resetPlayback {
+  os_unfair_lock_lock(&fillLock);
+  for (UInt32 i = 0; inuse != NULL && i < bufferCnt; i++) {
+    inuse[i] = false;
+  }
+  buffersUsed     = 0;
+  fillBufferIndex = 0;
+  bytesFilled     = 0;
+  packetsFilled   = 0;
+  if (queued != NULL) {
+    ASPacketRingClear(queued);
+  }
+  producerDone = false;
+  throttled    = false;
+  flushed      = false;
+  finishing    = false;
+  os_unfair_lock_unlock(&fillLock);
+}
+
 - (NSString *)description {
   NSMutableString *description = [[NSString stringWithFormat:@"%@", [super description]] mutableCopy];
 
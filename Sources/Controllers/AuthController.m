@@ -2,6 +2,7 @@
 #import "PlaybackController.h"
 #import "StationsController.h"
 #import "Notifications.h"
+#import "TrafficRecorder.h"
 
 #define ROUGH_EMAIL_REGEX @"[^\\s@]+@[^\\s@]+\\.[^\\s@]+"
 
@@ -68,6 +69,7 @@
   [spinner setHidden:NO];
   [spinner startAnimation: sender];
 
+  [[TrafficRecorder sharedRecorder] beginSpan:@"login"];
   [[HMSAppDelegate pandora] authenticate:[username stringValue]
                                   password:[password stringValue]
                                    request:nil];
@@ -18,6 +18,7 @@
 #import "StationsController.h"
 #import "PreferencesController.h"
 #import "Notifications.h"
+#import "TrafficRecorder.h"
 
 BOOL playOnStart = YES;
 
@@ -419,6 +420,7 @@ BOOL playOnStart = YES;
   [HMSAppDelegate showLoader];
 
   if (playOnStart) {
+    [[TrafficRecorder sharedRecorder] beginSpan:@"station switch"];
     [station play];
   } else {
     playOnStart = YES;
@@ -502,6 +504,7 @@ BOOL playOnStart = YES;
     [[ImageLoader loader] cancel:[[playing playingSong] art]];
   }
 
+  [[TrafficRecorder sharedRecorder] beginSpan:@"skip"];
   [playing next];
 }
 
@@ -51,6 +51,7 @@
 #define QUALITY_HIGH 0
 #define QUALITY_MED  1
 #define QUALITY_LOW  2
+#define QUALITY_AUTO 3 /* picked for each song, see ASPlaylist */
 
 #define PROXY_SYSTEM 0
 #define PROXY_HTTP   1
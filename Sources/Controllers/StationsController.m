@@ -1,10 +1,12 @@
 #import "FileReader.h"
 #import "Pandora/Station.h"
+#import "Pandora/StationRegistry.h"
 #import "PlaybackController.h"
 #import "PreferencesController.h"
 #import "StationController.h"
 #import "StationsController.h"
 #import "Notifications.h"
+#import "TrafficRecorder.h"
 
 #define SORT_NAME 0
 #define SORT_DATE 1
@@ -119,17 +121,8 @@
 }
 
 - (int) stationIndex:(Station *)station {
-  unsigned i;
-  Station *cur;
-  NSArray *arr = [[self pandora] stations];
-  for (i = 0; i < [arr count]; i++) {
-    cur = arr[i];
-
-    if ([[station stationId] isEqual: [cur stationId]]) {
-      return i;
-    }
-  }
-  return -1;
+  NSUInteger index = [[[self pandora] stationRegistry] indexOfStation:station];
+  return index == NSNotFound ? -1 : (int) index;
 }
 
 /* Selects a station in the stations menu */
@@ -153,14 +146,7 @@
   if (lastPlayed == nil) {
     return NO;
   }
-  __block Station *last = nil;
-
-  for (Station *cur in [[self pandora] stations]) {
-    if ([lastPlayed isEqual: [cur stationId]]) {
-      last = cur;
-      break;
-    }
-  }
+  __block Station *last = [[[self pandora] stationRegistry] stationWithId:lastPlayed];
   if (last == nil) return NO;
 
   /* Restore station saved state on application startup */
@@ -363,6 +349,7 @@
 
 /* Called whenever stations finish loading from pandora */
 - (void) stationsLoaded: (NSNotification*) not {
+  [[TrafficRecorder sharedRecorder] endSpan:@"login"];
   [self sortStations];
   [stationsTable reloadData];
 
@@ -419,16 +406,8 @@
 }
 
 - (void) genreStationsLoaded: (NSNotification*) not {
-  NSArray *categories = [not userInfo][@"categories"];
-  NSMutableArray *mutableCategories = [[NSMutableArray alloc] initWithCapacity:[categories count]];
-  for (NSDictionary *category in categories) {
-    NSMutableDictionary *mutableCategory = [category mutableCopy];
-    mutableCategory[@"stations"] = [category[@"stations"] sortedArrayUsingComparator:^NSComparisonResult(id  _Nonnull s1, id  _Nonnull s2) {
-      return [s1[@"stationName"] localizedStandardCompare:s2[@"stationName"]];
-    }];
-    [mutableCategories addObject:[mutableCategory copy]];
-  }
-  genreResults = [mutableCategories copy];
+  /* Already sorted */
+  genreResults = [not userInfo][@"categories"];
   [genres reloadData];
   [genreSpinner stopAnimation:nil];
   [genreSpinner setHidden:YES];
@@ -11,11 +11,16 @@
 #import "AuthController.h"
 #import "HistoryController.h"
 #import "Integration/Keychain.h"
+#import "Pandora/PlaylistPrefetcher.h"
+#import "Pandora/RateLimiter.h"
+#import "Pandora/Station.h"
 #import "PlaybackController.h"
 #import "PreferencesController.h"
 #import "StationController.h"
 #import "StationsController.h"
 #import "Notifications.h"
+#import "TrafficRecorder.h"
+#import "URLConnectionPool.h"
 
 // strftime_l()
 #include <xlocale.h>
@@ -24,11 +29,24 @@
 #define DEBUG_MODE_TITLE_PREFIX @"🐞 "
 #define STATUS_BAR_MAX_WIDTH 200
 
+/* Launch arguments, such as -RecordTraffic ~/session.json, for recording the
+   session's traffic or answering it from an earlier recording, optionally
+   faster than recorded with -ReplaySpeed */
+#define RECORD_TRAFFIC @"RecordTraffic"
+#define REPLAY_TRAFFIC @"ReplayTraffic"
+#define REPLAY_SPEED @"ReplaySpeed"
+
+/* Seconds to wait when quitting for ratings which were still held back */
+#define RATING_FLUSH_WAIT 1.5
+
 @interface HermesAppDelegate ()
 
 @property (readonly) NSString *hermesLogFile;
 @property (readonly, nonatomic) FILE *hermesLogFileHandle;
 
+/* When the app launched, until the first song starts playing */
+@property (assign) CFAbsoluteTime launchTime;
+
 @end
 
 @implementation HermesAppDelegate
@@ -39,6 +57,7 @@
 - (id) init {
   if ((self = [super init])) {
     pandora = [[Pandora alloc] init];
+    [Station setRegistry:[pandora stationRegistry]];
     _debugMode = NO;
   }
   return self;
@@ -187,6 +206,7 @@
 }
 
 - (void)applicationDidFinishLaunching:(NSNotification *)aNotification {
+  self.launchTime = CFAbsoluteTimeGetCurrent();
   NSUInteger flags = ([NSEvent modifierFlags] & NSDeviceIndependentModifierFlagsMask);
   BOOL isOptionPressed = (flags == NSAlternateKeyMask);
   
@@ -195,6 +215,7 @@
     HMSLog("Starting in debug mode. Log file: %@", self.hermesLogFile);
     [self updateWindowTitle];
   }
+  [self startTrafficRecorder];
   
   window.restorable = YES;
   window.restorationClass = [self class];
@@ -203,8 +224,9 @@
 
   NSNotificationCenter *notificationCenter = [NSNotificationCenter defaultCenter];
 
+  /* Only this Pandora's, not those the unit tests make of their own */
   [notificationCenter addObserver:self selector:@selector(handlePandoraError:)
-                             name:PandoraDidErrorNotification object:nil];
+                             name:PandoraDidErrorNotification object:pandora];
 
   [notificationCenter addObserver:self selector:@selector(handleStreamError:)
                              name:ASStreamError object:nil];
@@ -230,6 +252,7 @@
     [auth show];
   } else {
     [self showLoader];
+    [[TrafficRecorder sharedRecorder] beginSpan:@"login"];
     [pandora authenticate:[self getSavedUsername]
                  password:[self getSavedPassword]
                   request:nil];
@@ -268,9 +291,38 @@
 }
 
 - (void) applicationWillTerminate: (NSNotification *)aNotification {
+  if ([pandora sendHeldRatings] > 0) {
+    /* Give the ratings a moment to reach Pandora before the process goes */
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:RATING_FLUSH_WAIT]];
+  }
   [playback saveState];
   [playback stop];
   [history saveSongs];
+  if (self.debugMode) {
+    HMSLog(@"Connection pool: %@", [[URLConnectionPool sharedPool] statistics]);
+    HMSLog(@"Pandora requests saved: %@", [pandora savedCalls]);
+    HMSLog(@"Playlist prefetching: %@", [PlaylistPrefetcher statistics]);
+    HMSLog(@"Song transitions: %@", [ASPlaylist transitionStatistics]);
+    HMSLog(@"Song qualities: %@", [ASPlaylist qualityStatistics]);
+    HMSLog(@"Pandora rate limits: %@", [[pandora rateLimiter] state]);
+    HMSLog(@"Pandora queue waits: %@", [pandora queueStatistics]);
+    HMSLog(@"Searching: %@", [pandora searchStatistics]);
+  }
+  [[TrafficRecorder sharedRecorder] stop];
+}
+
+- (void) startTrafficRecorder {
+  NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+  TrafficRecorder *recorder = [TrafficRecorder sharedRecorder];
+  NSString *path;
+  if ((path = [defaults stringForKey:REPLAY_TRAFFIC]) != nil) {
+    double speed = [defaults objectForKey:REPLAY_SPEED] != nil ?
+                   [defaults doubleForKey:REPLAY_SPEED] : 1;
+    [recorder startReplayingFrom:path speed:speed];
+  } else if ((path = [defaults stringForKey:RECORD_TRAFFIC]) != nil) {
+    [recorder startRecordingTo:path];
+  }
+  [recorder beginSpan:@"first audio"];
 }
 
 #pragma mark - NSWindow notification
@@ -664,6 +716,22 @@
   [self updateWindowTitle];
   [self updateStatusItem:nil];
 
+  if (streamIsPlaying) {
+    TrafficRecorder *recorder = [TrafficRecorder sharedRecorder];
+    [recorder endSpan:@"first audio"];
+    [recorder endSpan:@"station switch"];
+    [recorder endSpan:@"skip"];
+  }
+
+  if (streamIsPlaying && self.launchTime != 0) {
+    if (self.debugMode) {
+      HMSLog(@"First audio %.0f ms after launch, %@",
+             (CFAbsoluteTimeGetCurrent() - self.launchTime) * 1000,
+             pandora.resumedSession ? @"resuming the last session" : @"logging in");
+    }
+    self.launchTime = 0;
+  }
+
   if ([MPNowPlayingInfoCenter class]) {
     MPNowPlayingInfoCenter *nowPlayingInfoCenter = [MPNowPlayingInfoCenter defaultCenter];
     if (streamIsPlaying) {
@@ -766,13 +834,22 @@
   // From the unofficial Pandora API documentation ( http://6xq.net/playground/pandora-apidoc/json/errorcodes/ ):
   // code 0 == INTERNAL, "It can denote that your account has been temporarily blocked due to having too frequent station.getPlaylist calls."
   // code 1039 == PLAYLIST_EXCEEDED, "Returned on excessive calls to station.getPlaylist. Error self clears (probably 1 hour)."
-  if (code != 0 && code != 1039) {
-    autoRetry = [NSTimer scheduledTimerWithTimeInterval:20
-                                                 target:self
-                                               selector:@selector(retry:)
-                                               userInfo:nil
-                                                repeats:NO];
+  // Retrying those only makes the block last longer, so they wait for the
+  // user. Network errors are retried once the kind of request which failed
+  // has backed off, which grows with every failure in a row.
+  if (nscode != nil && (code == 0 || code == PLAYLIST_EXCEEDED)) {
+    return;
+  }
+  NSTimeInterval delay = 20;
+  if (nscode == nil) {
+    delay = [pandora retryDelayForRequest:lastRequest];
   }
+  NSLogd(@"Retrying in %.1fs", delay);
+  autoRetry = [NSTimer scheduledTimerWithTimeInterval:delay
+                                               target:self
+                                             selector:@selector(retry:)
+                                             userInfo:nil
+                                              repeats:NO];
 }
 
 - (void) handlePandoraLoggedOut: (NSNotification*) notification {
@@ -0,0 +1,105 @@
+/**
+ * @file LoopbackHTTPServer.h
+ * @brief A minimal HTTP/1.1 server on 127.0.0.1
+ *
+ * Stands in for remote servers when measuring the networking code in debug
+ * mode. It keeps connections alive unless asked not to, answers every request
+ * with whatever the handler returns, and counts the connections it accepts so
+ * that reuse can be checked from the server's side.
+ */
+
+/**
+ * @brief The response to a request, written a piece at a time
+ */
+@interface LoopbackHTTPResponse : NSObject
+
+/**
+ * @brief The header fields of the request being answered
+ */
+@property (readonly) NSDictionary *requestHeaders;
+
+/**
+ * @brief Send the head of a 200 response. Must be called before any of the
+ *        body is written.
+ *
+ * @param length the Content-Length of the body
+ * @param type the Content-Type of the body
+ */
+- (void) startWithLength:(NSUInteger)length type:(NSString*)type;
+
+/**
+ * @brief Send the head of a 206 response to a Range request. Must be called
+ *        before any of the body is written.
+ *
+ * @param range the part of the resource which the body is
+ * @param total the length of the whole resource
+ * @param type the Content-Type of the body
+ */
+- (void) startWithRange:(NSRange)range total:(NSUInteger)total
+                   type:(NSString*)type;
+
+/**
+ * @brief Write the next piece of the body, at the server's bytesPerSecond
+ *
+ * @return NO if the client has closed the connection
+ */
+- (BOOL) writeData:(NSData*)data;
+
+@end
+
+typedef NSData*(^LoopbackHTTPHandler)(NSString *method, NSString *path,
+                                      NSData *body);
+typedef void(^LoopbackHTTPStreamingHandler)(NSString *method, NSString *path,
+                                            NSData *body,
+                                            LoopbackHTTPResponse *response);
+
+@interface LoopbackHTTPServer : NSObject
+
+/**
+ * @brief The port the server is listening on, once started
+ */
+@property (readonly) uint16_t port;
+
+/**
+ * @brief How many connections have been accepted so far
+ */
+@property (readonly) NSUInteger connectionsAccepted;
+
+/**
+ * @brief How fast responses are written, in bytes per second, or 0 (the
+ *        default) to write each at once
+ */
+@property double bytesPerSecond;
+
+/**
+ * @brief Create a server
+ *
+ * @param handler invoked for each request with the path and query of its
+ *        URL, returning the body of a 200 response. Each connection is served
+ *        on a queue of its own, so the handler may be invoked concurrently.
+ */
+- (id) initWithHandler:(LoopbackHTTPHandler)handler;
+
+/**
+ * @brief Create a server whose handler writes each response itself, for
+ *        responses which should arrive at a pace of their own
+ *
+ * @param handler invoked like the handler of initWithHandler:, which starts
+ *        the response and writes all of its body before returning. A response
+ *        which wasn't started is sent empty.
+ */
+- (id) initWithStreamingHandler:(LoopbackHTTPStreamingHandler)handler;
+
+/**
+ * @brief Start listening on an unused port
+ *
+ * @return YES if the server is listening
+ */
+- (BOOL) start;
+
+/**
+ * @brief Stop listening and close all connections
+ */
+- (void) stop;
+
+@end
@@ -0,0 +1,262 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#import "LoopbackHTTPServer.h"
+
+@interface LoopbackHTTPResponse ()
+- (id) initWithSocket:(int)socket rate:(double)bytesPerSecond
+            keepAlive:(BOOL)keep headers:(NSDictionary*)headers;
+- (void) startWithStatus:(NSString*)status fields:(NSString*)fields
+                  length:(NSUInteger)length type:(NSString*)type;
+- (void) finish;
+@end
+
+@implementation LoopbackHTTPResponse {
+  int fd;
+  double rate;
+  BOOL keepAlive;
+  /* The head, until it can go out with the first piece of the body */
+  NSMutableData *pending;
+  BOOL started;
+}
+
+- (id) initWithSocket:(int)socket rate:(double)bytesPerSecond
+            keepAlive:(BOOL)keep headers:(NSDictionary*)headers {
+  if (!(self = [super init])) return nil;
+  fd = socket;
+  rate = bytesPerSecond;
+  keepAlive = keep;
+  _requestHeaders = headers;
+  return self;
+}
+
+- (void) startWithLength:(NSUInteger)length type:(NSString*)type {
+  [self startWithStatus:@"200 OK" fields:@"" length:length type:type];
+}
+
+- (void) startWithRange:(NSRange)range total:(NSUInteger)total
+                   type:(NSString*)type {
+  NSString *fields =
+      [NSString stringWithFormat:@"Content-Range: bytes %lu-%lu/%lu\r\n",
+                                 (unsigned long) range.location,
+                                 (unsigned long) NSMaxRange(range) - 1,
+                                 (unsigned long) total];
+  [self startWithStatus:@"206 Partial Content" fields:fields
+                 length:range.length type:type];
+}
+
+- (void) startWithStatus:(NSString*)status fields:(NSString*)fields
+                  length:(NSUInteger)length type:(NSString*)type {
+  NSString *head = [NSString stringWithFormat:
+                    @"HTTP/1.1 %@\r\n"
+                    @"%@"
+                    @"Content-Type: %@\r\n"
+                    @"Content-Length: %lu\r\n"
+                    @"Connection: %@\r\n\r\n",
+                    status, fields, type, (unsigned long) length,
+                    keepAlive ? @"keep-alive" : @"close"];
+  pending = [[head dataUsingEncoding:NSASCIIStringEncoding] mutableCopy];
+  started = YES;
+}
+
+- (BOOL) writeData:(NSData*)data {
+  NSData *out = data;
+  if (pending != nil) {
+    [pending appendData:data];
+    out = pending;
+    pending = nil;
+  }
+  const char *bytes = [out bytes];
+  size_t left = [out length];
+  /* Paced as a twentieth of a second's worth at a time */
+  size_t chunk = rate > 0 ? MAX((size_t) (rate / 20), 1) : left;
+  while (left > 0) {
+    ssize_t written = write(fd, bytes, MIN(left, chunk));
+    if (written <= 0) return NO;
+    bytes += written;
+    left -= (size_t) written;
+    if (rate > 0 && left > 0) {
+      usleep((useconds_t) (written / rate * 1000000));
+    }
+  }
+  return YES;
+}
+
+/**
+ * @brief Send whatever the handler left unsent
+ */
+- (void) finish {
+  if (!started) {
+    [self startWithLength:0 type:@"application/json"];
+  }
+  if (pending != nil) {
+    [self writeData:[NSData data]];
+  }
+}
+
+@end
+
+@implementation LoopbackHTTPServer {
+  LoopbackHTTPStreamingHandler handler;
+  dispatch_queue_t queue;
+  dispatch_source_t listener;
+  NSMutableSet *clients;
+}
+
+- (id) initWithHandler:(LoopbackHTTPHandler)aHandler {
+  return [self initWithStreamingHandler:^(NSString *method, NSString *path,
+                                          NSData *body,
+                                          LoopbackHTTPResponse *response) {
+    NSData *data = aHandler(method, path, body);
+    [response startWithLength:[data length] type:@"application/json"];
+    [response writeData:data];
+  }];
+}
+
+- (id) initWithStreamingHandler:(LoopbackHTTPStreamingHandler)aHandler {
+  if (!(self = [super init])) return nil;
+  handler = [aHandler copy];
+  queue = dispatch_queue_create("hermes.loopback-http", DISPATCH_QUEUE_SERIAL);
+  clients = [NSMutableSet set];
+  return self;
+}
+
+- (void) dealloc {
+  [self stop];
+}
+
+- (BOOL) start {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return NO;
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_len = sizeof(addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  socklen_t addrlen = sizeof(addr);
+  if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 ||
+      listen(fd, 16) != 0 ||
+      getsockname(fd, (struct sockaddr*) &addr, &addrlen) != 0) {
+    close(fd);
+    return NO;
+  }
+  _port = ntohs(addr.sin_port);
+
+  listener = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, (uintptr_t) fd,
+                                    0, queue);
+  __weak LoopbackHTTPServer *weakSelf = self;
+  dispatch_source_set_event_handler(listener, ^{
+    int client = accept(fd, NULL, NULL);
+    LoopbackHTTPServer *server = weakSelf;
+    if (client >= 0 && server == nil) {
+      close(client);
+    } else if (client >= 0) {
+      [server serveClient:client];
+    }
+  });
+  dispatch_source_set_cancel_handler(listener, ^{
+    close(fd);
+  });
+  dispatch_resume(listener);
+  return YES;
+}
+
+- (void) stop {
+  if (listener == nil) return;
+  dispatch_source_cancel(listener);
+  listener = nil;
+  NSSet *open;
+  @synchronized(clients) {
+    open = [clients copy];
+    [clients removeAllObjects];
+  }
+  for (dispatch_source_t client in open) {
+    dispatch_source_cancel(client);
+  }
+}
+
+/**
+ * @brief Read requests from a connection until it's closed, answering each
+ *        as soon as it has all arrived
+ */
+- (void) serveClient:(int)fd {
+  @synchronized(self) {
+    _connectionsAccepted++;
+  }
+  int nosigpipe = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
+
+  /* A queue per connection, so that a slow response only holds up its own */
+  dispatch_queue_t clientQueue =
+      dispatch_queue_create("hermes.loopback-http.client", DISPATCH_QUEUE_SERIAL);
+  dispatch_source_t source =
+      dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, (uintptr_t) fd, 0, clientQueue);
+  __block CFHTTPMessageRef request = CFHTTPMessageCreateEmpty(NULL, TRUE);
+  __weak dispatch_source_t weakSource = source;
+  LoopbackHTTPStreamingHandler answer = handler;
+  __weak LoopbackHTTPServer *weakSelf = self;
+  NSMutableSet *open = clients;
+
+  dispatch_source_set_event_handler(source, ^{
+    UInt8 buf[4096];
+    ssize_t len = read(fd, buf, sizeof(buf));
+    if (len <= 0) {
+      dispatch_source_cancel(weakSource);
+      return;
+    }
+    CFHTTPMessageAppendBytes(request, buf, len);
+    if (!CFHTTPMessageIsHeaderComplete(request)) return;
+
+    NSString *method = CFBridgingRelease(CFHTTPMessageCopyRequestMethod(request));
+    NSURL *url = CFBridgingRelease(CFHTTPMessageCopyRequestURL(request));
+    NSData *body = CFBridgingRelease(CFHTTPMessageCopyBody(request));
+    NSString *length = CFBridgingRelease(
+        CFHTTPMessageCopyHeaderFieldValue(request, CFSTR("Content-Length")));
+    if ((NSInteger) [body length] < [length integerValue]) return;
+    NSString *connection = CFBridgingRelease(
+        CFHTTPMessageCopyHeaderFieldValue(request, CFSTR("Connection")));
+    BOOL keepAlive = connection == nil ||
+                     [connection caseInsensitiveCompare:@"close"] != NSOrderedSame;
+
+    NSString *path = [url path];
+    if ([url query] != nil) {
+      path = [NSString stringWithFormat:@"%@?%@", path, [url query]];
+    }
+    NSDictionary *headers =
+        CFBridgingRelease(CFHTTPMessageCopyAllHeaderFields(request));
+    LoopbackHTTPResponse *response =
+        [[LoopbackHTTPResponse alloc] initWithSocket:fd
+                                                rate:weakSelf.bytesPerSecond
+                                           keepAlive:keepAlive
+                                             headers:headers];
+    answer(method, path, body, response);
+    [response finish];
+
+    CFRelease(request);
+    request = CFHTTPMessageCreateEmpty(NULL, TRUE);
+    if (!keepAlive) {
+      dispatch_source_cancel(weakSource);
+    }
+  });
+  dispatch_source_set_cancel_handler(source, ^{
+    close(fd);
+    CFRelease(request);
+    dispatch_source_t closed = weakSource;
+    if (closed != nil) {
+      @synchronized(open) {
+        [open removeObject:closed];
+      }
+    }
+  });
+
+  @synchronized(clients) {
+    [clients addObject:source];
+  }
+  dispatch_resume(source);
+}
+
+@end
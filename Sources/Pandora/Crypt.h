@@ -9,6 +9,64 @@
 #ifndef CRYPT_H
 #define CRYPT_H
 
+/**
+ * @brief A precomputed Blowfish key schedule
+ *
+ * Computing the subkeys for a key costs far more than encrypting a typical
+ * request body, so this is done once per key. Instances are immutable after
+ * creation and may be shared between any number of requests.
+ */
+@interface PandoraCipherKey : NSObject
+
+- (instancetype)initWithKey:(NSString *)key;
+
+@end
+
+/**
+ * @brief Get the shared key schedule for a key
+ *
+ * Schedules are computed on first use and cached for the lifetime of the
+ * process; Pandora only ever uses a handful of keys.
+ *
+ * @param key the encryption or decryption key
+ * @return the key schedule for the key, or nil if key is nil
+ */
+PandoraCipherKey* PandoraCipherKeyForString(NSString *key);
+
+/**
+ * @brief Encrypt some data for Pandora
+ *
+ * @param data the data to encrypt
+ * @param encryptionKey the key schedule of the encryption key to use
+ * @return the encrypted data, hex encoded, or nil if there's no key
+ */
+NSData* PandoraEncryptDataWithKey(NSData *data, PandoraCipherKey *encryptionKey);
+
+/**
+ * @brief Encrypt some bytes for Pandora
+ *
+ * Only the returned data is allocated, so this suits callers which have
+ * built the plaintext in a buffer of their own.
+ *
+ * @param data the bytes to encrypt
+ * @param len the number of bytes to encrypt
+ * @param encryptionKey the key schedule of the encryption key to use
+ * @return the encrypted data, hex encoded, or nil if there's no key
+ */
+NSData* PandoraEncryptBytesWithKey(const void *data, NSUInteger len,
+                                   PandoraCipherKey *encryptionKey);
+
+/**
+ * @brief Decrypt some data received from Pandora
+ *
+ * @param string the hex-encoded string to be decrypted.
+ * @param decryptionKey the key schedule of the decryption key to use
+ * @return the decrypted data, empty for an empty string, or nil if the
+ *         string is not valid hex (including any that isn't ASCII) or
+ *         there's no key
+ */
+NSData* PandoraDecryptStringWithKey(NSString *string, PandoraCipherKey *decryptionKey);
+
 /**
  * @brief Encrypt some data for Pandora
  *
@@ -23,7 +81,8 @@ NSData* PandoraEncryptData(NSData* string, NSString *encryptionKey);
  *
  * @param string the hex-encoded string to be decrypted.
  * @param decryptionKey the decryption key to use
- * @return the decrypted data
+ * @return the decrypted data, empty for an empty string, or nil if the
+ *         string is not valid hex (including any that isn't ASCII)
  */
 NSData* PandoraDecryptString(NSString* string, NSString *decryptionKey);
 
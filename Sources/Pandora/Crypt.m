@@ -1,62 +1,114 @@
 #include "blowfish/blowfish.h"
 
 #import "Crypt.h"
+#import "HexCodec.h"
 
-/* Conversion from hex to int and int to hex */
-static char i2h[16] = "0123456789abcdef";
-static char h2i[256] = {
-  ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4, ['5'] = 5, ['6'] = 6,
-  ['7'] = 7, ['8'] = 8, ['9'] = 9, ['a'] = 10, ['b'] = 11, ['c'] = 12,
-  ['d'] = 13, ['e'] = 14, ['f'] = 15
-};
+@implementation PandoraCipherKey {
+@public
+  struct blf_ctx schedule;
+}
 
-static void appendByte(unsigned char byte, void *_data) {
-  NSMutableData *data = (__bridge NSMutableData *)_data;
-  [data appendBytes:&byte length:1];
+- (instancetype)initWithKey:(NSString *)key {
+  if (!(self = [super init])) { return nil; }
+  const char *bytes = key.UTF8String;
+  Blowfish_initialize(&schedule, (const unsigned char *)bytes, strlen(bytes));
+  return self;
 }
 
-static void appendHex(unsigned char byte, void *_data) {
-  NSMutableData *data = (__bridge NSMutableData *)_data;
-  char bytes[2];
-  bytes[1] = i2h[byte % 16];
-  bytes[0] = i2h[byte / 16];
-  [data appendBytes:bytes length:2];
+@end
+
+PandoraCipherKey* PandoraCipherKeyForString(NSString *key) {
+  if (key == nil) {
+    return nil;
+  }
+
+  static NSMutableDictionary *schedules;
+  static dispatch_once_t onceToken;
+  dispatch_once(&onceToken, ^{
+    schedules = [NSMutableDictionary dictionary];
+  });
+
+  @synchronized(schedules) {
+    PandoraCipherKey *cipherKey = schedules[key];
+    if (cipherKey == nil) {
+      cipherKey = [[PandoraCipherKey alloc] initWithKey:key];
+      schedules[key] = cipherKey;
+    }
+    return cipherKey;
+  }
 }
 
-NSData* PandoraDecryptString(NSString *string, NSString *decryptionKey) {
-  struct blf_ecb_ctx ctx;
-  NSMutableData *mut = [[NSMutableData alloc] init];
-  const char *key = decryptionKey.UTF8String;
-  
-  Blowfish_ecb_start(&ctx, FALSE, (const unsigned char *)key,
-                     strlen(key), appendByte,
-                     (__bridge void *)mut);
-
-  const char *bytes = [string cStringUsingEncoding:NSASCIIStringEncoding];
+/* Bytes of plaintext handled per step when encrypting or decrypting, so the
+   intermediate binary ciphertext stays in the L1 cache between the cipher and
+   the hex codec. Must be a multiple of the 8-byte Blowfish block size. */
+#define CRYPT_CHUNK 1024
+
+NSData* PandoraDecryptStringWithKey(NSString *string, PandoraCipherKey *decryptionKey) {
+  if (decryptionKey == nil) {
+    return nil;
+  }
+  /* Avoid copying the string when it's already stored as ASCII */
+  const char *bytes = CFStringGetCStringPtr((__bridge CFStringRef) string,
+                                            kCFStringEncodingASCII);
+  if (bytes == NULL) {
+    bytes = [string cStringUsingEncoding:NSASCIIStringEncoding];
+  }
+  /* Anything but ASCII is no more hex than a bad digit is */
+  if (bytes == NULL) {
+    NSLogd(@"Encrypted data isn't ASCII");
+    return nil;
+  }
   NSUInteger len = [string lengthOfBytesUsingEncoding:NSASCIIStringEncoding];
-  for (NSUInteger i = 0; i < len; i += 2) {
-    Blowfish_ecb_feed(&ctx, h2i[(int) bytes[i]] * 16 + h2i[(int) bytes[i + 1]]);
+  if (len == 0) {
+    return [NSData data];
   }
-  Blowfish_ecb_stop(&ctx);
 
-  return mut;
+  NSUInteger outlen = BLOWFISH_ECB_LENGTH(len / 2);
+  unsigned char *out = malloc(outlen);
+  for (NSUInteger i = 0; i < len; i += 2 * CRYPT_CHUNK) {
+    NSUInteger n = MIN(2 * CRYPT_CHUNK, len - i);
+    size_t decoded = HexCodecDecode(bytes + i, n, out + i / 2);
+    if (decoded != n) {
+      NSLogd(@"Invalid hex digit at offset %lu of encrypted data", (unsigned long)(i + decoded));
+      free(out);
+      return nil;
+    }
+    Blowfish_ecb_decrypt(&decryptionKey->schedule, out + i / 2, n / 2, out + i / 2);
+  }
+  return [NSData dataWithBytesNoCopy:out length:outlen freeWhenDone:YES];
 }
 
-NSData* PandoraEncryptData(NSData *data, NSString *encryptionKey) {
-  struct blf_ecb_ctx ctx;
-  NSMutableData *mut = [[NSMutableData alloc] init];
-  const char *key = encryptionKey.UTF8String;
-
-  Blowfish_ecb_start(&ctx, TRUE, (const unsigned char *)key,
-                     strlen(key), appendHex,
-                     (__bridge void*)mut);
+NSData* PandoraEncryptBytesWithKey(const void *data, NSUInteger len,
+                                   PandoraCipherKey *encryptionKey) {
+  if (encryptionKey == nil) {
+    return nil;
+  }
+  if (len == 0) {
+    return [NSData data];
+  }
 
-  const char *bytes = [data bytes];
-  NSUInteger len = [data length];
-  for (NSUInteger i = 0; i < len; i++) {
-    Blowfish_ecb_feed(&ctx, bytes[i]);
+  const unsigned char *bytes = data;
+  unsigned char chunk[CRYPT_CHUNK];
+  NSUInteger outlen = 2 * BLOWFISH_ECB_LENGTH(len);
+  char *out = malloc(outlen);
+  for (NSUInteger i = 0; i < len; i += CRYPT_CHUNK) {
+    NSUInteger n = MIN(CRYPT_CHUNK, len - i);
+    Blowfish_ecb_encrypt(&encryptionKey->schedule, bytes + i, n, chunk);
+    HexCodecEncode(chunk, BLOWFISH_ECB_LENGTH(n), out + 2 * i);
   }
-  Blowfish_ecb_stop(&ctx);
+  return [NSData dataWithBytesNoCopy:out length:outlen freeWhenDone:YES];
+}
 
-  return mut;
+NSData* PandoraEncryptDataWithKey(NSData *data, PandoraCipherKey *encryptionKey) {
+  return PandoraEncryptBytesWithKey([data bytes], [data length], encryptionKey);
+}
+
+NSData* PandoraDecryptString(NSString *string, NSString *decryptionKey) {
+  return PandoraDecryptStringWithKey(string,
+                                     PandoraCipherKeyForString(decryptionKey));
+}
+
+NSData* PandoraEncryptData(NSData *data, NSString *encryptionKey) {
+  return PandoraEncryptDataWithKey(data,
+                                   PandoraCipherKeyForString(encryptionKey));
 }
@@ -0,0 +1,278 @@
+/**
+ * @file Pandora/HexCodec.c
+ * @brief Implementation of the hex codec
+ *
+ * Every variant handles as many whole vectors as it can and leaves the rest
+ * to the scalar code. When decoding, a vector containing an invalid digit is
+ * also left to the scalar code, which then finds its exact offset.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "HexCodec.h"
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HEXCODEC_X86
+#elif defined(__aarch64__) || defined(__arm64__)
+#include <arm_neon.h>
+#define HEXCODEC_NEON
+#endif
+
+typedef size_t (*HexEncodeKernel)(const unsigned char *in, size_t len,
+                                  char *out);
+typedef size_t (*HexDecodeKernel)(const char *in, size_t len,
+                                  unsigned char *out);
+
+static const char i2h[16] = "0123456789abcdef";
+
+/* The value of each hex digit plus one, so that anything else is 0 */
+static const unsigned char h2i[256] = {
+  ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6,
+  ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+  ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+  ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+
+/* --- Scalar --- */
+
+static void encode_scalar(const unsigned char *in, size_t len, char *out) {
+  for (size_t i = 0; i < len; i++) {
+    out[2 * i] = i2h[in[i] >> 4];
+    out[2 * i + 1] = i2h[in[i] & 0xf];
+  }
+}
+
+static size_t decode_scalar(const char *in, size_t len, unsigned char *out) {
+  size_t i;
+  for (i = 0; i + 1 < len; i += 2) {
+    unsigned char hi = h2i[(unsigned char) in[i]];
+    unsigned char lo = h2i[(unsigned char) in[i + 1]];
+    if (hi == 0) return i;
+    if (lo == 0) return i + 1;
+    out[i / 2] = (unsigned char) ((hi - 1) << 4 | (lo - 1));
+  }
+  return i;
+}
+
+/* --- SSE2 and AVX2 --- */
+
+#ifdef HEXCODEC_X86
+
+static inline __m128i nibbles_to_hex_sse2(__m128i n) {
+  __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)),
+                                  _mm_set1_epi8('a' - '0' - 10));
+  return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), letters);
+}
+
+static size_t encode_sse2(const unsigned char *in, size_t len, char *out) {
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  size_t i;
+  for (i = 0; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+    __m128i hi = nibbles_to_hex_sse2(_mm_and_si128(_mm_srli_epi16(v, 4), mask));
+    __m128i lo = nibbles_to_hex_sse2(_mm_and_si128(v, mask));
+    _mm_storeu_si128((__m128i *) (out + 2 * i), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *) (out + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+  }
+  return i;
+}
+
+/* Values of the digits in c, clearing bytes of valid for non-digits. SSE2
+ * has no unsigned byte compare, so x < n is tested as min(x, n - 1) == x. */
+static inline __m128i hex_values_sse2(__m128i c, __m128i *valid) {
+  __m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+  __m128i dv = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+  __m128i l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)),
+                           _mm_set1_epi8('a'));
+  __m128i lv = _mm_cmpeq_epi8(_mm_min_epu8(l, _mm_set1_epi8(5)), l);
+  *valid = _mm_and_si128(*valid, _mm_or_si128(dv, lv));
+  return _mm_or_si128(_mm_and_si128(dv, d),
+                      _mm_and_si128(lv, _mm_add_epi8(l, _mm_set1_epi8(10))));
+}
+
+/* Join the pairs of digit values in each 16-bit lane into one byte */
+static inline __m128i join_pairs_sse2(__m128i v) {
+  return _mm_or_si128(_mm_and_si128(_mm_slli_epi16(v, 4), _mm_set1_epi16(0xf0)),
+                      _mm_srli_epi16(v, 8));
+}
+
+static size_t decode_sse2(const char *in, size_t len, unsigned char *out) {
+  size_t i;
+  for (i = 0; i + 32 <= len; i += 32) {
+    __m128i valid = _mm_set1_epi8(-1);
+    __m128i v0 = hex_values_sse2(_mm_loadu_si128((const __m128i *) (in + i)), &valid);
+    __m128i v1 = hex_values_sse2(_mm_loadu_si128((const __m128i *) (in + i + 16)), &valid);
+    if (_mm_movemask_epi8(valid) != 0xffff) break;
+    _mm_storeu_si128((__m128i *) (out + i / 2),
+                     _mm_packus_epi16(join_pairs_sse2(v0), join_pairs_sse2(v1)));
+  }
+  return i;
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m256i nibbles_to_hex_avx2(__m256i n) {
+  __m256i letters = _mm256_and_si256(_mm256_cmpgt_epi8(n, _mm256_set1_epi8(9)),
+                                     _mm256_set1_epi8('a' - '0' - 10));
+  return _mm256_add_epi8(_mm256_add_epi8(n, _mm256_set1_epi8('0')), letters);
+}
+
+static AVX2 size_t encode_avx2(const unsigned char *in, size_t len, char *out) {
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+  size_t i;
+  for (i = 0; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (in + i));
+    __m256i hi = nibbles_to_hex_avx2(_mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+    __m256i lo = nibbles_to_hex_avx2(_mm256_and_si256(v, mask));
+    /* Unpacking works within each 128-bit half, so put the halves back in
+     * order before storing */
+    __m256i a = _mm256_unpacklo_epi8(hi, lo);
+    __m256i b = _mm256_unpackhi_epi8(hi, lo);
+    _mm256_storeu_si256((__m256i *) (out + 2 * i),
+                        _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256((__m256i *) (out + 2 * i + 32),
+                        _mm256_permute2x128_si256(a, b, 0x31));
+  }
+  return i;
+}
+
+static inline AVX2 __m256i hex_values_avx2(__m256i c, __m256i *valid) {
+  __m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+  __m256i dv = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+  __m256i l = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)),
+                              _mm256_set1_epi8('a'));
+  __m256i lv = _mm256_cmpeq_epi8(_mm256_min_epu8(l, _mm256_set1_epi8(5)), l);
+  *valid = _mm256_and_si256(*valid, _mm256_or_si256(dv, lv));
+  return _mm256_or_si256(_mm256_and_si256(dv, d),
+                         _mm256_and_si256(lv, _mm256_add_epi8(l, _mm256_set1_epi8(10))));
+}
+
+static inline AVX2 __m256i join_pairs_avx2(__m256i v) {
+  return _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(v, 4),
+                                          _mm256_set1_epi16(0xf0)),
+                         _mm256_srli_epi16(v, 8));
+}
+
+static AVX2 size_t decode_avx2(const char *in, size_t len, unsigned char *out) {
+  size_t i;
+  for (i = 0; i + 64 <= len; i += 64) {
+    __m256i valid = _mm256_set1_epi8(-1);
+    __m256i v0 = hex_values_avx2(_mm256_loadu_si256((const __m256i *) (in + i)), &valid);
+    __m256i v1 = hex_values_avx2(_mm256_loadu_si256((const __m256i *) (in + i + 32)), &valid);
+    if (_mm256_movemask_epi8(valid) != -1) break;
+    /* Packing also works within each 128-bit half (see above) */
+    __m256i packed = _mm256_packus_epi16(join_pairs_avx2(v0), join_pairs_avx2(v1));
+    _mm256_storeu_si256((__m256i *) (out + i / 2),
+                        _mm256_permute4x64_epi64(packed, 0xd8));
+  }
+  return i;
+}
+
+static int cpu_has_avx2(void) {
+  unsigned int eax, ebx, ecx, edx, xcr0, xcr0_hi;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return 0;
+  if (!(ecx & bit_AVX) || !(ecx & bit_OSXSAVE)) return 0;
+  /* The OS must also preserve the YMM registers across context switches */
+  __asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0_hi) : "c"(0));
+  (void) xcr0_hi;
+  if ((xcr0 & 6) != 6) return 0;
+  if (__get_cpuid_max(0, NULL) < 7) return 0;
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  return (ebx & bit_AVX2) != 0;
+}
+
+#endif /* HEXCODEC_X86 */
+
+/* --- NEON --- */
+
+#ifdef HEXCODEC_NEON
+
+static size_t encode_neon(const unsigned char *in, size_t len, char *out) {
+  const uint8x16_t digits = vld1q_u8((const uint8_t *) i2h);
+  const uint8x16_t mask = vdupq_n_u8(0x0f);
+  size_t i;
+  for (i = 0; i + 16 <= len; i += 16) {
+    uint8x16_t v = vld1q_u8(in + i);
+    uint8x16x2_t hex;
+    hex.val[0] = vqtbl1q_u8(digits, vshrq_n_u8(v, 4));
+    hex.val[1] = vqtbl1q_u8(digits, vandq_u8(v, mask));
+    vst2q_u8((uint8_t *) (out + 2 * i), hex);
+  }
+  return i;
+}
+
+static inline uint8x16_t hex_values_neon(uint8x16_t c, uint8x16_t *valid) {
+  uint8x16_t d = vsubq_u8(c, vdupq_n_u8('0'));
+  uint8x16_t dv = vcltq_u8(d, vdupq_n_u8(10));
+  uint8x16_t l = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+  uint8x16_t lv = vcltq_u8(l, vdupq_n_u8(6));
+  *valid = vandq_u8(*valid, vorrq_u8(dv, lv));
+  return vorrq_u8(vandq_u8(dv, d), vandq_u8(lv, vaddq_u8(l, vdupq_n_u8(10))));
+}
+
+static size_t decode_neon(const char *in, size_t len, unsigned char *out) {
+  size_t i;
+  for (i = 0; i + 32 <= len; i += 32) {
+    /* Loading pairs splits the high and the low digits of each byte */
+    uint8x16x2_t c = vld2q_u8((const uint8_t *) (in + i));
+    uint8x16_t valid = vdupq_n_u8(0xff);
+    uint8x16_t hi = hex_values_neon(c.val[0], &valid);
+    uint8x16_t lo = hex_values_neon(c.val[1], &valid);
+    if (vminvq_u8(valid) != 0xff) break;
+    vst1q_u8(out + i / 2, vorrq_u8(vshlq_n_u8(hi, 4), lo));
+  }
+  return i;
+}
+
+#endif /* HEXCODEC_NEON */
+
+/* --- Dispatch --- */
+
+#if !defined(HEXCODEC_X86) && !defined(HEXCODEC_NEON)
+static size_t encode_none(const unsigned char *in, size_t len, char *out) {
+  (void) in; (void) len; (void) out;
+  return 0;
+}
+
+static size_t decode_none(const char *in, size_t len, unsigned char *out) {
+  (void) in; (void) len; (void) out;
+  return 0;
+}
+#endif
+
+static HexEncodeKernel encode_vector;
+static HexDecodeKernel decode_vector;
+static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+
+static void select_kernels(void) {
+#if defined(HEXCODEC_X86)
+  if (cpu_has_avx2()) {
+    encode_vector = encode_avx2;
+    decode_vector = decode_avx2;
+  } else {
+    encode_vector = encode_sse2;
+    decode_vector = decode_sse2;
+  }
+#elif defined(HEXCODEC_NEON)
+  encode_vector = encode_neon;
+  decode_vector = decode_neon;
+#else
+  encode_vector = encode_none;
+  decode_vector = decode_none;
+#endif
+}
+
+void HexCodecEncode(const unsigned char *in, size_t len, char *out) {
+  pthread_once(&select_once, select_kernels);
+  size_t done = encode_vector(in, len, out);
+  encode_scalar(in + done, len - done, out + 2 * done);
+}
+
+size_t HexCodecDecode(const char *in, size_t len, unsigned char *out) {
+  pthread_once(&select_once, select_kernels);
+  size_t done = decode_vector(in, len, out);
+  return done + decode_scalar(in + done, len - done, out + done / 2);
+}
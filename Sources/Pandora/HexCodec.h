@@ -0,0 +1,40 @@
+/**
+ * @file Pandora/HexCodec.h
+ * @brief Hex encoding and decoding of binary data
+ *
+ * Pandora's encrypted requests and responses are hex encoded. The routines
+ * here use SSE2/AVX2 on x86_64 and NEON on arm64 (with a portable fallback
+ * elsewhere), picking the best variant for the CPU at first use.
+ */
+
+#ifndef HEXCODEC_H
+#define HEXCODEC_H
+
+#include <stddef.h>
+
+/**
+ * @brief Hex encode some bytes
+ *
+ * @param in the bytes to encode
+ * @param len the number of bytes to encode
+ * @param out where to write the lowercase hex digits. This must have room for
+ *        2 * len bytes, and no terminating NUL is written.
+ */
+void HexCodecEncode(const unsigned char *in, size_t len, char *out);
+
+/**
+ * @brief Decode some hex digits
+ *
+ * Both lowercase and uppercase digits are accepted.
+ *
+ * @param in the hex digits to decode
+ * @param len the number of digits, which should be even
+ * @param out where to write the decoded bytes. This must have room for
+ *        len / 2 bytes.
+ * @return len if all of the input was decoded, or otherwise the offset of the
+ *         first character which is not a hex digit (a trailing unpaired digit
+ *         counts as invalid). The contents of out are then unspecified.
+ */
+size_t HexCodecDecode(const char *in, size_t len, unsigned char *out);
+
+#endif /* HEXCODEC_H */
@@ -0,0 +1,459 @@
+/**
+ * @file Pandora/JSONStream.c
+ * @brief Implementation of the JSON push parser
+ *
+ * A byte-at-a-time state machine, except that runs of plain characters in
+ * strings are copied in one go. Strings, numbers and literals are collected
+ * in a buffer which is reused for the whole document, so that a token split
+ * between two pieces is reported whole.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "JSONStream.h"
+
+/* Deeper nesting than Pandora's responses will ever have */
+#define JSON_MAX_DEPTH 64
+
+enum {
+  S_VALUE,        /* Expecting a value */
+  S_ARRAY_FIRST,  /* After '[', expecting a value or ']' */
+  S_OBJECT_FIRST, /* After '{', expecting a key or '}' */
+  S_KEY,          /* After ',' in an object, expecting a key */
+  S_COLON,        /* After a key */
+  S_AFTER,        /* After a value in a container, expecting ',' or its end */
+  S_STRING,
+  S_ESCAPE,       /* After a '\' in a string */
+  S_UNICODE,      /* In the digits of a \u escape */
+  S_NUMBER,
+  S_LITERAL,
+  S_DONE,         /* After the top-level value */
+  S_FAILED
+};
+
+struct JSONStream {
+  const JSONStreamCallbacks *cb;
+  void *ctx;
+  int state;
+  size_t offset;
+  size_t error_offset;
+
+  char stack[JSON_MAX_DEPTH];
+  int depth;
+
+  char *buf;
+  size_t len;
+  size_t cap;
+  int is_key;
+
+  unsigned escape;
+  int escape_digits;
+  unsigned high_surrogate;
+};
+
+JSONStream* JSONStreamCreate(const JSONStreamCallbacks *callbacks, void *ctx) {
+  JSONStream *s = calloc (1, sizeof(JSONStream));
+  if (s == NULL) return NULL;
+  s->cb = callbacks;
+  s->ctx = ctx;
+  s->cap = 256;
+  s->buf = malloc (s->cap);
+  if (s->buf == NULL) {
+    free (s);
+    return NULL;
+  }
+  return s;
+}
+
+void JSONStreamReset(JSONStream *s) {
+  s->state = S_VALUE;
+  s->offset = s->error_offset = 0;
+  s->depth = 0;
+  s->len = 0;
+  s->high_surrogate = 0;
+}
+
+void JSONStreamFree(JSONStream *s) {
+  if (s == NULL) return;
+  free (s->buf);
+  free (s);
+}
+
+size_t JSONStreamErrorOffset(const JSONStream *s) {
+  return s->error_offset;
+}
+
+/* --- Token buffer --- */
+
+static int append(JSONStream *s, const char *bytes, size_t n) {
+  if (s->len + n > s->cap) {
+    size_t cap = s->cap * 2;
+    while (cap < s->len + n) cap *= 2;
+    char *buf = realloc (s->buf, cap);
+    if (buf == NULL) return -1;
+    s->buf = buf;
+    s->cap = cap;
+  }
+  memcpy (s->buf + s->len, bytes, n);
+  s->len += n;
+  return 0;
+}
+
+static int append_utf8(JSONStream *s, unsigned cp) {
+  char out[4];
+  size_t n;
+  if (cp < 0x80) {
+    out[0] = (char) cp;
+    n = 1;
+  } else if (cp < 0x800) {
+    out[0] = (char) (0xc0 | cp >> 6);
+    out[1] = (char) (0x80 | (cp & 0x3f));
+    n = 2;
+  } else if (cp < 0x10000) {
+    out[0] = (char) (0xe0 | cp >> 12);
+    out[1] = (char) (0x80 | (cp >> 6 & 0x3f));
+    out[2] = (char) (0x80 | (cp & 0x3f));
+    n = 3;
+  } else {
+    out[0] = (char) (0xf0 | cp >> 18);
+    out[1] = (char) (0x80 | (cp >> 12 & 0x3f));
+    out[2] = (char) (0x80 | (cp >> 6 & 0x3f));
+    out[3] = (char) (0x80 | (cp & 0x3f));
+    n = 4;
+  }
+  return append (s, out, n);
+}
+
+/* A \u escape of a high surrogate not followed by one of a low surrogate
+   stands for nothing, so it becomes U+FFFD */
+static int flush_surrogate(JSONStream *s) {
+  if (s->high_surrogate == 0) return 0;
+  s->high_surrogate = 0;
+  return append_utf8 (s, 0xfffd);
+}
+
+static int unicode_escape(JSONStream *s, unsigned cp) {
+  if (s->high_surrogate != 0 && cp >= 0xdc00 && cp <= 0xdfff) {
+    cp = 0x10000 + ((s->high_surrogate - 0xd800) << 10) + (cp - 0xdc00);
+    s->high_surrogate = 0;
+    return append_utf8 (s, cp);
+  }
+  if (flush_surrogate (s) != 0) return -1;
+  if (cp >= 0xd800 && cp <= 0xdbff) {
+    s->high_surrogate = cp;
+    return 0;
+  }
+  if (cp >= 0xdc00 && cp <= 0xdfff) {
+    cp = 0xfffd;
+  }
+  return append_utf8 (s, cp);
+}
+
+/* --- Tokens --- */
+
+static void value_done(JSONStream *s) {
+  s->state = s->depth > 0 ? S_AFTER : S_DONE;
+}
+
+static int push(JSONStream *s, char container) {
+  if (s->depth == JSON_MAX_DEPTH) return -1;
+  s->stack[s->depth++] = container;
+  if (container == '{') {
+    if (s->cb->begin_object) s->cb->begin_object (s->ctx);
+    s->state = S_OBJECT_FIRST;
+  } else {
+    if (s->cb->begin_array) s->cb->begin_array (s->ctx);
+    s->state = S_ARRAY_FIRST;
+  }
+  return 0;
+}
+
+static int pop(JSONStream *s, char container) {
+  if (s->depth == 0 || s->stack[s->depth - 1] != container) return -1;
+  s->depth--;
+  if (container == '{') {
+    if (s->cb->end_object) s->cb->end_object (s->ctx);
+  } else {
+    if (s->cb->end_array) s->cb->end_array (s->ctx);
+  }
+  value_done (s);
+  return 0;
+}
+
+static int end_string(JSONStream *s) {
+  if (flush_surrogate (s) != 0) return -1;
+  if (s->is_key) {
+    if (s->cb->key) s->cb->key (s->ctx, s->buf, s->len);
+    s->state = S_COLON;
+  } else {
+    if (s->cb->string) s->cb->string (s->ctx, s->buf, s->len);
+    value_done (s);
+  }
+  return 0;
+}
+
+static int is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+/* -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)? */
+static int valid_number(const char *p, size_t len) {
+  const char *end = p + len;
+  if (p < end && *p == '-') p++;
+  if (p == end) return 0;
+  if (*p == '0') {
+    p++;
+  } else if (is_digit (*p)) {
+    while (p < end && is_digit (*p)) p++;
+  } else {
+    return 0;
+  }
+  if (p < end && *p == '.') {
+    p++;
+    if (p == end || !is_digit (*p)) return 0;
+    while (p < end && is_digit (*p)) p++;
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    if (p < end && (*p == '+' || *p == '-')) p++;
+    if (p == end || !is_digit (*p)) return 0;
+    while (p < end && is_digit (*p)) p++;
+  }
+  return p == end;
+}
+
+static int end_number(JSONStream *s) {
+  if (!valid_number (s->buf, s->len)) return -1;
+  if (s->cb->number) s->cb->number (s->ctx, s->buf, s->len);
+  value_done (s);
+  return 0;
+}
+
+static int end_literal(JSONStream *s) {
+  JSONStreamLiteral literal;
+  if (s->len == 4 && memcmp (s->buf, "true", 4) == 0) {
+    literal = JSONStreamTrue;
+  } else if (s->len == 5 && memcmp (s->buf, "false", 5) == 0) {
+    literal = JSONStreamFalse;
+  } else if (s->len == 4 && memcmp (s->buf, "null", 4) == 0) {
+    literal = JSONStreamNull;
+  } else {
+    return -1;
+  }
+  if (s->cb->literal) s->cb->literal (s->ctx, literal);
+  value_done (s);
+  return 0;
+}
+
+/* Start the value beginning with c */
+static int begin_value(JSONStream *s, char c) {
+  s->len = 0;
+  if (c == '{' || c == '[') {
+    return push (s, c);
+  } else if (c == '"') {
+    s->is_key = 0;
+    s->state = S_STRING;
+  } else if (c == '-' || is_digit (c)) {
+    s->state = S_NUMBER;
+    return append (s, &c, 1);
+  } else if (c >= 'a' && c <= 'z') {
+    s->state = S_LITERAL;
+    return append (s, &c, 1);
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+static int is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int is_number_char(char c) {
+  return is_digit (c) || c == '-' || c == '+' || c == '.' || c == 'e' ||
+         c == 'E';
+}
+
+/* --- Parsing --- */
+
+int JSONStreamFeed(JSONStream *s, const char *bytes, size_t len) {
+  size_t i = 0;
+  int err = 0;
+
+  while (i < len && err == 0) {
+    char c = bytes[i];
+
+    switch (s->state) {
+      case S_STRING: {
+        /* Copy the run of characters which need no attention */
+        size_t j = i;
+        while (j < len && bytes[j] != '"' && bytes[j] != '\\' &&
+               (unsigned char) bytes[j] >= 0x20) {
+          j++;
+        }
+        if (j > i) {
+          if (flush_surrogate (s) != 0 || append (s, bytes + i, j - i) != 0) {
+            err = -1;
+            break;
+          }
+          i = j;
+          continue;
+        }
+        if (c == '"') {
+          err = end_string (s);
+        } else if (c == '\\') {
+          s->state = S_ESCAPE;
+        } else {
+          err = -1; /* Unescaped control character */
+        }
+        i++;
+        break;
+      }
+
+      case S_ESCAPE: {
+        char out;
+        switch (c) {
+          case '"': case '\\': case '/': out = c; break;
+          case 'b': out = '\b'; break;
+          case 'f': out = '\f'; break;
+          case 'n': out = '\n'; break;
+          case 'r': out = '\r'; break;
+          case 't': out = '\t'; break;
+          case 'u':
+            s->escape = 0;
+            s->escape_digits = 0;
+            s->state = S_UNICODE;
+            i++;
+            continue;
+          default:
+            err = -1;
+            continue;
+        }
+        if (flush_surrogate (s) != 0 || append (s, &out, 1) != 0) {
+          err = -1;
+          continue;
+        }
+        s->state = S_STRING;
+        i++;
+        break;
+      }
+
+      case S_UNICODE: {
+        unsigned digit;
+        if (is_digit (c)) {
+          digit = (unsigned) (c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+          digit = (unsigned) (c - 'a' + 10);
+        } else if (c >= 'A' && c <= 'F') {
+          digit = (unsigned) (c - 'A' + 10);
+        } else {
+          err = -1;
+          continue;
+        }
+        s->escape = s->escape << 4 | digit;
+        if (++s->escape_digits == 4) {
+          err = unicode_escape (s, s->escape);
+          s->state = S_STRING;
+        }
+        i++;
+        break;
+      }
+
+      case S_NUMBER:
+        if (is_number_char (c)) {
+          err = append (s, &c, 1);
+          i++;
+        } else {
+          /* The character after the number is looked at again */
+          err = end_number (s);
+        }
+        break;
+
+      case S_LITERAL:
+        if (c >= 'a' && c <= 'z') {
+          err = append (s, &c, 1);
+          i++;
+        } else {
+          err = end_literal (s);
+        }
+        break;
+
+      case S_FAILED:
+        return -1;
+
+      default:
+        if (is_space (c)) {
+          i++;
+          break;
+        }
+        switch (s->state) {
+          case S_VALUE:
+            err = begin_value (s, c);
+            break;
+          case S_ARRAY_FIRST:
+            err = c == ']' ? pop (s, '[') : begin_value (s, c);
+            break;
+          case S_OBJECT_FIRST:
+          case S_KEY:
+            if (c == '"') {
+              s->len = 0;
+              s->is_key = 1;
+              s->state = S_STRING;
+            } else if (c == '}' && s->state == S_OBJECT_FIRST) {
+              err = pop (s, '{');
+            } else {
+              err = -1;
+            }
+            break;
+          case S_COLON:
+            if (c == ':') {
+              s->state = S_VALUE;
+            } else {
+              err = -1;
+            }
+            break;
+          case S_AFTER:
+            if (c == ',') {
+              s->state = s->stack[s->depth - 1] == '{' ? S_KEY : S_VALUE;
+            } else if (c == '}' || c == ']') {
+              err = pop (s, c == '}' ? '{' : '[');
+            } else {
+              err = -1;
+            }
+            break;
+          default: /* S_DONE */
+            err = -1;
+            break;
+        }
+        if (err == 0) i++;
+        break;
+    }
+  }
+
+  if (err != 0) {
+    s->error_offset = s->offset + i;
+    s->state = S_FAILED;
+    return -1;
+  }
+  s->offset += len;
+  return 0;
+}
+
+int JSONStreamFinish(JSONStream *s) {
+  int err = 0;
+  /* Only a top-level number or literal is still waiting for its end */
+  if (s->state == S_NUMBER) {
+    err = end_number (s);
+  } else if (s->state == S_LITERAL) {
+    err = end_literal (s);
+  }
+  if (err != 0 || s->state != S_DONE) {
+    if (s->state != S_FAILED) {
+      s->error_offset = s->offset;
+      s->state = S_FAILED;
+    }
+    return -1;
+  }
+  return 0;
+}
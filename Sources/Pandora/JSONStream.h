@@ -0,0 +1,80 @@
+/**
+ * @file Pandora/JSONStream.h
+ * @brief A push parser for JSON
+ *
+ * The parser is fed a document in whatever pieces it arrives in, and reports
+ * each token through callbacks as soon as the token is complete, so that the
+ * caller can build just the objects it cares about while the rest of the
+ * response is still on its way. A piece may end anywhere, even in the middle
+ * of a string escape or a UTF-8 sequence.
+ */
+
+#ifndef JSONSTREAM_H
+#define JSONSTREAM_H
+
+#include <stddef.h>
+
+typedef enum {
+  JSONStreamTrue,
+  JSONStreamFalse,
+  JSONStreamNull
+} JSONStreamLiteral;
+
+/**
+ * @brief Callbacks for the tokens of a document
+ *
+ * Strings (keys and values) are passed unescaped as UTF-8 which is not NUL
+ * terminated, and numbers as their text as it appeared in the document. The
+ * pointers are only valid for the duration of the call. Any callback may be
+ * NULL.
+ */
+typedef struct {
+  void (*begin_object)(void *ctx);
+  void (*end_object)(void *ctx);
+  void (*begin_array)(void *ctx);
+  void (*end_array)(void *ctx);
+  void (*key)(void *ctx, const char *str, size_t len);
+  void (*string)(void *ctx, const char *str, size_t len);
+  void (*number)(void *ctx, const char *str, size_t len);
+  void (*literal)(void *ctx, JSONStreamLiteral literal);
+} JSONStreamCallbacks;
+
+typedef struct JSONStream JSONStream;
+
+/**
+ * @brief Create a parser for one document
+ *
+ * @param callbacks the callbacks to invoke, which must outlive the parser
+ * @param ctx passed to each callback
+ * @return the parser, or NULL if out of memory
+ */
+JSONStream* JSONStreamCreate(const JSONStreamCallbacks *callbacks, void *ctx);
+
+/**
+ * @brief Parse the next piece of the document
+ *
+ * @return 0 on success, or -1 if the document is invalid (in which case all
+ *         further calls fail too)
+ */
+int JSONStreamFeed(JSONStream *stream, const char *bytes, size_t len);
+
+/**
+ * @brief Signal the end of the document
+ *
+ * @return 0 if a complete document was parsed, or -1 otherwise
+ */
+int JSONStreamFinish(JSONStream *stream);
+
+/**
+ * @brief The offset into the document at which parsing failed
+ */
+size_t JSONStreamErrorOffset(const JSONStream *stream);
+
+/**
+ * @brief Reset a parser to the start of a new document
+ */
+void JSONStreamReset(JSONStream *stream);
+
+void JSONStreamFree(JSONStream *stream);
+
+#endif /* JSONSTREAM_H */
@@ -0,0 +1,102 @@
+/**
+ * @file Pandora/MockTuner.h
+ * @brief A stand-in for Pandora's tuner on 127.0.0.1
+ *
+ * Answers the JSON v5 methods which Hermes uses, with request bodies
+ * encrypted and the partner login's sync time encrypted just as Pandora's
+ * are, so that the client can be measured end to end without the network.
+ * Playlists point at silent MP3s served by the same server.
+ *
+ * How the tuner behaves is configurable: a delay before every answer, the
+ * bandwidth responses are written at, errors to answer particular methods
+ * with, quotas beyond which a method is answered with PLAYLIST_EXCEEDED, and
+ * expiring the session so that the next request fails with
+ * INVALID_AUTH_TOKEN.
+ */
+
+@interface PandoraMockTuner : NSObject
+
+/**
+ * @brief Create a tuner which accepts requests from a device
+ *
+ * @param device one of the PandoraDevice dictionaries, whose keys the
+ *        requests are encrypted with
+ */
+- (id) initWithDevice:(NSDictionary*)device;
+
+/**
+ * @brief Start listening on an unused port
+ *
+ * @return YES if the tuner is listening
+ */
+- (BOOL) start;
+
+/**
+ * @brief Stop listening and close all connections
+ */
+- (void) stop;
+
+/**
+ * @brief The device given when created, with its API host pointed at this
+ *        tuner and TLS turned off once started, for setting as a Pandora's
+ *        device
+ */
+@property (readonly) NSDictionary *device;
+
+/**
+ * @brief Seconds to wait before answering each request, audio included
+ */
+@property NSTimeInterval latency;
+
+/**
+ * @brief How fast responses are written, in bytes per second, or 0 (the
+ *        default) for as fast as the connection takes them
+ */
+@property double bytesPerSecond;
+
+/**
+ * @brief How many stations the station list has. Defaults to 20.
+ */
+@property NSUInteger stationCount;
+
+/**
+ * @brief How long each song's audio lasts, in seconds. Defaults to 30.
+ */
+@property double songSeconds;
+
+/**
+ * @brief Answer the next requests for a method with an error
+ *
+ * @param method the method to fail, such as "station.getPlaylist"
+ * @param code the Pandora error code to answer with, such as
+ *        INVALID_SYNC_TIME or INVALID_AUTH_TOKEN
+ * @param times how many requests in a row to fail
+ */
+- (void) failMethod:(NSString*)method withCode:(int)code times:(NSUInteger)times;
+
+/**
+ * @brief Answer a method with PLAYLIST_EXCEEDED once more than a number of
+ *        requests for it arrive within a window
+ *
+ * @param requests how many requests are allowed within the window, or 0 for
+ *        no quota
+ * @param window the length of the window, in seconds
+ */
+- (void) setQuota:(NSUInteger)requests window:(NSTimeInterval)window
+        forMethod:(NSString*)method;
+
+/**
+ * @brief Forget the current user token, so that requests made with it are
+ *        answered with INVALID_AUTH_TOKEN until the user logs in again
+ */
+- (void) expireSession;
+
+/**
+ * @brief What the tuner has answered so far
+ *
+ * The keys are "requests" (counts keyed by method), "errors" (counts keyed by
+ * error code), "audioRequests" and "bytesSent".
+ */
+- (NSDictionary*) statistics;
+
+@end
@@ -0,0 +1,373 @@
+#import "LoopbackHTTPServer.h"
+#import "MockTuner.h"
+#import "Pandora.h"
+#import "PandoraDevice.h"
+#import "Pandora/Crypt.h"
+
+#define PARTNER_ID @"42"
+#define USER_ID @"1000"
+
+/* A silent MPEG-1 Layer III frame at 128 Kbps and 44.1 kHz: the header, and
+   side information of zeros, which decodes as nothing to play */
+#define MP3_FRAME_HEADER "\xff\xfb\x90\x44"
+#define MP3_FRAME_BYTES 417
+#define MP3_FRAME_SECONDS (1152 / 44100.0)
+
+@implementation PandoraMockTuner {
+  NSDictionary *baseDevice;
+  LoopbackHTTPServer *server;
+  PandoraCipherKey *encryptKey;
+  PandoraCipherKey *decryptKey;
+
+  NSString *userToken;
+  NSUInteger logins;
+  NSUInteger feedbackIds;
+
+  NSMutableDictionary *failures;
+  NSMutableDictionary *quotas;
+  NSMutableDictionary *arrivals;
+
+  NSMutableDictionary *requestCounts;
+  NSMutableDictionary *errorCounts;
+  NSUInteger audioRequests;
+  unsigned long long bytesSent;
+}
+
+- (id) initWithDevice:(NSDictionary*)device {
+  if (!(self = [super init])) return nil;
+  baseDevice = device;
+  _device = device;
+  encryptKey = PandoraCipherKeyForString(device[kPandoraDeviceEncrypt]);
+  decryptKey = PandoraCipherKeyForString(device[kPandoraDeviceDecrypt]);
+  failures = [NSMutableDictionary dictionary];
+  quotas = [NSMutableDictionary dictionary];
+  arrivals = [NSMutableDictionary dictionary];
+  requestCounts = [NSMutableDictionary dictionary];
+  errorCounts = [NSMutableDictionary dictionary];
+  _stationCount = 20;
+  _songSeconds = 30;
+  return self;
+}
+
+- (BOOL) start {
+  __weak PandoraMockTuner *weakSelf = self;
+  server = [[LoopbackHTTPServer alloc] initWithHandler:^(NSString *method,
+                                                         NSString *path,
+                                                         NSData *body) {
+    return [weakSelf answer:method path:path body:body];
+  }];
+  server.bytesPerSecond = self.bytesPerSecond;
+  if (![server start]) {
+    server = nil;
+    return NO;
+  }
+  NSMutableDictionary *device = [baseDevice mutableCopy];
+  device[kPandoraDeviceAPIHost] = [self host];
+  device[kPandoraDeviceNoTLS] = @YES;
+  _device = device;
+  return YES;
+}
+
+- (void) stop {
+  [server stop];
+  server = nil;
+}
+
+- (NSString*) host {
+  return [NSString stringWithFormat:@"127.0.0.1:%u", (unsigned) server.port];
+}
+
+- (void) setBytesPerSecond:(double)rate {
+  _bytesPerSecond = rate;
+  server.bytesPerSecond = rate;
+}
+
+#pragma mark - Configuration
+
+- (void) failMethod:(NSString*)method withCode:(int)code times:(NSUInteger)times {
+  @synchronized(self) {
+    failures[method] = @{@"code": @(code), @"times": @(times)};
+  }
+}
+
+- (void) setQuota:(NSUInteger)requests window:(NSTimeInterval)window
+        forMethod:(NSString*)method {
+  @synchronized(self) {
+    if (requests == 0) {
+      [quotas removeObjectForKey:method];
+    } else {
+      quotas[method] = @{@"requests": @(requests), @"window": @(window)};
+    }
+    [arrivals removeObjectForKey:method];
+  }
+}
+
+- (void) expireSession {
+  @synchronized(self) {
+    userToken = nil;
+  }
+}
+
+- (NSDictionary*) statistics {
+  @synchronized(self) {
+    return @{@"requests": [requestCounts copy], @"errors": [errorCounts copy],
+             @"audioRequests": @(audioRequests), @"bytesSent": @(bytesSent)};
+  }
+}
+
+#pragma mark - Answering requests
+
+- (NSData*) answer:(NSString*)httpMethod path:(NSString*)path body:(NSData*)body {
+  if (self.latency > 0) {
+    usleep((useconds_t) (self.latency * 1000000));
+  }
+
+  NSData *response;
+  if ([path hasPrefix:@"/audio/"]) {
+    response = [self audio];
+    @synchronized(self) { audioRequests++; }
+  } else {
+    NSDictionary *json = [self answerQuery:[self parseQuery:path] body:body];
+    response = [NSJSONSerialization dataWithJSONObject:json options:0 error:nil];
+  }
+  @synchronized(self) { bytesSent += [response length]; }
+  return response;
+}
+
+- (NSDictionary*) parseQuery:(NSString*)path {
+  NSMutableDictionary *query = [NSMutableDictionary dictionary];
+  NSRange mark = [path rangeOfString:@"?"];
+  if (mark.location == NSNotFound) return query;
+  for (NSString *pair in [[path substringFromIndex:mark.location + 1]
+                          componentsSeparatedByString:@"&"]) {
+    NSRange eq = [pair rangeOfString:@"="];
+    if (eq.location == NSNotFound) continue;
+    NSString *value = [[pair substringFromIndex:eq.location + 1]
+                       stringByRemovingPercentEncoding];
+    query[[pair substringToIndex:eq.location]] = value ?: @"";
+  }
+  return query;
+}
+
+- (NSDictionary*) error:(int)code {
+  @synchronized(self) {
+    errorCounts[@(code)] = @([errorCounts[@(code)] unsignedIntegerValue] + 1);
+  }
+  NSString *message = [Pandora stringForErrorCode:code] ?: @"Mock tuner error";
+  return @{@"stat": @"fail", @"message": message, @"code": @(code)};
+}
+
+/* The failure configured for a request, counting it against its quota */
+- (int) injectedErrorFor:(NSString*)method {
+  @synchronized(self) {
+    requestCounts[method] = @([requestCounts[method] unsignedIntegerValue] + 1);
+
+    NSDictionary *failure = failures[method];
+    if (failure != nil) {
+      NSUInteger times = [failure[@"times"] unsignedIntegerValue];
+      if (times <= 1) {
+        [failures removeObjectForKey:method];
+      } else {
+        failures[method] = @{@"code": failure[@"code"], @"times": @(times - 1)};
+      }
+      return [failure[@"code"] intValue];
+    }
+
+    NSDictionary *quota = quotas[method];
+    if (quota != nil) {
+      CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+      NSMutableArray *times = arrivals[method];
+      if (times == nil) {
+        times = [NSMutableArray array];
+        arrivals[method] = times;
+      }
+      while ([times count] > 0 &&
+             now - [times[0] doubleValue] > [quota[@"window"] doubleValue]) {
+        [times removeObjectAtIndex:0];
+      }
+      if ([times count] >= [quota[@"requests"] unsignedIntegerValue]) {
+        return PLAYLIST_EXCEEDED;
+      }
+      [times addObject:@(now)];
+    }
+    return -1;
+  }
+}
+
+- (NSDictionary*) answerQuery:(NSDictionary*)query body:(NSData*)body {
+  NSString *method = query[@"method"] ?: @"";
+  int injected = [self injectedErrorFor:method];
+  if (injected >= 0) {
+    return [self error:injected];
+  }
+
+  if ([method isEqualToString:@"auth.partnerLogin"]) {
+    return [self ok:[self partnerLogin]];
+  }
+
+  /* Everything else is encrypted */
+  NSString *hex = [[NSString alloc] initWithData:body encoding:NSASCIIStringEncoding];
+  NSData *plain = PandoraDecryptStringWithKey(hex, encryptKey);
+  if (plain == nil) {
+    return [self error:9];
+  }
+  /* Blowfish pads the JSON out to a whole block with zeros */
+  NSUInteger length = [plain length];
+  const char *bytes = [plain bytes];
+  while (length > 0 && bytes[length - 1] == 0) {
+    length--;
+  }
+  NSDictionary *params = [NSJSONSerialization
+                          JSONObjectWithData:[plain subdataWithRange:NSMakeRange(0, length)]
+                                     options:0 error:nil];
+  if (![params isKindOfClass:[NSDictionary class]]) {
+    return [self error:9];
+  }
+
+  if ([method isEqualToString:@"auth.userLogin"]) {
+    if (params[@"username"] == nil || params[@"password"] == nil) {
+      return [self error:INVALID_USERNAME];
+    }
+    @synchronized(self) {
+      userToken = [NSString stringWithFormat:@"mock-user-token-%lu",
+                   (unsigned long) ++logins];
+      return [self ok:@{@"userId": USER_ID, @"userAuthToken": userToken,
+                        @"isSubscriber": @NO}];
+    }
+  }
+
+  @synchronized(self) {
+    if (userToken == nil || ![query[@"auth_token"] isEqual:userToken] ||
+        ![params[@"userAuthToken"] isEqual:userToken]) {
+      return [self error:INVALID_AUTH_TOKEN];
+    }
+  }
+
+  if ([method isEqualToString:@"user.getStationList"]) {
+    return [self ok:@{@"stations": [self stations], @"checksum": [self checksum]}];
+  } else if ([method isEqualToString:@"user.getStationListChecksum"]) {
+    return [self ok:@{@"checksum": [self checksum]}];
+  } else if ([method isEqualToString:@"station.getPlaylist"]) {
+    return [self ok:@{@"items": [self playlistFor:params[@"stationToken"]]}];
+  } else if ([method isEqualToString:@"station.getStation"]) {
+    return [self ok:[self stationInfo:params[@"stationToken"]]];
+  } else if ([method isEqualToString:@"station.addFeedback"]) {
+    @synchronized(self) {
+      return [self ok:@{@"feedbackId": [NSString stringWithFormat:@"feedback-%lu",
+                                        (unsigned long) ++feedbackIds]}];
+    }
+  } else if ([method isEqualToString:@"station.deleteFeedback"] ||
+             [method isEqualToString:@"user.sleepSong"]) {
+    return [self ok:@{}];
+  } else if ([method isEqualToString:@"music.search"]) {
+    return [self ok:[self search:params[@"searchText"]]];
+  } else if ([method isEqualToString:@"station.getGenreStations"]) {
+    return [self ok:@{@"categories": [self genres], @"checksum": @"genres-1"}];
+  } else if ([method isEqualToString:@"station.getGenreStationsChecksum"]) {
+    return [self ok:@{@"checksum": @"genres-1"}];
+  }
+  return [self error:14];
+}
+
+- (NSDictionary*) ok:(NSDictionary*)result {
+  return @{@"stat": @"ok", @"result": result};
+}
+
+#pragma mark - Results
+
+- (NSDictionary*) partnerLogin {
+  /* Four bytes Pandora doesn't explain, then the time in decimal */
+  NSString *sync = [NSString stringWithFormat:@"\x01\x02\x03\x04%lld",
+                    (long long) [[NSDate date] timeIntervalSince1970]];
+  NSData *encrypted = PandoraEncryptDataWithKey(
+      [sync dataUsingEncoding:NSISOLatin1StringEncoding], decryptKey);
+  return @{@"partnerId": PARTNER_ID,
+           @"partnerAuthToken": @"mock-partner-token",
+           @"syncTime": [[NSString alloc] initWithData:encrypted
+                                              encoding:NSASCIIStringEncoding]};
+}
+
+- (NSString*) checksum {
+  return [NSString stringWithFormat:@"stations-%lu",
+          (unsigned long) self.stationCount];
+}
+
+- (NSArray*) stations {
+  NSMutableArray *stations = [NSMutableArray array];
+  for (NSUInteger i = 0; i < self.stationCount; i++) {
+    [stations addObject:@{
+      @"stationName": [NSString stringWithFormat:@"Mock Station %lu", (unsigned long) i],
+      @"stationToken": [NSString stringWithFormat:@"mock-station-%lu", (unsigned long) i],
+      @"stationId": [NSString stringWithFormat:@"%lu", (unsigned long) (5000 + i)],
+      @"dateCreated": @{@"time": @(1300000000000ULL + i * 86400000ULL)},
+      @"isShared": @NO,
+      @"allowRename": @YES,
+      @"allowAddMusic": @YES,
+      @"isQuickMix": @(i == 0)
+    }];
+  }
+  return stations;
+}
+
+- (NSArray*) playlistFor:(NSString*)stationToken {
+  NSString *base = [NSString stringWithFormat:@"http://%@/audio/", [self host]];
+  NSMutableArray *items = [NSMutableArray array];
+  for (int i = 0; i < 4; i++) {
+    NSString *track = [NSString stringWithFormat:@"%@-%u", stationToken,
+                       arc4random_uniform(1000000)];
+    NSString *url = [NSString stringWithFormat:@"%@%@.mp3", base, track];
+    [items addObject:@{
+      @"artistName": @"Mock Artist",
+      @"songName": [NSString stringWithFormat:@"Silence %@", track],
+      @"albumName": @"Mock Album",
+      @"stationId": stationToken ?: @"",
+      @"trackToken": track,
+      @"songRating": @0,
+      @"additionalAudioUrl": @[url, url, url],
+      @"audioUrlMap": @{
+        @"highQuality": @{@"bitrate": @"128", @"encoding": @"mp3",
+                          @"audioUrl": url, @"protocol": @"http"}
+      }
+    }];
+  }
+  return items;
+}
+
+- (NSDictionary*) stationInfo:(NSString*)stationToken {
+  return @{
+    @"stationName": [NSString stringWithFormat:@"Mock %@", stationToken],
+    @"stationToken": stationToken ?: @"",
+    @"dateCreated": @{@"year": @113, @"month": @0, @"date": @1},
+    @"genre": @[@"Mock"],
+    @"music": @{@"songs": @[], @"artists": @[]},
+    @"feedback": @{@"thumbsUp": @[], @"thumbsDown": @[]}
+  };
+}
+
+- (NSDictionary*) search:(NSString*)text {
+  NSString *name = text ?: @"";
+  return @{
+    @"songs": @[@{@"songName": [name stringByAppendingString:@" Song"],
+                  @"artistName": @"Mock Artist", @"musicToken": @"S1"}],
+    @"artists": @[@{@"artistName": [name stringByAppendingString:@" Artist"],
+                    @"musicToken": @"R1"}]
+  };
+}
+
+- (NSArray*) genres {
+  return @[@{@"categoryName": @"Mock",
+             @"stations": @[@{@"stationName": @"Quiet", @"stationToken": @"G1"},
+                            @{@"stationName": @"Calm", @"stationToken": @"G2"}]}];
+}
+
+- (NSData*) audio {
+  NSUInteger frames = (NSUInteger) (self.songSeconds / MP3_FRAME_SECONDS);
+  NSMutableData *audio = [NSMutableData dataWithLength:frames * MP3_FRAME_BYTES];
+  char *bytes = [audio mutableBytes];
+  for (NSUInteger i = 0; i < frames; i++) {
+    memcpy(bytes + i * MP3_FRAME_BYTES, MP3_FRAME_HEADER, 4);
+  }
+  return audio;
+}
+
+@end
@@ -1,5 +1,11 @@
 @class Station;
+@class PandoraCipherKey;
+@class PandoraRateLimiter;
+@class PandoraResponseParser;
+@class PandoraSearchCache;
+@class PandoraStationRegistry;
 
+#import "Pandora/RequestQueue.h"
 #import "Pandora/Song.h"
 
 
@@ -12,6 +18,7 @@
 #define INVALID_USERNAME      1011
 #define INVALID_PASSWORD      1012
 #define NO_SEEDS_LEFT         1032
+#define PLAYLIST_EXCEEDED     1039
 
 typedef void(^SyncCallback)(void);
 typedef void(^PandoraCallback)(NSDictionary*);
@@ -68,13 +75,43 @@ typedef void(^PandoraCallback)(NSDictionary*);
 @property (assign) BOOL tls;
 @property (assign) BOOL encrypted;
 
+/**
+ * Identifies a read which identical reads in flight at the same time share,
+ * or nil if the request must always be sent
+ */
+@property (retain) NSString *coalescingKey;
+
+/**
+ * Parses the response as it arrives, or nil to parse all of it once it has
+ * arrived
+ */
+@property (retain) PandoraResponseParser *parser;
+
+/**
+ * Whether nobody is waiting on the request, so that it may be held back
+ * behind other requests, or dropped while Pandora is throttling
+ */
+@property (assign) BOOL deferrable;
+
+/**
+ * Invoked if the request is deferrable and is dropped or given up on after
+ * failing, so that whoever sent it knows not to wait for it
+ */
+@property (copy) SyncCallback dropped;
+
+/**
+ * Which requests this one waits behind for a free slot, PandoraPriorityDefault
+ * unless set otherwise
+ */
+@property (assign) PandoraPriority priority;
+
 @end
 
 #pragma mark - Pandora
 
 /* Implementation of Pandora's API */
 @interface Pandora : NSObject {
-  NSMutableArray *stations;
+  PandoraStationRegistry *station_registry;
   int retries;
 
   NSString *partner_id;
@@ -84,16 +121,71 @@ typedef void(^PandoraCallback)(NSDictionary*);
   uint64_t sync_time;
   uint64_t start_time;
   int64_t syncOffset;
+
+  NSDictionary *device;
+  PandoraCipherKey *encrypt_key;
+  PandoraCipherKey *decrypt_key;
+
+  NSMutableDictionary *inflight_reads;
+  NSMutableDictionary *inflight_priorities;
+  NSMutableDictionary *pending_ratings;
+  NSMutableDictionary *feedback_ids;
+  NSMutableDictionary *saved_calls;
+
+  NSString *station_checksum;
+  NSDictionary *station_cache;
+  NSDictionary *genre_cache;
+
+  BOOL resumed_session;
+  PandoraRateLimiter *rate_limiter;
+  PandoraRequestQueue *request_queue;
+
+  PandoraSearchCache *search_cache;
+  NSMutableDictionary *search_stats;
+  NSUInteger search_generation;
 }
 
 @property (readonly) NSArray* stations;
+/**
+ * The device Hermes poses as. Setting this also selects the key schedules
+ * used by encryptData: and decryptString:.
+ */
 @property (strong) NSDictionary *device;
 @property (retain) NSNumber *cachedSubscriberStatus;
 
+/**
+ * Whether the current session was resumed from the last launch rather than
+ * started by logging in
+ */
+@property (readonly) BOOL resumedSession;
+
+/**
+ * Whether sessions are kept in the Keychain and the station and genre lists
+ * are cached on disk. Defaults to YES, and is only turned off for a Pandora
+ * which talks to a stand-in tuner, so that it leaves nothing behind.
+ */
+@property BOOL persistsState;
+
+/**
+ * Holds requests back to keep them under Pandora's limits
+ */
+@property (readonly) PandoraRateLimiter *rateLimiter;
+
+/**
+ * The stations of the logged in user, indexed by id, token and position
+ */
+@property (readonly) PandoraStationRegistry *stationRegistry;
+
 #pragma mark - Error handling
 
 + (NSString*) stringForErrorCode: (int) code;
 
+/**
+ * @brief How long to wait before retrying a request which failed, according
+ *        to how its kind of request has been failing
+ */
+- (NSTimeInterval) retryDelayForRequest:(PandoraRequest*)request;
+
 #pragma mark - Crypto
 
 - (NSData *)encryptData:(NSData *)data;
@@ -109,6 +201,11 @@ typedef void(^PandoraCallback)(NSDictionary*);
  * "auth.partnerLogin", "auth.userLogin", and "user.canSubscribe" API
  * methods indirectly.
  *
+ * Each session is kept in the Keychain, and if there's no request to retry,
+ * the last session of the same user is resumed without logging in again
+ * while it's recent enough. Its tokens are then checked by the first request
+ * sent with them, and an invalid one is answered by logging in as usual.
+ *
  * @param user the username to log in with
  * @param pass the password to log in with
  * @param req an optional request which will be retried once the authentication
@@ -175,6 +272,11 @@ typedef void(^PandoraCallback)(NSDictionary*);
  *
  * Fires the "hermes.stations" event with no extra information. All of the
  * stations found are stored internally in this Pandora object.
+ *
+ * The list is cached in the state directory along with Pandora's checksum of
+ * it, and only the checksum is fetched while it matches the cached list or
+ * the one already loaded. Stations already loaded are updated in place, so
+ * they stay the same objects as long as they stay on the account.
  */
 - (BOOL) fetchStations;
 
@@ -189,13 +291,60 @@ typedef void(^PandoraCallback)(NSDictionary*);
  */
 - (BOOL) fetchPlaylistForStation: (Station*)station;
 
+/**
+ * @brief Get a small list of songs for a station, possibly ahead of time
+ *
+ * @param station the station to fetch more songs for
+ * @param prefetch YES if the station still has songs to play, in which case
+ *        the request may be held back or dropped to stay under Pandora's limits
+ */
+- (BOOL) fetchPlaylistForStation: (Station*)station prefetch:(BOOL)prefetch;
+
+/**
+ * @brief Parse the dictionary provided to create a station
+ *
+ * @param s the dictionary describing the station
+ * @return the station object
+ */
+- (Station*) parseStationFromDictionary: (NSDictionary*) s;
+
+/**
+ * @brief Parse one item of a playlist to create a song
+ *
+ * @param s the dictionary describing the item
+ * @return the song object, or nil if the item is an advertisement
+ */
+- (Song*) parseSongFromDictionary: (NSDictionary*) s;
+
+/**
+ * @brief A parser for the response to "user.getStationList"
+ *
+ * The "stations" of the parsed response's "result" are dictionaries of just
+ * the fields which parseStationFromDictionary: reads, and its "checksum" is
+ * kept too.
+ */
+- (PandoraResponseParser*) stationListParser;
+
+/**
+ * @brief A parser for the response to "station.getPlaylist"
+ *
+ * The "items" of the parsed response's "result" are the Song objects, without
+ * any advertisements.
+ */
+- (PandoraResponseParser*) playlistParser;
+
 /**
  * @brief Fetch the "genre stations" from pandora
  *
  * Pandora provides some pre-defined genre stations available to create a
  * station from, and this provides the API to fetch those. The
- * "hermes.genre-stations" event is fired when done with the extra information
- * of the response from Pandora.
+ * "hermes.genre-stations" event is fired when done, with a "categories" list
+ * of dictionaries holding a "categoryName" and its "stations", each with just
+ * a "stationName" and "stationToken" and sorted by name.
+ *
+ * The catalog is cached on disk. If there is a cached copy, the event fires
+ * with it straight away, and if the copy is a day old Pandora is asked whether
+ * it has changed, firing the event again with the new catalog if so.
  */
 - (BOOL) fetchGenreStations;
 
@@ -225,6 +374,9 @@ typedef void(^PandoraCallback)(NSDictionary*);
  *      - songName
  *      - artistName
  *
+ * If information about the station is already being fetched, no new request
+ * is sent and the event is fired once more when that one completes.
+ *
  * @param station the station to fetch information for
  */
 - (BOOL) fetchStationInfo: (Station*) station;
@@ -279,21 +431,39 @@ typedef void(^PandoraCallback)(NSDictionary*);
  * Fires the "hermes.song-rated" event when done. The userInfo for the event is
  * a dictionary with one key, "song", the same one as provided to this method
  *
+ * The song's rating changes straight away, but the request is held back for a
+ * moment so that quick changes of mind only send the final rating, or nothing
+ * at all if the song ends up rated as it was before.
+ *
  * @param song the song to add a rating for
  * @param liked the rating to give the song, TRUE for liked or FALSE for
  *        disliked
+ * @return NO if the rating can't be sent, e.g. because nobody is logged in
  */
 - (BOOL) rateSong:(Song*) song as:(BOOL) liked;
 
 /**
  * @brief Delete a rating for a song
  *
- * Fires the same event for deleteFeedback
+ * Fires the same event for deleteFeedback. Held back like rateSong:as:, and if
+ * the song was rated since launch the rating is deleted directly, without
+ * looking it up in the station's feedback first.
  *
  * @param song the song to delete a user's rating for
+ * @return NO if the rating can't be deleted, e.g. because nobody is logged in
  */
 - (BOOL) deleteRating:(Song*)song;
 
+/**
+ * @brief Send every rating which is still being held back now
+ *
+ * Called when the ratings couldn't otherwise go out, such as when quitting.
+ * Logging out does this itself.
+ *
+ * @return the number of ratings sent
+ */
+- (NSUInteger) sendHeldRatings;
+
 /**
  * @brief Inform Pandora that the specified song shouldn't be played for awhile
  *
@@ -316,12 +486,58 @@ typedef void(^PandoraCallback)(NSDictionary*);
  *    - Songs: a list of SearchResult objects, one for each song found
  *    - Artists: a list of SearchResult objects, one for each artist found
  *
+ * Meant to be called as the search is typed. A search is only sent once no
+ * other has followed it for a moment, and searches made recently are answered
+ * from a cache without asking Pandora. While a search is on its way, the
+ * event may fire first with the cached results of a search it adds to which
+ * still match.
+ *
  * @param search the query string to send to Pandora
  */
 - (BOOL) search: (NSString*) search;
 
+/**
+ * @brief How well searching has avoided asking Pandora
+ *
+ * The keys are "searches" (calls to search:), "cacheHits", "refinements"
+ * (searches shown early from an earlier search's results), "debounced"
+ * (searches followed by another too soon to be sent), "requests" (searches
+ * sent), and "hitRate" and "requestReduction" as fractions of the searches.
+ */
+- (NSDictionary*) searchStatistics;
+
+/**
+ * @brief Build the results shown for the "result" of a "music.search"
+ *
+ * @return arrays of PandoraSearchResult keyed by "Songs" and "Artists"
+ */
+- (NSDictionary*) parseSearchResults: (NSDictionary*) result;
+
 #pragma mark - Prepare and Send Requests
 
+/**
+ * @brief Create the default request, with appropriate fields set based on the
+ *        current state of authentication
+ *
+ * @param method the method name for the request to be for
+ * @return the PandoraRequest object to further add callbacks to
+ */
+- (PandoraRequest*) defaultRequestWithMethod: (NSString*) method;
+
+/**
+ * @brief Creates a dictionary which contains the default keys necessary for
+ *        most requests
+ *
+ * Currently fills in the "userAuthToken" and "syncTime" fields
+ */
+- (NSMutableDictionary*) defaultRequestDictionary;
+
+/**
+ * @brief The URL a request is sent to, with its method and credentials in the
+ *        query string
+ */
+- (NSURL*) URLForRequest: (PandoraRequest*) request;
+
 /**
  * @brief Send a request to Pandora
  *
@@ -334,5 +550,24 @@ typedef void(^PandoraCallback)(NSDictionary*);
  */
 - (BOOL) sendRequest: (PandoraRequest*) request;
 
+/**
+ * @brief Counts of the requests which were never sent
+ *
+ * The keys are "coalescedReads" (answered by an identical read already in
+ * flight), "collapsedWrites" (ratings superseded or undone before being sent),
+ * "skippedLookups" (rating deletions which didn't need to fetch the station's
+ * feedback), "skippedStationLists" (station lists which were still
+ * current according to their checksum) and "cachedGenreCatalogs" (genre
+ * station catalogs which were served from the cache).
+ */
+- (NSDictionary*) savedCalls;
+
+/**
+ * @brief How long requests of each priority have waited for a free slot
+ *
+ * @see -[PandoraRequestQueue statistics]
+ */
+- (NSDictionary*) queueStatistics;
+
 @end
 
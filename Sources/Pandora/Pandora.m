@@ -7,13 +7,50 @@
  */
 
 #import "FMEngine/NSString+FMEngine.h"
+#import "Integration/Keychain.h"
 #import "Pandora/Crypt.h"
+#import "Pandora/RateLimiter.h"
+#import "Pandora/RequestBody.h"
+#import "Pandora/ResponseParser.h"
+#import "Pandora/SearchCache.h"
 #import "Pandora/Station.h"
+#import "Pandora/StationRegistry.h"
 #import "PreferencesController.h"
 #import "URLConnection.h"
 #import "Notifications.h"
 #import "PandoraDevice.h"
 
+/* Seconds a rating is held back for before being sent, in case it changes */
+#define RATING_HOLD 0.75
+
+/* Where the station list is cached, in the state directory */
+#define STATION_CACHE @"stations.savestate"
+
+/* Where the genre station catalog is cached, in the state directory, and how
+   long before checking whether it's still current */
+#define GENRE_CACHE @"genres.plist"
+#define GENRE_CACHE_LIFETIME (24 * 60 * 60)
+
+/* The Keychain item a user's session is kept in, and how long after logging
+   in it may be resumed. Pandora doesn't say when its tokens expire, and an
+   expired one only costs the login which would have happened anyway. */
+#define SESSION_KEYCHAIN_ITEM(user) [@"hermes-pandora-session:" stringByAppendingString:(user)]
+#define SESSION_LIFETIME (12 * 60 * 60)
+
+/* Requests in flight to Pandora at once, and how many of those may be ones
+   nobody is waiting on. Kept under the connection pool's limit per host, so
+   that the pool never queues a request in the order it arrived. */
+#define MAX_IN_FLIGHT 3
+#define MAX_BACKGROUND_IN_FLIGHT 2
+
+/* Searches remembered, and for how long. Pandora's catalog doesn't change
+   much within a session. */
+#define SEARCH_CACHE_SIZE 64
+#define SEARCH_CACHE_LIFETIME (15 * 60)
+
+/* Seconds without another search before one is sent */
+#define SEARCH_DEBOUNCE 0.3
+
 #pragma mark Error Codes
 
 static NSString *lowerrs[] = {
@@ -82,6 +119,7 @@ static NSString *hierrs[] = {
   self.authToken = self.partnerId = self.userId = @"";
   self.response = [[NSMutableData alloc] init];
   self.tls = self.encrypted = TRUE;
+  self.priority = PandoraPriorityDefault;
   return self;
 }
 
@@ -106,6 +144,11 @@ static NSString *hierrs[] = {
     newRequest.callback = self.callback;
     newRequest.tls = self.tls;
     newRequest.encrypted = self.encrypted;
+    newRequest.coalescingKey = self.coalescingKey;
+    newRequest.parser = self.parser;
+    newRequest.deferrable = self.deferrable;
+    newRequest.dropped = self.dropped;
+    newRequest.priority = self.priority;
   }
   return newRequest;
 }
@@ -123,45 +166,62 @@ static NSString *hierrs[] = {
 - (void)postNotification:(NSString *)notificationName request:(id)request result:(NSDictionary *)result;
 
 /**
- * @brief Parse the dictionary provided to create a station
- *
- * @param s the dictionary describing the station
- * @return the station object
+ * Gets the current UNIX time
  */
-- (Station*) parseStationFromDictionary: (NSDictionary*) s;
+- (int64_t) time;
 
 /**
- * @brief Create the default request, with appropriate fields set based on the
- *        current state of authentication
+ * @brief Send a read, unless an identical one is already in flight
  *
- * @param method the method name for the request to be for
- * @return the PandoraRequest object to further add callbacks to
- */
-- (PandoraRequest*) defaultRequestWithMethod: (NSString*) method;
-
-/**
- * @brief Creates a dictionary which contains the default keys necessary for
- *        most requests
+ * If one is, and it was sent at the same priority or a more urgent one, the
+ * request's callback is invoked with that one's response instead.
  *
- * Currently fills in the "userAuthToken" and "syncTime" fields
+ * @param req the request to send
+ * @param key identifies the reads which are identical to this one
  */
-- (NSMutableDictionary*) defaultRequestDictionary;
+- (BOOL) sendCoalescedRequest:(PandoraRequest*)req key:(NSString*)key;
 
 /**
- * Gets the current UNIX time
+ * @brief Rate a song once any further changes to its rating have had a
+ *        chance to supersede this one
+ *
+ * @param rating 1 for liked, -1 for disliked, or 0 to delete the rating
+ * @param song the song to rate
+ * @return NO if the rating couldn't be sent, in which case it isn't held
  */
-- (int64_t) time;
+- (BOOL) queueRating:(int)rating forSong:(Song*)song;
 
 @end
 
 @implementation Pandora
 
-@synthesize stations;
+@synthesize stationRegistry = station_registry;
+@synthesize resumedSession = resumed_session;
+@synthesize rateLimiter = rate_limiter;
+
+- (NSArray*) stations {
+  return [station_registry stations];
+}
 
 - (id) init {
   if ((self = [super init])) {
-    stations = [[NSMutableArray alloc] init];
+    station_registry = [[PandoraStationRegistry alloc] init];
     retries  = 0;
+    inflight_reads = [NSMutableDictionary dictionary];
+    inflight_priorities = [NSMutableDictionary dictionary];
+    pending_ratings = [NSMutableDictionary dictionary];
+    feedback_ids = [NSMutableDictionary dictionary];
+    saved_calls = [@{@"coalescedReads": @0, @"collapsedWrites": @0,
+                     @"skippedLookups": @0, @"skippedStationLists": @0,
+                     @"cachedGenreCatalogs": @0} mutableCopy];
+    rate_limiter = [[PandoraRateLimiter alloc] init];
+    _persistsState = YES;
+    request_queue = [[PandoraRequestQueue alloc] initWithLimit:MAX_IN_FLIGHT
+                                                    background:MAX_BACKGROUND_IN_FLIGHT];
+    search_cache = [[PandoraSearchCache alloc] initWithCapacity:SEARCH_CACHE_SIZE
+                                                       lifetime:SEARCH_CACHE_LIFETIME];
+    search_stats = [@{@"searches": @0, @"cacheHits": @0, @"refinements": @0,
+                      @"debounced": @0, @"requests": @0} mutableCopy];
     self.device = [PandoraDevice android];
   }
   return self;
@@ -198,12 +258,33 @@ static NSString *hierrs[] = {
 
 #pragma mark - Crypto
 
+- (NSDictionary *)device {
+  @synchronized(self) {
+    return device;
+  }
+}
+
+- (void)setDevice:(NSDictionary *)newDevice {
+  /* Look up the key schedules here rather than once per request */
+  PandoraCipherKey *encryptKey = PandoraCipherKeyForString(newDevice[kPandoraDeviceEncrypt]);
+  PandoraCipherKey *decryptKey = PandoraCipherKeyForString(newDevice[kPandoraDeviceDecrypt]);
+  @synchronized(self) {
+    device = newDevice;
+    encrypt_key = encryptKey;
+    decrypt_key = decryptKey;
+  }
+}
+
 - (NSData *)encryptData:(NSData *)data {
-  return PandoraEncryptData(data, self.device[kPandoraDeviceEncrypt]);
+  PandoraCipherKey *key;
+  @synchronized(self) { key = encrypt_key; }
+  return PandoraEncryptDataWithKey(data, key);
 }
 
 - (NSData *)decryptString:(NSString *)string {
-  return PandoraDecryptString(string, self.device[kPandoraDeviceDecrypt]);
+  PandoraCipherKey *key;
+  @synchronized(self) { key = decrypt_key; }
+  return PandoraDecryptStringWithKey(string, key);
 }
 
 #pragma mark - Authentication
@@ -211,7 +292,19 @@ static NSString *hierrs[] = {
 - (BOOL) authenticate:(NSString*)user
              password:(NSString*)pass
               request:(PandoraRequest*)req {
+  if (req == nil && [self resumeSessionForUser:user]) {
+    NSLogd(@"Resumed the session of %@", user);
+    /* Still let whoever is authenticating finish first */
+    dispatch_async(dispatch_get_main_queue(), ^{
+      [self postNotification:PandoraDidAuthenticateNotification];
+    });
+    return YES;
+  }
+
   return [self doUserLogin:user password:pass callback:^(NSDictionary *dict) {
+    self->resumed_session = NO;
+    [self saveSessionForUser:user];
+
     // Only send the PandoraDidAuthenticateNotification if there is no request to retry.
     if (req == nil) {
       [self postNotification:PandoraDidAuthenticateNotification];
@@ -300,11 +393,26 @@ static NSString *hierrs[] = {
                         };
   request.method    = @"auth.partnerLogin";
   request.encrypted = FALSE;
+  __weak PandoraRequest *weakRequest = request;
   request.callback  = ^(NSDictionary* dict) {
     NSDictionary *result = dict[@"result"];
     self->partner_auth_token = result[@"partnerAuthToken"];
     self->partner_id = result[@"partnerId"];
     NSData *sync = [self decryptString:result[@"syncTime"]];
+    if ([sync length] <= 4) {
+      /* The request is normally still alive while its callback runs, but
+         a nil value would throw */
+      PandoraRequest *failed = weakRequest;
+      NSMutableDictionary *info = [NSMutableDictionary dictionary];
+      info[@"err"] = @"Bad sync time";
+      if (failed != nil) {
+        info[@"request"] = failed;
+      }
+      [[NSNotificationCenter defaultCenter] postNotificationName:PandoraDidErrorNotification
+                                                          object:self
+                                                        userInfo:info];
+      return;
+    }
     const char *bytes = [sync bytes];
     self->sync_time = strtoul(bytes + 4, NULL, 10);
     callback();
@@ -312,11 +420,84 @@ static NSString *hierrs[] = {
   return [self sendRequest:request];
 }
 
+#pragma mark - Session
+
+- (void) saveSessionForUser:(NSString*)user {
+  NSString *device = self.device[kPandoraDeviceUsername];
+  /* Any of these missing would throw building the dictionary, and a session
+     without them couldn't be resumed anyway */
+  if (!self.persistsState || user == nil || device == nil ||
+      partner_id == nil || partner_auth_token == nil || user_id == nil ||
+      user_auth_token == nil) {
+    return;
+  }
+  NSDictionary *session = @{
+    @"device":         device,
+    @"isSubscriber":   self.cachedSubscriberStatus ?: @NO,
+    @"partnerId":      partner_id,
+    @"partnerToken":   partner_auth_token,
+    @"userId":         user_id,
+    @"userToken":      user_auth_token,
+    @"syncOffset":     @((int64_t) sync_time - (int64_t) start_time),
+    @"loggedIn":       @([self time])
+  };
+  NSData *json = [NSJSONSerialization dataWithJSONObject:session options:0 error:nil];
+  NSString *value = [[NSString alloc] initWithData:json encoding:NSASCIIStringEncoding];
+  if (value != nil) {
+    KeychainSetItem(SESSION_KEYCHAIN_ITEM(user), value);
+  }
+}
+
+- (BOOL) resumeSessionForUser:(NSString*)user {
+  if (!self.persistsState || user == nil || user_auth_token != nil) return NO;
+  NSString *value = KeychainGetPassword(SESSION_KEYCHAIN_ITEM(user));
+  NSData *json = [value dataUsingEncoding:NSASCIIStringEncoding];
+  if ([json length] == 0) return NO;
+  NSDictionary *session = [NSJSONSerialization JSONObjectWithData:json options:0 error:nil];
+  if (![session isKindOfClass:[NSDictionary class]] ||
+      [self time] - [session[@"loggedIn"] longLongValue] > SESSION_LIFETIME) {
+    return NO;
+  }
+
+  NSDictionary *device = nil;
+  for (NSDictionary *d in @[[PandoraDevice android], [PandoraDevice desktop],
+                            [PandoraDevice iPhone]]) {
+    if ([d[kPandoraDeviceUsername] isEqual:session[@"device"]]) {
+      device = d;
+    }
+  }
+  if (device == nil || session[@"partnerId"] == nil ||
+      session[@"partnerToken"] == nil || session[@"userId"] == nil ||
+      session[@"userToken"] == nil) {
+    return NO;
+  }
+
+  self.device = device;
+  self.cachedSubscriberStatus = session[@"isSubscriber"];
+  partner_id = session[@"partnerId"];
+  partner_auth_token = session[@"partnerToken"];
+  user_id = session[@"userId"];
+  user_auth_token = session[@"userToken"];
+  start_time = [self time];
+  sync_time = start_time + [session[@"syncOffset"] longLongValue];
+  resumed_session = YES;
+  return YES;
+}
+
+- (void) forgetSessionForUser:(NSString*)user {
+  if (!self.persistsState || user == nil) return;
+  KeychainSetItem(SESSION_KEYCHAIN_ITEM(user), @"");
+}
+
 - (void) logout {
+  [self forgetSessionForUser:[HMSAppDelegate getSavedUsername]];
+  /* Ratings still being held back belong to the old account, so they go out
+     while its session is still here */
+  [self sendHeldRatings];
   [self logoutNoNotify];
-  for (Station *s in stations)
-    [Station removeStation:s];
-  [stations removeAllObjects];
+  [station_registry removeAllStations];
+  station_checksum = nil;
+  [feedback_ids removeAllObjects];
   [self postNotification:PandoraDidLogOutNotification];
   // Always assume non-subscriber until API says otherwise.
   self.cachedSubscriberStatus = nil;
@@ -329,6 +510,7 @@ static NSString *hierrs[] = {
   partner_id = nil;
   user_id = nil;
   sync_time = start_time = 0;
+  resumed_session = NO;
 }
 
 - (BOOL) isAuthenticated {
@@ -349,8 +531,7 @@ static NSString *hierrs[] = {
     Station *s = [self parseStationFromDictionary:result];
     NSMutableDictionary *dict = [NSMutableDictionary dictionary];
     dict[@"station"] = s;
-    [self->stations addObject:s];
-    [Station addStation:s];
+    [self->station_registry addStation:s];
     [self postNotification:PandoraDidCreateStationNotification result:dict];
   }];
   return [self sendAuthenticatedRequest:req];
@@ -364,24 +545,14 @@ static NSString *hierrs[] = {
   [req setRequest:d];
   [req setTls:FALSE];
   [req setCallback:^(NSDictionary* d) {
-    unsigned int i;
-    
     /* Remove the station internally */
-    for (i = 0; i < [self->stations count]; i++) {
-      if ([[self->stations[i] token] isEqual:stationToken]) {
-        break;
-      }
-    }
-
-    if ([self->stations count] == i) {
+    Station *stationToRemove = [self->station_registry stationWithToken:stationToken];
+    if (stationToRemove == nil) {
       NSLogd(@"Deleted unknown station?!");
     } else {
-      Station *stationToRemove = self->stations[i];
-      [Station removeStation:stationToRemove];
-      [self->stations removeObjectAtIndex:i];
+      [self->station_registry removeStation:stationToRemove];
       [self postNotification:PandoraDidDeleteStationNotification request:stationToRemove];
     }
-    
   }];
   return [self sendAuthenticatedRequest:req];
 }
@@ -404,31 +575,106 @@ static NSString *hierrs[] = {
 
 - (BOOL) fetchStations {
   NSLogd(@"Fetching stations...");
-  
-  NSMutableDictionary *d = [self defaultRequestDictionary];
-  
+
+  [self loadStationCache];
+  if (station_checksum == nil && station_cache == nil) {
+    return [self fetchStationList];
+  }
+
+  /* Something to compare against, so see whether it's still current */
+  PandoraRequest *r = [self defaultRequestWithMethod:@"user.getStationListChecksum"];
+  [r setRequest:[self defaultRequestDictionary]];
+  [r setTls:FALSE];
+  [r setCallback: ^(NSDictionary* dict) {
+    NSString *checksum = dict[@"result"][@"checksum"];
+    NSDictionary *cache = self->station_cache;
+    if (checksum != nil && [checksum isEqual:self->station_checksum]) {
+      NSLogd(@"Station list is unchanged");
+    } else if (checksum != nil && [checksum isEqual:cache[@"checksum"]] &&
+               [self->user_id isEqual:cache[@"userId"]]) {
+      NSLogd(@"Station list is unchanged since it was cached");
+      [self mergeStations:cache[@"stations"] checksum:checksum];
+    } else {
+      [self fetchStationList];
+      return;
+    }
+    [self countSavedCall:@"skippedStationLists"];
+    [self postNotification:PandoraDidLoadStationsNotification];
+  }];
+
+  return [self sendAuthenticatedRequest:r];
+}
+
+- (BOOL) fetchStationList {
   PandoraRequest *r = [self defaultRequestWithMethod:@"user.getStationList"];
-  [r setRequest:d];
+  [r setRequest:[self defaultRequestDictionary]];
   [r setTls:FALSE];
+  [r setParser:[self stationListParser]];
   [r setCallback: ^(NSDictionary* dict) {
     NSDictionary *result = dict[@"result"];
-    for (NSDictionary *s in result[@"stations"]) {
-      Station *station = [self parseStationFromDictionary:s];
-      if (![self->stations containsObject:station]) {
-        [self->stations addObject:station];
-        [Station addStation:station];
-      }
-    };
-    
+    [self mergeStations:result[@"stations"] checksum:result[@"checksum"]];
+    [self saveStationCache:result[@"stations"] checksum:result[@"checksum"]];
     [self postNotification:PandoraDidLoadStationsNotification];
   }];
-  
+
   return [self sendAuthenticatedRequest:r];
 }
 
+- (void) mergeStations:(NSArray*)list checksum:(NSString*)checksum {
+  NSMutableArray *merged = [NSMutableArray arrayWithCapacity:[list count]];
+  for (NSDictionary *s in list) {
+    Station *station = [station_registry stationWithId:s[@"stationId"]];
+    if (station != nil) {
+      [self updateStation:station fromDictionary:s];
+    } else {
+      station = [self parseStationFromDictionary:s];
+    }
+    [merged addObject:station];
+  }
+
+  /* Whatever wasn't in the list has been deleted elsewhere */
+  [station_registry setStations:merged];
+  station_checksum = checksum;
+}
+
+- (void) loadStationCache {
+  if (station_cache != nil || !self.persistsState) return;
+  NSString *path = [HMSAppDelegate stateDirectory:STATION_CACHE];
+  if (path == nil || ![[NSFileManager defaultManager] fileExistsAtPath:path]) {
+    return;
+  }
+  @try {
+    id cache = [NSKeyedUnarchiver unarchiveObjectWithFile:path];
+    if ([cache isKindOfClass:[NSDictionary class]] &&
+        [cache[@"stations"] isKindOfClass:[NSArray class]]) {
+      station_cache = cache;
+    }
+  }
+  @catch (NSException *e) {
+    NSLogd(@"Ignoring unreadable station cache: %@", e);
+  }
+}
+
+- (void) saveStationCache:(NSArray*)list checksum:(NSString*)checksum {
+  if (list == nil || checksum == nil || user_id == nil) return;
+  station_cache = @{@"userId": user_id, @"checksum": checksum, @"stations": list};
+  if (!self.persistsState) return;
+  NSString *path = [HMSAppDelegate stateDirectory:STATION_CACHE];
+  if (path != nil) {
+    [NSKeyedArchiver archiveRootObject:station_cache toFile:path];
+  }
+}
+
 - (Station*) parseStationFromDictionary: (NSDictionary*) s {
   Station *station = [[Station alloc] init];
-  
+  [self updateStation:station fromDictionary:s];
+  return station;
+}
+
+- (void) updateStation:(Station*)station fromDictionary:(NSDictionary*)s {
+  NSString *oldToken = [station token];
+  BOOL moved = ![oldToken isEqual:s[@"stationToken"]];
+
   [station setName:           s[@"stationName"]];
   [station setStationId:      s[@"stationId"]];
   [station setToken:          s[@"stationToken"]];
@@ -436,17 +682,23 @@ static NSString *hierrs[] = {
   [station setAllowAddMusic: [s[@"allowAddMusic"] boolValue]];
   [station setAllowRename:   [s[@"allowRename"] boolValue]];
   [station setCreated:       [s[@"dateCreated"][@"time"] unsignedLongLongValue]];
-  [station setRadio:self];
+  if (moved) {
+    [station setRadio:self];
+    [station_registry station:station changedTokenFrom:oldToken];
+  }
   
   if ([s[@"isQuickMix"] boolValue]) {
     station.name = @"\U0001F500 Shuffle";
     station.isQuickMix = YES;
   }
-  return station;
 }
 
-// FIXME: Should post a standard notification, not per-invocation choice.
 - (BOOL) fetchPlaylistForStation: (Station*) station {
+  return [self fetchPlaylistForStation:station prefetch:NO];
+}
+
+// FIXME: Should post a standard notification, not per-invocation choice.
+- (BOOL) fetchPlaylistForStation: (Station*) station prefetch:(BOOL)prefetch {
   NSLogd(@"Getting fragment for %@...", [station name]);
   
   NSMutableDictionary *d = [self defaultRequestDictionary];
@@ -455,94 +707,229 @@ static NSString *hierrs[] = {
   
   PandoraRequest *r = [self defaultRequestWithMethod:@"station.getPlaylist"];
   r.request = d;
+  r.parser = [self playlistParser];
+  r.deferrable = prefetch;
+  /* The station is playing, and may have nothing left to play */
+  r.priority = prefetch ? PandoraPriorityBackground : PandoraPriorityInteractive;
   r.callback = ^(NSDictionary* dict) {
-    NSDictionary *result = dict[@"result"];
-    NSMutableArray *songs = [NSMutableArray array];
-    
-    for (NSDictionary *s in result[@"items"]) {
-      if (s[@"adToken"] != nil) continue; // Skip if this is an adToken
-      
-      Song *song = [[Song alloc] init];
-      
-      song.artist = s[@"artistName"];
-      song.title = s[@"songName"];
-      song.album = s[@"albumName"];
-      song.art = s[@"albumArtUrl"];
-      song.stationId = s[@"stationId"];
-      song.token = s[@"trackToken"];
-      song.nrating = s[@"songRating"];
-      song.albumUrl = s[@"albumDetailUrl"];
-      song.artistUrl = s[@"artistDetailUrl"];
-      song.titleUrl = s[@"songDetailUrl"];
-
-      id urls = s[@"additionalAudioUrl"];
-      if ([urls isKindOfClass:[NSArray class]]) {
-        NSArray *urlArray = urls;
-        if (urlArray.count < 3) {
-          NSLog(@"Fewer than 3 (expected) items for additionalAudioUrl: %@", urlArray);
-        }
-        switch (urlArray.count) {
-          case 3: song.highUrl = urlArray[2];
-          case 2: song.medUrl = urlArray[1];
-          case 1: song.lowUrl = urlArray[0];
-            break;
-          default:
-            NSLog(@"Unexpected number of items (not 1-3) for additionalAudioUrl: %@", urlArray);
-        }
-      } else {
-        NSLog(@"Unexpected format for additionalAudioUrl: %@", urls);
-      }
-
-      id audioUrlMap = s[@"audioUrlMap"];
-      if ([audioUrlMap isKindOfClass:[NSDictionary class]]) {
-        id qualityMap = audioUrlMap[@"highQuality"];
-        if ([qualityMap isKindOfClass:[NSDictionary class]]) {
-          NSLogd(@"High quality audio from audioUrlMap is %@ Kbps %@", qualityMap[@"bitrate"], qualityMap[@"encoding"]);
-          if (!song.highUrl || [qualityMap[@"bitrate"] integerValue] > 128)
-            song.highUrl = qualityMap[@"audioUrl"]; // 192 Kbps MP3 with Pandora One; 64 Kbps AAC+ without
-        }
-        qualityMap = audioUrlMap[@"mediumQuality"];
-        if ([qualityMap isKindOfClass:[NSDictionary class]]) {
-          NSLogd(@"Medium quality audio from audioUrlMap is %@ Kbps %@", qualityMap[@"bitrate"], qualityMap[@"encoding"]);
-          if (!song.medUrl || [qualityMap[@"bitrate"] integerValue] > 64)
-            song.medUrl = qualityMap[@"audioUrl"]; // 64 Kbps AAC+
-        }
-        qualityMap = audioUrlMap[@"lowQuality"];
-        if ([qualityMap isKindOfClass:[NSDictionary class]]) {
-          NSLogd(@"Low quality audio from audioUrlMap is %@ Kbps %@", qualityMap[@"bitrate"], qualityMap[@"encoding"]);
-          if (!song.lowUrl || [qualityMap[@"bitrate"] integerValue] > 32)
-            song.lowUrl = qualityMap[@"audioUrl"]; // 32 Kbps AAC+ (not provided with Pandora One)
-        }
-      }
-
-      if (!song.medUrl) song.medUrl = song.lowUrl;
-      if (!song.highUrl) song.highUrl = song.medUrl;
+    NSArray *songs = dict[@"result"][@"items"];
 
-      [songs addObject: song];
-    };
-    
     NSString *name = [NSString stringWithFormat:@"hermes.fragment-fetched.%@",
                       station.token];
     NSMutableDictionary *d = [NSMutableDictionary dictionary];
     d[@"songs"] = songs;
     [self postNotification:name result:d];
   };
+  r.dropped = ^{
+    NSString *name = [NSString stringWithFormat:@"hermes.fragment-dropped.%@",
+                      station.token];
+    [self postNotification:name];
+  };
   
   return [self sendAuthenticatedRequest:r];
 }
 
+- (Song*) parseSongFromDictionary: (NSDictionary*) s {
+  if (s[@"adToken"] != nil) return nil; // Skip if this is an adToken
+
+  Song *song = [[Song alloc] init];
+  
+  song.artist = s[@"artistName"];
+  song.title = s[@"songName"];
+  song.album = s[@"albumName"];
+  song.art = s[@"albumArtUrl"];
+  song.stationId = s[@"stationId"];
+  song.token = s[@"trackToken"];
+  song.nrating = s[@"songRating"];
+  song.albumUrl = s[@"albumDetailUrl"];
+  song.artistUrl = s[@"artistDetailUrl"];
+  song.titleUrl = s[@"songDetailUrl"];
+
+  id urls = s[@"additionalAudioUrl"];
+  if ([urls isKindOfClass:[NSArray class]]) {
+    NSArray *urlArray = urls;
+    if (urlArray.count < 3) {
+      NSLog(@"Fewer than 3 (expected) items for additionalAudioUrl: %@", urlArray);
+    }
+    switch (urlArray.count) {
+      case 3: song.highUrl = urlArray[2];
+      case 2: song.medUrl = urlArray[1];
+      case 1: song.lowUrl = urlArray[0];
+        break;
+      default:
+        NSLog(@"Unexpected number of items (not 1-3) for additionalAudioUrl: %@", urlArray);
+    }
+  } else {
+    NSLog(@"Unexpected format for additionalAudioUrl: %@", urls);
+  }
+
+  id audioUrlMap = s[@"audioUrlMap"];
+  if ([audioUrlMap isKindOfClass:[NSDictionary class]]) {
+    id qualityMap = audioUrlMap[@"highQuality"];
+    if ([qualityMap isKindOfClass:[NSDictionary class]]) {
+      NSLogd(@"High quality audio from audioUrlMap is %@ Kbps %@", qualityMap[@"bitrate"], qualityMap[@"encoding"]);
+      if (!song.highUrl || [qualityMap[@"bitrate"] integerValue] > 128)
+        song.highUrl = qualityMap[@"audioUrl"]; // 192 Kbps MP3 with Pandora One; 64 Kbps AAC+ without
+    }
+    qualityMap = audioUrlMap[@"mediumQuality"];
+    if ([qualityMap isKindOfClass:[NSDictionary class]]) {
+      NSLogd(@"Medium quality audio from audioUrlMap is %@ Kbps %@", qualityMap[@"bitrate"], qualityMap[@"encoding"]);
+      if (!song.medUrl || [qualityMap[@"bitrate"] integerValue] > 64)
+        song.medUrl = qualityMap[@"audioUrl"]; // 64 Kbps AAC+
+    }
+    qualityMap = audioUrlMap[@"lowQuality"];
+    if ([qualityMap isKindOfClass:[NSDictionary class]]) {
+      NSLogd(@"Low quality audio from audioUrlMap is %@ Kbps %@", qualityMap[@"bitrate"], qualityMap[@"encoding"]);
+      if (!song.lowUrl || [qualityMap[@"bitrate"] integerValue] > 32)
+        song.lowUrl = qualityMap[@"audioUrl"]; // 32 Kbps AAC+ (not provided with Pandora One)
+    }
+  }
+
+  if (!song.medUrl) song.medUrl = song.lowUrl;
+  if (!song.highUrl) song.highUrl = song.medUrl;
+  return song;
+}
+
+- (PandoraResponseParser*) stationListParser {
+  NSSet *fields = [NSSet setWithObjects:@"stationName", @"stationId",
+                   @"stationToken", @"isShared", @"allowAddMusic",
+                   @"allowRename", @"dateCreated", @"isQuickMix", nil];
+  /* The stations are merged into the ones already known, and cached, so
+     they're built later */
+  PandoraResponseParser *parser =
+      [[PandoraResponseParser alloc] initWithListKey:@"stations"
+                                              fields:fields
+                                             builder:^id(NSDictionary *s) {
+    return s;
+  }];
+  parser.resultFields = [NSSet setWithObject:@"checksum"];
+  return parser;
+}
+
+- (PandoraResponseParser*) playlistParser {
+  NSSet *fields = [NSSet setWithObjects:@"artistName", @"songName",
+                   @"albumName", @"albumArtUrl", @"stationId", @"trackToken",
+                   @"songRating", @"albumDetailUrl", @"artistDetailUrl",
+                   @"songDetailUrl", @"additionalAudioUrl", @"audioUrlMap",
+                   @"adToken", nil];
+  __weak Pandora *weakSelf = self;
+  return [[PandoraResponseParser alloc] initWithListKey:@"items"
+                                                 fields:fields
+                                                builder:^id(NSDictionary *s) {
+    return [weakSelf parseSongFromDictionary:s];
+  }];
+}
+
 - (BOOL) fetchGenreStations {
+  [self loadGenreCache];
+  if (genre_cache == nil) {
+    return [self fetchGenreCatalog];
+  }
+
+  /* The sheet asking is still setting itself up */
+  NSDictionary *result = @{@"categories": genre_cache[@"categories"]};
+  dispatch_async(dispatch_get_main_queue(), ^{
+    [self postNotification:PandoraDidLoadGenreStationsNotification result:result];
+  });
+
+  double age = [self time] - [genre_cache[@"fetched"] doubleValue];
+  if (age >= 0 && age < GENRE_CACHE_LIFETIME) {
+    [self countSavedCall:@"cachedGenreCatalogs"];
+    return YES;
+  }
+
+  /* Stale, but the catalog rarely changes, so ask whether it has */
+  PandoraRequest *req = [self defaultRequestWithMethod:@"station.getGenreStationsChecksum"];
+  [req setRequest:[self defaultRequestDictionary]];
+  [req setTls:FALSE];
+  [req setPriority:PandoraPriorityBackground];
+  [req setCallback:^(NSDictionary* d) {
+    NSString *checksum = d[@"result"][@"checksum"];
+    NSDictionary *cache = self->genre_cache;
+    if (checksum == nil || ![checksum isEqual:cache[@"checksum"]]) {
+      [self fetchGenreCatalog];
+      return;
+    }
+    NSLogd(@"Genre stations are unchanged since they were cached");
+    [self countSavedCall:@"cachedGenreCatalogs"];
+    [self saveGenreCache:cache[@"categories"] checksum:checksum];
+  }];
+  return [self sendAuthenticatedRequest:req];
+}
+
+- (BOOL) fetchGenreCatalog {
   NSMutableDictionary *d = [self defaultRequestDictionary];
   
   PandoraRequest *req = [self defaultRequestWithMethod:@"station.getGenreStations"];
   [req setRequest:d];
   [req setTls:FALSE];
+  [req setPriority:PandoraPriorityBackground];
   [req setCallback:^(NSDictionary* d) {
-    [self postNotification:PandoraDidLoadGenreStationsNotification result:d[@"result"]];
+    NSArray *categories = [self compactGenreCategories:d[@"result"][@"categories"]];
+    [self saveGenreCache:categories checksum:d[@"result"][@"checksum"]];
+    [self postNotification:PandoraDidLoadGenreStationsNotification
+                    result:@{@"categories": categories}];
   }];
   return [self sendAuthenticatedRequest:req];
 }
 
+/* Only the names and tokens are needed, and sorting once here saves every
+   sheet from sorting again */
+- (NSArray*) compactGenreCategories:(NSArray*)categories {
+  NSMutableArray *compact = [NSMutableArray arrayWithCapacity:[categories count]];
+  for (NSDictionary *category in categories) {
+    NSMutableArray *stations = [NSMutableArray array];
+    for (NSDictionary *s in category[@"stations"]) {
+      if (s[@"stationName"] == nil || s[@"stationToken"] == nil) continue;
+      [stations addObject:@{@"stationName": s[@"stationName"],
+                            @"stationToken": s[@"stationToken"]}];
+    }
+    [stations sortUsingComparator:^NSComparisonResult(NSDictionary *s1, NSDictionary *s2) {
+      return [s1[@"stationName"] localizedStandardCompare:s2[@"stationName"]];
+    }];
+    [compact addObject:@{@"categoryName": category[@"categoryName"] ?: @"",
+                         @"stations": stations}];
+  }
+  return compact;
+}
+
+- (void) loadGenreCache {
+  if (genre_cache != nil || !self.persistsState) return;
+  NSString *path = [HMSAppDelegate stateDirectory:GENRE_CACHE];
+  NSData *data = path == nil ? nil : [NSData dataWithContentsOfFile:path];
+  if (data == nil) return;
+  id cache = [NSPropertyListSerialization propertyListWithData:data
+                                                       options:NSPropertyListImmutable
+                                                        format:NULL
+                                                         error:nil];
+  if ([cache isKindOfClass:[NSDictionary class]] &&
+      [cache[@"categories"] isKindOfClass:[NSArray class]]) {
+    genre_cache = cache;
+  } else {
+    NSLogd(@"Ignoring unreadable genre cache");
+  }
+}
+
+- (void) saveGenreCache:(NSArray*)categories checksum:(NSString*)checksum {
+  if (categories == nil) return;
+  NSMutableDictionary *cache = [NSMutableDictionary dictionary];
+  cache[@"categories"] = categories;
+  cache[@"fetched"] = @([self time]);
+  if (checksum != nil) {
+    cache[@"checksum"] = checksum;
+  }
+  genre_cache = cache;
+  if (!self.persistsState) return;
+  NSString *path = [HMSAppDelegate stateDirectory:GENRE_CACHE];
+  NSData *data = [NSPropertyListSerialization dataWithPropertyList:cache
+                                                            format:NSPropertyListBinaryFormat_v1_0
+                                                           options:0
+                                                             error:nil];
+  if (path != nil && data != nil) {
+    [data writeToFile:path atomically:YES];
+  }
+}
+
 - (BOOL) fetchStationInfo:(Station *)station {
   NSMutableDictionary *d = [self defaultRequestDictionary];
   d[@"stationToken"] = [station token];
@@ -551,6 +938,7 @@ static NSString *hierrs[] = {
   PandoraRequest *req = [self defaultRequestWithMethod:@"station.getStation"];
   [req setRequest:d];
   [req setTls:FALSE];
+  [req setPriority:PandoraPriorityBackground];
   [req setCallback:^(NSDictionary* d) {
     NSMutableDictionary *info = [NSMutableDictionary dictionary];
     NSDictionary *result = d[@"result"];
@@ -586,7 +974,8 @@ static NSString *hierrs[] = {
     
     [self postNotification:PandoraDidLoadStationInfoNotification result:info];
   }];
-  return [self sendAuthenticatedRequest:req];
+  return [self sendCoalescedRequest:req
+                                key:[@"station.getStation:" stringByAppendingString:[station token]]];
 }
 
 #pragma mark Seed & Feedback Management (see also Song Manipulation)
@@ -600,6 +989,7 @@ static NSString *hierrs[] = {
   [req setRequest:d];
   [req setTls:FALSE];
   [req setCallback:^(NSDictionary* d) {
+    [self->feedback_ids removeObjectsForKeys:[self->feedback_ids allKeysForObject:feedbackId]];
     [self postNotification:PandoraDidDeleteFeedbackNotification request:feedbackId];
   }];
   return [self sendAuthenticatedRequest:req];
@@ -635,61 +1025,124 @@ static NSString *hierrs[] = {
 #pragma mark Sort stations in UI
 
 - (void) sortStations:(NSInteger)sort {
-  [stations sortUsingComparator:
-   ^NSComparisonResult (Station *s1, Station *s2) {
-     // keep Shuffle/QuickMix at the top of the list
-     if ([s1 isQuickMix]) return NSOrderedAscending;
-     if ([s2 isQuickMix]) return NSOrderedDescending;
-
-     NSInteger factor = (sort == SORT_NAME_DSC || sort == SORT_DATE_DSC) ? -1 : 1;
-     if (sort == SORT_NAME_ASC || sort == SORT_NAME_DSC)
-       return factor * [[s1 name] caseInsensitiveCompare:[s2 name]];
-     
-     if ([s1 created] < [s2 created]) {
-       return factor * NSOrderedAscending;
-     } else if ([s1 created] > [s2 created]) {
-       return factor * NSOrderedDescending;
-     }
-     return NSOrderedSame;
-   }];
+  [station_registry sortBy:sort];
 }
 
 #pragma mark - Song Manipulation
 
 - (BOOL) rateSong:(Song*) song as:(BOOL) liked {
   NSLogd(@"Rating song '%@' as %d...", [song title], liked);
-  
-  if (liked == TRUE) {
-    [song setNrating:@1];
+  return [self queueRating:(liked ? 1 : -1) forSong:song];
+}
+
+- (BOOL) deleteRating:(Song*)song {
+  NSLogd(@"Removing rating on '%@'", [song title]);
+  return [self queueRating:0 forSong:song];
+}
+
+/* Whether a rating of the song could be sent once it's no longer held back:
+   the requests need the song's and its station's tokens, and a session or the
+   credentials to start one */
+- (BOOL) canSendRatingForSong:(Song*)song {
+  if ([song token] == nil || [[song station] token] == nil) {
+    return NO;
+  }
+  return [self isAuthenticated] || [HMSAppDelegate getSavedUsername] != nil;
+}
+
+- (BOOL) queueRating:(int)rating forSong:(Song*)song {
+  if (![self canSendRatingForSong:song]) {
+    /* As before ratings were held back, the song still shows the rating */
+    [song setNrating:@(rating)];
+    return NO;
+  }
+
+  NSMutableDictionary *pending = pending_ratings[[song token]];
+  if (pending == nil) {
+    pending = [@{@"song": song, @"sent": @([[song nrating] intValue])} mutableCopy];
+    pending_ratings[[song token]] = pending;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(RATING_HOLD * NSEC_PER_SEC)),
+                   dispatch_get_main_queue(), ^{
+      [self sendQueuedRating:pending];
+    });
   } else {
-    [song setNrating:@-1];
+    /* The rating waiting to go out is superseded by this one */
+    [self countSavedCall:@"collapsedWrites"];
   }
-  
+  pending[@"rating"] = @(rating);
+  [song setNrating:@(rating)];
+  return YES;
+}
+
+- (NSUInteger) sendHeldRatings {
+  NSArray *held = [pending_ratings allValues];
+  for (NSDictionary *pending in held) {
+    [self sendQueuedRating:pending];
+  }
+  return [held count];
+}
+
+- (void) sendQueuedRating:(NSDictionary*)pending {
+  Song *song = pending[@"song"];
+  if (pending_ratings[[song token]] != pending) {
+    return; /* Already sent early */
+  }
+  [pending_ratings removeObjectForKey:[song token]];
+
+  int rating = [pending[@"rating"] intValue];
+  if (rating == [pending[@"sent"] intValue]) {
+    /* Changed back to what Pandora already has. Still let everyone waiting on
+       the rating know that it's settled. */
+    NSLogd(@"Rating of '%@' is unchanged, not sending it", [song title]);
+    [self countSavedCall:@"collapsedWrites"];
+    if (rating == 0) {
+      [self postNotification:PandoraDidDeleteFeedbackNotification request:nil];
+    } else {
+      [self postNotification:PandoraDidRateSongNotification request:song];
+    }
+  } else if (rating == 0) {
+    [self sendDeleteRating:song];
+  } else {
+    [self sendRating:song as:(rating > 0)];
+  }
+}
+
+- (BOOL) sendRating:(Song*)song as:(BOOL)liked {
   NSMutableDictionary *d = [self defaultRequestDictionary];
   d[@"trackToken"] = [song token];
   d[@"isPositive"] = @(liked);
   d[@"stationToken"] = [[song station] token];
-  
+
   PandoraRequest *req = [self defaultRequestWithMethod:@"station.addFeedback"];
   [req setRequest:d];
   [req setTls:FALSE];
-  [req setCallback:^(NSDictionary* _) {
+  [req setPriority:PandoraPriorityInteractive];
+  [req setCallback:^(NSDictionary* d) {
+    /* Remembered so that deleting the rating needn't look it up */
+    NSString *feedbackId = d[@"result"][@"feedbackId"];
+    if (feedbackId != nil) {
+      self->feedback_ids[[song token]] = feedbackId;
+    }
     [self postNotification:PandoraDidRateSongNotification request:song];
   }];
   return [self sendAuthenticatedRequest:req];
 }
 
-- (BOOL) deleteRating:(Song*)song {
-  NSLogd(@"Removing rating on '%@'", [song title]);
-  [song setNrating:@0];
-  
+- (BOOL) sendDeleteRating:(Song*)song {
+  NSString *feedbackId = feedback_ids[[song token]];
+  if (feedbackId != nil) {
+    [self countSavedCall:@"skippedLookups"];
+    return [self deleteFeedback:feedbackId];
+  }
+
   NSMutableDictionary *d = [self defaultRequestDictionary];
   d[@"stationToken"] = [[song station] token];
   d[@"includeExtendedAttributes"] = @YES;
-  
+
   PandoraRequest *req = [self defaultRequestWithMethod:@"station.getStation"];
   [req setRequest:d];
   [req setTls:FALSE];
+  [req setPriority:PandoraPriorityInteractive];
   [req setCallback:^(NSDictionary* d) {
     for (NSString *thumb in @[@"thumbsUp", @"thumbsDown"]) {
       for (NSDictionary* feed in d[@"result"][@"feedback"][thumb]) {
@@ -700,7 +1153,10 @@ static NSString *hierrs[] = {
       }
     }
   }];
-  return [self sendAuthenticatedRequest:req];
+  /* The same read as fetchStationInfo:, which the station editor may well
+     have in flight */
+  return [self sendCoalescedRequest:req
+                                key:[@"station.getStation:" stringByAppendingString:[[song station] token]]];
 }
 
 - (BOOL) tiredOfSong: (Song*) song {
@@ -712,6 +1168,7 @@ static NSString *hierrs[] = {
   PandoraRequest *req = [self defaultRequestWithMethod:@"user.sleepSong"];
   [req setRequest:d];
   [req setTls:FALSE];
+  [req setPriority:PandoraPriorityInteractive];
   [req setCallback:^(NSDictionary* _) {
     [self postNotification:PandoraDidTireSongNotification request:song];
   }];
@@ -733,51 +1190,102 @@ static NSString *hierrs[] = {
 
 - (BOOL) search: (NSString*) search {
   NSLogd(@"Searching for %@...", search);
+  [self countSearch:@"searches"];
 
-  search = [search stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
-  if ([search length] == 0) {
+  NSString *query = [PandoraSearchCache normalizeQuery:search];
+  if ([query length] == 0) {
     [self postNotification:PandoraDidLoadSearchResultsNotification request:search result:@{}];
     return YES;
   }
 
+  NSDictionary *cached = [search_cache resultsForQuery:query];
+  if (cached != nil) {
+    [self countSearch:@"cacheHits"];
+    [self postNotification:PandoraDidLoadSearchResultsNotification request:search result:cached];
+    return YES;
+  }
+
+  /* Something to show until Pandora answers */
+  NSDictionary *refined = [search_cache refinedResultsForQuery:query];
+  if (refined != nil) {
+    [self countSearch:@"refinements"];
+    [self postNotification:PandoraDidLoadSearchResultsNotification request:search result:refined];
+  }
+
+  /* Only the search typed last before a pause is sent */
+  NSUInteger generation = ++search_generation;
+  dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(SEARCH_DEBOUNCE * NSEC_PER_SEC)),
+                 dispatch_get_main_queue(), ^{
+    if (self->search_generation != generation) {
+      [self countSearch:@"debounced"];
+      return;
+    }
+    [self sendSearch:search query:query];
+  });
+  return YES;
+}
+
+- (BOOL) sendSearch:(NSString*)search query:(NSString*)query {
   NSMutableDictionary *d = [self defaultRequestDictionary];
-  d[@"searchText"] = search;
+  d[@"searchText"] = [search stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
 
   PandoraRequest *req = [self defaultRequestWithMethod:@"music.search"];
   [req setRequest:d];
   [req setTls:FALSE];
+  [req setPriority:PandoraPriorityBackground];
   [req setCallback:^(NSDictionary* d) {
     NSDictionary *result = d[@"result"];
     NSLogd(@"%@", result);
 
-    NSMutableArray *search_songs, *search_artists;
-    search_songs    = [NSMutableArray array];
-    search_artists  = [NSMutableArray array];
-
-    for (NSDictionary *s in result[@"songs"]) {
-      PandoraSearchResult *r = [[PandoraSearchResult alloc] init];
-      NSString *name = [NSString stringWithFormat:@"%@ - %@",
-                          s[@"songName"],
-                          s[@"artistName"]];
-      [r setName:name];
-      [r setValue:s[@"musicToken"]];
-      [search_songs addObject:r];
-    }
-
-    for (NSDictionary *a in result[@"artists"]) {
-      PandoraSearchResult *r = [[PandoraSearchResult alloc] init];
-      [r setValue:a[@"musicToken"]];
-      [r setName:a[@"artistName"]];
-      [search_artists addObject:r];
-    }
-
-    NSDictionary *searchResults = @{@"Songs": search_songs,
-                                    @"Artists": search_artists};
+    NSDictionary *searchResults = [self parseSearchResults:result];
+    [self->search_cache setResults:searchResults forQuery:query];
 
     [self postNotification:PandoraDidLoadSearchResultsNotification request:search result:searchResults];
   }];
 
-  return [self sendAuthenticatedRequest:req];
+  [self countSearch:@"requests"];
+  /* The same search typed again before the first was answered */
+  return [self sendCoalescedRequest:req
+                                key:[@"music.search:" stringByAppendingString:query]];
+}
+
+- (NSDictionary*) parseSearchResults: (NSDictionary*) result {
+  NSMutableArray *search_songs, *search_artists;
+  search_songs    = [NSMutableArray array];
+  search_artists  = [NSMutableArray array];
+
+  for (NSDictionary *s in result[@"songs"]) {
+    PandoraSearchResult *r = [[PandoraSearchResult alloc] init];
+    NSString *name = [NSString stringWithFormat:@"%@ - %@",
+                        s[@"songName"],
+                        s[@"artistName"]];
+    [r setName:name];
+    [r setValue:s[@"musicToken"]];
+    [search_songs addObject:r];
+  }
+
+  for (NSDictionary *a in result[@"artists"]) {
+    PandoraSearchResult *r = [[PandoraSearchResult alloc] init];
+    [r setValue:a[@"musicToken"]];
+    [r setName:a[@"artistName"]];
+    [search_artists addObject:r];
+  }
+
+  return @{@"Songs": search_songs, @"Artists": search_artists};
+}
+
+- (void) countSearch:(NSString*)kind {
+  search_stats[kind] = @([search_stats[kind] unsignedIntegerValue] + 1);
+}
+
+- (NSDictionary*) searchStatistics {
+  NSMutableDictionary *stats = [search_stats mutableCopy];
+  double searches = [stats[@"searches"] doubleValue];
+  if (searches > 0) {
+    stats[@"hitRate"] = @([stats[@"cacheHits"] doubleValue] / searches);
+    stats[@"requestReduction"] = @(1 - [stats[@"requests"] doubleValue] / searches);
+  }
+  return stats;
 }
 
 #pragma mark - Prepare and Send Requests
@@ -800,6 +1308,19 @@ static NSString *hierrs[] = {
   return req;
 }
 
+- (NSURL*) URLForRequest: (PandoraRequest*) request {
+  NSString *url  = [NSString stringWithFormat:
+                    @"http%s://%@" PANDORA_API_PATH
+                    @"?method=%@&partner_id=%@&auth_token=%@&user_id=%@",
+                    [request tls] && ![self.device[kPandoraDeviceNoTLS] boolValue] ? "s" : "",
+                    self.device[kPandoraDeviceAPIHost],
+                    [request method],
+                    [request partnerId],
+                    [[request authToken] urlEncoded],
+                    [request userId]];
+  return [NSURL URLWithString:url];
+}
+
 - (BOOL) sendAuthenticatedRequest: (PandoraRequest*) req {
   if ([self isAuthenticated]) {
     return [self sendRequest:req];
@@ -810,36 +1331,103 @@ static NSString *hierrs[] = {
 }
 
 
+- (BOOL) sendCoalescedRequest:(PandoraRequest*)req key:(NSString*)key {
+  /* Only behind a read which is at least as urgent, as a background one may
+     yet be waiting for a slot. A more urgent read goes out itself, and the
+     reads after it wait on it instead. */
+  NSMutableArray *waiting = inflight_reads[key];
+  if (waiting != nil &&
+      [inflight_priorities[key] intValue] <= (int) [req priority]) {
+    [waiting addObject:[req callback]];
+    [self countSavedCall:@"coalescedReads"];
+    return YES;
+  }
+
+  waiting = [NSMutableArray arrayWithObject:[req callback]];
+  inflight_reads[key] = waiting;
+  inflight_priorities[key] = @([req priority]);
+  [req setCoalescingKey:key];
+  [req setCallback:^(NSDictionary* d) {
+    if (self->inflight_reads[key] == waiting) {
+      [self->inflight_reads removeObjectForKey:key];
+      [self->inflight_priorities removeObjectForKey:key];
+    }
+    for (PandoraCallback callback in waiting) {
+      callback(d);
+    }
+  }];
+  return [self sendAuthenticatedRequest:req];
+}
+
+- (void) countSavedCall:(NSString*)kind {
+  saved_calls[kind] = @([saved_calls[kind] unsignedIntegerValue] + 1);
+  NSLogd(@"Saved a request (%@), %@ so far", kind, saved_calls[kind]);
+}
+
+- (NSDictionary*) savedCalls {
+  return [saved_calls copy];
+}
+
+- (NSDictionary*) queueStatistics {
+  return [request_queue statistics];
+}
+
+- (NSTimeInterval) retryDelayForRequest:(PandoraRequest*)request {
+  return [rate_limiter retryDelayForMethod:[request method]];
+}
+
 - (BOOL) sendRequest: (PandoraRequest*) request {
-  NSString *url  = [NSString stringWithFormat:
-                    @"http%s://%@" PANDORA_API_PATH
-                    @"?method=%@&partner_id=%@&auth_token=%@&user_id=%@",
-                    [request tls] ? "s" : "",
-                    self.device[kPandoraDeviceAPIHost],
-                    [request method],
-                    [request partnerId],
-                    [[request authToken] urlEncoded],
-                    [request userId]];
-  NSLogd(@"%@", url);
-  
+  NSTimeInterval wait = [rate_limiter admitMethod:[request method]
+                                       deferrable:[request deferrable]];
+  if (wait < 0) {
+    NSLogd(@"Dropping %@ while Pandora is throttling it", [request method]);
+    if ([request dropped] != nil) {
+      [request dropped]();
+    }
+    return NO;
+  }
+  if (wait > 0) {
+    NSLogd(@"Holding %@ back for %.1fs", [request method], wait);
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(wait * NSEC_PER_SEC)),
+                   dispatch_get_main_queue(), ^{
+      /* The sync time was only good for when the request was made */
+      if (request.request[@"syncTime"] != nil) {
+        NSMutableDictionary *d = [request.request mutableCopy];
+        d[@"syncTime"] = [self syncTimeNum];
+        request.request = d;
+      }
+      [self sendRequest:request];
+    });
+    return TRUE;
+  }
+
+  NSURL *nsurl = [self URLForRequest:request];
+  NSLogd(@"%@", nsurl);
+
   /* Prepare the request */
-  NSURL *nsurl = [NSURL URLWithString:url];
   NSMutableURLRequest *nsrequest = [NSMutableURLRequest requestWithURL:nsurl];
   [nsrequest setHTTPMethod: @"POST"];
   [nsrequest addValue:@"application/json" forHTTPHeaderField:@"Content-Type"];
   
   /* Create the body */
-  NSData *data = [NSJSONSerialization dataWithJSONObject:request.request options:0 error:nil];
-  if ([request encrypted]) { data = [self encryptData:data]; }
-  [nsrequest setHTTPBody: data];
+  PandoraCipherKey *key = nil;
+  if ([request encrypted]) {
+    @synchronized(self) { key = encrypt_key; }
+  }
+  [nsrequest setHTTPBody: PandoraRequestBody(request.request, key)];
   
   /* Create the connection with necessary callback for when done */
+  PandoraResponseParser *parser = request.parser;
+  PandoraPriority priority = [request priority];
   URLConnection *c =
   [URLConnection connectionForRequest:nsrequest
                     completionHandler:^(NSData *d, NSError *e) {
+                      [self->request_queue finished:priority];
                       NSDictionary *dict = nil;
                       /* Parse the JSON if we don't have an error */
-                      if (!e) {
+                      if (!e && parser != nil) {
+                        dict = [parser finishWithError:&e];
+                      } else if (!e) {
                         dict = [NSJSONSerialization JSONObjectWithData:d options:0 error:&e];
                       }
 
@@ -854,10 +1442,20 @@ static NSString *hierrs[] = {
                       /* If we don't have an error, then invoke the callback. */
                       if (err == nil) {
                         assert(dict != nil);
+                        [self->rate_limiter recordSuccessForMethod:[request method]];
                         [request callback](dict);
                         return;
                       }
 
+                      /* A failed read is no longer in flight for others to
+                         wait on, although it may yet be retried */
+                      NSString *key = request.coalescingKey;
+                      if (key != nil &&
+                          [self->inflight_priorities[key] intValue] == (int) priority) {
+                        [self->inflight_reads removeObjectForKey:key];
+                        [self->inflight_priorities removeObjectForKey:key];
+                      }
+
                       /* Otherwise build the error dictionary. */
                       NSMutableDictionary *info = [NSMutableDictionary dictionary];
                       info[@"request"] = request;
@@ -866,14 +1464,38 @@ static NSString *hierrs[] = {
                         NSInteger code = e.code;
                         if (code != 0)
                           info[@"nsErrorCode"] = @(code); /* This is a NSError code. */
+                        [self->rate_limiter recordFailure:PandoraFailureNetwork
+                                                forMethod:[request method]];
                       } else if (dict) {
                         info[@"code"] = dict[@"code"]; /* This is a Pandora error code. */
+                        int code = [dict[@"code"] intValue];
+                        if (code == 0 || code == PLAYLIST_EXCEEDED) {
+                          [self->rate_limiter recordFailure:PandoraFailureThrottled
+                                                  forMethod:[request method]];
+                        }
+                      }
+                      /* Nobody is waiting on it, and it'll be asked for again
+                         when it is needed */
+                      if ([request deferrable]) {
+                        NSLogd(@"Giving up on %@: %@", [request method], err);
+                        if ([request dropped] != nil) {
+                          [request dropped]();
+                        }
+                        return;
                       }
                       [[NSNotificationCenter defaultCenter] postNotificationName:PandoraDidErrorNotification
                                                                           object:self
                                                                         userInfo:info];
                     }];
-  [c start];
+  if (parser != nil) {
+    [c setDataHandler:^(const void *bytes, NSUInteger length) {
+      [parser feed:bytes length:length];
+    }];
+  }
+  [request_queue enqueue:^{
+    [parser reset];
+    [c start];
+  } priority:priority];
   return TRUE;
 }
 
@@ -13,6 +13,8 @@ extern NSString * const kPandoraDeviceDeviceID;
 extern NSString * const kPandoraDeviceEncrypt;
 extern NSString * const kPandoraDeviceDecrypt;
 extern NSString * const kPandoraDeviceAPIHost;
+/* Set to @YES for a stand-in tuner which only speaks plain HTTP */
+extern NSString * const kPandoraDeviceNoTLS;
 
 
 @interface PandoraDevice : NSObject
@@ -15,6 +15,7 @@ NSString * const kPandoraDeviceDeviceID = @"deviceid";
 NSString * const kPandoraDeviceEncrypt  = @"encrypt";
 NSString * const kPandoraDeviceDecrypt  = @"decrypt";
 NSString * const kPandoraDeviceAPIHost  = @"apihost";
+NSString * const kPandoraDeviceNoTLS    = @"notls";
 
 
 @implementation PandoraDevice : NSObject
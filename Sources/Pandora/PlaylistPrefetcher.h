@@ -0,0 +1,76 @@
+/**
+ * @file Pandora/PlaylistPrefetcher.h
+ * @brief Deciding when a station should fetch more of its playlist
+ *
+ * A station keeps enough songs queued to cover a target amount of listening,
+ * rather than waiting until it is down to its last song. How long a queued
+ * song lasts is learned from how long songs are actually listened to, so
+ * skipping songs makes the queue count for less, and the target grows with
+ * how long station.getPlaylist has been taking to answer. Fetches are spaced
+ * out and capped per hour across all stations, to stay clear of Pandora's
+ * limits on playlist requests.
+ */
+
+@interface PlaylistPrefetcher : NSObject
+
+/**
+ * @brief Whether a fetch is in flight
+ *
+ * A fetch which hasn't been answered for long enough that it probably failed
+ * doesn't count.
+ */
+@property (readonly) BOOL fetching;
+
+/**
+ * @brief Learn from how long a song was listened to before the next started
+ *
+ * @param seconds how far into the song playback got, whether it finished or
+ *        was skipped
+ */
+- (void) songEndedAfter:(double)seconds;
+
+/**
+ * @brief Whether there is too little queued to cover the lookahead
+ *
+ * @param queued the songs queued after the current one
+ * @param progress how far into the current song playback is, or 0 if no song
+ *        is playing
+ * @param duration the length of the current song, or 0 if not known
+ */
+- (BOOL) shouldFetchWithQueued:(NSUInteger)queued
+                      progress:(double)progress
+                      duration:(double)duration;
+
+/**
+ * @brief Whether the rate limits allow a fetch now
+ *
+ * @param urgent YES if the station has run out of songs, in which case the
+ *        fetch is always allowed
+ */
+- (BOOL) mayFetch:(BOOL)urgent;
+
+/**
+ * @brief Record that a fetch was sent
+ */
+- (void) fetchStarted:(BOOL)urgent;
+
+/**
+ * @brief Record that a fetch was answered, learning how long it took
+ */
+- (void) fetchFinished;
+/**
+ * @brief Record that a fetch was dropped without an answer, so that another
+ *        may be sent when one is next needed
+ */
+- (void) fetchDropped;
+
+/**
+ * @brief Counters of how prefetching has done so far, across all stations
+ *
+ * The keys are "prefetches" (fetches sent before the station ran out),
+ * "urgentFetches" (fetches sent because a station had nothing left to play)
+ * and "rateLimited" (times a fetch was held back by the limits).
+ */
++ (NSDictionary*) statistics;
+
+@end
@@ -0,0 +1,123 @@
+#import "PlaylistPrefetcher.h"
+
+/* Seconds of listening to keep queued, before allowing for latency */
+#define LOOKAHEAD 120
+
+/* How many of the latest station.getPlaylist round trips to add on top */
+#define LATENCY_MARGIN 3
+
+/* Songs queued beyond which no more are fetched, however briefly they're
+   listened to, since their URLs expire */
+#define MAX_QUEUED 8
+
+/* Guesses until there's something to learn from */
+#define INITIAL_LISTEN 180
+#define INITIAL_LATENCY 2
+
+/* Weight of the newest sample in the running averages */
+#define SMOOTHING 0.3
+
+/* Seconds between fetches for one station, unless it has run out */
+#define MIN_FETCH_INTERVAL 20
+
+/* Fetches allowed in an hour, across all stations */
+#define FETCHES_PER_HOUR 40
+
+/* Seconds after which an unanswered fetch is assumed to have failed */
+#define FETCH_TIMEOUT 30
+
+static NSMutableArray *recentFetches;
+static NSUInteger prefetches, urgentFetches, rateLimited;
+
+@implementation PlaylistPrefetcher {
+  double listen;
+  double latency;
+  CFAbsoluteTime fetchedAt;
+  BOOL inFlight;
+}
+
++ (void) initialize {
+  if (self == [PlaylistPrefetcher class]) {
+    recentFetches = [NSMutableArray array];
+  }
+}
+
+- (id) init {
+  if (!(self = [super init])) return nil;
+  listen = INITIAL_LISTEN;
+  latency = INITIAL_LATENCY;
+  return self;
+}
+
+- (BOOL) fetching {
+  return inFlight && CFAbsoluteTimeGetCurrent() - fetchedAt < FETCH_TIMEOUT;
+}
+
+- (void) songEndedAfter:(double)seconds {
+  if (seconds <= 0) return;
+  listen += SMOOTHING * (seconds - listen);
+}
+
+- (BOOL) shouldFetchWithQueued:(NSUInteger)queued
+                      progress:(double)progress
+                      duration:(double)duration {
+  if (queued >= MAX_QUEUED) return NO;
+  /* A skip must always have something to go to */
+  if (queued < 2) return YES;
+
+  /* The current song is expected to last as long as songs usually do, but no
+     longer than it has left */
+  double current = MAX(listen - progress, 0);
+  if (duration > 0) {
+    current = MIN(current, MAX(duration - progress, 0));
+  }
+  double lookahead = current + queued * listen;
+  return lookahead < LOOKAHEAD + LATENCY_MARGIN * latency;
+}
+
+- (BOOL) mayFetch:(BOOL)urgent {
+  CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+  while ([recentFetches count] > 0 &&
+         now - [recentFetches[0] doubleValue] > 60 * 60) {
+    [recentFetches removeObjectAtIndex:0];
+  }
+
+  /* Running out is worse than risking Pandora's limit */
+  BOOL allowed = urgent ||
+                 ([recentFetches count] < FETCHES_PER_HOUR &&
+                  (fetchedAt == 0 || now - fetchedAt >= MIN_FETCH_INTERVAL));
+  if (!allowed) {
+    rateLimited++;
+  }
+  return allowed;
+}
+
+- (void) fetchStarted:(BOOL)urgent {
+  fetchedAt = CFAbsoluteTimeGetCurrent();
+  inFlight = YES;
+  [recentFetches addObject:@(fetchedAt)];
+  if (urgent) {
+    urgentFetches++;
+  } else {
+    prefetches++;
+  }
+}
+
+- (void) fetchFinished {
+  if (!inFlight) return;
+  inFlight = NO;
+  latency += SMOOTHING * (CFAbsoluteTimeGetCurrent() - fetchedAt - latency);
+  NSLogd(@"Playlist arrived, latency now %.2fs, listening %.0fs per song",
+         latency, listen);
+}
+
+- (void) fetchDropped {
+  inFlight = NO;
+}
+
++ (NSDictionary*) statistics {
+  return @{@"prefetches": @(prefetches), @"urgentFetches": @(urgentFetches),
+           @"rateLimited": @(rateLimited)};
+}
+
+@end
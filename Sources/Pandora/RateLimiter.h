@@ -0,0 +1,79 @@
+/**
+ * @file Pandora/RateLimiter.h
+ * @brief Keeping the requests sent to Pandora under its limits
+ *
+ * Methods are grouped into families which each have a token bucket: a burst
+ * of requests may go out at once, after which they go out no faster than the
+ * bucket refills. Requests which nobody is waiting on get the last token of
+ * a bucket only after everything else, and are dropped altogether while
+ * Pandora is throttling their family.
+ *
+ * Failures put a family into exponential backoff with jitter, which is much
+ * longer when Pandora said it was getting too many requests than when the
+ * network failed.
+ */
+
+typedef enum {
+  PandoraFailureNetwork,    /* No answer came back */
+  PandoraFailureThrottled,  /* Pandora answered that it's getting too much */
+  PandoraFailureClasses
+} PandoraFailureClass;
+
+@interface PandoraRateLimiter : NSObject
+
+/**
+ * @brief The family a method is limited with
+ *
+ * One of "auth", "playlist", "feedback", "edit" or "browse".
+ */
++ (NSString*) familyForMethod:(NSString*)method;
+
+/**
+ * @brief Change the quota of a family, starting it with a full bucket
+ *
+ * @param burst how many requests may go out at once
+ * @param rate how many requests per second may go out after a burst
+ */
+- (void) setBurst:(double)burst rate:(double)rate forFamily:(NSString*)family;
+
+/**
+ * @brief Ask whether a request may be sent now, taking a token if it may
+ *
+ * @param method the Pandora method of the request
+ * @param deferrable YES if nobody is waiting on the request
+ * @return 0 if the request may be sent, the number of seconds after which to
+ *         ask again if it must wait, or -1 if it should be dropped
+ */
+- (NSTimeInterval) admitMethod:(NSString*)method deferrable:(BOOL)deferrable;
+
+/**
+ * @brief Record that a request was answered successfully, ending the backoff
+ *        of its family
+ */
+- (void) recordSuccessForMethod:(NSString*)method;
+
+/**
+ * @brief Record that a request failed, backing off its family
+ */
+- (void) recordFailure:(PandoraFailureClass)failure forMethod:(NSString*)method;
+
+/**
+ * @brief How long to wait before retrying a failed request
+ */
+- (NSTimeInterval) retryDelayForMethod:(NSString*)method;
+
+/**
+ * @brief A snapshot of every family
+ *
+ * Keyed by family, each with "tokens", "burst", "rate", "backoff" (seconds
+ * left), "failures", and the counts "admitted", "deferred" and "shed".
+ */
+- (NSDictionary*) state;
+
+/**
+ * @brief The clock the limiter runs on, which defaults to
+ *        CFAbsoluteTimeGetCurrent() and is only replaced to check the limiter
+ */
+@property (copy) CFAbsoluteTime(^clock)(void);
+
+@end
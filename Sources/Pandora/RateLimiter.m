@@ -0,0 +1,201 @@
+#import "RateLimiter.h"
+
+/* Tokens a deferrable request must leave behind, so that there's always one
+   for a request someone is waiting on */
+#define RESERVE 1
+
+/* Backoff after the first failure of each class, doubling with every further
+   failure up to the cap */
+#define NETWORK_BACKOFF 2
+#define NETWORK_BACKOFF_CAP 60
+#define THROTTLED_BACKOFF 30
+#define THROTTLED_BACKOFF_CAP (30 * 60)
+
+/* Shortest wait before retrying a failed request, if its family isn't
+   backing off */
+#define MIN_RETRY 1
+
+@interface PandoraRateFamily : NSObject {
+@public
+  double burst;
+  double rate;
+  double tokens;
+  CFAbsoluteTime refilled;
+  CFAbsoluteTime backoffUntil;
+  NSUInteger failures[PandoraFailureClasses];
+  NSUInteger admitted, deferred, shed;
+}
+@end
+
+@implementation PandoraRateFamily
+@end
+
+@implementation PandoraRateLimiter {
+  NSMutableDictionary *families;
+}
+
++ (NSString*) familyForMethod:(NSString*)method {
+  if ([method hasPrefix:@"auth."]) {
+    return @"auth";
+  }
+  if ([method isEqualToString:@"station.getPlaylist"]) {
+    return @"playlist";
+  }
+  if ([method isEqualToString:@"station.addFeedback"] ||
+      [method isEqualToString:@"station.deleteFeedback"] ||
+      [method isEqualToString:@"user.sleepSong"]) {
+    return @"feedback";
+  }
+  if ([method isEqualToString:@"station.createStation"] ||
+      [method isEqualToString:@"station.deleteStation"] ||
+      [method isEqualToString:@"station.renameStation"] ||
+      [method isEqualToString:@"station.addMusic"] ||
+      [method isEqualToString:@"station.deleteMusic"]) {
+    return @"edit";
+  }
+  return @"browse";
+}
+
+- (id) init {
+  if (!(self = [super init])) return nil;
+  families = [NSMutableDictionary dictionary];
+  /* Someone flicking through stations fetches a playlist for each, and is
+     kept waiting for the bucket, so it refills in seconds; prefetches are
+     already spaced out and capped per hour by PlaylistPrefetcher */
+  [self setBurst:4 rate:1.0 / 5 forFamily:@"playlist"];
+  [self setBurst:4 rate:1.0 / 5 forFamily:@"auth"];
+  [self setBurst:10 rate:1 forFamily:@"feedback"];
+  [self setBurst:5 rate:1.0 / 2 forFamily:@"edit"];
+  [self setBurst:10 rate:1.0 / 3 forFamily:@"browse"];
+  _clock = ^{ return CFAbsoluteTimeGetCurrent(); };
+  return self;
+}
+
+- (void) setBurst:(double)burst rate:(double)rate forFamily:(NSString*)name {
+  @synchronized(self) {
+    PandoraRateFamily *family = families[name];
+    if (family == nil) {
+      family = [[PandoraRateFamily alloc] init];
+      families[name] = family;
+    }
+    family->burst = burst;
+    family->rate = rate;
+    family->tokens = burst;
+  }
+}
+
+- (PandoraRateFamily*) familyForMethod:(NSString*)method
+                                    at:(CFAbsoluteTime)now {
+  PandoraRateFamily *family =
+      families[[PandoraRateLimiter familyForMethod:method]];
+  if (family->refilled != 0) {
+    family->tokens = MIN(family->burst,
+                         family->tokens + (now - family->refilled) * family->rate);
+  }
+  family->refilled = now;
+  return family;
+}
+
+- (NSTimeInterval) admitMethod:(NSString*)method deferrable:(BOOL)deferrable {
+  @synchronized(self) {
+    CFAbsoluteTime now = self.clock();
+    PandoraRateFamily *family = [self familyForMethod:method at:now];
+
+    if (now < family->backoffUntil) {
+      if (deferrable) {
+        family->shed++;
+        return -1;
+      }
+      family->deferred++;
+      return family->backoffUntil - now;
+    }
+
+    double needed = 1;
+    if (deferrable) {
+      needed += MIN(RESERVE, MAX(family->burst - 1, 0));
+    }
+    if (family->tokens >= needed) {
+      family->tokens -= 1;
+      family->admitted++;
+      return 0;
+    }
+    family->deferred++;
+    return (needed - family->tokens) / family->rate;
+  }
+}
+
+- (void) recordSuccessForMethod:(NSString*)method {
+  @synchronized(self) {
+    PandoraRateFamily *family = [self familyForMethod:method at:self.clock()];
+    for (int i = 0; i < PandoraFailureClasses; i++) {
+      family->failures[i] = 0;
+    }
+    family->backoffUntil = 0;
+  }
+}
+
+- (void) recordFailure:(PandoraFailureClass)failure forMethod:(NSString*)method {
+  @synchronized(self) {
+    CFAbsoluteTime now = self.clock();
+    PandoraRateFamily *family = [self familyForMethod:method at:now];
+    NSUInteger count = ++family->failures[failure];
+
+    double base, cap;
+    if (failure == PandoraFailureThrottled) {
+      base = THROTTLED_BACKOFF;
+      cap = THROTTLED_BACKOFF_CAP;
+      /* Whatever was left in the bucket was evidently too much */
+      family->tokens = 0;
+    } else {
+      base = NETWORK_BACKOFF;
+      cap = NETWORK_BACKOFF_CAP;
+    }
+    double delay = MIN(cap, base * pow(2, MIN(count - 1, 16)));
+    /* Anywhere from half to all of it, so that requests which failed together
+       don't all come back together */
+    delay = delay / 2 + delay / 2 * (arc4random_uniform(1001) / 1000.0);
+    family->backoffUntil = MAX(family->backoffUntil, now + delay);
+    NSLogd(@"%@ failed %lu times, backing off %.1fs", method,
+           (unsigned long) count, family->backoffUntil - now);
+  }
+}
+
+- (NSTimeInterval) retryDelayForMethod:(NSString*)method {
+  @synchronized(self) {
+    CFAbsoluteTime now = self.clock();
+    PandoraRateFamily *family = [self familyForMethod:method at:now];
+    return MAX(family->backoffUntil - now, MIN_RETRY);
+  }
+}
+
+- (NSDictionary*) state {
+  @synchronized(self) {
+    CFAbsoluteTime now = self.clock();
+    NSMutableDictionary *state = [NSMutableDictionary dictionary];
+    for (NSString *name in families) {
+      PandoraRateFamily *family = families[name];
+      double tokens = family->tokens;
+      if (family->refilled != 0) {
+        tokens = MIN(family->burst,
+                     tokens + (now - family->refilled) * family->rate);
+      }
+      NSUInteger failures = 0;
+      for (int i = 0; i < PandoraFailureClasses; i++) {
+        failures += family->failures[i];
+      }
+      state[name] = @{
+        @"tokens": @(tokens),
+        @"burst": @(family->burst),
+        @"rate": @(family->rate),
+        @"backoff": @(MAX(family->backoffUntil - now, 0)),
+        @"failures": @(failures),
+        @"admitted": @(family->admitted),
+        @"deferred": @(family->deferred),
+        @"shed": @(family->shed)
+      };
+    }
+    return state;
+  }
+}
+
+@end
@@ -0,0 +1,33 @@
+/**
+ * @file Pandora/RequestBody.h
+ * @brief Serialization of the JSON bodies sent with requests to Pandora
+ *
+ * Request bodies are small and built for every request, so rather than going
+ * through NSJSONSerialization and then encrypting a copy of its output, the
+ * JSON is written straight into a stack buffer and encrypted from there into
+ * the data which is sent.
+ */
+
+#ifndef REQUESTBODY_H
+#define REQUESTBODY_H
+
+@class PandoraCipherKey;
+
+/**
+ * @brief Build the body of a request to Pandora
+ *
+ * The JSON written is byte-for-byte what NSJSONSerialization produces for the
+ * same dictionary (keys are written in the dictionary's enumeration order, and
+ * '/' is escaped). Values which can't be written identically here, such as
+ * floating point numbers or strings with control characters, are handed to
+ * NSJSONSerialization instead.
+ *
+ * @param body the request parameters. These may contain strings, integer or
+ *        boolean numbers, NSNull, arrays and dictionaries.
+ * @param encryptionKey the key to encrypt the body with, or nil to send it
+ *        as plain JSON
+ * @return the body to send, or nil if it could not be serialized
+ */
+NSData* PandoraRequestBody(NSDictionary *body, PandoraCipherKey *encryptionKey);
+
+#endif /* REQUESTBODY_H */
@@ -0,0 +1,173 @@
+#import "Crypt.h"
+#import "RequestBody.h"
+
+/* Room for the JSON of any request Hermes normally sends. Bodies which don't
+   fit spill over onto the heap. */
+#define BODY_STACK_SIZE 4096
+
+typedef struct {
+  char *buf;
+  NSUInteger len;
+  NSUInteger cap;
+  BOOL heap;
+} BodyWriter;
+
+static BOOL writerReserve(BodyWriter *w, NSUInteger n) {
+  if (w->len + n <= w->cap) {
+    return YES;
+  }
+  NSUInteger cap = w->cap * 2;
+  while (cap < w->len + n) { cap *= 2; }
+  char *buf = w->heap ? realloc(w->buf, cap) : malloc(cap);
+  if (buf == NULL) {
+    return NO;
+  }
+  if (!w->heap) {
+    memcpy(buf, w->buf, w->len);
+  }
+  w->buf = buf;
+  w->cap = cap;
+  w->heap = YES;
+  return YES;
+}
+
+static BOOL writeBytes(BodyWriter *w, const char *bytes, NSUInteger n) {
+  if (!writerReserve(w, n)) { return NO; }
+  memcpy(w->buf + w->len, bytes, n);
+  w->len += n;
+  return YES;
+}
+
+static BOOL writeChar(BodyWriter *w, char c) {
+  if (!writerReserve(w, 1)) { return NO; }
+  w->buf[w->len++] = c;
+  return YES;
+}
+
+static BOOL writeString(BodyWriter *w, NSString *string) {
+  if (!writeChar(w, '"')) { return NO; }
+
+  /* Convert to UTF-8 a piece at a time so no temporary string is created */
+  char utf8[256];
+  NSRange remaining = NSMakeRange(0, [string length]);
+  while (remaining.length > 0) {
+    NSUInteger used = 0;
+    [string getBytes:utf8
+           maxLength:sizeof(utf8)
+          usedLength:&used
+            encoding:NSUTF8StringEncoding
+             options:0
+               range:remaining
+      remainingRange:&remaining];
+    /* Nothing converted means an unpaired surrogate */
+    if (used == 0) { return NO; }
+
+    /* Each byte becomes at most two */
+    if (!writerReserve(w, 2 * used)) { return NO; }
+    char *out = w->buf + w->len;
+    for (NSUInteger i = 0; i < used; i++) {
+      unsigned char c = (unsigned char) utf8[i];
+      if (c < 0x20) {
+        /* Leave the choice of escape to NSJSONSerialization */
+        return NO;
+      }
+      if (c == '"' || c == '\\' || c == '/') {
+        *out++ = '\\';
+      }
+      *out++ = (char) c;
+    }
+    w->len = (NSUInteger) (out - w->buf);
+  }
+
+  return writeChar(w, '"');
+}
+
+static BOOL writeNumber(BodyWriter *w, NSNumber *number) {
+  if (CFGetTypeID((__bridge CFTypeRef) number) == CFBooleanGetTypeID()) {
+    return [number boolValue] ? writeBytes(w, "true", 4)
+                              : writeBytes(w, "false", 5);
+  }
+
+  char digits[24];
+  int n;
+  switch (*[number objCType]) {
+    case 's': case 'i': case 'l': case 'q':
+      n = snprintf(digits, sizeof(digits), "%lld", [number longLongValue]);
+      break;
+    case 'S': case 'I': case 'L': case 'Q':
+      n = snprintf(digits, sizeof(digits), "%llu", [number unsignedLongLongValue]);
+      break;
+    default:
+      /* Floating point and char numbers have their own formatting rules */
+      return NO;
+  }
+  return writeBytes(w, digits, (NSUInteger) n);
+}
+
+static BOOL writeValue(BodyWriter *w, id value);
+
+static BOOL writeDictionary(BodyWriter *w, NSDictionary *dict) {
+  if (!writeChar(w, '{')) { return NO; }
+  BOOL first = YES;
+  for (id key in dict) {
+    if (![key isKindOfClass:[NSString class]]) { return NO; }
+    if (!first && !writeChar(w, ',')) { return NO; }
+    first = NO;
+    if (!writeString(w, key) || !writeChar(w, ':') ||
+        !writeValue(w, dict[key])) {
+      return NO;
+    }
+  }
+  return writeChar(w, '}');
+}
+
+static BOOL writeArray(BodyWriter *w, NSArray *array) {
+  if (!writeChar(w, '[')) { return NO; }
+  BOOL first = YES;
+  for (id value in array) {
+    if (!first && !writeChar(w, ',')) { return NO; }
+    first = NO;
+    if (!writeValue(w, value)) { return NO; }
+  }
+  return writeChar(w, ']');
+}
+
+static BOOL writeValue(BodyWriter *w, id value) {
+  if ([value isKindOfClass:[NSString class]]) {
+    return writeString(w, value);
+  } else if ([value isKindOfClass:[NSNumber class]] &&
+             ![value isKindOfClass:[NSDecimalNumber class]]) {
+    return writeNumber(w, value);
+  } else if ([value isKindOfClass:[NSDictionary class]]) {
+    return writeDictionary(w, value);
+  } else if ([value isKindOfClass:[NSArray class]]) {
+    return writeArray(w, value);
+  } else if (value == [NSNull null]) {
+    return writeBytes(w, "null", 4);
+  }
+  return NO;
+}
+
+NSData* PandoraRequestBody(NSDictionary *body, PandoraCipherKey *encryptionKey) {
+  char stack[BODY_STACK_SIZE];
+  BodyWriter w = { stack, 0, sizeof(stack), NO };
+
+  NSData *data;
+  if (writeDictionary(&w, body)) {
+    if (encryptionKey != nil) {
+      data = PandoraEncryptBytesWithKey(w.buf, w.len, encryptionKey);
+    } else {
+      data = [NSData dataWithBytes:w.buf length:w.len];
+    }
+  } else {
+    data = [NSJSONSerialization dataWithJSONObject:body options:0 error:nil];
+    if (data != nil && encryptionKey != nil) {
+      data = PandoraEncryptDataWithKey(data, encryptionKey);
+    }
+  }
+
+  if (w.heap) {
+    free(w.buf);
+  }
+  return data;
+}
@@ -0,0 +1,55 @@
+/**
+ * @file Pandora/RequestQueue.h
+ * @brief Ordering the requests sent to Pandora by how much they matter now
+ *
+ * Only a few requests are in flight to Pandora at once. The rest wait in a
+ * queue per priority, and whenever one finishes the oldest request of the
+ * most urgent priority goes next, so that rating or skipping a song doesn't
+ * wait behind station details or genre lists which were asked for first.
+ * Background requests are kept from taking every slot, so that there is room
+ * for an interactive one as soon as it's made.
+ */
+
+typedef enum {
+  PandoraPriorityInteractive,  /* Someone just did something and is waiting */
+  PandoraPriorityDefault,
+  PandoraPriorityBackground,   /* Nobody is waiting on it yet */
+  PandoraPriorities
+} PandoraPriority;
+
+@interface PandoraRequestQueue : NSObject
+
+/**
+ * @brief Create a queue
+ *
+ * @param limit the most requests which may be in flight at once
+ * @param background the most of those which may be background requests
+ */
+- (id) initWithLimit:(NSUInteger)limit background:(NSUInteger)background;
+
+/**
+ * @brief Start a request now if there is a free slot for it, or once there is
+ *
+ * Must be called on the main thread, where start is also invoked.
+ *
+ * @param start sends the request, which must then call finished: once it is
+ *        done one way or another
+ * @param priority which queue the request waits in
+ */
+- (void) enqueue:(void(^)(void))start priority:(PandoraPriority)priority;
+
+/**
+ * @brief Release the slot of a request, starting the next waiting one
+ */
+- (void) finished:(PandoraPriority)priority;
+
+/**
+ * @brief How long requests have waited for a slot, per priority
+ *
+ * Keyed by "interactive", "default" and "background", each with "requests"
+ * (how many have started), "queued" (how many of those had to wait), and
+ * "meanWaitMs" and "maxWaitMs" over the ones which waited.
+ */
+- (NSDictionary*) statistics;
+
+@end
@@ -0,0 +1,97 @@
+#import "RequestQueue.h"
+
+static NSString *priorityNames[PandoraPriorities] = {
+  [PandoraPriorityInteractive] = @"interactive",
+  [PandoraPriorityDefault] = @"default",
+  [PandoraPriorityBackground] = @"background"
+};
+
+@implementation PandoraRequestQueue {
+  NSUInteger limit;
+  NSUInteger backgroundLimit;
+  NSUInteger inFlight[PandoraPriorities];
+  NSMutableArray *waiting[PandoraPriorities];
+
+  NSUInteger started[PandoraPriorities];
+  NSUInteger queued[PandoraPriorities];
+  double totalWait[PandoraPriorities];
+  double maxWait[PandoraPriorities];
+}
+
+- (id) initWithLimit:(NSUInteger)max background:(NSUInteger)background {
+  if (!(self = [super init])) return nil;
+  limit = max;
+  backgroundLimit = MIN(background, max);
+  for (int i = 0; i < PandoraPriorities; i++) {
+    waiting[i] = [NSMutableArray array];
+  }
+  return self;
+}
+
+- (NSUInteger) running {
+  NSUInteger total = 0;
+  for (int i = 0; i < PandoraPriorities; i++) {
+    total += inFlight[i];
+  }
+  return total;
+}
+
+- (BOOL) hasSlotFor:(PandoraPriority)priority {
+  if ([self running] >= limit) return NO;
+  return priority != PandoraPriorityBackground ||
+         inFlight[PandoraPriorityBackground] < backgroundLimit;
+}
+
+/* queuedAt is 0 for a request which didn't have to wait */
+- (void) start:(void(^)(void))start priority:(PandoraPriority)priority
+      queuedAt:(CFAbsoluteTime)queuedAt {
+  inFlight[priority]++;
+  started[priority]++;
+  if (queuedAt != 0) {
+    double wait = CFAbsoluteTimeGetCurrent() - queuedAt;
+    queued[priority]++;
+    totalWait[priority] += wait;
+    maxWait[priority] = MAX(maxWait[priority], wait);
+  }
+  start();
+}
+
+- (void) enqueue:(void(^)(void))start priority:(PandoraPriority)priority {
+  /* Nothing may jump ahead of requests of the same priority already waiting */
+  if ([waiting[priority] count] == 0 && [self hasSlotFor:priority]) {
+    [self start:start priority:priority queuedAt:0];
+    return;
+  }
+  NSLogd(@"Queueing %@ request behind %lu in flight", priorityNames[priority],
+         (unsigned long) [self running]);
+  [waiting[priority] addObject:@[[start copy], @(CFAbsoluteTimeGetCurrent())]];
+}
+
+- (void) finished:(PandoraPriority)priority {
+  if (inFlight[priority] > 0) {
+    inFlight[priority]--;
+  }
+  for (int i = 0; i < PandoraPriorities; i++) {
+    while ([waiting[i] count] > 0 && [self hasSlotFor:(PandoraPriority) i]) {
+      NSArray *next = waiting[i][0];
+      [waiting[i] removeObjectAtIndex:0];
+      [self start:next[0] priority:(PandoraPriority) i
+         queuedAt:[next[1] doubleValue]];
+    }
+  }
+}
+
+- (NSDictionary*) statistics {
+  NSMutableDictionary *stats = [NSMutableDictionary dictionary];
+  for (int i = 0; i < PandoraPriorities; i++) {
+    stats[priorityNames[i]] = @{
+      @"requests": @(started[i]),
+      @"queued": @(queued[i]),
+      @"meanWaitMs": @(queued[i] == 0 ? 0 : totalWait[i] / queued[i] * 1000),
+      @"maxWaitMs": @(maxWait[i] * 1000)
+    };
+  }
+  return stats;
+}
+
+@end
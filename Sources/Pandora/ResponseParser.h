@@ -0,0 +1,60 @@
+/**
+ * @file Pandora/ResponseParser.h
+ * @brief Parsing of Pandora responses while they're being received
+ *
+ * Responses which are mostly a list of songs or stations are parsed as they
+ * arrive, and each item of the list is built into its object as soon as the
+ * item is complete. Only the fields of an item which are used are kept long
+ * enough to build it; the rest of the response is never turned into objects.
+ */
+
+/**
+ * @brief Build the object for one item of a list
+ *
+ * @param item the fields of the item which the parser was asked to keep
+ * @return the object, or nil to leave this item out
+ */
+typedef id(^PandoraItemBuilder)(NSDictionary *item);
+
+@interface PandoraResponseParser : NSObject
+
+/**
+ * @brief Create a parser for responses with a list of items in their result
+ *
+ * @param listKey the key of the list in the response's "result"
+ * @param fields the keys of each item which the builder reads. Anything else
+ *        is skipped without being parsed into objects.
+ * @param builder invoked for each item as soon as it has been parsed
+ */
+- (id) initWithListKey:(NSString*)listKey
+                fields:(NSSet*)fields
+               builder:(PandoraItemBuilder)builder;
+
+/**
+ * The keys of the response's "result", other than the list, which are kept
+ */
+@property (copy) NSSet *resultFields;
+
+/**
+ * @brief Get ready to parse a new response
+ */
+- (void) reset;
+
+/**
+ * @brief Parse the next piece of the response
+ *
+ * @return NO if the response is not valid JSON
+ */
+- (BOOL) feed:(const void*)bytes length:(NSUInteger)length;
+
+/**
+ * @brief Finish parsing the response
+ *
+ * @param error set if the response was invalid
+ * @return the response's "stat", "message" and "code", and a "result" with
+ *         the array of objects built from the list under the list's key, as
+ *         well as any of the resultFields. nil if the response was invalid.
+ */
+- (NSDictionary*) finishWithError:(NSError**)error;
+
+@end
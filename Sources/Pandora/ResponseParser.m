@@ -0,0 +1,251 @@
+#import "JSONStream.h"
+#import "ResponseParser.h"
+
+/* What a container in the response is to the parser */
+typedef enum {
+  FrameRoot,     /* The response itself */
+  FrameResult,   /* The response's "result" */
+  FrameList,     /* The list of items in the result */
+  FrameItem,     /* One item of the list */
+  FrameCapture,  /* A value which is being kept, e.g. a field of an item */
+  FrameSkip      /* Something nobody reads */
+} FrameRole;
+
+@interface PandoraParseFrame : NSObject {
+@public
+  FrameRole role;
+  id container;
+  NSString *key;
+}
+@end
+
+@implementation PandoraParseFrame
+@end
+
+@interface PandoraResponseParser ()
+- (BOOL) wantsValue;
+- (void) storeValue:(id)value;
+- (void) key:(const char*)str length:(size_t)len;
+- (void) beginContainer:(BOOL)object;
+- (void) endContainer;
+@end
+
+@implementation PandoraResponseParser {
+  NSString *listKey;
+  NSSet *fields;
+  PandoraItemBuilder builder;
+
+  JSONStream *json;
+  NSMutableArray *frames;
+  NSMutableDictionary *response;
+  NSMutableDictionary *result;
+  NSMutableArray *items;
+  BOOL invalid;
+}
+
+static NSSet *rootFields;
+
+#pragma mark - JSONStream callbacks
+
+static void onBeginObject(void *ctx) {
+  [(__bridge PandoraResponseParser*) ctx beginContainer:YES];
+}
+
+static void onEndObject(void *ctx) {
+  [(__bridge PandoraResponseParser*) ctx endContainer];
+}
+
+static void onBeginArray(void *ctx) {
+  [(__bridge PandoraResponseParser*) ctx beginContainer:NO];
+}
+
+static void onEndArray(void *ctx) {
+  [(__bridge PandoraResponseParser*) ctx endContainer];
+}
+
+static void onKey(void *ctx, const char *str, size_t len) {
+  [(__bridge PandoraResponseParser*) ctx key:str length:len];
+}
+
+static void onString(void *ctx, const char *str, size_t len) {
+  PandoraResponseParser *parser = (__bridge PandoraResponseParser*) ctx;
+  if (![parser wantsValue]) return;
+  NSString *value = [[NSString alloc] initWithBytes:str
+                                             length:len
+                                           encoding:NSUTF8StringEncoding];
+  [parser storeValue:value];
+}
+
+static void onNumber(void *ctx, const char *str, size_t len) {
+  PandoraResponseParser *parser = (__bridge PandoraResponseParser*) ctx;
+  if (![parser wantsValue]) return;
+
+  /* The parser has checked the syntax, so the text is short and well formed */
+  char text[len + 1];
+  memcpy(text, str, len);
+  text[len] = '\0';
+  NSNumber *value;
+  if (strpbrk(text, ".eE") != NULL) {
+    value = @(strtod(text, NULL));
+  } else if (text[0] != '-' && strtoull(text, NULL, 10) > LLONG_MAX) {
+    value = @(strtoull(text, NULL, 10));
+  } else {
+    value = @(strtoll(text, NULL, 10));
+  }
+  [parser storeValue:value];
+}
+
+static void onLiteral(void *ctx, JSONStreamLiteral literal) {
+  PandoraResponseParser *parser = (__bridge PandoraResponseParser*) ctx;
+  if (![parser wantsValue]) return;
+  switch (literal) {
+    case JSONStreamTrue:  [parser storeValue:@YES]; break;
+    case JSONStreamFalse: [parser storeValue:@NO]; break;
+    case JSONStreamNull:  [parser storeValue:[NSNull null]]; break;
+  }
+}
+
+static const JSONStreamCallbacks callbacks = {
+  onBeginObject, onEndObject, onBeginArray, onEndArray,
+  onKey, onString, onNumber, onLiteral
+};
+
+#pragma mark - Parsing
+
++ (void) initialize {
+  if (self == [PandoraResponseParser class]) {
+    rootFields = [NSSet setWithObjects:@"stat", @"message", @"code", nil];
+  }
+}
+
+- (id) initWithListKey:(NSString*)aListKey
+                fields:(NSSet*)someFields
+               builder:(PandoraItemBuilder)aBuilder {
+  if (!(self = [super init])) return nil;
+  listKey = aListKey;
+  fields = someFields;
+  builder = [aBuilder copy];
+  json = JSONStreamCreate(&callbacks, (__bridge void*) self);
+  if (json == NULL) return nil;
+  [self reset];
+  return self;
+}
+
+- (void) dealloc {
+  JSONStreamFree(json);
+}
+
+- (void) reset {
+  JSONStreamReset(json);
+  frames = [NSMutableArray array];
+  response = [NSMutableDictionary dictionary];
+  items = [NSMutableArray array];
+  result = [NSMutableDictionary dictionaryWithObject:items forKey:listKey];
+  invalid = NO;
+}
+
+- (BOOL) feed:(const void*)bytes length:(NSUInteger)length {
+  return JSONStreamFeed(json, bytes, length) == 0 && !invalid;
+}
+
+- (NSDictionary*) finishWithError:(NSError**)error {
+  if (JSONStreamFinish(json) != 0 || invalid) {
+    if (error != NULL) {
+      /* The same error NSJSONSerialization gives */
+      NSString *debug = [NSString stringWithFormat:@"Invalid JSON around character %lu.",
+                         (unsigned long) JSONStreamErrorOffset(json)];
+      *error = [NSError errorWithDomain:NSCocoaErrorDomain
+                                   code:NSPropertyListReadCorruptError
+                               userInfo:@{@"NSDebugDescription": debug}];
+    }
+    return nil;
+  }
+  response[@"result"] = result;
+  return response;
+}
+
+/* Whether the value about to be parsed is wanted by anyone */
+- (BOOL) wantsValue {
+  PandoraParseFrame *top = [frames lastObject];
+  if (top == nil) return NO;
+  switch (top->role) {
+    case FrameRoot:    return [rootFields containsObject:top->key];
+    case FrameResult:  return [_resultFields containsObject:top->key];
+    case FrameItem:    return [fields containsObject:top->key];
+    case FrameCapture: return YES;
+    default:           return NO;
+  }
+}
+
+- (void) storeValue:(id)value {
+  PandoraParseFrame *top = [frames lastObject];
+  if (value == nil) {
+    invalid = YES; /* Invalid UTF-8 */
+    return;
+  }
+  if ([top->container isKindOfClass:[NSMutableArray class]]) {
+    [top->container addObject:value];
+  } else {
+    top->container[top->key] = value;
+  }
+}
+
+- (void) key:(const char*)str length:(size_t)len {
+  PandoraParseFrame *top = [frames lastObject];
+  if (top->role == FrameSkip || top->role == FrameList) return;
+  top->key = [[NSString alloc] initWithBytes:str
+                                      length:len
+                                    encoding:NSUTF8StringEncoding];
+  if (top->key == nil) invalid = YES;
+}
+
+- (void) beginContainer:(BOOL)object {
+  PandoraParseFrame *top = [frames lastObject];
+  PandoraParseFrame *frame = [[PandoraParseFrame alloc] init];
+
+  if (top == nil) {
+    frame->role = object ? FrameRoot : FrameSkip;
+  } else if (top->role == FrameRoot && object && [top->key isEqualToString:@"result"]) {
+    frame->role = FrameResult;
+  } else if (top->role == FrameResult && !object && [top->key isEqualToString:listKey]) {
+    frame->role = FrameList;
+  } else if (top->role == FrameList && object) {
+    frame->role = FrameItem;
+  } else if ([self wantsValue]) {
+    frame->role = FrameCapture;
+  } else {
+    frame->role = FrameSkip;
+  }
+
+  switch (frame->role) {
+    case FrameRoot:
+      frame->container = response;
+      break;
+    case FrameResult:
+      frame->container = result;
+      break;
+    case FrameItem:
+    case FrameCapture:
+      frame->container = object ? [NSMutableDictionary dictionary] : [NSMutableArray array];
+      break;
+    default:
+      break;
+  }
+  [frames addObject:frame];
+}
+
+- (void) endContainer {
+  PandoraParseFrame *frame = [frames lastObject];
+  [frames removeLastObject];
+
+  if (frame->role == FrameItem) {
+    id object = builder(frame->container);
+    if (object != nil) {
+      [items addObject:object];
+    }
+  } else if (frame->role == FrameCapture) {
+    [self storeValue:frame->container];
+  }
+}
+
+@end
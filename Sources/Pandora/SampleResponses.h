@@ -0,0 +1,25 @@
+/**
+ * @file Pandora/SampleResponses.h
+ * @brief Responses like Pandora's, for checking and timing how they're parsed
+ *
+ * These only need Foundation, so that the benchmarks outside the app can
+ * use them as well.
+ */
+
+#ifndef SAMPLERESPONSES_H
+#define SAMPLERESPONSES_H
+
+/**
+ * @brief A response like station.getPlaylist's: four songs, an advertisement,
+ *        and everything Hermes doesn't read
+ */
+NSData* PandoraSamplePlaylistResponse(void);
+
+/**
+ * @brief A response like user.getStationList's
+ *
+ * @param count how many stations the list has
+ */
+NSData* PandoraSampleStationListResponse(NSUInteger count);
+
+#endif /* SAMPLERESPONSES_H */
@@ -0,0 +1,74 @@
+#import "SampleResponses.h"
+
+NSData* PandoraSamplePlaylistResponse(void) {
+  NSMutableArray *items = [NSMutableArray array];
+  for (int i = 0; i < 4; i++) {
+    NSString *base = [NSString stringWithFormat:@"http://audio.example.com/%d", i];
+    NSMutableDictionary *item = [@{
+      @"artistName": [NSString stringWithFormat:@"Sigur R\u00f3s %d", i],
+      @"songName": @"Hopp\u00edpolla \"live\" / \u65e5\u672c \U0001F3B5",
+      @"albumName": @"Takk...",
+      @"albumArtUrl": [base stringByAppendingString:@"/art.jpg"],
+      @"stationId": @"1234567890",
+      @"trackToken": [NSString stringWithFormat:@"token-%d", i],
+      @"songRating": @(i % 2),
+      @"albumDetailUrl": [base stringByAppendingString:@"/album"],
+      @"artistDetailUrl": [base stringByAppendingString:@"/artist"],
+      @"songDetailUrl": [base stringByAppendingString:@"/song"],
+      @"additionalAudioUrl": @[[base stringByAppendingString:@"/32"],
+                               [base stringByAppendingString:@"/64"],
+                               [base stringByAppendingString:@"/128"]],
+      @"audioUrlMap": @{
+        @"highQuality": @{@"bitrate": @"192", @"encoding": @"mp3",
+                          @"audioUrl": [base stringByAppendingString:@"/192"],
+                          @"protocol": @"http"},
+        @"mediumQuality": @{@"bitrate": @"64", @"encoding": @"aacplus",
+                            @"audioUrl": [base stringByAppendingString:@"/64"],
+                            @"protocol": @"http"},
+        @"lowQuality": @{@"bitrate": @"32", @"encoding": @"aacplus",
+                         @"audioUrl": [base stringByAppendingString:@"/32"],
+                         @"protocol": @"http"}},
+      @"trackGain": @(-7.25),
+      @"allowFeedback": @YES,
+      @"songExplorerUrl": [base stringByAppendingString:@"/explorer"],
+      @"amazonAlbumDigitalAsin": [NSNull null],
+      @"itunesSongUrl": [base stringByAppendingString:@"/itunes"],
+    } mutableCopy];
+    if (i == 3) {
+      /* Songs without the newer audioUrlMap */
+      [item removeObjectForKey:@"audioUrlMap"];
+    }
+    [items addObject:item];
+  }
+  [items insertObject:@{@"adToken": @"ad-token"} atIndex:2];
+
+  NSDictionary *response = @{@"stat": @"ok", @"result": @{@"items": items}};
+  return [NSJSONSerialization dataWithJSONObject:response options:0 error:nil];
+}
+
+NSData* PandoraSampleStationListResponse(NSUInteger count) {
+  NSMutableArray *stations = [NSMutableArray array];
+  for (int i = 0; i < (int) count; i++) {
+    [stations addObject:@{
+      @"stationName": [NSString stringWithFormat:@"Caf\u00e9 Radio %d", i],
+      @"stationId": [NSString stringWithFormat:@"%d", 100000 + i],
+      @"stationToken": [NSString stringWithFormat:@"%d", 200000 + i],
+      @"isShared": @(i % 3 == 0),
+      @"allowAddMusic": @(i % 2 == 0),
+      @"allowRename": @YES,
+      @"allowDelete": @YES,
+      @"dateCreated": @{@"time": @(1300000000000ULL + (uint64_t) i),
+                        @"year": @111, @"month": @2},
+      @"isQuickMix": @(i == 0),
+      @"genre": @[@"Rock", @"Indie"],
+      @"quickMixStationIds": @[@"100001", @"100002"],
+      @"stationDetailUrl": [NSString stringWithFormat:@"http://example.com/station/%d", i],
+      @"stationSharingUrl": [NSString stringWithFormat:@"http://example.com/share/%d", i],
+      @"suppressVideoAds": @YES,
+    }];
+  }
+  NSDictionary *response = @{@"stat": @"ok",
+                             @"result": @{@"stations": stations,
+                                          @"checksum": @"a3b9c7d1e5f2"}};
+  return [NSJSONSerialization dataWithJSONObject:response options:0 error:nil];
+}
@@ -0,0 +1,63 @@
+/**
+ * @file Pandora/SearchCache.h
+ * @brief Remembering recent music searches
+ *
+ * Searches are keyed by their text once case, accents and spacing are folded
+ * away, so that "Sigur Ros" and "sigur  rós" are the same search. The cache
+ * holds a limited number of searches, forgetting the least recently used
+ * first, and each only for a while since Pandora's catalog changes.
+ *
+ * While a search which adds to the end of an earlier one is on its way, the
+ * earlier one's results which still match can be shown in the meantime.
+ */
+
+@interface PandoraSearchCache : NSObject
+
+/**
+ * @brief Fold a search into the key it is cached under
+ *
+ * @return the search lowercased, without accents, and with runs of
+ *         whitespace collapsed to single spaces and trimmed from the ends
+ */
++ (NSString*) normalizeQuery:(NSString*)query;
+
+/**
+ * @brief Create a cache
+ *
+ * @param capacity how many searches to remember
+ * @param lifetime seconds after which a search's results are forgotten
+ */
+- (id) initWithCapacity:(NSUInteger)capacity lifetime:(NSTimeInterval)lifetime;
+
+/**
+ * @brief The results of a search, if they are cached and haven't expired
+ *
+ * @param query a normalized search
+ */
+- (NSDictionary*) resultsForQuery:(NSString*)query;
+
+/**
+ * @brief The results of the longest cached search which the query adds to,
+ *        narrowed to those which match every word of the query
+ *
+ * @param query a normalized search
+ * @return results in the same form as those cached, or nil if no shorter
+ *         search is cached
+ */
+- (NSDictionary*) refinedResultsForQuery:(NSString*)query;
+
+/**
+ * @brief Remember the results of a search
+ *
+ * @param results arrays of PandoraSearchResult keyed by kind
+ * @param query a normalized search
+ */
+- (void) setResults:(NSDictionary*)results forQuery:(NSString*)query;
+
+/**
+ * @brief The clock the cache runs on, which defaults to
+ *        CFAbsoluteTimeGetCurrent() and is only replaced to check the cache
+ */
+@property (copy) CFAbsoluteTime(^clock)(void);
+
+@end
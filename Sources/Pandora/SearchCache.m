@@ -0,0 +1,95 @@
+#import "Pandora.h"
+#import "SearchCache.h"
+
+@implementation PandoraSearchCache {
+  NSUInteger capacity;
+  NSTimeInterval lifetime;
+  NSMutableDictionary *entries;
+  /* Queries from least to most recently used */
+  NSMutableArray *recency;
+}
+
++ (NSString*) normalizeQuery:(NSString*)query {
+  NSString *folded = [query stringByFoldingWithOptions:NSCaseInsensitiveSearch |
+                                                       NSDiacriticInsensitiveSearch
+                                                locale:nil];
+  NSArray *words = [folded componentsSeparatedByCharactersInSet:
+                    [NSCharacterSet whitespaceAndNewlineCharacterSet]];
+  words = [words filteredArrayUsingPredicate:
+           [NSPredicate predicateWithFormat:@"length > 0"]];
+  return [words componentsJoinedByString:@" "];
+}
+
+- (id) initWithCapacity:(NSUInteger)max lifetime:(NSTimeInterval)seconds {
+  if (!(self = [super init])) return nil;
+  capacity = max;
+  lifetime = seconds;
+  entries = [NSMutableDictionary dictionary];
+  recency = [NSMutableArray array];
+  _clock = ^{ return CFAbsoluteTimeGetCurrent(); };
+  return self;
+}
+
+- (NSDictionary*) freshEntry:(NSString*)query {
+  NSDictionary *entry = entries[query];
+  if (entry == nil) return nil;
+  if (self.clock() - [entry[@"time"] doubleValue] > lifetime) {
+    [entries removeObjectForKey:query];
+    [recency removeObject:query];
+    return nil;
+  }
+  return entry;
+}
+
+- (NSDictionary*) resultsForQuery:(NSString*)query {
+  NSDictionary *entry = [self freshEntry:query];
+  if (entry == nil) return nil;
+  [recency removeObject:query];
+  [recency addObject:query];
+  return entry[@"results"];
+}
+
+- (NSDictionary*) refinedResultsForQuery:(NSString*)query {
+  NSString *longest = nil;
+  for (NSString *cached in [entries allKeys]) {
+    if ([query length] > [cached length] && [query hasPrefix:cached] &&
+        [longest length] < [cached length] && [self freshEntry:cached] != nil) {
+      longest = cached;
+    }
+  }
+  if (longest == nil) return nil;
+
+  NSArray *words = [query componentsSeparatedByString:@" "];
+  NSMutableDictionary *refined = [NSMutableDictionary dictionary];
+  NSDictionary *results = entries[longest][@"results"];
+  for (NSString *kind in results) {
+    NSMutableArray *matching = [NSMutableArray array];
+    for (PandoraSearchResult *r in results[kind]) {
+      NSString *name = [PandoraSearchCache normalizeQuery:[r name]];
+      BOOL matches = YES;
+      for (NSString *word in words) {
+        if ([name rangeOfString:word].location == NSNotFound) {
+          matches = NO;
+          break;
+        }
+      }
+      if (matches) {
+        [matching addObject:r];
+      }
+    }
+    refined[kind] = matching;
+  }
+  return refined;
+}
+
+- (void) setResults:(NSDictionary*)results forQuery:(NSString*)query {
+  entries[query] = @{@"results": results, @"time": @(self.clock())};
+  [recency removeObject:query];
+  [recency addObject:query];
+  while ([recency count] > capacity) {
+    [entries removeObjectForKey:recency[0]];
+    [recency removeObjectAtIndex:0];
+  }
+}
+
+@end
@@ -1,5 +1,6 @@
 
 #import "Station.h"
+#import "StationRegistry.h"
 
 @implementation Song
 
@@ -81,7 +82,7 @@
 #pragma mark - Reference to station
 
 - (Station*) station {
-  return [Station stationForToken:[self stationId]];
+  return [[Station registry] stationWithId:[self stationId]];
 }
 
 #pragma mark - Formatted play date
@@ -1,6 +1,8 @@
 #import <AudioStreamer/ASPlaylist.h>
 
 @class Pandora;
+@class PandoraStationRegistry;
+@class PlaylistPrefetcher;
 @class Song;
 
 @interface Station : ASPlaylist<NSCoding> {
@@ -8,6 +10,10 @@
 
   NSMutableArray *songs;
   Pandora *radio;
+
+  PlaylistPrefetcher *prefetcher;
+  dispatch_source_t prefetchTimer;
+  double listened;
 }
 
 @property NSString *name;
@@ -20,11 +26,15 @@
 @property BOOL allowAddMusic; // seems that (with the exception of QuickMix, which is excluded from editing elsewhere) that this is not actually a limitation any more; it's possible to add seeds to genre stations (#267).
 @property BOOL isQuickMix;
 
+/**
+ * @brief Sets the registry that songs and decoded stations look stations up in
+ *
+ * The app sets this to its Pandora's registry when it starts.
+ */
++ (void) setRegistry:(PandoraStationRegistry*)registry;
++ (PandoraStationRegistry*) registry;
+
 - (void) setRadio:(Pandora*)radio;
 - (NSString*) streamNetworkError;
 
-+ (Station*) stationForToken:(NSString*)token;
-+ (void) addStation:(Station*)s;
-+ (void) removeStation:(Station*)s;
-
 @end
@@ -1,15 +1,35 @@
 
+#import "Pandora/PlaylistPrefetcher.h"
 #import "Pandora/Station.h"
+#import "Pandora/StationRegistry.h"
 #import "PreferencesController.h"
 #import "StationsController.h"
 #import "Notifications.h"
 
+/* Nominal bit rates of Pandora's qualities, in bits per second, taking the
+   higher of what the high quality can be (128 Kbps MP3, or 192 Kbps with
+   Pandora One) so it's only picked when the connection can take either */
+#define kLowQualityBitrate  32000
+#define kMedQualityBitrate  64000
+#define kHighQualityBitrate 192000
+
+static PandoraStationRegistry *registry = nil;
+
 @implementation Station
 
++ (void) setRegistry:(PandoraStationRegistry*)r {
+  registry = r;
+}
+
++ (PandoraStationRegistry*) registry {
+  return registry;
+}
+
 - (id) init {
   if (!(self = [super init])) return nil;
 
   songs = [NSMutableArray arrayWithCapacity:10];
+  prefetcher = [[PlaylistPrefetcher alloc] init];
 
   [[NSNotificationCenter defaultCenter]
       addObserver:self
@@ -62,7 +82,9 @@
       [songs removeAllObjects];
       [urls removeAllObjects];
     }
-    [Station addStation:self];
+    /* Stands in for the listed station with its id, if there is one, so
+       that its songs find the station which is playing them */
+    [registry addStation:self];
   }
   return self;
 }
@@ -89,6 +111,7 @@
 
 - (void) dealloc {
   [[NSNotificationCenter defaultCenter] removeObserver:self name:nil object:nil];
+  [self stopPrefetchTimer];
 }
 
 - (BOOL) isEqual:(id)object {
@@ -96,13 +119,89 @@
 }
 
 - (void) attemptingNewSong:(NSNotification*) notification {
+    if (_playingSong != nil) {
+      [prefetcher songEndedAfter:listened];
+    }
+    listened = 0;
     _playingSong = songs[0];
     [songs removeObjectAtIndex:0];
+    [self startPrefetchTimer];
 }
 
 - (void) fetchMoreSongs:(NSNotification*) notification {
-  shouldPlaySongOnFetch = YES;
-  [radio fetchPlaylistForStation:self];
+  if ([[notification name] isEqualToString:ASNoSongsLeft]) {
+    shouldPlaySongOnFetch = YES;
+    NSLogd(@"%@ ran out of songs", _name);
+    [self prefetchSongs:YES];
+  } else {
+    [self prefetchSongs:NO];
+  }
+}
+
+/**
+ * @brief Fetch more songs if the prefetcher says the queue is running low
+ *
+ * @param urgent YES if there is nothing left to play, in which case songs are
+ *        fetched regardless
+ */
+- (void) prefetchSongs:(BOOL)urgent {
+  if ([prefetcher fetching]) return;
+
+  double progress = 0, duration = 0;
+  if (stream != nil) {
+    if ([self progress:&progress]) {
+      listened = MAX(listened, progress);
+    }
+    if (![self duration:&duration]) {
+      duration = 0;
+    }
+  }
+  if (!urgent && ![prefetcher shouldFetchWithQueued:[songs count]
+                                           progress:progress
+                                           duration:duration]) {
+    return;
+  }
+  if (![prefetcher mayFetch:urgent]) return;
+
+  [prefetcher fetchStarted:urgent];
+  [radio fetchPlaylistForStation:self prefetch:!urgent];
+}
+
+/**
+ * @brief Check the queue every few seconds while this station is playing,
+ *        since it runs down with time as well as with skips
+ */
+- (void) startPrefetchTimer {
+  if (prefetchTimer != nil) return;
+  prefetchTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0,
+                                         dispatch_get_main_queue());
+  dispatch_source_set_timer(prefetchTimer,
+                            dispatch_time(DISPATCH_TIME_NOW, 5 * NSEC_PER_SEC),
+                            5 * NSEC_PER_SEC, NSEC_PER_SEC);
+  __weak Station *weakSelf = self;
+  dispatch_source_set_event_handler(prefetchTimer, ^{
+    Station *station = weakSelf;
+    if (station != nil && [station isPlaying]) {
+      [station prefetchSongs:NO];
+    }
+  });
+  dispatch_resume(prefetchTimer);
+}
+
+- (void) stopPrefetchTimer {
+  if (prefetchTimer != nil) {
+    dispatch_source_cancel(prefetchTimer);
+    prefetchTimer = nil;
+  }
+}
+
+/**
+ * @brief Stop playing, which is also when another station starts playing
+ *        instead, so the queue no longer needs checking
+ */
+- (void) stop {
+  [self stopPrefetchTimer];
+  [super stop];
 }
 
 - (void) setRadio:(Pandora *)pandora {
@@ -120,10 +219,21 @@
                                              selector:@selector(songsLoaded:)
                                                  name:n
                                                object:nil];
+
+    n = [NSString stringWithFormat:@"hermes.fragment-dropped.%@", _token];
+    [[NSNotificationCenter defaultCenter] addObserver:self
+                                             selector:@selector(songsDropped:)
+                                                 name:n
+                                               object:nil];
   }
 }
 
+- (void) songsDropped: (NSNotification*)not {
+  [prefetcher fetchDropped];
+}
+
 - (void) songsLoaded: (NSNotification*)not {
+  [prefetcher fetchFinished];
   NSArray *more = [not userInfo][@"songs"];
   NSMutableArray *qualities = [[NSMutableArray alloc] init];
   if (more == nil) return;
@@ -139,6 +249,11 @@
         [qualities addObject:@"low"];
         url = [NSURL URLWithString:[s lowUrl]];
         break;
+      case QUALITY_AUTO:
+        /* Which to play is picked when the song starts */
+        [qualities addObject:@"auto"];
+        url = [NSURL URLWithString:[s medUrl]];
+        break;
 
       case QUALITY_MED:
       default:
@@ -156,19 +271,48 @@
   NSLogd(@"Received %@ from %@ with qualities: %@", not.name, not.object, [qualities componentsJoinedByString:@" "]);
 }
 
+- (NSDictionary*) qualitiesForURL:(NSURL*)url {
+  if (PREF_KEY_INT(DESIRED_QUALITY) != QUALITY_AUTO) return nil;
+  NSString *str = [url absoluteString];
+  NSMutableArray *candidates = [songs mutableCopy];
+  if (_playingSong != nil) {
+    [candidates addObject:_playingSong];
+  }
+  for (Song *s in candidates) {
+    if (![str isEqualToString:[s lowUrl]] &&
+        ![str isEqualToString:[s medUrl]] &&
+        ![str isEqualToString:[s highUrl]]) {
+      continue;
+    }
+    NSMutableDictionary *qualities = [NSMutableDictionary dictionary];
+    if ([s lowUrl] != nil) {
+      qualities[@kLowQualityBitrate] = [NSURL URLWithString:[s lowUrl]];
+    }
+    if ([s medUrl] != nil) {
+      qualities[@kMedQualityBitrate] = [NSURL URLWithString:[s medUrl]];
+    }
+    if ([s highUrl] != nil) {
+      qualities[@kHighQualityBitrate] = [NSURL URLWithString:[s highUrl]];
+    }
+    return qualities;
+  }
+  return nil;
+}
+
 - (void) configureNewStream:(NSNotification*) notification {
-  assert(stream == [notification userInfo][@"stream"]);
-  [stream setBufferInfinite:TRUE];
-  [stream setTimeoutInterval:15];
+  /* Either the stream about to play or the next song's, preloading */
+  AudioStreamer *created = [notification userInfo][@"stream"];
+  [created setBufferInfinite:TRUE];
+  [created setTimeoutInterval:15];
 
   if (PREF_KEY_BOOL(PROXY_AUDIO)) {
     switch ([PREF_KEY_VALUE(ENABLED_PROXY) intValue]) {
       case PROXY_HTTP:
-        [stream setHTTPProxy:PREF_KEY_VALUE(PROXY_HTTP_HOST)
+        [created setHTTPProxy:PREF_KEY_VALUE(PROXY_HTTP_HOST)
                         port:[PREF_KEY_VALUE(PROXY_HTTP_PORT) intValue]];
         break;
       case PROXY_SOCKS:
-        [stream setSOCKSProxy:PREF_KEY_VALUE(PROXY_SOCKS_HOST)
+        [created setSOCKSProxy:PREF_KEY_VALUE(PROXY_SOCKS_HOST)
                          port:[PREF_KEY_VALUE(PROXY_SOCKS_PORT) intValue]];
         break;
       default:
@@ -210,25 +354,4 @@
   [super clearSongList];
 }
 
-static NSMutableDictionary *stations = nil;
-
-+ (Station*) stationForToken:(NSString*)stationId{
-  if (stations == nil)
-    return nil;
-  return stations[stationId];
-}
-
-+ (void) addStation:(Station*) s {
-  if (stations == nil) {
-    stations = [NSMutableDictionary dictionary];
-  }
-  stations[[s stationId]] = s;
-}
-
-+ (void) removeStation:(Station*) s {
-  if (stations == nil)
-    return;
-  [stations removeObjectForKey:[s stationId]];
-}
-
 @end
@@ -0,0 +1,78 @@
+/**
+ * @file Pandora/StationRegistry.h
+ * @brief The logged in user's stations, indexed
+ *
+ * Holds the stations in the order they're listed in, along with indexes from
+ * their ids and tokens to the stations and from their ids to where they're
+ * listed, so that finding a station or its row never scans the list. The
+ * indexes are rebuilt whenever the list is replaced or sorted, and patched
+ * when a single station is added or removed, or a listed station's token
+ * changes.
+ *
+ * Sorting by name compares keys folded once per name and kept until the name
+ * changes, instead of folding both names on every comparison.
+ *
+ * Only to be used from the main thread.
+ */
+
+@class Station;
+
+@interface PandoraStationRegistry : NSObject
+
+/**
+ * @brief The stations in the order they're listed in
+ */
+- (NSArray*) stations;
+
+- (NSUInteger) count;
+
+/**
+ * @return the station with an id, or nil if there is none
+ */
+- (Station*) stationWithId:(NSString*)stationId;
+
+/**
+ * @return the station with a token, or nil if there is none
+ */
+- (Station*) stationWithToken:(NSString*)token;
+
+/**
+ * @brief Where the station with the same id as a station is listed
+ *
+ * @return the index into stations, or NSNotFound if it isn't listed
+ */
+- (NSUInteger) indexOfStation:(Station*)station;
+
+/**
+ * @brief List a station last, or in place of the station with its id
+ */
+- (void) addStation:(Station*)station;
+
+/**
+ * @brief Index a station by its new token, which must be told whenever the
+ *        token of a listed station changes
+ *
+ * @param oldToken the token the station had before, or nil
+ */
+- (void) station:(Station*)station changedTokenFrom:(NSString*)oldToken;
+
+/**
+ * @brief Stop listing the station with the same id as a station
+ */
+- (void) removeStation:(Station*)station;
+
+/**
+ * @brief Replace the whole list, such as with a fresh station list
+ */
+- (void) setStations:(NSArray*)stations;
+
+- (void) removeAllStations;
+
+/**
+ * @brief Sort the list, keeping QuickMix first
+ *
+ * @param sort one of the SORT_* orders in PreferencesController.h
+ */
+- (void) sortBy:(NSInteger)sort;
+
+@end
@@ -0,0 +1,210 @@
+#import "PreferencesController.h"
+#import "Station.h"
+#import "StationRegistry.h"
+
+typedef struct {
+  __unsafe_unretained Station *station;
+  __unsafe_unretained NSString *key;
+  unsigned long long created;
+  BOOL quickMix;
+} sort_entry_t;
+/* The entries' stations are retained by list and their keys by a separate
+   array for as long as the entries are used, since a station without an id
+   gets a folded name which nothing else keeps */
+
+@implementation PandoraStationRegistry {
+  NSMutableArray *list;
+  NSMutableDictionary *by_id;
+  NSMutableDictionary *by_token;
+  /* Index into list, keyed by station id */
+  NSMutableDictionary *positions;
+  /* [name, folded name] keyed by station id, kept until the name changes */
+  NSMutableDictionary *name_keys;
+}
+
+- (id) init {
+  if (!(self = [super init])) return nil;
+  list = [NSMutableArray array];
+  by_id = [NSMutableDictionary dictionary];
+  by_token = [NSMutableDictionary dictionary];
+  positions = [NSMutableDictionary dictionary];
+  name_keys = [NSMutableDictionary dictionary];
+  return self;
+}
+
+- (NSArray*) stations {
+  return list;
+}
+
+- (NSUInteger) count {
+  return [list count];
+}
+
+- (Station*) stationWithId:(NSString*)stationId {
+  if (stationId == nil) return nil;
+  return by_id[stationId];
+}
+
+- (Station*) stationWithToken:(NSString*)token {
+  if (token == nil) return nil;
+  Station *station = by_token[token];
+  return [[station token] isEqual:token] ? station : nil;
+}
+
+- (NSUInteger) indexOfStation:(Station*)station {
+  NSString *stationId = [station stationId];
+  if (stationId == nil) return NSNotFound;
+  NSNumber *position = positions[stationId];
+  return position == nil ? NSNotFound : [position unsignedIntegerValue];
+}
+
+- (void) addStation:(Station*)station {
+  if ([station stationId] == nil) return;
+  NSUInteger index = [self indexOfStation:station];
+  if (index != NSNotFound) {
+    Station *old = list[index];
+    if ([old token] != nil) [by_token removeObjectForKey:[old token]];
+    list[index] = station;
+    [self indexStation:station at:index];
+    return;
+  }
+  [list addObject:station];
+  [self indexStation:station at:[list count] - 1];
+}
+
+- (void) removeStation:(Station*)station {
+  NSUInteger index = [self indexOfStation:station];
+  if (index == NSNotFound) return;
+  Station *old = list[index];
+  [by_id removeObjectForKey:[old stationId]];
+  [positions removeObjectForKey:[old stationId]];
+  [name_keys removeObjectForKey:[old stationId]];
+  if ([old token] != nil) [by_token removeObjectForKey:[old token]];
+  [list removeObjectAtIndex:index];
+  [self rebuildIndexesFrom:index];
+}
+
+- (void) setStations:(NSArray*)stations {
+  [list setArray:stations];
+  [by_id removeAllObjects];
+  [positions removeAllObjects];
+  [self rebuildIndexesFrom:0];
+
+  /* Forget the sort keys of stations which are gone */
+  for (NSString *stationId in [name_keys allKeys]) {
+    if (by_id[stationId] == nil) {
+      [name_keys removeObjectForKey:stationId];
+    }
+  }
+}
+
+- (void) station:(Station*)station changedTokenFrom:(NSString*)oldToken {
+  if (oldToken != nil && by_token[oldToken] == station) {
+    [by_token removeObjectForKey:oldToken];
+  }
+  NSUInteger index = [self indexOfStation:station];
+  if (index != NSNotFound && list[index] == station && [station token] != nil) {
+    by_token[[station token]] = station;
+  }
+}
+
+- (void) removeAllStations {
+  [list removeAllObjects];
+  [by_id removeAllObjects];
+  [by_token removeAllObjects];
+  [positions removeAllObjects];
+  [name_keys removeAllObjects];
+}
+
+#pragma mark - Indexes
+
+- (void) indexStation:(Station*)station at:(NSUInteger)index {
+  if ([station stationId] != nil) {
+    by_id[[station stationId]] = station;
+    positions[[station stationId]] = @(index);
+  }
+  if ([station token] != nil) {
+    by_token[[station token]] = station;
+  }
+}
+
+/* Reindexes the stations from an index on, which is all that moves when a
+   station is removed */
+- (void) rebuildIndexesFrom:(NSUInteger)start {
+  if (start == 0) {
+    [by_token removeAllObjects];
+  }
+  NSUInteger count = [list count];
+  for (NSUInteger i = start; i < count; i++) {
+    [self indexStation:list[i] at:i];
+  }
+}
+
+#pragma mark - Sorting
+
+- (NSString*) nameKeyFor:(Station*)station {
+  NSString *name = [station name];
+  if (name == nil) return @"";
+  if ([station stationId] == nil) {
+    return [name stringByFoldingWithOptions:NSCaseInsensitiveSearch locale:nil];
+  }
+  NSArray *cached = name_keys[[station stationId]];
+  if (cached != nil && (cached[0] == name || [cached[0] isEqualToString:name])) {
+    return cached[1];
+  }
+  NSString *key = [name stringByFoldingWithOptions:NSCaseInsensitiveSearch
+                                            locale:nil];
+  name_keys[[station stationId]] = @[name, key];
+  return key;
+}
+
+- (void) sortBy:(NSInteger)sort {
+  NSUInteger count = [list count];
+  if (count < 2) return;
+
+  BOOL byName = sort == SORT_NAME_ASC || sort == SORT_NAME_DSC;
+  NSInteger factor = (sort == SORT_NAME_DSC || sort == SORT_DATE_DSC) ? -1 : 1;
+
+  sort_entry_t *entries = malloc(count * sizeof(sort_entry_t));
+  if (entries == NULL) return;
+  NSMutableArray *keys = byName ? [NSMutableArray arrayWithCapacity:count] : nil;
+  for (NSUInteger i = 0; i < count; i++) {
+    Station *station = list[i];
+    entries[i].station = station;
+    entries[i].key = nil;
+    if (byName) {
+      NSString *key = [self nameKeyFor:station];
+      [keys addObject:key];
+      entries[i].key = key;
+    }
+    entries[i].created = [station created];
+    entries[i].quickMix = [station isQuickMix];
+  }
+
+  mergesort_b(entries, count, sizeof(sort_entry_t), ^int(const void *a, const void *b) {
+    const sort_entry_t *e1 = a, *e2 = b;
+    // keep Shuffle/QuickMix at the top of the list
+    if (e1->quickMix != e2->quickMix) return e1->quickMix ? -1 : 1;
+
+    if (byName) {
+      return (int) (factor * [e1->key compare:e2->key]);
+    }
+    if (e1->created < e2->created) {
+      return (int) -factor;
+    } else if (e1->created > e2->created) {
+      return (int) factor;
+    }
+    return 0;
+  });
+
+  NSMutableArray *sorted = [NSMutableArray arrayWithCapacity:count];
+  for (NSUInteger i = 0; i < count; i++) {
+    [sorted addObject:entries[i].station];
+  }
+  free(entries);
+  keys = nil;
+  [list setArray:sorted];
+  [self rebuildIndexesFrom:0];
+}
+
+@end
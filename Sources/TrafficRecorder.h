@@ -0,0 +1,128 @@
+/**
+ * @file TrafficRecorder.h
+ * @brief Recording a session's traffic, and playing it back without the
+ *        network
+ *
+ * While recording, each URLConnection request and AudioStreamer download is
+ * written down as it happens: when it was sent, when each piece of its
+ * response arrived, and the response itself, although audio is kept only as
+ * its timing and length. Secrets are left out as they're recorded: request
+ * bodies aren't kept, URLs lose every query parameter but the API method,
+ * wherever they appear, errors included, and tokens and account details are
+ * blanked out of JSON responses.
+ *
+ * While replaying, the same requests go to a LoopbackHTTPServer instead, which
+ * answers each with the response recorded for its URL, with the pieces
+ * arriving at the recorded pace or a multiple of it. Audio is answered with
+ * silence of the recorded length, and errors with empty responses.
+ *
+ * Named spans, such as logging in, are timed while recording and again while
+ * replaying, so that the two can be compared from build to build.
+ */
+
+#ifndef TRAFFICRECORDER_H
+#define TRAFFICRECORDER_H
+
+typedef enum {
+  TrafficRecorderOff,
+  TrafficRecorderRecording,
+  TrafficRecorderReplaying
+} TrafficRecorderMode;
+
+/**
+ * @brief One request being recorded
+ */
+@interface TrafficExchange : NSObject
+
+/**
+ * @brief The length of the whole response, if it's known before all of it
+ *        has arrived
+ */
+@property NSUInteger expectedLength;
+
+/**
+ * @brief Note that the request is being sent, which the times of the pieces
+ *        of its response are counted from
+ */
+- (void) opened;
+
+/**
+ * @brief Note a piece of the response as it arrives
+ */
+- (void) receivedBytes:(const void*)bytes length:(NSUInteger)length;
+
+/**
+ * @brief Note the end of the response
+ *
+ * @param error why the request failed, or nil if it didn't
+ */
+- (void) finishedWithError:(NSError*)error;
+
+@end
+
+@interface TrafficRecorder : NSObject
+
+/**
+ * @brief The recorder which URLConnection and AudioStreamer go through
+ */
++ (TrafficRecorder*) sharedRecorder;
+
+@property (readonly) TrafficRecorderMode mode;
+
+/**
+ * @brief Start recording, which is written out every so often and once
+ *        more when stopped
+ *
+ * @param path the file to write the recording to
+ * @return YES if recording started
+ */
+- (BOOL) startRecordingTo:(NSString*)path;
+
+/**
+ * @brief Start answering requests with a recording
+ *
+ * @param path the file written by an earlier recording
+ * @param speed how many times faster than recorded the responses arrive, or 0
+ *        for as fast as possible
+ * @return YES if the recording was read and the replay server started
+ */
+- (BOOL) startReplayingFrom:(NSString*)path speed:(double)speed;
+
+/**
+ * @brief Stop recording and write out the recording, or stop replaying and
+ *        log how many requests it answered
+ */
+- (void) stop;
+
+/**
+ * @brief The URL a request should actually be sent to
+ *
+ * @return the URL itself, or while replaying, the replay server's URL for it
+ */
+- (NSURL*) URLForRequest:(NSURL*)url;
+
+/**
+ * @brief Start recording a request
+ *
+ * @param url the URL the request is for, before URLForRequest:
+ * @param method the HTTP method
+ * @param audio YES if the response is audio, which is kept only as its timing
+ * @return the exchange to note the response with, or nil if not recording
+ */
+- (TrafficExchange*) exchangeForURL:(NSURL*)url method:(NSString*)method
+                              audio:(BOOL)audio;
+
+/**
+ * @brief Start timing a span, such as logging in or skipping a song
+ */
+- (void) beginSpan:(NSString*)name;
+
+/**
+ * @brief Stop timing a span, if it was started, and log how long it took
+ *        along with how long it took when recorded
+ */
+- (void) endSpan:(NSString*)name;
+
+@end
+
+#endif /* TRAFFICRECORDER_H */
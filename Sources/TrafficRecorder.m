@@ -0,0 +1,479 @@
+#import "LoopbackHTTPServer.h"
+#import "TrafficRecorder.h"
+
+/* Pieces of a response which arrive within this many seconds of the first
+   are recorded as one */
+#define CHUNK_COALESCE 0.05
+
+/* Seconds between writing out what has been recorded so far, so that a
+   crash or a kill loses no more than this much */
+#define FLUSH_INTERVAL 30
+
+/* A silent MPEG-1 Layer III frame at 128 Kbps and 44.1 kHz, which recorded
+   audio is replayed as */
+#define MP3_FRAME_HEADER "\xff\xfb\x90\x44"
+#define MP3_FRAME_BYTES 417
+
+/* JSON keys whose values are blanked out of recorded responses */
+static NSSet* secretKeys(void) {
+  static NSSet *keys;
+  static dispatch_once_t once;
+  dispatch_once(&once, ^{
+    keys = [NSSet setWithObjects:@"partnerAuthToken", @"userAuthToken",
+            @"partnerId", @"userId", @"username", @"password", @"email",
+            @"webname", @"listenerId", @"zipCode", @"birthYear", @"gender",
+            nil];
+  });
+  return keys;
+}
+
+/* A URL without credentials, a fragment, or any query parameter but the API
+   method */
+static NSString* redactedURL(NSURL *url) {
+  NSURLComponents *c = [NSURLComponents componentsWithURL:url
+                                  resolvingAgainstBaseURL:YES];
+  if (c == nil) return [url absoluteString];
+  NSMutableArray *kept = [NSMutableArray array];
+  for (NSURLQueryItem *item in [c queryItems]) {
+    if ([[item name] isEqualToString:@"method"]) {
+      [kept addObject:item];
+    }
+  }
+  c.queryItems = [kept count] > 0 ? kept : nil;
+  c.user = nil;
+  c.password = nil;
+  c.fragment = nil;
+  return [c string];
+}
+
+/* Text such as an error's description, with any URLs in it redacted */
+static NSString* redactedText(NSString *text) {
+  static NSDataDetector *links;
+  static dispatch_once_t once;
+  dispatch_once(&once, ^{
+    links = [NSDataDetector dataDetectorWithTypes:NSTextCheckingTypeLink
+                                            error:nil];
+  });
+  if (text == nil || links == nil) return text;
+  NSMutableString *copy = [text mutableCopy];
+  NSArray *matches = [links matchesInString:text options:0
+                                      range:NSMakeRange(0, [text length])];
+  /* From the end, so that earlier ranges stay where they were */
+  for (NSTextCheckingResult *match in [matches reverseObjectEnumerator]) {
+    if ([match URL] != nil) {
+      [copy replaceCharactersInRange:[match range]
+                          withString:redactedURL([match URL])];
+    }
+  }
+  return copy;
+}
+
+static id redacted(id value, NSString *key) {
+  if ([value isKindOfClass:[NSDictionary class]]) {
+    NSMutableDictionary *copy = [NSMutableDictionary dictionaryWithCapacity:[value count]];
+    for (NSString *k in value) {
+      copy[k] = redacted(value[k], k);
+    }
+    return copy;
+  }
+  if ([value isKindOfClass:[NSArray class]]) {
+    NSMutableArray *copy = [NSMutableArray arrayWithCapacity:[value count]];
+    for (id v in value) {
+      [copy addObject:redacted(v, key)];
+    }
+    return copy;
+  }
+  if (key != nil && [secretKeys() containsObject:key]) {
+    return @"redacted";
+  }
+  /* Audio URLs in particular are signed */
+  if ([value isKindOfClass:[NSString class]] && [value hasPrefix:@"http"]) {
+    NSURL *url = [NSURL URLWithString:value];
+    if (url != nil) {
+      return redactedURL(url);
+    }
+  }
+  return value;
+}
+
+static NSData* silence(NSUInteger length) {
+  NSMutableData *audio = [NSMutableData dataWithLength:length];
+  char *bytes = [audio mutableBytes];
+  for (NSUInteger at = 0; at + 4 <= length; at += MP3_FRAME_BYTES) {
+    memcpy(bytes + at, MP3_FRAME_HEADER, 4);
+  }
+  return audio;
+}
+
+@interface TrafficRecorder ()
+- (CFAbsoluteTime) recordingStart;
+@end
+
+@implementation TrafficExchange {
+  TrafficRecorder *recorder;
+  NSMutableDictionary *entry;
+  NSMutableData *body;
+  NSMutableArray *chunks;
+  CFAbsoluteTime openedAt;
+  CFAbsoluteTime chunkAt;
+  NSUInteger received;
+}
+
+- (id) initWithRecorder:(TrafficRecorder*)aRecorder
+                  entry:(NSMutableDictionary*)anEntry audio:(BOOL)audio {
+  if (!(self = [super init])) return nil;
+  recorder = aRecorder;
+  entry = anEntry;
+  body = audio ? nil : [NSMutableData data];
+  chunks = [NSMutableArray array];
+  return self;
+}
+
+- (void) opened {
+  openedAt = CFAbsoluteTimeGetCurrent();
+  received = 0;
+  [body setLength:0];
+  [chunks removeAllObjects];
+}
+
+- (void) receivedBytes:(const void*)bytes length:(NSUInteger)length {
+  CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+  received += length;
+  [body appendBytes:bytes length:length];
+  NSArray *last = [chunks lastObject];
+  if (last != nil && now - chunkAt < CHUNK_COALESCE) {
+    chunks[[chunks count] - 1] = @[last[0], @([last[1] unsignedIntegerValue] + length)];
+    return;
+  }
+  chunkAt = now;
+  [chunks addObject:@[@(round((now - openedAt) * 1000)), @(length)]];
+}
+
+- (void) finishedWithError:(NSError*)error {
+  CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+  id json = nil;
+  if (body != nil && error == nil && [body length] > 0) {
+    json = [NSJSONSerialization JSONObjectWithData:body options:0 error:nil];
+  }
+  @synchronized(recorder) {
+    entry[@"start"] = @(round((openedAt - [recorder recordingStart]) * 1000));
+    entry[@"ms"] = @(round((now - openedAt) * 1000));
+    entry[@"chunks"] = [chunks copy];
+    entry[@"length"] = @(MAX(received, self.expectedLength));
+    if (error != nil) {
+      entry[@"error"] = redactedText([error localizedDescription]);
+    } else if (json != nil) {
+      entry[@"json"] = redacted(json, nil);
+    } else if (body != nil) {
+      entry[@"data"] = [body base64EncodedStringWithOptions:0];
+    }
+  }
+  body = nil;
+}
+
+@end
+
+@implementation TrafficRecorder {
+  NSString *tracePath;
+  CFAbsoluteTime startedAt;
+  NSMutableArray *exchanges;
+  NSMutableArray *spans;
+  NSMutableDictionary *openSpans;
+  dispatch_source_t flushTimer;
+  NSUInteger written;
+  NSUInteger spansWritten;
+
+  /* Replaying */
+  LoopbackHTTPServer *server;
+  double replaySpeed;
+  NSMutableDictionary *replies;
+  NSMutableDictionary *spansReplayed;
+  NSUInteger answered;
+  NSUInteger missed;
+}
+
++ (TrafficRecorder*) sharedRecorder {
+  static TrafficRecorder *recorder;
+  static dispatch_once_t once;
+  dispatch_once(&once, ^{
+    recorder = [[TrafficRecorder alloc] init];
+  });
+  return recorder;
+}
+
+- (id) init {
+  if (!(self = [super init])) return nil;
+  openSpans = [NSMutableDictionary dictionary];
+  return self;
+}
+
+- (CFAbsoluteTime) recordingStart {
+  return startedAt;
+}
+
+#pragma mark - Recording
+
+- (BOOL) startRecordingTo:(NSString*)path {
+  if (_mode != TrafficRecorderOff) return NO;
+  tracePath = [path stringByExpandingTildeInPath];
+  startedAt = CFAbsoluteTimeGetCurrent();
+  exchanges = [NSMutableArray array];
+  spans = [NSMutableArray array];
+  /* Written once at least, even if nothing is recorded */
+  written = spansWritten = NSNotFound;
+  _mode = TrafficRecorderRecording;
+  HMSLog(@"traffic: recording to %@", tracePath);
+
+  flushTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0,
+      dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+  dispatch_source_set_timer(flushTimer,
+                            dispatch_time(DISPATCH_TIME_NOW, FLUSH_INTERVAL * NSEC_PER_SEC),
+                            FLUSH_INTERVAL * NSEC_PER_SEC, NSEC_PER_SEC);
+  __weak TrafficRecorder *weakSelf = self;
+  dispatch_source_set_event_handler(flushTimer, ^{
+    [weakSelf writeRecording];
+  });
+  dispatch_resume(flushTimer);
+  return YES;
+}
+
+- (TrafficExchange*) exchangeForURL:(NSURL*)url method:(NSString*)method
+                              audio:(BOOL)audio {
+  if (_mode != TrafficRecorderRecording || url == nil) return nil;
+  NSMutableDictionary *entry = [@{@"url": redactedURL(url),
+                                  @"method": method ?: @"GET",
+                                  @"audio": @(audio)} mutableCopy];
+  @synchronized(self) {
+    [exchanges addObject:entry];
+  }
+  return [[TrafficExchange alloc] initWithRecorder:self entry:entry audio:audio];
+}
+
+/**
+ * @brief Write out everything recorded so far, replacing what was written
+ *        before, unless nothing has been recorded since
+ *
+ * This is done every FLUSH_INTERVAL seconds while recording, and once more
+ * when recording stops.
+ */
+- (void) writeRecording {
+  NSArray *finished;
+  NSData *data = nil;
+  NSString *path;
+  NSError *error = nil;
+  /* Requests still in flight may finish meanwhile, and writes from the
+     timer and from stopping mustn't overlap */
+  @synchronized(self) {
+    finished = [exchanges filteredArrayUsingPredicate:
+                [NSPredicate predicateWithFormat:@"ms != nil"]];
+    if ([finished count] == written && [spans count] == spansWritten) {
+      return;
+    }
+    NSDictionary *trace = @{@"version": @1, @"exchanges": finished, @"spans": spans};
+    data = [NSJSONSerialization dataWithJSONObject:trace options:0 error:&error];
+    path = tracePath;
+    if (data == nil || ![data writeToFile:path options:NSDataWritingAtomic error:&error]) {
+      HMSLog(@"traffic: couldn't write %@: %@", path, error);
+      return;
+    }
+    written = [finished count];
+    spansWritten = [spans count];
+  }
+  HMSLog(@"traffic: recorded %lu requests to %@",
+         (unsigned long) [finished count], path);
+}
+
+#pragma mark - Replaying
+
+- (BOOL) startReplayingFrom:(NSString*)path speed:(double)speed {
+  if (_mode != TrafficRecorderOff) return NO;
+  tracePath = [path stringByExpandingTildeInPath];
+  NSData *data = [NSData dataWithContentsOfFile:tracePath];
+  NSDictionary *trace = data == nil ? nil :
+      [NSJSONSerialization JSONObjectWithData:data options:0 error:nil];
+  if (![trace isKindOfClass:[NSDictionary class]] ||
+      ![trace[@"exchanges"] isKindOfClass:[NSArray class]]) {
+    HMSLog(@"traffic: couldn't read a recording from %@", tracePath);
+    return NO;
+  }
+
+  /* Answered in the order they were recorded in, per URL */
+  replies = [NSMutableDictionary dictionary];
+  NSArray *recorded = [trace[@"exchanges"] sortedArrayUsingDescriptors:
+                       @[[NSSortDescriptor sortDescriptorWithKey:@"start" ascending:YES]]];
+  for (NSDictionary *entry in recorded) {
+    NSMutableArray *queue = replies[entry[@"url"]];
+    if (queue == nil) {
+      queue = [NSMutableArray array];
+      replies[entry[@"url"]] = queue;
+    }
+    [queue addObject:entry];
+  }
+  spans = [trace[@"spans"] mutableCopy] ?: [NSMutableArray array];
+  spansReplayed = [NSMutableDictionary dictionary];
+  replaySpeed = speed;
+  answered = missed = 0;
+
+  __weak TrafficRecorder *weakSelf = self;
+  server = [[LoopbackHTTPServer alloc] initWithStreamingHandler:^(NSString *method,
+                                                                  NSString *path,
+                                                                  NSData *body,
+                                                                  LoopbackHTTPResponse *response) {
+    [weakSelf replay:path response:response];
+  }];
+  if (![server start]) {
+    HMSLog(@"traffic: couldn't start the replay server");
+    server = nil;
+    return NO;
+  }
+  _mode = TrafficRecorderReplaying;
+  HMSLog(@"traffic: replaying %lu requests from %@ at %gx",
+         (unsigned long) [recorded count], tracePath, speed);
+  return YES;
+}
+
+- (NSURL*) URLForRequest:(NSURL*)url {
+  if (_mode != TrafficRecorderReplaying || url == nil) return url;
+  NSString *escaped =
+      [redactedURL(url) stringByAddingPercentEncodingWithAllowedCharacters:
+       [NSCharacterSet alphanumericCharacterSet]];
+  return [NSURL URLWithString:[NSString stringWithFormat:
+                               @"http://127.0.0.1:%u/replay?url=%@",
+                               (unsigned) server.port, escaped]];
+}
+
+/**
+ * @brief Answer a request to the replay server with the next response
+ *        recorded for its URL, at the recorded pace
+ *
+ * The last response recorded for a URL answers any further requests for it.
+ */
+- (void) replay:(NSString*)path response:(LoopbackHTTPResponse*)response {
+  NSRange query = [path rangeOfString:@"?url="];
+  NSString *key = query.location == NSNotFound ? nil :
+      [[path substringFromIndex:NSMaxRange(query)] stringByRemovingPercentEncoding];
+  NSDictionary *entry = nil;
+  double speed;
+  @synchronized(self) {
+    NSMutableArray *queue = key == nil ? nil : replies[key];
+    entry = [queue firstObject];
+    if ([queue count] > 1) {
+      [queue removeObjectAtIndex:0];
+    }
+    if (entry != nil) {
+      answered++;
+    } else {
+      missed++;
+    }
+    speed = replaySpeed;
+  }
+  if (entry == nil) {
+    NSLogd(@"Nothing was recorded for %@", key);
+    return;
+  }
+
+  NSData *data = [NSData data];
+  NSString *type = @"application/json";
+  if ([entry[@"audio"] boolValue]) {
+    data = silence([entry[@"length"] unsignedIntegerValue]);
+    type = @"audio/mpeg";
+  } else if (entry[@"json"] != nil) {
+    data = [NSJSONSerialization dataWithJSONObject:entry[@"json"] options:0 error:nil];
+  } else if (entry[@"data"] != nil) {
+    data = [[NSData alloc] initWithBase64EncodedString:entry[@"data"] options:0];
+    type = @"application/octet-stream";
+  }
+  if (entry[@"error"] != nil || data == nil) {
+    return;
+  }
+
+  [response startWithLength:[data length] type:type];
+  CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+  NSUInteger at = 0;
+  for (NSArray *chunk in entry[@"chunks"]) {
+    if (speed > 0) {
+      double due = [chunk[0] doubleValue] / 1000 / speed;
+      double wait = due - (CFAbsoluteTimeGetCurrent() - start);
+      if (wait > 0) {
+        usleep((useconds_t) (wait * 1000000));
+      }
+    }
+    /* Redacted responses aren't quite the length recorded */
+    NSUInteger length = MIN([chunk[1] unsignedIntegerValue], [data length] - at);
+    if (chunk == [entry[@"chunks"] lastObject]) {
+      length = [data length] - at;
+    }
+    if (![response writeData:[data subdataWithRange:NSMakeRange(at, length)]]) {
+      return;
+    }
+    at += length;
+  }
+  if (at < [data length]) {
+    [response writeData:[data subdataWithRange:NSMakeRange(at, [data length] - at)]];
+  }
+}
+
+#pragma mark - Spans
+
+- (void) beginSpan:(NSString*)name {
+  if (_mode == TrafficRecorderOff) return;
+  @synchronized(self) {
+    openSpans[name] = @(CFAbsoluteTimeGetCurrent());
+  }
+}
+
+- (void) endSpan:(NSString*)name {
+  if (_mode == TrafficRecorderOff) return;
+  NSNumber *began;
+  NSDictionary *recorded = nil;
+  @synchronized(self) {
+    began = openSpans[name];
+    if (began == nil) return;
+    [openSpans removeObjectForKey:name];
+    double ms = (CFAbsoluteTimeGetCurrent() - [began doubleValue]) * 1000;
+
+    if (_mode == TrafficRecorderRecording) {
+      [spans addObject:@{@"name": name, @"ms": @(round(ms))}];
+      HMSLog(@"traffic: %@ took %.0f ms", name, ms);
+      return;
+    }
+
+    /* Compared with the same occurrence of the span in the recording */
+    NSUInteger n = [spansReplayed[name] unsignedIntegerValue];
+    spansReplayed[name] = @(n + 1);
+    for (NSDictionary *span in spans) {
+      if ([span[@"name"] isEqual:name] && n-- == 0) {
+        recorded = span;
+        break;
+      }
+    }
+    if (recorded != nil) {
+      HMSLog(@"traffic: %@ took %.0f ms, %@ ms when recorded", name, ms, recorded[@"ms"]);
+    } else {
+      HMSLog(@"traffic: %@ took %.0f ms, and wasn't recorded", name, ms);
+    }
+  }
+}
+
+#pragma mark -
+
+- (void) stop {
+  switch (_mode) {
+    case TrafficRecorderRecording:
+      dispatch_source_cancel(flushTimer);
+      flushTimer = nil;
+      [self writeRecording];
+      break;
+    case TrafficRecorderReplaying:
+      [server stop];
+      server = nil;
+      HMSLog(@"traffic: replay answered %lu requests, had nothing for %lu",
+             (unsigned long) answered, (unsigned long) missed);
+      break;
+    case TrafficRecorderOff:
+      return;
+  }
+  _mode = TrafficRecorderOff;
+}
+
+@end
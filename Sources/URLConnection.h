@@ -1,13 +1,25 @@
+@class TrafficExchange;
+@class URLConnectionPool;
+
 typedef void(^URLConnectionCallback)(NSData*, NSError*);
+typedef void(^URLConnectionDataHandler)(const void *bytes, NSUInteger length);
 
 extern NSString * const URLConnectionProxyValidityChangedNotification;
 
 @interface URLConnection : NSObject {
+  CFHTTPMessageRef message;
   CFReadStreamRef stream;
   URLConnectionCallback cb;
+  URLConnectionDataHandler dataHandler;
   NSMutableData *bytes;
+  NSUInteger received;
   NSTimer *timeout;
   int events;
+  BOOL persistent;
+  BOOL retried;
+  BOOL sawSocket;
+  TrafficExchange *traffic;
+  URLConnectionPool *pool;
 }
 
 + (URLConnection*) connectionForRequest:(NSURLRequest*)request
@@ -18,4 +30,38 @@ extern NSString * const URLConnectionProxyValidityChangedNotification;
 - (void) start;
 - (void) setHermesProxy;
 
+/**
+ * @brief Hand the response to a handler as it arrives instead of collecting it
+ *
+ * Each piece of the response body is passed to the handler as soon as it's
+ * read, and the completion handler is then invoked with empty data. This must
+ * be set before the connection is started.
+ */
+- (void) setDataHandler:(URLConnectionDataHandler)handler;
+
+/**
+ * @brief Go through a pool other than the shared one
+ *
+ * Only meant for measuring a pool without disturbing the connections, or the
+ * settings, of the shared one. This must be set before the connection is
+ * started.
+ */
+- (void) setPool:(URLConnectionPool*)connectionPool;
+
+/**
+ * @brief The URL this connection requests
+ */
+- (NSURL*) URL;
+
+/**
+ * @brief Open the stream and begin the request
+ *
+ * This is called by the URLConnectionPool once a connection to the host is
+ * available; everyone else should call start.
+ *
+ * @param persist whether the underlying connection may be kept open for use
+ *        by later requests to the same host
+ */
+- (void) openPersistent:(BOOL)persist;
+
 @end
@@ -1,10 +1,35 @@
 #import "PreferencesController.h"
+#import "TrafficRecorder.h"
 #import "URLConnection.h"
+#import "URLConnectionPool.h"
 
 NSString * const URLConnectionProxyValidityChangedNotification = @"URLConnectionProxyValidityChangedNotification";
 
 @implementation URLConnection
 
+/* Errors which mean a kept-alive connection was closed by the server while it
+   sat idle, rather than that the request itself failed */
+static BOOL isStaleConnectionError(NSError *error) {
+  if ([[error domain] isEqualToString:(__bridge NSString*) kCFErrorDomainCFNetwork]) {
+    return [error code] == kCFErrorHTTPConnectionLost ||
+           [error code] == kCFURLErrorNetworkConnectionLost;
+  }
+  if ([[error domain] isEqualToString:NSPOSIXErrorDomain]) {
+    return [error code] == ECONNRESET || [error code] == EPIPE ||
+           [error code] == ENOTCONN;
+  }
+  return NO;
+}
+
+static void* URLConnectionRetain(void *conn) {
+  CFRetain(conn);
+  return conn;
+}
+
+static void URLConnectionRelease(void *conn) {
+  CFRelease(conn);
+}
+
 static void URLConnectionStreamCallback(CFReadStreamRef aStream,
                                         CFStreamEventType eventType,
                                         void* _conn) {
@@ -15,13 +40,28 @@ static void URLConnectionStreamCallback(CFReadStreamRef aStream,
 
   switch (eventType) {
     case kCFStreamEventHasBytesAvailable:
+      if (!conn->sawSocket) {
+        conn->sawSocket = YES;
+        [conn noteSocket];
+      }
       while ((len = CFReadStreamRead(aStream, buf, sizeof(buf))) > 0) {
-        [conn->bytes appendBytes:buf length:len];
+        conn->received += (NSUInteger) len;
+        [conn->traffic receivedBytes:buf length:(NSUInteger) len];
+        if (conn->dataHandler != nil) {
+          conn->dataHandler(buf, (NSUInteger) len);
+        } else {
+          [conn->bytes appendBytes:buf length:(NSUInteger) len];
+        }
       }
       return;
-    case kCFStreamEventErrorOccurred:
-      conn->cb(nil, (__bridge_transfer NSError*) CFReadStreamCopyError(aStream));
+    case kCFStreamEventErrorOccurred: {
+      NSError *error = (__bridge_transfer NSError*) CFReadStreamCopyError(aStream);
+      if ([conn retryAfterError:error]) {
+        return;
+      }
+      conn->cb(nil, error);
       break;
+    }
     case kCFStreamEventEndEncountered: {
       conn->cb(conn->bytes, nil);
       break;
@@ -30,19 +70,14 @@ static void URLConnectionStreamCallback(CFReadStreamRef aStream,
       assert(0);
   }
 
-  conn->cb = nil;
-  [conn->timeout invalidate];
-  conn->timeout = nil;
-  CFReadStreamClose(conn->stream);
-  CFRelease(conn->stream);
-  conn->stream = nil;
+  [conn finish];
 }
 
 - (void) dealloc {
   [timeout invalidate];
-  if (stream != nil) {
-    CFReadStreamClose(stream);
-    CFRelease(stream);
+  [self closeStream];
+  if (message != NULL) {
+    CFRelease(message);
   }
 }
 
@@ -58,62 +93,123 @@ static void URLConnectionStreamCallback(CFReadStreamRef aStream,
                       completionHandler:(void(^)(NSData*, NSError*)) cb {
 
   URLConnection *c = [[URLConnection alloc] init];
+  TrafficRecorder *recorder = [TrafficRecorder sharedRecorder];
 
   /* Create the HTTP message to send */
-  CFHTTPMessageRef message =
+  c->message =
       CFHTTPMessageCreateRequest(NULL,
                                  (__bridge CFStringRef)[request HTTPMethod],
-                                 (__bridge CFURLRef)   [request URL],
+                                 (__bridge CFURLRef)   [recorder URLForRequest:[request URL]],
                                  kCFHTTPVersion1_1);
 
   /* Copy headers over */
   NSDictionary *headers = [request allHTTPHeaderFields];
   for (NSString *header in headers) {
-    CFHTTPMessageSetHeaderFieldValue(message,
+    CFHTTPMessageSetHeaderFieldValue(c->message,
                          (__bridge CFStringRef) header,
                          (__bridge CFStringRef) headers[header]);
   }
 
   /* Also the http body */
   if ([request HTTPBody] != nil) {
-    CFHTTPMessageSetBody(message, (__bridge CFDataRef) [request HTTPBody]);
+    CFHTTPMessageSetBody(c->message, (__bridge CFDataRef) [request HTTPBody]);
   }
-  c->stream = CFReadStreamCreateForHTTPRequest(NULL, message);
-  CFRelease(message);
+
+  c->cb = [cb copy];
+  c->pool = [URLConnectionPool sharedPool];
+  c->traffic = [recorder exchangeForURL:[request URL]
+                                 method:[request HTTPMethod]
+                                  audio:NO];
+  if (c->traffic != nil) {
+    TrafficExchange *traffic = c->traffic;
+    c->cb = ^(NSData *data, NSError *error) {
+      [traffic finishedWithError:error];
+      cb(data, error);
+    };
+  }
+  c->bytes = [NSMutableData dataWithCapacity:100];
+  [c createStream];
+  return c;
+}
+
+/**
+ * @brief Create the stream which will send the request
+ *
+ * Done when the connection is created, so that the proxy can be changed before
+ * it's started, and again if the request has to be resent.
+ */
+- (void) createStream {
+  stream = CFReadStreamCreateForHTTPRequest(NULL, message);
 
   /* Handle SSL connections */
-  NSString *urlstring = [[request URL] absoluteString];
-  if ([urlstring rangeOfString:@"https"].location == 0) {
+  NSURL *url = [self URL];
+  if ([[[url scheme] lowercaseString] isEqualToString:@"https"]) {
     NSDictionary *settings =
     @{(id)kCFStreamSSLLevel: (NSString *)kCFStreamSocketSecurityLevelNegotiatedSSL,
      (id)kCFStreamSSLValidatesCertificateChain: @NO,
      (id)kCFStreamSSLPeerName: [NSNull null]};
 
-    CFReadStreamSetProperty(c->stream, kCFStreamPropertySSLSettings,
+    CFReadStreamSetProperty(stream, kCFStreamPropertySSLSettings,
                             (__bridge CFDictionaryRef) settings);
   }
 
-  c->cb = [cb copy];
-  c->bytes = [NSMutableData dataWithCapacity:100];
-  [c setHermesProxy];
-  return c;
+  [self setHermesProxy];
+}
+
+- (void) closeStream {
+  CFReadStreamRef s = stream;
+  if (s == NULL) return;
+  /* Removing the client may release the last reference to this connection */
+  stream = NULL;
+  CFReadStreamSetClient(s, kCFStreamEventNone, NULL, NULL);
+  CFReadStreamClose(s);
+  CFRelease(s);
+}
+
+- (void) setDataHandler:(URLConnectionDataHandler)handler {
+  dataHandler = [handler copy];
+}
+
+- (void) setPool:(URLConnectionPool*)connectionPool {
+  pool = connectionPool;
+}
+
+- (NSURL*) URL {
+  return (__bridge_transfer NSURL*) CFHTTPMessageCopyRequestURL(message);
 }
 
 /**
  * @brief Start sending this request to the server
+ *
+ * The request may wait in the URLConnectionPool if there are already as many
+ * requests to the same host in flight as the pool allows.
  */
 - (void) start {
+  [pool startConnection:self];
+}
+
+- (void) openPersistent:(BOOL)persist {
+  persistent = persist;
+  if (persistent) {
+    CFReadStreamSetProperty(stream, kCFStreamPropertyHTTPAttemptPersistentConnection,
+                            kCFBooleanTrue);
+  }
+
+  [traffic opened];
   CFReadStreamOpen(stream);
   CFStreamStatus streamStatus = CFReadStreamGetStatus(stream);
   if (streamStatus == kCFStreamStatusError) {
     cb(nil, (NSError *)CFBridgingRelease(CFReadStreamCopyError(stream)));
+    [self finish];
     return;
   }
   if (streamStatus != kCFStreamStatusOpen)
     NSLog(@"Expected read stream to be open, but it was not (%ld)", (long)streamStatus);
 
-  CFStreamClientContext context = {0, (__bridge_retained void*) self, NULL,
-                                   NULL, NULL};
+  /* The stream keeps this connection alive until it's finished */
+  CFStreamClientContext context = {0, (__bridge void*) self,
+                                   URLConnectionRetain, URLConnectionRelease,
+                                   NULL};
   CFReadStreamSetClient(stream,
                         kCFStreamEventHasBytesAvailable |
                           kCFStreamEventErrorOccurred |
@@ -122,11 +218,70 @@ static void URLConnectionStreamCallback(CFReadStreamRef aStream,
                         &context);
   CFReadStreamScheduleWithRunLoop(stream, CFRunLoopGetCurrent(),
                                   kCFRunLoopCommonModes);
-  timeout = [NSTimer scheduledTimerWithTimeInterval:10
-                                             target:self
-                                           selector:@selector(checkTimeout)
-                                           userInfo:nil
-                                            repeats:YES];
+  if (timeout == nil) {
+    timeout = [NSTimer scheduledTimerWithTimeInterval:10
+                                               target:self
+                                             selector:@selector(checkTimeout)
+                                             userInfo:nil
+                                              repeats:YES];
+  }
+}
+
+/**
+ * @brief Resend the request on a new connection if a kept-alive one had gone
+ *        stale
+ *
+ * This is the pool's health check: a server may close an idle connection at
+ * any time, which only shows up as an error on the next request sent over it.
+ * Such a request never reached the server, so it's sent once more on a
+ * connection of its own.
+ *
+ * @return YES if the request was resent, NO if the error should be reported
+ */
+- (BOOL) retryAfterError:(NSError*)error {
+  if (!persistent || retried || received > 0 ||
+      !isStaleConnectionError(error)) {
+    return NO;
+  }
+  NSLogd(@"Resending %@ after stale connection: %@", [self URL], error);
+  retried = YES;
+  sawSocket = NO;
+  events = 0;
+  [pool connectionWasStale:self];
+  [self closeStream];
+  [self createStream];
+  [self openPersistent:NO];
+  return YES;
+}
+
+/**
+ * @brief Tell the pool which socket the request went over, now that it's
+ *        known
+ */
+- (void) noteSocket {
+  CFDataRef handle = CFReadStreamCopyProperty(stream, kCFStreamPropertySocketNativeHandle);
+  CFSocketNativeHandle fd = -1;
+  if (handle != NULL) {
+    if (CFDataGetLength(handle) == sizeof(fd)) {
+      CFDataGetBytes(handle, CFRangeMake(0, sizeof(fd)), (UInt8*) &fd);
+    }
+    CFRelease(handle);
+  }
+  [pool connection:self usedSocket:fd];
+}
+
+/**
+ * @brief Tear down once the callback has been invoked
+ */
+- (void) finish {
+  /* The stream and the timer may hold the last references to us */
+  URLConnection *me = self;
+  cb = nil;
+  dataHandler = nil;
+  [timeout invalidate];
+  timeout = nil;
+  [self closeStream];
+  [pool connectionDidFinish:me];
 }
 
 - (void) checkTimeout {
@@ -135,14 +290,12 @@ static void URLConnectionStreamCallback(CFReadStreamRef aStream,
     return;
   }
 
-  CFReadStreamClose(stream);
-  CFRelease(stream);
   // FIXME: Most definitely a cause of "Internal Pandora Error".
   NSError *error = [NSError errorWithDomain:@"Connection timeout."
                                        code:0
                                    userInfo:nil];
   cb(nil, error);
-  cb = nil;
+  [self finish];
 }
 
 - (void) setHermesProxy {
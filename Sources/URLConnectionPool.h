@@ -0,0 +1,73 @@
+/**
+ * @file URLConnectionPool.h
+ * @brief Reuse of HTTP connections between URLConnection requests
+ *
+ * Every URLConnection is started through the shared pool. Requests ask
+ * CFNetwork to keep their connection open afterwards, so the next request to
+ * the same host skips TCP (and TLS) setup. The pool limits how many requests
+ * may be in flight to one host, queueing the rest, and stops reusing a host's
+ * connections once they have been idle longer than the servers are likely to
+ * keep them open.
+ */
+
+@class URLConnection;
+
+@interface URLConnectionPool : NSObject
+
+/**
+ * @brief The pool which all URLConnections go through
+ */
++ (URLConnectionPool*) sharedPool;
+
+/**
+ * @brief The most requests to one host which may be in flight at once.
+ *        Defaults to 4.
+ */
+@property NSUInteger maxConnectionsPerHost;
+
+/**
+ * @brief How long a host's connections may sit unused before the next request
+ *        to it opens a new one. Defaults to 30 seconds.
+ */
+@property NSTimeInterval idleTimeout;
+
+/**
+ * @brief Whether connections are kept open between requests. Defaults to YES,
+ *        and only turned off to measure what the pool saves.
+ */
+@property BOOL persistentConnections;
+
+/**
+ * @brief Start a connection, or queue it until its host has a free slot
+ */
+- (void) startConnection:(URLConnection*)conn;
+
+/**
+ * @brief Record the socket a connection's response arrived over
+ *
+ * @param fd the native socket, or -1 if the stream wouldn't say
+ */
+- (void) connection:(URLConnection*)conn usedSocket:(int)fd;
+
+/**
+ * @brief Record that a connection found its kept-alive socket closed and is
+ *        being resent
+ */
+- (void) connectionWasStale:(URLConnection*)conn;
+
+/**
+ * @brief Release a connection's slot once it has finished, starting the next
+ *        queued request to the same host
+ */
+- (void) connectionDidFinish:(URLConnection*)conn;
+
+/**
+ * @brief Counters of how the pool has done so far
+ *
+ * The keys are "requests", "newConnections", "reusedConnections",
+ * "unknownConnections" (the socket couldn't be identified), "queued" and
+ * "staleRetries".
+ */
+- (NSDictionary*) statistics;
+
+@end
@@ -0,0 +1,154 @@
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#import "URLConnection.h"
+#import "URLConnectionPool.h"
+
+/**
+ * @brief What the pool knows about one scheme/host/port
+ */
+@interface URLConnectionPoolHost : NSObject {
+@public
+  NSUInteger active;
+  NSMutableArray *waiting;
+  NSMutableSet *sockets;
+  CFAbsoluteTime lastUsed;
+}
+@end
+
+@implementation URLConnectionPoolHost
+
+- (id) init {
+  if (!(self = [super init])) return nil;
+  waiting = [NSMutableArray array];
+  sockets = [NSMutableSet set];
+  return self;
+}
+
+@end
+
+@implementation URLConnectionPool {
+  NSMutableDictionary *hosts;
+  NSUInteger requests;
+  NSUInteger newConnections;
+  NSUInteger reusedConnections;
+  NSUInteger unknownConnections;
+  NSUInteger queued;
+  NSUInteger staleRetries;
+}
+
++ (URLConnectionPool*) sharedPool {
+  static URLConnectionPool *pool;
+  static dispatch_once_t onceToken;
+  dispatch_once(&onceToken, ^{
+    pool = [[URLConnectionPool alloc] init];
+  });
+  return pool;
+}
+
+- (id) init {
+  if (!(self = [super init])) return nil;
+  hosts = [NSMutableDictionary dictionary];
+  _maxConnectionsPerHost = 4;
+  _idleTimeout = 30;
+  _persistentConnections = YES;
+  return self;
+}
+
+- (URLConnectionPoolHost*) hostForConnection:(URLConnection*)conn {
+  NSURL *url = [conn URL];
+  NSString *key = [NSString stringWithFormat:@"%@://%@:%@",
+                   [[url scheme] lowercaseString], [[url host] lowercaseString],
+                   [url port]];
+  URLConnectionPoolHost *host = hosts[key];
+  if (host == nil) {
+    host = [[URLConnectionPoolHost alloc] init];
+    hosts[key] = host;
+  }
+  return host;
+}
+
+- (void) startConnection:(URLConnection*)conn {
+  BOOL persist;
+  @synchronized(self) {
+    URLConnectionPoolHost *host = [self hostForConnection:conn];
+    requests++;
+    if (host->active >= self.maxConnectionsPerHost) {
+      queued++;
+      [host->waiting addObject:conn];
+      return;
+    }
+    host->active++;
+
+    /* Servers drop idle connections after a while. Rather than find that out
+       by having a request fail, start over with a new connection. */
+    persist = self.persistentConnections;
+    if (host->lastUsed != 0 &&
+        CFAbsoluteTimeGetCurrent() - host->lastUsed > self.idleTimeout) {
+      [host->sockets removeAllObjects];
+      persist = NO;
+    }
+  }
+  [conn openPersistent:persist];
+}
+
+- (void) connection:(URLConnection*)conn usedSocket:(int)fd {
+  /* A new connection gets a new local port, so the descriptor and port
+     together tell whether a socket has been used before */
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
+  NSString *identity = nil;
+  if (fd >= 0 && getsockname(fd, (struct sockaddr*) &addr, &addrlen) == 0) {
+    in_port_t port = addr.ss_family == AF_INET6 ?
+        ((struct sockaddr_in6*) &addr)->sin6_port :
+        ((struct sockaddr_in*) &addr)->sin_port;
+    identity = [NSString stringWithFormat:@"%d:%d", fd, ntohs(port)];
+  }
+
+  @synchronized(self) {
+    URLConnectionPoolHost *host = [self hostForConnection:conn];
+    if (identity == nil) {
+      unknownConnections++;
+    } else if ([host->sockets containsObject:identity]) {
+      reusedConnections++;
+    } else {
+      newConnections++;
+      [host->sockets addObject:identity];
+    }
+  }
+}
+
+- (void) connectionWasStale:(URLConnection*)conn {
+  @synchronized(self) {
+    staleRetries++;
+  }
+}
+
+- (void) connectionDidFinish:(URLConnection*)conn {
+  URLConnection *next = nil;
+  @synchronized(self) {
+    URLConnectionPoolHost *host = [self hostForConnection:conn];
+    host->lastUsed = CFAbsoluteTimeGetCurrent();
+    if ([host->waiting count] > 0) {
+      /* Hand the slot straight to the next request */
+      next = host->waiting[0];
+      [host->waiting removeObjectAtIndex:0];
+    } else if (host->active > 0) {
+      host->active--;
+    }
+  }
+  [next openPersistent:self.persistentConnections];
+}
+
+- (NSDictionary*) statistics {
+  @synchronized(self) {
+    return @{@"requests":           @(requests),
+             @"newConnections":     @(newConnections),
+             @"reusedConnections":  @(reusedConnections),
+             @"unknownConnections": @(unknownConnections),
+             @"queued":             @(queued),
+             @"staleRetries":       @(staleRetries)};
+  }
+}
+
+@end
@@ -0,0 +1,162 @@
+/**
+ * @file Tests/MockTunerTests.m
+ * @brief Times the client end to end against the stand-in tuner
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "MockTuner.h"
+#import "Notifications.h"
+#import "Pandora.h"
+#import "PandoraDevice.h"
+#import "URLConnection.h"
+
+static double msSince(CFAbsoluteTime start) {
+  return (CFAbsoluteTimeGetCurrent() - start) * 1000;
+}
+
+static void fetchSong(Pandora *pandora, NSString *stationToken,
+                      void(^done)(NSString *error, double playlistMs,
+                                  double audioMs, NSUInteger bytes)) {
+  CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+  NSMutableDictionary *d = [pandora defaultRequestDictionary];
+  d[@"stationToken"] = stationToken;
+  PandoraRequest *req = [pandora defaultRequestWithMethod:@"station.getPlaylist"];
+  req.request = d;
+  req.tls = NO;
+  req.parser = [pandora playlistParser];
+  req.callback = ^(NSDictionary *dict) {
+    double playlistMs = msSince(start);
+    Song *song = [dict[@"result"][@"items"] firstObject];
+    if (song == nil) {
+      done(@"empty playlist", playlistMs, 0, 0);
+      return;
+    }
+    CFAbsoluteTime audioStart = CFAbsoluteTimeGetCurrent();
+    NSURLRequest *audio = [NSURLRequest requestWithURL:[NSURL URLWithString:[song highUrl]]];
+    URLConnection *c =
+    [URLConnection connectionForRequest:audio
+                      completionHandler:^(NSData *data, NSError *error) {
+                        if (error != nil) {
+                          done([error localizedDescription], playlistMs, 0, 0);
+                        } else {
+                          done(nil, playlistMs, msSince(audioStart), [data length]);
+                        }
+                      }];
+    [c start];
+  };
+  [pandora sendRequest:req];
+}
+
+/**
+ * @brief Time a run, optionally expiring the session once the station list
+ *        has arrived, so that fetching the playlist has to log in again
+ *
+ * The run's Pandora recovers the way HermesAppDelegate does for its
+ * own: logging in again and resending the request which failed.
+ */
+static void timeRun(NSString *label, NSTimeInterval latency, double bandwidth,
+                    BOOL expire, void(^done)(BOOL passed)) {
+  PandoraMockTuner *tuner =
+      [[PandoraMockTuner alloc] initWithDevice:[PandoraDevice android]];
+  tuner.latency = latency;
+  tuner.bytesPerSecond = bandwidth;
+  if (![tuner start]) {
+    HMSLog(@"tuner: couldn't start the stand-in");
+    done(NO);
+    return;
+  }
+
+  Pandora *pandora = [[Pandora alloc] init];
+  pandora.persistsState = NO;
+  pandora.device = tuner.device;
+
+  __block NSUInteger relogins = 0;
+  __block id observer = nil;
+  void(^finish)(BOOL) = ^(BOOL passed) {
+    HMSLog(@"tuner: %@ answered %@", label, [tuner statistics]);
+    [[NSNotificationCenter defaultCenter] removeObserver:observer];
+    observer = nil;
+    [tuner stop];
+    done(passed);
+  };
+  observer =
+  [[NSNotificationCenter defaultCenter]
+      addObserverForName:PandoraDidErrorNotification
+                  object:pandora
+                   queue:[NSOperationQueue mainQueue]
+              usingBlock:^(NSNotification *note) {
+    NSDictionary *info = [note userInfo];
+    /* Logging in once more must be enough */
+    if ([info[@"code"] intValue] != INVALID_AUTH_TOKEN || relogins > 0) {
+      HMSLog(@"tuner: %@ run failed: %@", label, info[@"err"]);
+      finish(NO);
+      return;
+    }
+    relogins++;
+    [pandora logoutNoNotify];
+    [pandora authenticate:@"mock-listener" password:@"mock"
+                  request:info[@"request"]];
+  }];
+
+  /* Logging in sends the station list once it's done, as it would any
+     request made before logging in */
+  CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+  PandoraRequest *list = [pandora defaultRequestWithMethod:@"user.getStationList"];
+  list.request = [pandora defaultRequestDictionary];
+  list.tls = NO;
+  list.parser = [pandora stationListParser];
+  list.callback = ^(NSDictionary *dict) {
+    double loginMs = msSince(start);
+    NSArray *stations = dict[@"result"][@"stations"];
+    if (expire) {
+      [tuner expireSession];
+    }
+    fetchSong(pandora, [[stations lastObject] objectForKey:@"stationToken"],
+              ^(NSString *error, double playlistMs, double audioMs, NSUInteger bytes) {
+      if (error != nil) {
+        HMSLog(@"tuner: %@ run failed: %@", label, error);
+      } else {
+        HMSLog(@"tuner: %@: login and %lu stations %.1f ms, playlist %.1f ms "
+               "after %lu logins again, %lu KB of audio %.1f ms", label,
+               (unsigned long) [stations count], loginMs, playlistMs,
+               (unsigned long) relogins, (unsigned long) bytes / 1024, audioMs);
+      }
+      finish(error == nil && relogins == (expire ? 1 : 0));
+    });
+  };
+  [pandora authenticate:@"mock-listener" password:@"mock" request:list];
+}
+
+@interface MockTunerTests : XCTestCase
+@end
+
+@implementation MockTunerTests
+
+/**
+ * @brief Time logging in, fetching the station list and a playlist, and
+ *        downloading a song from a PandoraMockTuner
+ *
+ * Runs once against a tuner which answers straight away, once against one
+ * with the latency and bandwidth of a middling home connection, and once with
+ * the session expired before the playlist is fetched, so that the time to
+ * log in again and resend it is included. Each run has a Pandora of its own
+ * which keeps nothing on disk or in the Keychain. Logs the time each step
+ * took, and what the tuner answered.
+ */
+- (void) testEndToEnd {
+  XCTestExpectation *finished = [self expectationWithDescription:@"all runs"];
+  timeRun(@"local", 0, 0, NO, ^(BOOL local) {
+    XCTAssertTrue(local, @"local run failed");
+    timeRun(@"50 ms, 1 MB/s", 0.05, 1024 * 1024, NO, ^(BOOL slow) {
+      XCTAssertTrue(slow, @"50 ms, 1 MB/s run failed");
+      timeRun(@"session expired", 0, 0, YES, ^(BOOL expired) {
+        XCTAssertTrue(expired, @"session expired run failed");
+        [finished fulfill];
+      });
+    });
+  });
+  [self waitForExpectationsWithTimeout:60 handler:nil];
+}
+
+@end
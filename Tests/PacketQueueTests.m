@@ -0,0 +1,265 @@
+/**
+ * @file Tests/PacketQueueTests.m
+ * @brief What holding packets aside costs AudioStreamer
+ */
+
+#include <mach/mach_time.h>
+
+#import <XCTest/XCTest.h>
+
+#import "ASPacketRing.h"
+#import "AudioStreamer.h"
+
+/* Length of the song played out */
+#define SONG_SECONDS 240
+
+/* MP3 frames in a second of 44.1 kHz audio, at 1152 samples each */
+#define FRAMES_PER_SECOND (44100.0 / 1152)
+
+/* How many times faster than it plays the song downloads */
+#define DOWNLOAD_SPEEDUP 8
+
+/* Bytes in each audio queue buffer, AudioStreamer's default */
+#define BUFFER_SIZE 2048
+
+typedef struct {
+  uint64_t allocations;
+  uint64_t copies;
+  uint64_t copiedBytes;
+} cost_t;
+
+/* A way of holding packets aside: push copies a packet in, and fill copies
+   the oldest packets which fit into a buffer and returns how many it copied */
+typedef struct {
+  const char *name;
+  void *(*create)(size_t length, cost_t *cost);
+  void (*push)(void *holder, const char *data,
+               const AudioStreamPacketDescription *desc, cost_t *cost);
+  size_t (*fill)(void *holder, char *buffer,
+                 AudioStreamPacketDescription *descs, cost_t *cost);
+  void (*destroy)(void *holder, cost_t *cost);
+} holder_t;
+
+#pragma mark - A packet per allocation
+
+typedef struct held_packet {
+  AudioStreamPacketDescription desc;
+  struct held_packet *next;
+  char data[];
+} held_packet_t;
+
+typedef struct {
+  held_packet_t *head;
+  held_packet_t *tail;
+} held_list_t;
+
+static void* listCreate(size_t length, cost_t *cost) {
+  cost->allocations++;
+  return calloc(1, sizeof(held_list_t));
+}
+
+static void listPush(void *holder, const char *data,
+                     const AudioStreamPacketDescription *desc, cost_t *cost) {
+  held_list_t *list = holder;
+  held_packet_t *packet = malloc(sizeof(held_packet_t) + desc->mDataByteSize);
+  cost->allocations++;
+  packet->next = NULL;
+  packet->desc = *desc;
+  packet->desc.mStartOffset = 0;
+  memcpy(packet->data, data, desc->mDataByteSize);
+  cost->copies++;
+  cost->copiedBytes += desc->mDataByteSize;
+  if (list->head == NULL) {
+    list->head = list->tail = packet;
+  } else {
+    list->tail->next = packet;
+    list->tail = packet;
+  }
+}
+
+static size_t listFill(void *holder, char *buffer,
+                       AudioStreamPacketDescription *descs, cost_t *cost) {
+  held_list_t *list = holder;
+  size_t filled = 0;
+  size_t count = 0;
+  while (list->head != NULL && count < kAQMaxPacketDescs &&
+         filled + list->head->desc.mDataByteSize <= BUFFER_SIZE) {
+    held_packet_t *packet = list->head;
+    memcpy(buffer + filled, packet->data, packet->desc.mDataByteSize);
+    cost->copies++;
+    cost->copiedBytes += packet->desc.mDataByteSize;
+    descs[count] = packet->desc;
+    descs[count].mStartOffset = filled;
+    filled += packet->desc.mDataByteSize;
+    count++;
+    list->head = packet->next;
+    free(packet);
+  }
+  if (list->head == NULL) list->tail = NULL;
+  return count;
+}
+
+static void listDestroy(void *holder, cost_t *cost) {
+  held_list_t *list = holder;
+  while (list->head != NULL) {
+    held_packet_t *next = list->head->next;
+    free(list->head);
+    list->head = next;
+  }
+  free(list);
+}
+
+#pragma mark - A ring of packets
+
+static void* ringCreate(size_t length, cost_t *cost) {
+  return ASPacketRingCreate(0);
+}
+
+/* As AudioStreamer makes one when buffering infinitely */
+static void* reservedRingCreate(size_t length, cost_t *cost) {
+  return ASPacketRingCreate(length);
+}
+
+static void ringPush(void *holder, const char *data,
+                     const AudioStreamPacketDescription *desc, cost_t *cost) {
+  ASPacketRingPush(holder, data, desc);
+}
+
+/* As AudioStreamer's enqueueCachedData does */
+static size_t ringFill(void *holder, char *buffer,
+                       AudioStreamPacketDescription *descs, cost_t *cost) {
+  size_t filled = 0;
+  size_t count = 0;
+  for (;;) {
+    const void *data;
+    const AudioStreamPacketDescription *run;
+    size_t bytes;
+    size_t packets = ASPacketRingPeek(holder, BUFFER_SIZE - filled,
+                                      kAQMaxPacketDescs - count,
+                                      &data, &run, &bytes);
+    if (packets == 0) return count;
+    memcpy(buffer + filled, data, bytes);
+    cost->copies++;
+    cost->copiedBytes += bytes;
+    for (size_t i = 0; i < packets; i++) {
+      descs[count] = run[i];
+      descs[count].mStartOffset = run[i].mStartOffset - run[0].mStartOffset +
+                                  filled;
+      count++;
+    }
+    filled += bytes;
+    ASPacketRingPop(holder, packets);
+  }
+}
+
+static void ringDestroy(void *holder, cost_t *cost) {
+  ASPacketRingStats stats = ASPacketRingGetStats(holder);
+  cost->allocations += stats.allocations;
+  cost->copies += stats.copies;
+  cost->copiedBytes += stats.copiedBytes;
+  ASPacketRingFree(holder);
+}
+
+#pragma mark - Playing out a song
+
+static double nanoseconds(uint64_t ticks) {
+  static mach_timebase_info_data_t timebase;
+  if (timebase.denom == 0) {
+    mach_timebase_info(&timebase);
+  }
+  return (double)ticks * timebase.numer / timebase.denom;
+}
+
+/* Holds every packet of the song aside as it downloads, and copies them out
+   a buffer at a time as the song plays, returning how many packets played */
+static size_t playOut(const holder_t *way, int kbps, const char *song,
+                    size_t length, const AudioStreamPacketDescription *packets,
+                    size_t count) {
+  static char buffer[BUFFER_SIZE];
+  static AudioStreamPacketDescription descs[kAQMaxPacketDescs];
+  cost_t cost = {0, 0, 0};
+  size_t perSecond = (size_t) FRAMES_PER_SECOND;
+
+  uint64_t start = mach_absolute_time();
+  void *holder = way->create(length, &cost);
+  size_t downloaded = 0;
+  size_t played = 0;
+  while (played < count) {
+    for (size_t i = 0; i < perSecond * DOWNLOAD_SPEEDUP && downloaded < count;
+         i++, downloaded++) {
+      way->push(holder, song + packets[downloaded].mStartOffset,
+                &packets[downloaded], &cost);
+    }
+    size_t target = MIN(played + perSecond, count);
+    while (played < target) {
+      size_t filled = way->fill(holder, buffer, descs, &cost);
+      if (filled == 0) break;
+      played += filled;
+    }
+  }
+  way->destroy(holder, &cost);
+  double ns = nanoseconds(mach_absolute_time() - start);
+
+  HMSLog(@"packets: %3d kbps %-16s %8.2f allocs/s %7.1f copies/s "
+         "%8.0f bytes copied/s %8.0f ns/s",
+         kbps, way->name, (double) cost.allocations / SONG_SECONDS,
+         (double) cost.copies / SONG_SECONDS,
+         (double) cost.copiedBytes / SONG_SECONDS, ns / SONG_SECONDS);
+  return played;
+}
+
+@interface PacketQueueTests : XCTestCase
+@end
+
+@implementation PacketQueueTests
+
+/**
+ * @brief Compare holding packets aside in an ASPacketRing with holding each
+ *        in an allocation of its own, as AudioStreamer used to
+ *
+ * Plays out a song which downloads several times faster than it plays, as
+ * when buffering infinitely, so that most of its packets are held aside
+ * before being copied into audio queue buffers, which are stood in for by
+ * plain memory. For MP3s of a few bit rates, logs the allocations, copies
+ * and time taken per second of audio by each way of holding packets, and
+ * checks that every way plays out every packet.
+ */
+- (void) testHoldingPackets {
+  static const holder_t ways[] = {
+    {"one per packet", listCreate, listPush, listFill, listDestroy},
+    {"ring", ringCreate, ringPush, ringFill, ringDestroy},
+    {"reserved ring", reservedRingCreate, ringPush, ringFill, ringDestroy},
+  };
+  static const int rates[] = {64, 128, 192};
+
+  size_t count = (size_t) (SONG_SECONDS * FRAMES_PER_SECOND);
+  AudioStreamPacketDescription *packets = calloc(count, sizeof(packets[0]));
+  for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+    /* Frames are 144 * bit rate / sample rate bytes, padded by a byte
+       whenever the fraction adds up to one */
+    double frameBytes = 144.0 * rates[r] * 1000 / 44100;
+    size_t length = (size_t) (frameBytes * count) + 1;
+    char *song = malloc(length);
+    memset(song, 0x55, length);
+    for (size_t i = 0; i < count; i++) {
+      SInt64 offset = (SInt64) (frameBytes * i);
+      packets[i].mStartOffset = offset;
+      packets[i].mVariableFramesInPacket = 0;
+      packets[i].mDataByteSize = (UInt32) ((SInt64) (frameBytes * (i + 1)) -
+                                           offset);
+    }
+
+    for (size_t w = 0; w < sizeof(ways) / sizeof(ways[0]); w++) {
+      @autoreleasepool {
+        XCTAssertEqual(playOut(&ways[w], rates[r], song, length, packets,
+                               count), count,
+                       @"%s at %d kbps dropped packets", ways[w].name,
+                       rates[r]);
+      }
+    }
+    free(song);
+  }
+  free(packets);
+}
+
+@end
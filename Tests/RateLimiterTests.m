@@ -0,0 +1,244 @@
+/**
+ * @file Tests/RateLimiterTests.m
+ * @brief Checks of the rate limiter, alone and against a stand-in for Pandora
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "LoopbackHTTPServer.h"
+#import "Pandora.h"
+#import "PandoraDevice.h"
+#import "RateLimiter.h"
+
+/* The stand-in's quota: playlist requests allowed within a window */
+#define QUOTA 4
+#define QUOTA_WINDOW 1.0
+
+/* Requests sent at once against the quota */
+#define BURST_REQUESTS 12
+
+/* Seconds to let the requests turned away come back before counting them,
+   since only successes are called back */
+#define SETTLE 2
+
+#pragma mark - Checks on a clock of their own
+
+static BOOL near(double value, double expected) {
+  return fabs(value - expected) < 0.001;
+}
+
+static BOOL checkBuckets(void) {
+  __block CFAbsoluteTime now = 1000;
+  PandoraRateLimiter *limiter = [[PandoraRateLimiter alloc] init];
+  limiter.clock = ^{ return now; };
+  [limiter setBurst:3 rate:1 forFamily:@"playlist"];
+
+  BOOL passed = YES;
+  /* A deferrable request leaves the last token behind */
+  passed = [limiter admitMethod:@"station.getPlaylist" deferrable:YES] == 0 && passed;
+  passed = [limiter admitMethod:@"station.getPlaylist" deferrable:YES] == 0 && passed;
+  passed = near([limiter admitMethod:@"station.getPlaylist" deferrable:YES], 1) && passed;
+  passed = [limiter admitMethod:@"station.getPlaylist" deferrable:NO] == 0 && passed;
+  passed = near([limiter admitMethod:@"station.getPlaylist" deferrable:NO], 1) && passed;
+  /* Other families have buckets of their own */
+  passed = [limiter admitMethod:@"music.search" deferrable:NO] == 0 && passed;
+  now += 0.5;
+  passed = near([limiter admitMethod:@"station.getPlaylist" deferrable:NO], 0.5) && passed;
+  now += 0.5;
+  passed = [limiter admitMethod:@"station.getPlaylist" deferrable:NO] == 0 && passed;
+  now += 60;
+  passed = near([[limiter state][@"playlist"][@"tokens"] doubleValue], 3) && passed;
+
+  NSDictionary *playlist = [limiter state][@"playlist"];
+  passed = [playlist[@"admitted"] intValue] == 4 &&
+           [playlist[@"deferred"] intValue] == 3 && passed;
+  if (!passed) {
+    HMSLog(@"limiter: token buckets wrong, ended as %@", [limiter state]);
+  }
+  return passed;
+}
+
+static BOOL checkBackoff(void) {
+  __block CFAbsoluteTime now = 1000;
+  PandoraRateLimiter *limiter = [[PandoraRateLimiter alloc] init];
+  limiter.clock = ^{ return now; };
+  BOOL passed = YES;
+
+  /* Jitter spreads the delay over its upper half */
+  double low = INFINITY, high = 0;
+  for (int i = 0; i < 200; i++) {
+    [limiter recordFailure:PandoraFailureThrottled forMethod:@"station.getPlaylist"];
+    double delay = [limiter retryDelayForMethod:@"station.getPlaylist"];
+    low = MIN(low, delay);
+    high = MAX(high, delay);
+    [limiter recordSuccessForMethod:@"station.getPlaylist"];
+  }
+  if (low < 15 || high > 30 || high - low < 5) {
+    HMSLog(@"limiter: first throttled backoff ranged %.1f-%.1fs, expected "
+           "within 15-30s", low, high);
+    passed = NO;
+  }
+
+  /* Throttling drops deferrable requests and holds back the rest */
+  [limiter recordFailure:PandoraFailureThrottled forMethod:@"station.getPlaylist"];
+  double delay = [limiter retryDelayForMethod:@"station.getPlaylist"];
+  if ([limiter admitMethod:@"station.getPlaylist" deferrable:YES] >= 0 ||
+      !near([limiter admitMethod:@"station.getPlaylist" deferrable:NO], delay) ||
+      [limiter admitMethod:@"station.addFeedback" deferrable:NO] != 0) {
+    HMSLog(@"limiter: requests not held back while throttled");
+    passed = NO;
+  }
+  [limiter recordSuccessForMethod:@"station.getPlaylist"];
+
+  /* Network failures double up to their cap */
+  for (int i = 0; i < 20; i++) {
+    [limiter recordFailure:PandoraFailureNetwork forMethod:@"music.search"];
+    now += [limiter retryDelayForMethod:@"music.search"];
+  }
+  [limiter recordFailure:PandoraFailureNetwork forMethod:@"music.search"];
+  delay = [limiter retryDelayForMethod:@"music.search"];
+  if (delay < 30 || delay > 60) {
+    HMSLog(@"limiter: network backoff reached %.1fs, expected within 30-60s",
+           delay);
+    passed = NO;
+  }
+
+  /* And a success starts over */
+  [limiter recordSuccessForMethod:@"music.search"];
+  if ([limiter retryDelayForMethod:@"music.search"] > 1) {
+    HMSLog(@"limiter: backoff not reset by a success");
+    passed = NO;
+  }
+  return passed;
+}
+
+#pragma mark - Against the stand-in
+
+static void sendBurst(Pandora *pandora, BOOL deferrable,
+                      void(^done)(NSUInteger answered, double seconds)) {
+  __block NSUInteger answered = 0;
+  __block BOOL reported = NO;
+  CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+  for (int i = 0; i < BURST_REQUESTS; i++) {
+    PandoraRequest *req = [[PandoraRequest alloc] init];
+    req.method = @"station.getPlaylist";
+    req.request = @{@"stationToken": @"1", @"syncTime": @0};
+    req.tls = NO;
+    req.deferrable = deferrable;
+    req.callback = ^(NSDictionary *d) {
+      if (++answered == BURST_REQUESTS && !reported) {
+        reported = YES;
+        done(answered, CFAbsoluteTimeGetCurrent() - start);
+      }
+    };
+    [pandora sendRequest:req];
+  }
+  dispatch_after(dispatch_time(DISPATCH_TIME_NOW,
+                               (int64_t) ((BURST_REQUESTS / (double) QUOTA *
+                                           QUOTA_WINDOW * 4 + SETTLE) * NSEC_PER_SEC)),
+                 dispatch_get_main_queue(), ^{
+    /* Reported only once, even if the rest are answered after all */
+    if (!reported) {
+      reported = YES;
+      done(answered, CFAbsoluteTimeGetCurrent() - start);
+    }
+  });
+}
+
+@interface RateLimiterTests : XCTestCase
+@end
+
+@implementation RateLimiterTests
+
+/* The token buckets, and the holding back and dropping of deferrable
+   requests, on a clock of their own */
+- (void) testBuckets {
+  XCTAssertTrue(checkBuckets());
+}
+
+/* The bounds and reset of the backoff, on a clock of its own */
+- (void) testBackoff {
+  XCTAssertTrue(checkBackoff());
+}
+
+/**
+ * @brief Check that PandoraRateLimiter keeps requests under a quota
+ *
+ * Points a Pandora at a LoopbackHTTPServer which answers playlist requests
+ * like Pandora does until more than a set number arrive within a window,
+ * after which it answers PLAYLIST_EXCEEDED. A burst of requests sent with the
+ * limiter set a little under that quota must all succeed, and the same burst
+ * sent with the limiter opened up is logged with how many of its requests
+ * the server turned away.
+ */
+- (void) testQuota {
+  NSMutableArray *arrivals = [NSMutableArray array];
+  __block NSUInteger rejected = 0;
+  LoopbackHTTPServer *server =
+      [[LoopbackHTTPServer alloc] initWithHandler:^(NSString *method,
+                                                    NSString *path,
+                                                    NSData *body) {
+        NSString *response = @"{\"stat\":\"ok\",\"result\":{\"items\":[]}}";
+        @synchronized(arrivals) {
+          CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+          while ([arrivals count] > 0 &&
+                 now - [arrivals[0] doubleValue] > QUOTA_WINDOW) {
+            [arrivals removeObjectAtIndex:0];
+          }
+          if ([arrivals count] >= QUOTA) {
+            rejected++;
+            response = @"{\"stat\":\"fail\",\"message\":\"Playlist limit\","
+                       @"\"code\":1039}";
+          } else {
+            [arrivals addObject:@(now)];
+          }
+        }
+        return [response dataUsingEncoding:NSUTF8StringEncoding];
+      }];
+  if (![server start]) {
+    XCTFail(@"couldn't start the stand-in");
+    return;
+  }
+
+  Pandora *pandora = [[Pandora alloc] init];
+  NSMutableDictionary *device = [[PandoraDevice android] mutableCopy];
+  device[kPandoraDeviceAPIHost] =
+      [NSString stringWithFormat:@"127.0.0.1:%u", (unsigned) server.port];
+  pandora.device = device;
+  /* Any window of the quota's length holds at most the burst and what refills
+     during it, so that's kept a little under the quota */
+  [pandora.rateLimiter setBurst:QUOTA / 2 rate:QUOTA / 2 / QUOTA_WINDOW * 0.75
+                      forFamily:@"playlist"];
+
+  XCTestExpectation *finished = [self expectationWithDescription:@"both bursts"];
+  sendBurst(pandora, NO, ^(NSUInteger answered, double seconds) {
+    NSUInteger turnedAway;
+    @synchronized(arrivals) { turnedAway = rejected; }
+    HMSLog(@"limiter: %lu of %d requests answered in %.1fs under a quota of "
+           "%d per %.0fs, %lu turned away", (unsigned long) answered,
+           BURST_REQUESTS, seconds, QUOTA, QUOTA_WINDOW,
+           (unsigned long) turnedAway);
+    XCTAssertEqual(answered, (NSUInteger) BURST_REQUESTS);
+    XCTAssertEqual(turnedAway, (NSUInteger) 0);
+
+    /* The same again with nothing held back, as deferrable requests so that
+       being turned away isn't reported as an error */
+    [pandora.rateLimiter setBurst:BURST_REQUESTS rate:BURST_REQUESTS
+                        forFamily:@"playlist"];
+    [pandora.rateLimiter recordSuccessForMethod:@"station.getPlaylist"];
+    @synchronized(arrivals) { rejected = 0; }
+    sendBurst(pandora, YES, ^(NSUInteger answered, double seconds) {
+      NSUInteger turnedAway;
+      @synchronized(arrivals) { turnedAway = rejected; }
+      HMSLog(@"limiter: without limits, %lu of %d requests answered and %lu "
+             "turned away", (unsigned long) answered, BURST_REQUESTS,
+             (unsigned long) turnedAway);
+      HMSLog(@"limiter: state %@", [pandora.rateLimiter state]);
+      [server stop];
+      [finished fulfill];
+    });
+  });
+  [self waitForExpectationsWithTimeout:60 handler:nil];
+}
+
+@end
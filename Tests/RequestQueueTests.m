@@ -0,0 +1,56 @@
+/**
+ * @file Tests/RequestQueueTests.m
+ * @brief Checks of the order Pandora requests are sent in
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "RequestQueue.h"
+
+@interface RequestQueueTests : XCTestCase
+@end
+
+@implementation RequestQueueTests
+
+/**
+ * @brief Check that PandoraRequestQueue starts the most urgent requests first
+ *
+ * Fills a queue with requests of every priority, in the reverse of the order
+ * they should start in, and checks the order they do start in as earlier ones
+ * finish, that background requests never take every slot, and that requests
+ * of one priority keep the order they came in.
+ */
+- (void) testPriorityOrder {
+  PandoraRequestQueue *queue = [[PandoraRequestQueue alloc] initWithLimit:2
+                                                               background:1];
+  NSMutableArray *order = [NSMutableArray array];
+  void(^enqueue)(NSString*, PandoraPriority) = ^(NSString *name,
+                                                 PandoraPriority priority) {
+    [queue enqueue:^{ [order addObject:name]; } priority:priority];
+  };
+
+  enqueue(@"background 1", PandoraPriorityBackground);
+  /* Waits even with a slot free, which is kept for anything more urgent */
+  enqueue(@"background 2", PandoraPriorityBackground);
+  enqueue(@"default 1", PandoraPriorityDefault);
+  enqueue(@"default 2", PandoraPriorityDefault);
+  enqueue(@"interactive 1", PandoraPriorityInteractive);
+  enqueue(@"interactive 2", PandoraPriorityInteractive);
+
+  XCTAssertEqualObjects(order, (@[@"background 1", @"default 1"]));
+
+  [queue finished:PandoraPriorityDefault];
+  [queue finished:PandoraPriorityInteractive];
+  [queue finished:PandoraPriorityInteractive];
+  [queue finished:PandoraPriorityBackground];
+  [queue finished:PandoraPriorityDefault];
+  XCTAssertEqualObjects(order, (@[@"background 1", @"default 1",
+                                  @"interactive 1", @"interactive 2",
+                                  @"default 2", @"background 2"]));
+
+  NSDictionary *stats = [queue statistics];
+  XCTAssertEqual([stats[@"interactive"][@"queued"] intValue], 2);
+  XCTAssertEqual([stats[@"background"][@"requests"] intValue], 2);
+}
+
+@end
@@ -0,0 +1,268 @@
+/**
+ * @file Tests/ResponseParserTests.m
+ * @brief Checks and timings for parsing responses as they arrive
+ */
+
+#include <malloc/malloc.h>
+#include <mach/mach_time.h>
+
+#import <XCTest/XCTest.h>
+
+#import "Pandora.h"
+#import "ResponseParser.h"
+#import "SampleResponses.h"
+
+/* Stations in the station list, about as many as an account can have */
+#define STATIONS 200
+
+/* Parses timed per response and way of parsing */
+#define TIMED_PARSES 100
+
+#pragma mark - Parsing
+
+/* How sendRequest: parses a response without a parser */
+static NSArray* parseWhole(NSData *data, NSString *listKey,
+                           id(^build)(NSDictionary*)) {
+  NSDictionary *dict = [NSJSONSerialization JSONObjectWithData:data options:0 error:nil];
+  NSMutableArray *objects = [NSMutableArray array];
+  for (NSDictionary *item in dict[@"result"][listKey]) {
+    id object = build(item);
+    if (object != nil) {
+      [objects addObject:object];
+    }
+  }
+  return objects;
+}
+
+static NSArray* parseStreaming(NSData *data, NSString *listKey,
+                               PandoraResponseParser *parser, NSUInteger chunk) {
+  [parser reset];
+  const char *bytes = [data bytes];
+  for (NSUInteger at = 0; at < [data length]; at += chunk) {
+    [parser feed:bytes + at length:MIN(chunk, [data length] - at)];
+  }
+  NSError *error = nil;
+  NSDictionary *dict = [parser finishWithError:&error];
+  if (dict == nil) {
+    HMSLog(@"parser: %@", error);
+  }
+  return dict[@"result"][listKey];
+}
+
+#pragma mark - Checks
+
+static BOOL sameObjects(NSArray *expected, NSArray *actual, NSArray *keys) {
+  if ([expected count] != [actual count]) return NO;
+  for (NSUInteger i = 0; i < [expected count]; i++) {
+    for (NSString *key in keys) {
+      id a = [expected[i] valueForKey:key], b = [actual[i] valueForKey:key];
+      if (a != b && ![a isEqual:b]) {
+        HMSLog(@"parser: %@ of item %lu is %@, expected %@", key,
+               (unsigned long) i, b, a);
+        return NO;
+      }
+    }
+  }
+  return YES;
+}
+
+static BOOL checkResponse(NSString *label, NSData *data, NSString *listKey,
+                          PandoraResponseParser *parser, NSArray *keys,
+                          id(^build)(NSDictionary*)) {
+  NSArray *expected = parseWhole(data, listKey, build);
+  BOOL passed = YES;
+  for (NSNumber *chunk in @[@1, @7, @1024, @([data length])]) {
+    NSArray *actual = parseStreaming(data, listKey, parser, [chunk unsignedIntegerValue]);
+    if (!sameObjects(expected, actual, keys)) {
+      HMSLog(@"parser: %@ fed %@ bytes at a time differs from NSJSONSerialization",
+             label, chunk);
+      passed = NO;
+    }
+  }
+  return passed;
+}
+
+/* Responses which aren't JSON must fail like they would have before */
+static BOOL checkInvalid(PandoraResponseParser *parser) {
+  NSArray *invalid = @[@"", @"{\"stat\":\"ok\"", @"{\"stat\":\"ok\"}}",
+                       @"<html>502 Bad Gateway</html>",
+                       @"{\"stat\":\"ok\",\"result\":{\"items\":[{},]}}"];
+  BOOL passed = YES;
+  for (NSString *response in invalid) {
+    NSData *data = [response dataUsingEncoding:NSUTF8StringEncoding];
+    [parser reset];
+    [parser feed:[data bytes] length:[data length]];
+    NSError *error = nil;
+    if ([parser finishWithError:&error] != nil || error == nil) {
+      HMSLog(@"parser: accepted invalid response %@", response);
+      passed = NO;
+    }
+  }
+
+  /* The stat and error code of a failure are kept */
+  NSData *fail = [@"{\"stat\":\"fail\",\"message\":\"Invalid auth token\",\"code\":1001}"
+                  dataUsingEncoding:NSUTF8StringEncoding];
+  [parser reset];
+  [parser feed:[fail bytes] length:[fail length]];
+  NSDictionary *dict = [parser finishWithError:nil];
+  if (![dict[@"stat"] isEqual:@"fail"] || ![dict[@"code"] isEqual:@1001] ||
+      ![dict[@"message"] isEqual:@"Invalid auth token"]) {
+    HMSLog(@"parser: failure parsed as %@", dict);
+    passed = NO;
+  }
+  return passed;
+}
+
+#pragma mark - Timing
+
+static double nanoseconds(uint64_t ticks) {
+  static mach_timebase_info_data_t timebase;
+  if (timebase.denom == 0) {
+    mach_timebase_info(&timebase);
+  }
+  return (double)ticks * timebase.numer / timebase.denom;
+}
+
+static size_t bytesInUse(void) {
+  malloc_statistics_t stats;
+  malloc_zone_statistics(NULL, &stats);
+  return stats.size_in_use;
+}
+
+/* Other threads may free memory meanwhile, so this can't go below zero */
+static size_t bytesInUseSince(size_t before) {
+  size_t now = bytesInUse();
+  return now > before ? now - before : 0;
+}
+
+/* Log the time TIMED_PARSES parses of a response take, and the most memory
+   in use at once during one of them beyond what was in use before */
+static void timeResponse(NSString *label, NSData *data, NSString *listKey,
+                         PandoraResponseParser *parser,
+                         id(^build)(NSDictionary*)) {
+  const char *bytes = [data bytes];
+  NSUInteger length = [data length];
+
+  uint64_t start = mach_absolute_time();
+  for (int i = 0; i < TIMED_PARSES; i++) {
+    @autoreleasepool {
+      (void)parseWhole(data, listKey, build);
+    }
+  }
+  double whole = nanoseconds(mach_absolute_time() - start) / TIMED_PARSES;
+
+  start = mach_absolute_time();
+  for (int i = 0; i < TIMED_PARSES; i++) {
+    @autoreleasepool {
+      (void)parseStreaming(data, listKey, parser, 1024);
+    }
+  }
+  double streaming = nanoseconds(mach_absolute_time() - start) / TIMED_PARSES;
+
+  /* Both as the response arrives in pieces: the whole response collected and
+     then parsed, or each piece parsed straight away */
+  size_t wholePeak = 0, streamingPeak = 0;
+  @autoreleasepool {
+    size_t before = bytesInUse();
+    NSMutableData *received = [NSMutableData dataWithCapacity:100];
+    for (NSUInteger at = 0; at < length; at += 1024) {
+      [received appendBytes:bytes + at length:MIN(1024, length - at)];
+    }
+    NSDictionary *dict = [NSJSONSerialization JSONObjectWithData:received options:0 error:nil];
+    wholePeak = bytesInUseSince(before);
+    NSMutableArray *objects = [NSMutableArray array];
+    for (NSDictionary *item in dict[@"result"][listKey]) {
+      id object = build(item);
+      if (object != nil) [objects addObject:object];
+    }
+    wholePeak = MAX(wholePeak, bytesInUseSince(before));
+  }
+  @autoreleasepool {
+    [parser reset];
+    size_t before = bytesInUse();
+    for (NSUInteger at = 0; at < length; at += 1024) {
+      [parser feed:bytes + at length:MIN(1024, length - at)];
+      streamingPeak = MAX(streamingPeak, bytesInUseSince(before));
+    }
+    (void)[parser finishWithError:nil];
+    streamingPeak = MAX(streamingPeak, bytesInUseSince(before));
+  }
+
+  HMSLog(@"parser: %@ %lu B: NSJSONSerialization %8.1f us, peak %lu KB; "
+         @"streaming %8.1f us, peak %lu KB",
+         label, (unsigned long) length,
+         whole / 1e3, (unsigned long) wholePeak / 1024,
+         streaming / 1e3, (unsigned long) streamingPeak / 1024);
+}
+
+@interface ResponseParserTests : XCTestCase
+@end
+
+@implementation ResponseParserTests {
+  Pandora *pandora;
+  id(^buildSong)(NSDictionary*);
+  id(^buildStation)(NSDictionary*);
+  NSData *playlist;
+  NSData *stationList;
+}
+
+- (void) setUp {
+  [super setUp];
+  Pandora *radio = [[Pandora alloc] init];
+  pandora = radio;
+  buildSong = ^id(NSDictionary *s) {
+    return [radio parseSongFromDictionary:s];
+  };
+  /* Stations are only built once merged into the known ones */
+  buildStation = ^id(NSDictionary *s) {
+    return s;
+  };
+  playlist = PandoraSamplePlaylistResponse();
+  stationList = PandoraSampleStationListResponse(STATIONS);
+}
+
+/**
+ * @brief The songs and station fields which PandoraResponseParser gets from
+ *        playlist and station list responses like Pandora's, fed in pieces
+ *        of one byte and of a kilobyte, are the same as those from the whole
+ *        response parsed by NSJSONSerialization
+ */
+- (void) testMatchesWholeResponse {
+  NSArray *songKeys = @[@"artist", @"title", @"album", @"art", @"stationId",
+                         @"nrating", @"albumUrl", @"artistUrl", @"titleUrl",
+                         @"token", @"highUrl", @"medUrl", @"lowUrl"];
+  NSArray *stationKeys = @[@"stationName", @"stationId", @"stationToken",
+                           @"isShared", @"allowAddMusic", @"allowRename",
+                           @"dateCreated", @"isQuickMix"];
+  XCTAssertTrue(checkResponse(@"playlist", playlist, @"items",
+                              [pandora playlistParser], songKeys, buildSong));
+  XCTAssertTrue(checkResponse(@"station list", stationList, @"stations",
+                              [pandora stationListParser], stationKeys,
+                              buildStation));
+}
+
+- (void) testInvalidResponses {
+  XCTAssertTrue(checkInvalid([pandora playlistParser]));
+}
+
+/* The checksum which the station list is cached with */
+- (void) testStationListChecksum {
+  PandoraResponseParser *parser = [pandora stationListParser];
+  [parser reset];
+  [parser feed:[stationList bytes] length:[stationList length]];
+  NSString *checksum = [parser finishWithError:nil][@"result"][@"checksum"];
+  XCTAssertEqualObjects(checksum, @"a3b9c7d1e5f2");
+}
+
+/**
+ * @brief Time parsing with NSJSONSerialization and as the response arrives,
+ *        and log how much memory each had in use at its peak
+ */
+- (void) testParseTimes {
+  timeResponse(@"playlist", playlist, @"items", [pandora playlistParser],
+               buildSong);
+  timeResponse(@"station list", stationList, @"stations",
+               [pandora stationListParser], buildStation);
+}
+
+@end
@@ -0,0 +1,88 @@
+/**
+ * @file Tests/SearchCacheTests.m
+ * @brief Checks of the cache of music searches
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "Pandora.h"
+#import "SearchCache.h"
+
+static PandoraSearchResult* result(NSString *name) {
+  PandoraSearchResult *r = [[PandoraSearchResult alloc] init];
+  [r setName:name];
+  [r setValue:[@"token-" stringByAppendingString:name]];
+  return r;
+}
+
+static NSArray* names(NSArray *results) {
+  return [results valueForKey:@"name"];
+}
+
+/**
+ * Checks that PandoraSearchCache folds, narrows, evicts and expires searches
+ * as it should, on a clock of its own so that it takes no time.
+ */
+@interface SearchCacheTests : XCTestCase
+@end
+
+@implementation SearchCacheTests {
+  CFAbsoluteTime now;
+  PandoraSearchCache *cache;
+  NSDictionary *sigur;
+}
+
+- (void) setUp {
+  [super setUp];
+  now = 1000;
+  cache = [[PandoraSearchCache alloc] initWithCapacity:2 lifetime:60];
+  __weak SearchCacheTests *weakSelf = self;
+  cache.clock = ^{
+    SearchCacheTests *test = weakSelf;
+    return test != nil ? test->now : 0;
+  };
+
+  sigur = @{
+    @"Songs": @[result(@"Hoppípolla - Sigur Rós"),
+                result(@"Glosóli - Sigur Rós")],
+    @"Artists": @[result(@"Sigur Rós"), result(@"Sigur Ros Tribute")]
+  };
+  [cache setResults:sigur forQuery:@"sigur"];
+}
+
+- (void) testNormalizeQuery {
+  XCTAssertEqualObjects([PandoraSearchCache normalizeQuery:@"  Sigur\tRÓS  live "],
+                        @"sigur ros live");
+}
+
+- (void) testCachedSearch {
+  XCTAssertEqual([cache resultsForQuery:@"sigur"], sigur);
+}
+
+/* Refinements narrow the shorter search's results */
+- (void) testRefinedSearch {
+  NSDictionary *refined = [cache refinedResultsForQuery:@"sigur ros hopp"];
+  XCTAssertEqualObjects(names(refined[@"Songs"]), @[@"Hoppípolla - Sigur Rós"]);
+  XCTAssertEqual([refined[@"Artists"] count], (NSUInteger) 0);
+  /* Not from a search it doesn't add to */
+  XCTAssertNil([cache refinedResultsForQuery:@"sigur"]);
+  XCTAssertNil([cache refinedResultsForQuery:@"sig"]);
+}
+
+/* The least recently used goes first */
+- (void) testEviction {
+  [cache setResults:@{} forQuery:@"bjork"];
+  [cache resultsForQuery:@"sigur"];
+  [cache setResults:@{} forQuery:@"mum"];
+  XCTAssertNil([cache resultsForQuery:@"bjork"]);
+  XCTAssertNotNil([cache resultsForQuery:@"sigur"]);
+}
+
+/* And everything goes in time */
+- (void) testExpiry {
+  now += 61;
+  XCTAssertNil([cache resultsForQuery:@"sigur"]);
+  XCTAssertNil([cache refinedResultsForQuery:@"sigur ros"]);
+}
+
+@end
@@ -0,0 +1,150 @@
+/**
+ * @file Tests/StationRegistryTests.m
+ * @brief Checks of the indexed list of stations
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "PreferencesController.h"
+#import "Station.h"
+#import "StationRegistry.h"
+
+/* Stations sorted to time sorting, more than any account has */
+#define TIMED_STATIONS 5000
+
+static Station* station(NSString *stationId, NSString *name,
+                        unsigned long long created) {
+  Station *s = [[Station alloc] init];
+  [s setStationId:stationId];
+  [s setToken:[@"token-" stringByAppendingString:stationId]];
+  [s setName:name];
+  [s setCreated:created];
+  return s;
+}
+
+static NSArray* names(PandoraStationRegistry *registry) {
+  return [[registry stations] valueForKey:@"name"];
+}
+
+/* Every station is found where it's listed, by its id and by its token */
+static BOOL indexed(PandoraStationRegistry *registry) {
+  NSArray *stations = [registry stations];
+  for (NSUInteger i = 0; i < [stations count]; i++) {
+    Station *s = stations[i];
+    if ([registry indexOfStation:s] != i ||
+        [registry stationWithId:[s stationId]] != s ||
+        [registry stationWithToken:[s token]] != s) {
+      return NO;
+    }
+  }
+  return YES;
+}
+
+/**
+ * Checks that PandoraStationRegistry keeps its indexes in step with its list
+ * as stations come, go, are renamed and are sorted.
+ */
+@interface StationRegistryTests : XCTestCase
+@end
+
+@implementation StationRegistryTests {
+  PandoraStationRegistry *registry;
+  Station *shuffle, *zebra, *apple, *mango;
+}
+
+- (void) setUp {
+  [super setUp];
+  registry = [[PandoraStationRegistry alloc] init];
+  shuffle = station(@"0", @"\U0001F500 Shuffle", 5);
+  [shuffle setIsQuickMix:YES];
+  zebra = station(@"1", @"Zebra Radio", 1);
+  apple = station(@"2", @"apple Radio", 3);
+  mango = station(@"3", @"Mango Radio", 2);
+  [registry setStations:@[zebra, shuffle, apple]];
+  [registry addStation:mango];
+}
+
+- (void) testSort {
+  [registry sortBy:SORT_NAME_ASC];
+  XCTAssertEqualObjects(names(registry), (@[@"\U0001F500 Shuffle",
+                                            @"apple Radio", @"Mango Radio",
+                                            @"Zebra Radio"]));
+  XCTAssertTrue(indexed(registry));
+
+  [registry sortBy:SORT_DATE_DSC];
+  XCTAssertEqualObjects(names(registry), (@[@"\U0001F500 Shuffle",
+                                            @"apple Radio", @"Mango Radio",
+                                            @"Zebra Radio"]));
+  XCTAssertTrue(indexed(registry));
+
+  /* A renamed station is sorted by its new name */
+  [apple setName:@"Zoo Radio"];
+  [registry sortBy:SORT_NAME_DSC];
+  XCTAssertEqualObjects(names(registry), (@[@"\U0001F500 Shuffle",
+                                            @"Zoo Radio", @"Zebra Radio",
+                                            @"Mango Radio"]));
+  XCTAssertTrue(indexed(registry));
+}
+
+/* Removing a station moves up those after it */
+- (void) testRemove {
+  [registry removeStation:zebra];
+  XCTAssertEqual([registry count], (NSUInteger) 3);
+  XCTAssertNil([registry stationWithId:@"1"]);
+  XCTAssertNil([registry stationWithToken:@"token-1"]);
+  XCTAssertEqual([registry indexOfStation:zebra], (NSUInteger) NSNotFound);
+  XCTAssertTrue(indexed(registry));
+
+  [registry removeAllStations];
+  XCTAssertEqual([registry count], (NSUInteger) 0);
+  XCTAssertNil([registry stationWithId:@"0"]);
+}
+
+/* A station whose token changed is found by its new one once the registry is
+   told, and never by its old one */
+- (void) testChangedToken {
+  [mango setToken:@"token-moved"];
+  XCTAssertNil([registry stationWithToken:@"token-3"]);
+  [registry station:mango changedTokenFrom:@"token-3"];
+  XCTAssertEqual([registry stationWithToken:@"token-moved"], mango);
+  XCTAssertNil([registry stationWithToken:@"token-3"]);
+}
+
+/* Adding a station with a listed id takes its place */
+- (void) testReplace {
+  Station *restored = station(@"3", @"Mango Radio", 2);
+  [registry addStation:restored];
+  XCTAssertEqual([registry count], (NSUInteger) 4);
+  XCTAssertEqual([registry stationWithId:@"3"], restored);
+  XCTAssertTrue(indexed(registry));
+}
+
+/**
+ * @brief Sort thousands of stations by name, and log how long that took next
+ *        to sorting them by comparing their names directly
+ */
+- (void) testSortMany {
+  NSMutableArray *many = [NSMutableArray arrayWithCapacity:TIMED_STATIONS];
+  for (NSUInteger i = 0; i < TIMED_STATIONS; i++) {
+    NSString *name = [NSString stringWithFormat:@"%c%x Radio",
+                      (i % 2 ? 'a' : 'A') + (char) (i * 7 % 26),
+                      (unsigned) (i * 2654435761u)];
+    [many addObject:station([@(i) stringValue], name, i)];
+  }
+  [registry setStations:many];
+  [registry sortBy:SORT_NAME_ASC];
+  CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+  [registry sortBy:SORT_NAME_DSC];
+  CFAbsoluteTime keyed = CFAbsoluteTimeGetCurrent() - start;
+  start = CFAbsoluteTimeGetCurrent();
+  [many sortUsingComparator:^NSComparisonResult(Station *s1, Station *s2) {
+    return [[s2 name] caseInsensitiveCompare:[s1 name]];
+  }];
+  CFAbsoluteTime direct = CFAbsoluteTimeGetCurrent() - start;
+  XCTAssertEqualObjects([registry stations], many);
+  XCTAssertTrue(indexed(registry));
+  HMSLog(@"stations: sorted %d by name in %.1f ms, %.1f ms comparing names directly",
+         TIMED_STATIONS, keyed * 1000, direct * 1000);
+}
+
+@end
@@ -0,0 +1,615 @@
+/**
+ * @file Tests/StreamIndexTests.m
+ * @brief Checks of reading MP3 headers and indexing packets
+ */
+
+#import <AudioToolbox/AudioToolbox.h>
+#import <XCTest/XCTest.h>
+
+#import "ASStreamIndex.h"
+#import "AudioStreamer.h"
+#import "LoopbackHTTPServer.h"
+
+/* MPEG-1 Layer III, 128 kbps, 44.1 kHz, joint stereo, unpadded frames of 417
+   bytes with side information 32 bytes long */
+static const uint8_t mp3Frame[] = {0xff, 0xfb, 0x90, 0x64};
+#define MP3_FRAME_BYTES 417
+#define MP3_SIDE_INFO 32
+
+/* A silent AAC LC stereo frame, which is what each ADTS frame carries ahead of
+   padding out to its length */
+static const uint8_t silentAAC[] = {0x21, 0x10, 0x04, 0x60, 0x8c, 0x1c};
+#define ADTS_HEADER_BYTES 7
+#define ADTS_FRAMES 400
+
+/* Bytes handed to AudioFileStream at a time, less than a read usually is so
+   that plenty of packets straddle two */
+#define CHUNK_BYTES 1000
+
+static void put16(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t) (v >> 8);
+  p[1] = (uint8_t) v;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  put16(p, v >> 16);
+  put16(p + 2, v);
+}
+
+/* An ID3v2.4 tag of some size, returning how long it is in all */
+static size_t id3Tag(uint8_t *p, uint32_t size) {
+  memcpy(p, "ID3\x04\x00\x00", 6);
+  for (int i = 0; i < 4; i++) {
+    p[9 - i] = (size >> (7 * i)) & 0x7f;
+  }
+  memset(p + 10, 0, size);
+  return 10 + size;
+}
+
+/* An ADTS frame of some length, padding included */
+static size_t adtsFrame(uint8_t *p, size_t length) {
+  p[0] = 0xff;
+  p[1] = 0xf1;                                  /* MPEG-4, no CRC */
+  p[2] = 1 << 6 | 4 << 2;                       /* AAC LC, 44.1 kHz */
+  p[3] = (uint8_t) (2 << 6 | length >> 11);     /* stereo */
+  p[4] = (uint8_t) (length >> 3);
+  p[5] = (uint8_t) ((length & 7) << 5 | 0x1f);
+  p[6] = 0xfc;
+  memcpy(p + ADTS_HEADER_BYTES, silentAAC, sizeof(silentAAC));
+  memset(p + ADTS_HEADER_BYTES + sizeof(silentAAC), 0,
+         length - ADTS_HEADER_BYTES - sizeof(silentAAC));
+  return length;
+}
+
+static BOOL near(double a, double b) {
+  return fabs(a - b) < 1e-6;
+}
+
+#pragma mark - Headers
+
+static BOOL checkXing(void) {
+  BOOL passed = YES;
+  uint8_t *bytes = calloc(1, 8192);
+  size_t tag = id3Tag(bytes, 1200);
+  uint8_t *frame = bytes + tag;
+  memcpy(frame, mp3Frame, sizeof(mp3Frame));
+
+  /* Frames, bytes, a table of contents and a quality, with a LAME extension
+     of 576 frames of delay and 1104 of padding */
+  uint8_t *xing = frame + 4 + MP3_SIDE_INFO;
+  memcpy(xing, "Xing", 4);
+  put32(xing + 4, 0xf);
+  put32(xing + 8, 9000);
+  put32(xing + 12, 3000000);
+  for (int i = 0; i < 100; i++) {
+    xing[16 + i] = (uint8_t) (i * i * 255 / 9801);
+  }
+  put32(xing + 116, 75);
+  uint8_t *lame = xing + 120;
+  memcpy(lame, "LAME3.100", 9);
+  lame[21] = 576 >> 4;
+  lame[22] = (576 & 15) << 4 | 1104 >> 8;
+  lame[23] = 1104 & 0xff;
+
+  ASStreamHeader header;
+  if (ASStreamTagLength(bytes, AS_STREAM_TAG_BYTES) != tag) {
+    HMSLog(@"stream index: measured an ID3 tag as %llu bytes, not %zu",
+           ASStreamTagLength(bytes, AS_STREAM_TAG_BYTES), tag);
+    passed = NO;
+  }
+  if (!ASStreamHeaderParse(frame, AS_STREAM_HEADER_BYTES, tag, &header)) {
+    HMSLog(@"stream index: didn't find a Xing header");
+    free(bytes);
+    return NO;
+  }
+
+  double duration = (9000.0 * 1152 - 576 - 1104) / 44100;
+  if (header.offset != tag || header.packets != 9000 ||
+      header.bytes != 3000000 || header.delay != 576 ||
+      header.padding != 1104 ||
+      !near(ASStreamHeaderDuration(&header), duration)) {
+    HMSLog(@"stream index: read a Xing header as %llu packets, %llu bytes, "
+           "%u and %u frames trimmed, %.3fs",
+           header.packets, header.bytes, header.delay, header.padding,
+           ASStreamHeaderDuration(&header));
+    passed = NO;
+  }
+
+  /* A quarter of the way through lies a sixteenth of the way in */
+  uint64_t expected = tag + 3000000ULL * (25 * 25 * 255 / 9801) / 256;
+  uint64_t offset = ASStreamHeaderOffset(&header, duration / 4 + 1e-9);
+  if (offset < expected || offset > expected + 3000000 / 256) {
+    HMSLog(@"stream index: put a quarter of a Xing stream at %llu, not %llu",
+           offset, expected);
+    passed = NO;
+  }
+
+  /* LAME writes Info instead for CBR, often without a table of contents */
+  memcpy(xing, "Info", 4);
+  put32(xing + 4, 0x3);
+  memmove(xing + 16, lame, 24);
+  if (!ASStreamHeaderParse(frame, AS_STREAM_HEADER_BYTES, tag, &header) ||
+      header.hasToc || header.delay != 576 ||
+      ASStreamHeaderOffset(&header, duration / 2) != tag + 1500000) {
+    HMSLog(@"stream index: misread an Info header");
+    passed = NO;
+  }
+  free(bytes);
+  return passed;
+}
+
+static BOOL checkVBRI(void) {
+  BOOL passed = YES;
+  uint8_t *frame = calloc(1, AS_STREAM_HEADER_BYTES);
+  memcpy(frame, mp3Frame, sizeof(mp3Frame));
+
+  /* Ten entries of 100 packets each, the k-th taking (k + 1) * 1000 bytes,
+     stored halved with a scale of 2 */
+  uint8_t *vbri = frame + 4 + 32;
+  memcpy(vbri, "VBRI", 4);
+  put16(vbri + 4, 1);
+  put16(vbri + 6, 1105);
+  put16(vbri + 8, 75);
+  put32(vbri + 10, 55000);
+  put32(vbri + 14, 1000);
+  put16(vbri + 18, 10);
+  put16(vbri + 20, 2);
+  put16(vbri + 22, 2);
+  put16(vbri + 24, 100);
+  for (int k = 0; k < 10; k++) {
+    put16(vbri + 26 + 2 * k, (uint32_t) (k + 1) * 500);
+  }
+
+  ASStreamHeader header;
+  if (!ASStreamHeaderParse(frame, AS_STREAM_HEADER_BYTES, 0, &header)) {
+    HMSLog(@"stream index: didn't find a VBRI header");
+    free(frame);
+    return NO;
+  }
+  double duration = (1000.0 * 1152 - 1105) / 44100;
+  if (header.packets != 1000 || header.bytes != 55000 || !header.hasToc ||
+      !near(ASStreamHeaderDuration(&header), duration)) {
+    HMSLog(@"stream index: read a VBRI header as %llu packets, %llu bytes, "
+           "%.3fs", header.packets, header.bytes,
+           ASStreamHeaderDuration(&header));
+    passed = NO;
+  }
+  /* Half way lies after the first five entries, and 55% half way through
+     the sixth */
+  if (header.toc[50] != 15000 || header.toc[55] != 18000 ||
+      header.toc[100] != 55000) {
+    HMSLog(@"stream index: put 50%%, 55%% and 100%% of a VBRI stream at "
+           "%llu, %llu and %llu", header.toc[50], header.toc[55],
+           header.toc[100]);
+    passed = NO;
+  }
+
+  /* Without either header there's nothing to go on */
+  memset(vbri, 0, 4);
+  if (ASStreamHeaderParse(frame, AS_STREAM_HEADER_BYTES, 0, &header)) {
+    HMSLog(@"stream index: found a header in a plain MP3 frame");
+    passed = NO;
+  }
+  free(frame);
+  return passed;
+}
+
+#pragma mark - Indexing packets
+
+typedef struct {
+  ASSeekIndex *index;
+  uint64_t packets;
+  const uint8_t *chunk;
+  size_t chunkLength;
+  uint64_t chunkOffset;
+  BOOL failed;
+} parse_t;
+
+static void properties(void *info, AudioFileStreamID stream,
+                       AudioFileStreamPropertyID property, UInt32 *flags) {
+}
+
+static void packets(void *info, UInt32 bytes, UInt32 count, const void *data,
+                    AudioStreamPacketDescription *descs) {
+  parse_t *parse = info;
+  if (descs == NULL ||
+      ASSeekIndexAppendPackets(parse->index, parse->packets, data, descs,
+                               count, parse->chunk, parse->chunkLength,
+                               parse->chunkOffset) < 0) {
+    parse->failed = YES;
+  }
+  parse->packets += count;
+}
+
+/* Runs a stream through AudioFileStream as AudioStreamer would, and checks
+   that each packet indexed lies exactly at the start of its frame, framing
+   included, whether or not the packet before it was handed over from a copy */
+static BOOL checkParsed(NSString *name, AudioFileTypeID type,
+                        const uint8_t *bytes, size_t length,
+                        const uint64_t *starts, uint64_t frames) {
+  parse_t parse = {ASSeekIndexCreate(starts[0]), 0, NULL, 0, 0, NO};
+  AudioFileStreamID stream;
+  OSStatus status = AudioFileStreamOpen(&parse, properties, packets, type,
+                                        &stream);
+  for (size_t at = 0; status == noErr && at < length; at += CHUNK_BYTES) {
+    parse.chunk = bytes + at;
+    parse.chunkLength = MIN(CHUNK_BYTES, length - at);
+    parse.chunkOffset = at;
+    status = AudioFileStreamParseBytes(stream, (UInt32) parse.chunkLength,
+                                       parse.chunk, 0);
+  }
+  if (status == noErr) {
+    AudioFileStreamClose(stream);
+  }
+
+  BOOL passed = status == noErr && !parse.failed;
+  uint64_t count = ASSeekIndexCount(parse.index);
+  /* The parser may hold back the last packet until it sees the next frame */
+  if (!passed || count + 1 < frames || count > frames) {
+    HMSLog(@"stream index: AudioFileStream gave %llu of %llu %@ packets "
+           "(status %d)", count, frames, name, (int) status);
+    passed = NO;
+  }
+  for (uint64_t k = 0; passed && k <= count && k < frames; k++) {
+    uint64_t offset;
+    if (!ASSeekIndexFind(parse.index, k, &offset) || offset != starts[k]) {
+      HMSLog(@"stream index: put %@ packet %llu at %llu, not %llu", name, k,
+             offset, starts[k]);
+      passed = NO;
+    }
+  }
+  if (passed) {
+    HMSLog(@"stream index: all %llu %@ packets indexed exactly",
+           MIN(count + 1, frames), name);
+  }
+  ASSeekIndexFree(parse.index);
+  return passed;
+}
+
+/* Where each frame of an ADTS stream starts, from the lengths in their
+   headers, returning how many there are */
+static uint64_t adtsStarts(const uint8_t *bytes, size_t length,
+                           uint64_t *starts, uint64_t most) {
+  uint64_t frames = 0;
+  size_t at = 0;
+  while (frames < most && at + ADTS_HEADER_BYTES <= length &&
+         bytes[at] == 0xff && (bytes[at + 1] & 0xf6) == 0xf0) {
+    starts[frames++] = at;
+    size_t frame = (size_t) (bytes[at + 3] & 3) << 11 |
+                   (size_t) bytes[at + 4] << 3 | bytes[at + 5] >> 5;
+    if (frame < ADTS_HEADER_BYTES) break;
+    at += frame;
+  }
+  return frames;
+}
+
+/* Ten seconds of a wavering tone with a little noise, as Core Audio's own AAC
+   encoder writes it into an ADTS file, or nil if it couldn't be */
+static NSData* encodedADTS(void) {
+  NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:
+                    [NSString stringWithFormat:@"hermes-test-%d.aac",
+                     [[NSProcessInfo processInfo] processIdentifier]]];
+  AudioStreamBasicDescription aac = {0};
+  aac.mSampleRate = 44100;
+  aac.mFormatID = kAudioFormatMPEG4AAC;
+  aac.mChannelsPerFrame = 2;
+  AudioStreamBasicDescription pcm = {0};
+  pcm.mSampleRate = 44100;
+  pcm.mFormatID = kAudioFormatLinearPCM;
+  pcm.mFormatFlags = kAudioFormatFlagsNativeFloatPacked;
+  pcm.mChannelsPerFrame = 2;
+  pcm.mBitsPerChannel = 32;
+  pcm.mFramesPerPacket = 1;
+  pcm.mBytesPerFrame = pcm.mBytesPerPacket = 8;
+
+  ExtAudioFileRef file;
+  OSStatus status = ExtAudioFileCreateWithURL(
+      (__bridge CFURLRef) [NSURL fileURLWithPath:path], kAudioFileAAC_ADTSType,
+      &aac, NULL, kAudioFileFlags_EraseFile, &file);
+  if (status != noErr) return nil;
+  status = ExtAudioFileSetProperty(file,
+                                   kExtAudioFileProperty_ClientDataFormat,
+                                   sizeof(pcm), &pcm);
+
+  float samples[2 * 4096];
+  uint32_t noise = 1;
+  for (UInt32 done = 0; status == noErr && done < 10 * 44100; done += 4096) {
+    for (UInt32 i = 0; i < 4096; i++) {
+      double t = (done + i) / 44100.0;
+      noise = noise * 1664525 + 1013904223;
+      samples[2 * i] = samples[2 * i + 1] =
+          (float) (0.3 * sin(2 * M_PI * (440 + 200 * sin(t)) * t) *
+                   (0.5 + 0.5 * sin(3 * t)) +
+                   0.02 * ((double) noise / UINT32_MAX - 0.5));
+    }
+    AudioBufferList list;
+    list.mNumberBuffers = 1;
+    list.mBuffers[0].mNumberChannels = 2;
+    list.mBuffers[0].mDataByteSize = sizeof(samples);
+    list.mBuffers[0].mData = samples;
+    status = ExtAudioFileWrite(file, 4096, &list);
+  }
+  if (ExtAudioFileDispose(file) != noErr) {
+    status = -1;
+  }
+  NSData *data = status == noErr ? [NSData dataWithContentsOfFile:path] : nil;
+  [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+  if (data == nil) {
+    HMSLog(@"stream index: couldn't encode AAC (status %d)", (int) status);
+  }
+  return data;
+}
+
+static BOOL checkADTS(NSData *encoded) {
+  uint64_t starts[ADTS_FRAMES];
+  uint8_t *bytes = malloc(ADTS_FRAMES * 400);
+  size_t length = 0;
+  for (int i = 0; i < ADTS_FRAMES; i++) {
+    starts[i] = length;
+    length += adtsFrame(bytes + length, 100 + (size_t) (i * 37) % 250);
+  }
+
+  ASStreamHeader header;
+  BOOL passed = YES;
+  if (ASStreamHeaderParse(bytes, AS_STREAM_HEADER_BYTES, 0, &header)) {
+    HMSLog(@"stream index: found an MP3 header in ADTS");
+    passed = NO;
+  }
+  /* Packets are handed over without their ADTS headers, which are put back
+     between them, copied or not */
+  passed &= checkParsed(@"ADTS", kAudioFileAAC_ADTSType, bytes, length,
+                        starts, ADTS_FRAMES);
+  free(bytes);
+
+  /* And as an encoder lays its frames out */
+  uint64_t *encodedStarts = malloc([encoded length] / ADTS_HEADER_BYTES *
+                                   sizeof(uint64_t));
+  uint64_t frames = adtsStarts([encoded bytes], [encoded length],
+                               encodedStarts,
+                               [encoded length] / ADTS_HEADER_BYTES);
+  if (encoded == nil || frames < 400) {
+    HMSLog(@"stream index: found %llu frames of encoded AAC", frames);
+    passed = NO;
+  } else {
+    passed &= checkParsed(@"encoded ADTS", kAudioFileAAC_ADTSType,
+                          [encoded bytes], [encoded length], encodedStarts,
+                          frames);
+  }
+  free(encodedStarts);
+  return passed;
+}
+
+static BOOL checkMP3(void) {
+  size_t frames = 200;
+  uint64_t *starts = malloc(frames * sizeof(starts[0]));
+  uint8_t *bytes = calloc(frames, MP3_FRAME_BYTES);
+  for (size_t i = 0; i < frames; i++) {
+    starts[i] = i * MP3_FRAME_BYTES;
+    memcpy(bytes + starts[i], mp3Frame, sizeof(mp3Frame));
+  }
+  BOOL passed = checkParsed(@"MP3", kAudioFileMP3Type, bytes,
+                            frames * MP3_FRAME_BYTES, starts, frames);
+  free(bytes);
+  free(starts);
+  return passed;
+}
+
+#pragma mark - Seeking while streaming
+
+/* An MP3 of silent frames behind an ID3 tag, the first of them carrying a
+   Xing header whose table of contents puts each percent of the time at the
+   square of it in bytes, as in checkXing() */
+static NSData* xingStream(size_t frames, size_t *tag) {
+  NSMutableData *data = [NSMutableData dataWithLength:
+                         1210 + frames * MP3_FRAME_BYTES];
+  uint8_t *bytes = [data mutableBytes];
+  *tag = id3Tag(bytes, 1200);
+  for (size_t i = 0; i < frames; i++) {
+    memcpy(bytes + *tag + i * MP3_FRAME_BYTES, mp3Frame, sizeof(mp3Frame));
+  }
+  uint8_t *xing = bytes + *tag + 4 + MP3_SIDE_INFO;
+  memcpy(xing, "Xing", 4);
+  put32(xing + 4, 0x7);
+  put32(xing + 8, (uint32_t) frames - 1);
+  put32(xing + 12, (uint32_t) (frames * MP3_FRAME_BYTES));
+  for (int i = 0; i < 100; i++) {
+    xing[16 + i] = (uint8_t) (i * i * 255 / 9801);
+  }
+  return data;
+}
+
+/* Streams bytes to an AudioStreamer from a loopback server at some pace (or
+   all at once for 0), plays them silently until the stream knows its duration
+   and bit rate (and has all of them if whole), then seeks, and returns where
+   the download after the seek was asked to start, or -1 if there wasn't one */
+static int64_t seekWhileStreaming(NSString *name, NSData *bytes,
+                                  AudioFileTypeID type, double bytesPerSecond,
+                                  BOOL whole, double seekTo,
+                                  double *duration) {
+  NSObject *lock = [[NSObject alloc] init];
+  __block NSUInteger requests = 0;
+  __block int64_t lastFrom = -1;
+  LoopbackHTTPServer *server =
+      [[LoopbackHTTPServer alloc] initWithStreamingHandler:^(NSString *method,
+                                                             NSString *path,
+                                                             NSData *body,
+                                                             LoopbackHTTPResponse *response) {
+    NSString *range = response.requestHeaders[@"Range"];
+    NSUInteger from = 0;
+    if ([range hasPrefix:@"bytes="]) {
+      from = MIN((NSUInteger) [[range substringFromIndex:6] longLongValue],
+                 [bytes length] - 1);
+    }
+    @synchronized(lock) {
+      requests++;
+      lastFrom = (int64_t) from;
+    }
+    NSRange part = NSMakeRange(from, [bytes length] - from);
+    if (range != nil) {
+      [response startWithRange:part total:[bytes length]
+                          type:@"application/octet-stream"];
+    } else {
+      [response startWithLength:part.length type:@"application/octet-stream"];
+    }
+    [response writeData:[bytes subdataWithRange:part]];
+  }];
+  server.bytesPerSecond = bytesPerSecond;
+  if (![server start]) {
+    HMSLog(@"stream index: couldn't start a server for the %@ stream", name);
+    return -1;
+  }
+
+  NSString *url = [NSString stringWithFormat:@"http://127.0.0.1:%u/stream",
+                                             (unsigned) server.port];
+  AudioStreamer *streamer = [AudioStreamer streamWithURL:
+                             [NSURL URLWithString:url]];
+  streamer.fileType = type;
+  streamer.bufferInfinite = YES;
+  [streamer start];
+
+  BOOL muted = NO, ready = NO;
+  double bitrate;
+  for (int waited = 0; !ready && ![streamer isDone] && waited < 2000;
+       waited++) {
+    usleep(10000);
+    muted = muted || [streamer setVolume:0];
+    ready = muted && [streamer duration:duration] &&
+            [streamer calculatedBitRate:&bitrate] &&
+            (!whole || [streamer isDownloaded]);
+  }
+
+  int64_t from = -1;
+  if (ready && [streamer seekToTime:seekTo]) {
+    for (int waited = 0; from < 0 && waited < 500; waited++) {
+      usleep(10000);
+      @synchronized(lock) {
+        if (requests > 1) from = lastFrom;
+      }
+    }
+  } else {
+    HMSLog(@"stream index: couldn't seek the %@ stream (error %d)", name,
+           (int) [streamer errorCode]);
+  }
+  [streamer stop];
+  [server stop];
+  return from;
+}
+
+/* What AudioStreamer makes of the index and header as it streams, through
+   findHeaderIn: and seekReadStreamToTime: */
+static BOOL checkStreaming(NSData *encoded) {
+  BOOL passed = YES;
+
+  /* A seek into what was downloaded starts at the packet's ADTS header */
+  uint64_t *starts = malloc([encoded length] / ADTS_HEADER_BYTES *
+                            sizeof(uint64_t));
+  uint64_t frames = adtsStarts([encoded bytes], [encoded length], starts,
+                               [encoded length] / ADTS_HEADER_BYTES);
+  double packetDuration = 1024 / 44100.0;
+  uint64_t packet = (uint64_t) (5 / packetDuration);
+  double duration = 0;
+  if (packet < frames) {
+    int64_t from = seekWhileStreaming(@"ADTS", encoded, kAudioFileAAC_ADTSType,
+                                      0, YES, 5, &duration);
+    if (from != (int64_t) starts[packet]) {
+      HMSLog(@"stream index: seeking ADTS to 5s asked for %lld, not %llu",
+             from, starts[packet]);
+      passed = NO;
+    }
+    if (fabs(duration - frames * packetDuration) > packetDuration) {
+      HMSLog(@"stream index: streamed ADTS lasts %.3fs, not %.3fs", duration,
+             frames * packetDuration);
+      passed = NO;
+    }
+  }
+  free(starts);
+
+  /* A seek past what was downloaded goes by the Xing header, which was read
+     from the first few reads, well before the end */
+  size_t tag;
+  NSData *mp3 = xingStream(3000, &tag);
+  ASStreamHeader header;
+  ASStreamHeaderParse((const uint8_t*) [mp3 bytes] + tag,
+                      AS_STREAM_HEADER_BYTES, tag, &header);
+  double half = ASStreamHeaderDuration(&header) / 2;
+  int64_t from = seekWhileStreaming(@"MP3", mp3, kAudioFileMP3Type, 64000, NO,
+                                    half, &duration);
+  uint64_t expected = ASStreamHeaderOffset(&header, half);
+  if (from != (int64_t) expected) {
+    HMSLog(@"stream index: seeking MP3 half way asked for %lld, not %llu",
+           from, expected);
+    passed = NO;
+  }
+  if (!near(duration, ASStreamHeaderDuration(&header))) {
+    HMSLog(@"stream index: streamed MP3 lasts %.3fs, not %.3fs", duration,
+           ASStreamHeaderDuration(&header));
+    passed = NO;
+  }
+  return passed;
+}
+
+/* The checks above log what they found wrong through HMSLog, and return
+   whether everything they looked at was right */
+@interface StreamIndexTests : XCTestCase
+@end
+
+@implementation StreamIndexTests
+
+/**
+ * @brief Read Xing and Info headers, with LAME's extension, behind an ID3 tag,
+ *        and compare their durations and seek offsets with what they were
+ *        written with
+ */
+- (void) testXingHeader {
+  XCTAssertTrue(checkXing());
+}
+
+/**
+ * @brief Read a VBRI header's table of contents, and find no header in a
+ *        plain MP3 frame
+ */
+- (void) testVBRIHeader {
+  XCTAssertTrue(checkVBRI());
+}
+
+/**
+ * @brief Run an ADTS stream built in memory and another encoded by Core
+ *        Audio's AAC encoder through AudioFileStream a kilobyte at a time,
+ *        and check every packet's place in the seek index
+ */
+- (void) testIndexADTS {
+  NSData *encoded = encodedADTS();
+  XCTAssertNotNil(encoded, @"couldn't encode AAC");
+  XCTAssertTrue(checkADTS(encoded));
+}
+
+/**
+ * @brief Check every packet's place in the seek index of a CBR MP3
+ */
+- (void) testIndexMP3 {
+  XCTAssertTrue(checkMP3());
+}
+
+/**
+ * @brief Stream encoded ADTS and a Xing MP3 to a muted AudioStreamer from a
+ *        LoopbackHTTPServer, and compare the Range each seek asks for with
+ *        where the packet or the header's table of contents puts that time
+ *
+ * The checks wait on the stream by sleeping, so they're run off the main
+ * thread, and each may wait up to 25 seconds for its stream.
+ */
+- (void) testSeekWhileStreaming {
+  NSData *encoded = encodedADTS();
+  if (encoded == nil) {
+    XCTFail(@"couldn't encode AAC");
+    return;
+  }
+  XCTestExpectation *finished = [self expectationWithDescription:@"seeks"];
+  dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+    XCTAssertTrue(checkStreaming(encoded));
+    [finished fulfill];
+  });
+  [self waitForExpectationsWithTimeout:120 handler:nil];
+}
+
+@end
@@ -0,0 +1,119 @@
+/**
+ * @file Tests/URLConnectionPoolTests.m
+ * @brief Measures what the URLConnectionPool saves
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "LoopbackHTTPServer.h"
+#import "URLConnection.h"
+#import "URLConnectionPool.h"
+
+/* Requests sent in each run */
+#define BENCHMARK_REQUESTS 100
+
+/* About the size of an encrypted Pandora request body */
+#define BENCHMARK_BODY_SIZE 320
+
+static void sendRequests(URLConnectionPool *pool, NSURLRequest *request,
+                         NSUInteger remaining, void(^done)(NSError*)) {
+  if (remaining == 0) {
+    done(nil);
+    return;
+  }
+  URLConnection *c =
+  [URLConnection connectionForRequest:request
+                    completionHandler:^(NSData *d, NSError *e) {
+                      if (e != nil) {
+                        done(e);
+                        return;
+                      }
+                      /* Let the connection finish before sending the next */
+                      dispatch_async(dispatch_get_main_queue(), ^{
+                        sendRequests(pool, request, remaining - 1, done);
+                      });
+                    }];
+  [c setPool:pool];
+  [c start];
+}
+
+static void timeRun(LoopbackHTTPServer *server, BOOL persistent,
+                    void(^done)(NSError*)) {
+  /* A pool of the run's own, so that the shared one's connections and
+     settings are left alone */
+  URLConnectionPool *pool = [[URLConnectionPool alloc] init];
+  pool.persistentConnections = persistent;
+
+  NSString *url = [NSString stringWithFormat:@"http://127.0.0.1:%u/services/json/",
+                   (unsigned) server.port];
+  NSMutableURLRequest *request =
+      [NSMutableURLRequest requestWithURL:[NSURL URLWithString:url]];
+  NSMutableData *body = [NSMutableData dataWithLength:BENCHMARK_BODY_SIZE];
+  memset([body mutableBytes], 'a', BENCHMARK_BODY_SIZE);
+  [request setHTTPMethod:@"POST"];
+  [request setHTTPBody:body];
+  [request addValue:@"text/plain" forHTTPHeaderField:@"Content-Type"];
+
+  NSDictionary *before = [pool statistics];
+  NSUInteger accepted = server.connectionsAccepted;
+  CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+
+  sendRequests(pool, request, BENCHMARK_REQUESTS, ^(NSError *error) {
+    double ms = (CFAbsoluteTimeGetCurrent() - start) * 1000;
+    NSDictionary *after = [pool statistics];
+    if (error == nil) {
+      HMSLog(@"pool: %s %d requests in %.1f ms (%.3f ms each), "
+             "%lu connections accepted, %lu new, %lu reused",
+             persistent ? "keep-alive" : "one-shot", BENCHMARK_REQUESTS,
+             ms, ms / BENCHMARK_REQUESTS,
+             (unsigned long) (server.connectionsAccepted - accepted),
+             [after[@"newConnections"] unsignedLongValue] -
+               [before[@"newConnections"] unsignedLongValue],
+             [after[@"reusedConnections"] unsignedLongValue] -
+               [before[@"reusedConnections"] unsignedLongValue]);
+    }
+    done(error);
+  });
+}
+
+@interface URLConnectionPoolTests : XCTestCase
+@end
+
+@implementation URLConnectionPoolTests
+
+/**
+ * @brief Time requests to a LoopbackHTTPServer with and without connection
+ *        reuse
+ *
+ * Sends a run of Pandora-sized POSTs one after the other, first through a
+ * pool keeping connections alive and then with a new connection per request,
+ * and logs the time per request along with the connections the server
+ * accepted and the pool's reuse counters for each run. Each run has a pool of
+ * its own, so the shared pool which Hermes' own requests go through is left
+ * alone.
+ */
+- (void) testPersistentConnections {
+  LoopbackHTTPServer *server =
+      [[LoopbackHTTPServer alloc] initWithHandler:^(NSString *method,
+                                                    NSString *path,
+                                                    NSData *body) {
+        return [@"{\"stat\":\"ok\",\"result\":{}}" dataUsingEncoding:NSUTF8StringEncoding];
+      }];
+  if (![server start]) {
+    XCTFail(@"couldn't start the loopback server");
+    return;
+  }
+
+  XCTestExpectation *finished = [self expectationWithDescription:@"both runs"];
+  timeRun(server, YES, ^(NSError *keepAlive) {
+    XCTAssertNil(keepAlive, @"keep-alive run failed");
+    timeRun(server, NO, ^(NSError *oneShot) {
+      XCTAssertNil(oneShot, @"one-shot run failed");
+      [server stop];
+      [finished fulfill];
+    });
+  });
+  [self waitForExpectationsWithTimeout:60 handler:nil];
+}
+
+@end